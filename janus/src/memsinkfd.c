@@ -35,46 +35,44 @@
 #include "logging.h"
 
 
-int us_memsink_fd_wait_frame(int fd, us_memsink_shared_s *mem, u64 last_id) {
+int us_memsink_fd_wait_frame(int fd, us_memsink_shared_s **mem, uz *data_size, u64 last_id) {
 	const ldf deadline_ts = us_get_now_monotonic() + 1; // wait_timeout
 	ldf now_ts;
 	do {
-		const int result = us_flock_timedwait_monotonic(fd, 1); // lock_timeout
+		const u32 seq = us_memsink_shared_get_seq(*mem); // Before checking the id
 		now_ts = us_get_now_monotonic();
-		if (result < 0 && errno != EWOULDBLOCK) {
-			US_JLOG_PERROR("video", "Can't lock memsink");
-			return -1;
-		} else if (result == 0) {
-			if (mem->magic == US_MEMSINK_MAGIC && mem->version == US_MEMSINK_VERSION && mem->id != last_id) {
-				return 0;
+		if ((*mem)->magic == US_MEMSINK_MAGIC && (*mem)->version == US_MEMSINK_VERSION) {
+			if ((*mem)->data_size != *data_size) {
+				// The server has resized the slots
+				if (us_memsink_shared_remap(fd, mem, data_size) < 0) {
+					US_JLOG_PERROR("video", "Can't remap memsink");
+					return -1;
+				}
+				US_JLOG_INFO("video", "Memsink remapped; slot size=%zu", *data_size);
 			}
-			if (flock(fd, LOCK_UN) < 0) {
-				US_JLOG_PERROR("video", "Can't unlock memsink");
-				return -1;
+			if (us_memsink_shared_get_last_id(*mem) != last_id) {
+				return 0;
 			}
 		}
-		usleep(1000); // lock_polling
+		if (now_ts < deadline_ts && us_memsink_shared_wait(*mem, seq, deadline_ts - now_ts) < 0) {
+			US_JLOG_PERROR("video", "Can't wait for memsink frame");
+			return -1;
+		}
 	} while (now_ts < deadline_ts);
 	return US_ERROR_NO_DATA;
 }
 
-int us_memsink_fd_get_frame(int fd, us_memsink_shared_s *mem, us_frame_s *frame, u64 *frame_id, bool key_required) {
-	us_frame_set_data(frame, us_memsink_get_data(mem), mem->used);
-	US_FRAME_COPY_META(mem, frame);
-	*frame_id = mem->id;
+int us_memsink_fd_get_frame(us_memsink_shared_s *mem, uz data_size, us_frame_s *frame, u64 *frame_id, bool key_required) {
 	mem->last_client_ts = us_get_now_monotonic();
 	if (key_required) {
 		mem->key_requested = true;
 	}
-
-	bool retval = 0;
+	if (us_memsink_shared_read(mem, data_size, frame, frame_id) < 0) {
+		return US_ERROR_NO_DATA; // The frame is empty
+	}
 	if (frame->format != V4L2_PIX_FMT_H264) {
 		US_JLOG_ERROR("video", "Got non-H264 frame from memsink");
-		retval = -1;
-	}
-	if (flock(fd, LOCK_UN) < 0) {
-		US_JLOG_PERROR("video", "Can't unlock memsink");
-		retval = -1;
+		return -1;
 	}
-	return retval;
+	return 0;
 }
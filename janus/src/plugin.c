@@ -124,10 +124,12 @@ static void *_video_rtp_thread(void *arg) {
 		const int ri = us_ring_consumer_acquire(_g_video_ring, 0.1);
 		if (ri >= 0) {
 			const us_frame_s *const frame = _g_video_ring->items[ri];
-			_LOCK_VIDEO;
-			const bool zero_playout_delay = (frame->gop == 0);
-			us_rtpv_wrap(_g_rtpv, frame, zero_playout_delay);
-			_UNLOCK_VIDEO;
+			if (frame->used > 0) { // Empty if the memsink was overwritten while reading
+				_LOCK_VIDEO;
+				const bool zero_playout_delay = (frame->gop == 0);
+				us_rtpv_wrap(_g_rtpv, frame, zero_playout_delay);
+				_UNLOCK_VIDEO;
+			}
 			us_ring_consumer_release(_g_video_ring, ri);
 		}
 	}
@@ -152,9 +154,9 @@ static void *_video_sink_thread(void *arg) {
 
 		int fd = -1;
 		us_memsink_shared_s *mem = NULL;
+		uz data_size = 0; // Only the header at first, it will be remapped on a frame
 
-		const uz data_size = us_memsink_calculate_size(_g_config->video_sink_name);
-		if (data_size == 0) {
+		if (us_memsink_calculate_size(_g_config->video_sink_name) == 0) {
 			US_ONCE({ US_JLOG_ERROR("video", "Invalid memsink object suffix"); });
 			goto close_memsink;
 		}
@@ -173,7 +175,7 @@ static void *_video_sink_thread(void *arg) {
 
 		US_JLOG_INFO("video", "Memsink opened; reading frames ...");
 		while (!_STOP && _HAS_WATCHERS) {
-			const int waited = us_memsink_fd_wait_frame(fd, mem, frame_id);
+			const int waited = us_memsink_fd_wait_frame(fd, &mem, &data_size, frame_id);
 			if (waited == 0) {
 				const int ri = us_ring_producer_acquire(_g_video_ring, 0);
 				us_frame_s *frame;
@@ -184,15 +186,15 @@ static void *_video_sink_thread(void *arg) {
 					frame = drop;
 				}
 
-				const int got = us_memsink_fd_get_frame(fd, mem, frame, &frame_id, atomic_load(&_g_key_required));
+				const int got = us_memsink_fd_get_frame(mem, data_size, frame, &frame_id, atomic_load(&_g_key_required));
 				if (ri >= 0) {
 					us_ring_producer_release(_g_video_ring, ri);
 				}
-				if (got < 0) {
+				if (got < 0 && got != US_ERROR_NO_DATA) {
 					goto close_memsink;
 				}
 
-				if (ri >= 0 && frame->key) {
+				if (ri >= 0 && got == 0 && frame->key) {
 					atomic_store(&_g_key_required, false);
 				}
 			} else if (waited != US_ERROR_NO_DATA) {
@@ -7,7 +7,6 @@
 #include <errno.h>
 
 #include <sys/types.h>
-#include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 
@@ -25,31 +24,57 @@ typedef struct {
 	PyObject_HEAD
 
 	char	*obj;
-	double	lock_timeout;
+	double	lock_timeout; // Unused, the memsink is lock-free
 	double	wait_timeout;
 	double	drop_same_frames;
-	uz		data_size;
+	uz		data_size; // Of the current mapping
 
 	int					fd;
 	us_memsink_shared_s	*mem;
+	us_memsink_shared_s	*stale_mem; // The previous mapping, until its memoryviews are released
+	uz					stale_data_size;
+	Py_ssize_t			stale_exports;
 
 	u64				frame_id;
 	ldf				frame_ts;
 	us_frame_s		*frame;
+	us_frame_s		*next;
+
+	us_frame_s		view; // Borrowed from the memsink
+	int				borrowed; // The slot index or -1
+	u32				borrowed_gen;
+	Py_ssize_t		exports; // Memoryviews of the borrowed frame
 } _MemsinkObject;
 
 
+static bool _release_borrowed(_MemsinkObject *self) {
+	bool valid = true;
+	if (self->borrowed >= 0) {
+		valid = us_memsink_shared_release(self->mem, self->borrowed, self->borrowed_gen);
+		self->borrowed = -1;
+	}
+	return valid;
+}
+
+
 static void _MemsinkObject_destroy_internals(_MemsinkObject *self) {
 	if (self->mem != NULL) {
+		_release_borrowed(self);
 		us_memsink_shared_unmap(self->mem, self->data_size);
 		self->mem = NULL;
 	}
+	if (self->stale_mem != NULL) {
+		us_memsink_shared_unmap(self->stale_mem, self->stale_data_size);
+		self->stale_mem = NULL;
+	}
 	US_CLOSE_FD(self->fd);
 	US_DELETE(self->frame, us_frame_destroy);
+	US_DELETE(self->next, us_frame_destroy);
 }
 
 static int _MemsinkObject_init(_MemsinkObject *self, PyObject *args, PyObject *kwargs) {
 	self->fd = -1;
+	self->borrowed = -1;
 
 	self->lock_timeout = 1;
 	self->wait_timeout = 1;
@@ -72,12 +97,14 @@ static int _MemsinkObject_init(_MemsinkObject *self, PyObject *args, PyObject *k
 	SET_DOUBLE(drop_same_frames, >= 0);
 #	undef SET_DOUBLE
 
-	if ((self->data_size = us_memsink_calculate_size(self->obj)) == 0) {
+	if (us_memsink_calculate_size(self->obj) == 0) {
 		PyErr_SetString(PyExc_ValueError, "Invalid memsink object suffix");
 		return -1;
 	}
+	self->data_size = 0; // Only the header at first, it will be remapped on a frame
 
 	self->frame = us_frame_init();
+	self->next = us_frame_init();
 
 	if ((self->fd = shm_open(self->obj, O_RDWR, 0)) == -1) {
 		PyErr_SetFromErrno(PyExc_OSError);
@@ -106,6 +133,10 @@ static void _MemsinkObject_dealloc(_MemsinkObject *self) {
 }
 
 static PyObject *_MemsinkObject_close(_MemsinkObject *self, PyObject *Py_UNUSED(ignored)) {
+	if (self->exports > 0) {
+		PyErr_SetString(PyExc_BufferError, "Can't close memsink: the borrowed frame is still exported");
+		return NULL;
+	}
 	_MemsinkObject_destroy_internals(self);
 	Py_RETURN_NONE;
 }
@@ -119,47 +150,87 @@ static PyObject *_MemsinkObject_exit(_MemsinkObject *self, PyObject *Py_UNUSED(i
 	return PyObject_CallMethod((PyObject*)self, "close", "");
 }
 
-static int _wait_frame(_MemsinkObject *self) {
+static int _remap(_MemsinkObject *self) {
+	// Сервер поменял размер слотов. Если старый фрейм еще экспортирован в memoryview,
+	// то старый маппинг живет до их освобождения, см. _MemsinkObject_releasebuffer().
+	// Returns US_ERROR_NO_DATA if it can't be done right now.
+	if (self->exports == self->stale_exports) {
+		return us_memsink_shared_remap(self->fd, &self->mem, &self->data_size);
+	}
+	if (self->stale_mem != NULL) {
+		return US_ERROR_NO_DATA; // Both mappings are in use
+	}
+	const uz data_size = self->mem->data_size;
+	us_memsink_shared_s *const mem = us_memsink_shared_map(self->fd, data_size);
+	if (mem == NULL) {
+		return -1;
+	}
+	self->stale_mem = self->mem;
+	self->stale_data_size = self->data_size;
+	self->stale_exports = self->exports;
+	self->mem = mem;
+	self->data_size = data_size;
+	return 0;
+}
+
+static int _wait_frame(_MemsinkObject *self, bool borrow) {
 	const ldf deadline_ts = us_get_now_monotonic() + self->wait_timeout;
 
-	int locked = -1;
 	ldf now_ts;
 	do {
 		Py_BEGIN_ALLOW_THREADS
 
-		locked = us_flock_timedwait_monotonic(self->fd, self->lock_timeout);
+		const u32 seq = us_memsink_shared_get_seq(self->mem); // Before checking the id
 		now_ts = us_get_now_monotonic();
-		if (locked < 0) {
-			if (errno == EWOULDBLOCK) {
-				goto retry;
-			}
-			goto os_error;
-		}
 
 		us_memsink_shared_s *mem = self->mem;
 		if (mem->magic != US_MEMSINK_MAGIC || mem->version != US_MEMSINK_VERSION) {
 			goto retry;
 		}
+		if (mem->data_size != self->data_size) {
+			switch (_remap(self)) {
+				case 0: break;
+				case US_ERROR_NO_DATA: goto retry;
+				default: goto os_error;
+			}
+			mem = self->mem;
+		}
 
 		// Let the sink know that the client is alive
 		mem->last_client_ts = now_ts;
 
-		if (mem->id == self->frame_id) {
+		u64 id = self->frame_id;
+		if (borrow) {
+			// Без копирования нечего сравнивать, поэтому drop_same_frames здесь не работает
+			uint index;
+			if (us_memsink_shared_borrow(mem, self->data_size, &self->view, &id, &index, &self->borrowed_gen) < 0) {
+				goto retry;
+			}
+			self->borrowed = index;
+			self->frame_id = id;
+			Py_BLOCK_THREADS
+			return 0;
+		}
+		if (us_memsink_shared_read(mem, self->data_size, self->next, &id) < 0) {
 			goto retry;
 		}
 
 		if (self->drop_same_frames > 0) {
 			if (
-				US_FRAME_COMPARE_GEOMETRY(self->mem, self->frame)
+				US_FRAME_COMPARE_GEOMETRY(self->next, self->frame)
 				&& (self->frame_ts + self->drop_same_frames > now_ts)
-				&& !memcmp(self->frame->data, us_memsink_get_data(mem), mem->used)
+				&& !memcmp(self->frame->data, self->next->data, self->next->used)
 			) {
-				self->frame_id = mem->id;
+				self->frame_id = id;
 				goto retry;
 			}
 		}
 
 		// New frame found
+		self->frame_id = id;
+		us_frame_s *const tmp = self->frame;
+		self->frame = self->next;
+		self->next = tmp;
 		Py_BLOCK_THREADS
 		return 0;
 
@@ -169,10 +240,7 @@ static int _wait_frame(_MemsinkObject *self) {
 		return -1;
 
 	retry:
-		if (locked >= 0 && flock(self->fd, LOCK_UN) < 0) {
-			goto os_error;
-		}
-		if (usleep(1000) < 0) {
+		if (now_ts < deadline_ts && us_memsink_shared_wait(self->mem, seq, deadline_ts - now_ts) < 0) {
 			goto os_error;
 		}
 		Py_END_ALLOW_THREADS
@@ -191,28 +259,24 @@ static PyObject *_MemsinkObject_wait_frame(_MemsinkObject *self, PyObject *args,
 	}
 
 	bool key_required = false;
-	static char *kws[] = {"key_required", NULL};
-	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|p", kws, &key_required)) {
+	bool borrow = false;
+	static char *kws[] = {"key_required", "borrow", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|pp", kws, &key_required, &borrow)) {
 		return NULL;
 	}
 
-	switch (_wait_frame(self)) {
+	// The previous borrowed frame is no longer needed, even if it's still exported
+	_release_borrowed(self);
+
+	switch (_wait_frame(self, borrow)) {
 		case 0: break;
 		case US_ERROR_NO_DATA: Py_RETURN_NONE;
 		default: return NULL;
 	}
 
-	us_memsink_shared_s *mem = self->mem;
-	us_frame_set_data(self->frame, us_memsink_get_data(mem), mem->used);
-	US_FRAME_COPY_META(self->mem, self->frame);
-	self->frame_id = mem->id;
 	self->frame_ts = us_get_now_monotonic();
 	if (key_required) {
-		mem->key_requested = true;
-	}
-
-	if (flock(self->fd, LOCK_UN) < 0) {
-		return PyErr_SetFromErrno(PyExc_OSError);
+		self->mem->key_requested = true;
 	}
 
 	PyObject *dict_frame = PyDict_New();
@@ -232,7 +296,9 @@ static PyObject *_MemsinkObject_wait_frame(_MemsinkObject *self, PyObject *args,
 			Py_DECREF(m_tmp); \
 		}
 #	define SET_NUMBER(x_key, x_from, x_to) \
-		SET_VALUE(#x_key, Py##x_to##_From##x_from(self->frame->x_key))
+		SET_VALUE(#x_key, Py##x_to##_From##x_from(frame->x_key))
+
+	const us_frame_s *const frame = (borrow ? &self->view : self->frame);
 
 	SET_NUMBER(width, Long, Long);
 	SET_NUMBER(height, Long, Long);
@@ -244,7 +310,12 @@ static PyObject *_MemsinkObject_wait_frame(_MemsinkObject *self, PyObject *args,
 	SET_NUMBER(grab_ts, Double, Float);
 	SET_NUMBER(encode_begin_ts, Double, Float);
 	SET_NUMBER(encode_end_ts, Double, Float);
-	SET_VALUE("data", PyBytes_FromStringAndSize((const char*)self->frame->data, self->frame->used));
+	if (borrow) {
+		// Read-only view to the shared memory, valid until release() or the next wait_frame()
+		SET_VALUE("data", PyMemoryView_FromObject((PyObject*)self));
+	} else {
+		SET_VALUE("data", PyBytes_FromStringAndSize((const char*)frame->data, frame->used));
+	}
 
 #	undef SET_NUMBER
 #	undef SET_VALUE
@@ -252,6 +323,42 @@ static PyObject *_MemsinkObject_wait_frame(_MemsinkObject *self, PyObject *args,
 	return dict_frame;
 }
 
+static PyObject *_MemsinkObject_release(_MemsinkObject *self, PyObject *Py_UNUSED(ignored)) {
+	// False if the borrowed frame was overwritten by the server and should be discarded
+	if (self->borrowed < 0) {
+		Py_RETURN_NONE;
+	}
+	return PyBool_FromLong(_release_borrowed(self));
+}
+
+static int _MemsinkObject_getbuffer(_MemsinkObject *self, Py_buffer *view, int flags) {
+	if (self->borrowed < 0) {
+		PyErr_SetString(PyExc_BufferError, "There is no borrowed frame");
+		view->obj = NULL;
+		return -1;
+	}
+	if (PyBuffer_FillInfo(view, (PyObject*)self, self->view.data, self->view.used, 1, flags) < 0) {
+		return -1;
+	}
+	++self->exports;
+	return 0;
+}
+
+static void _MemsinkObject_releasebuffer(_MemsinkObject *self, Py_buffer *view) {
+	--self->exports;
+	if (self->stale_mem != NULL) {
+		const u8 *const begin = (const u8*)self->stale_mem;
+		const u8 *const end = begin + us_memsink_shared_get_size(self->stale_data_size);
+		if ((const u8*)view->buf >= begin && (const u8*)view->buf < end) {
+			--self->stale_exports;
+			if (self->stale_exports == 0) {
+				us_memsink_shared_unmap(self->stale_mem, self->stale_data_size);
+				self->stale_mem = NULL;
+			}
+		}
+	}
+}
+
 static PyObject *_MemsinkObject_is_opened(_MemsinkObject *self, PyObject *Py_UNUSED(ignored)) {
 	return PyBool_FromLong(self->mem != NULL && self->fd > 0);
 }
@@ -273,6 +380,7 @@ static PyMethodDef _MemsinkObject_methods[] = {
 	ADD_METHOD("__enter__", enter, METH_NOARGS),
 	ADD_METHOD("__exit__", exit, METH_VARARGS),
 	ADD_METHOD("wait_frame", wait_frame, METH_VARARGS | METH_KEYWORDS),
+	ADD_METHOD("release", release, METH_NOARGS),
 	ADD_METHOD("is_opened", is_opened, METH_NOARGS),
 	{},
 #	undef ADD_METHOD
@@ -289,6 +397,11 @@ static PyGetSetDef _MemsinkObject_getsets[] = {
 #	undef ADD_GETTER
 };
 
+static PyBufferProcs _MemsinkObject_buffer = {
+	.bf_getbuffer		= (getbufferproc)_MemsinkObject_getbuffer,
+	.bf_releasebuffer	= (releasebufferproc)_MemsinkObject_releasebuffer,
+};
+
 static PyTypeObject _MemsinkType = {
 	PyVarObject_HEAD_INIT(NULL, 0)
 	.tp_name		= "ustreamer.Memsink",
@@ -300,6 +413,7 @@ static PyTypeObject _MemsinkType = {
 	.tp_repr		= (reprfunc)_MemsinkObject_repr,
 	.tp_methods		= _MemsinkObject_methods,
 	.tp_getset		= _MemsinkObject_getsets,
+	.tp_as_buffer	= &_MemsinkObject_buffer,
 };
 
 static PyModuleDef _Module = {
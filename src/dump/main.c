@@ -36,6 +36,7 @@
 #include "../libs/logging.h"
 #include "../libs/frame.h"
 #include "../libs/memsink.h"
+#include "../libs/fdsink.h"
 #include "../libs/fpsi.h"
 #include "../libs/signal.h"
 #include "../libs/options.h"
@@ -46,6 +47,7 @@
 enum _OPT_VALUES {
 	_O_SINK = 's',
 	_O_SINK_TIMEOUT = 't',
+	_O_FDSINK = 'f',
 	_O_OUTPUT = 'o',
 	_O_OUTPUT_JSON = 'j',
 	_O_COUNT = 'c',
@@ -66,6 +68,7 @@ enum _OPT_VALUES {
 static const struct option _LONG_OPTS[] = {
 	{"sink",				required_argument,	NULL,	_O_SINK},
 	{"sink-timeout",		required_argument,	NULL,	_O_SINK_TIMEOUT},
+	{"fdsink",				required_argument,	NULL,	_O_FDSINK},
 	{"output",				required_argument,	NULL,	_O_OUTPUT},
 	{"output-json",			no_argument,		NULL,	_O_OUTPUT_JSON},
 	{"count",				required_argument,	NULL,	_O_COUNT},
@@ -99,7 +102,7 @@ typedef struct {
 static void _signal_handler(int signum);
 
 static int _dump_sink(
-	const char *sink_name, unsigned sink_timeout,
+	const char *sink_name, const char *fdsink_path, unsigned sink_timeout,
 	long long count, long double interval,
 	bool key_required,
 	_output_context_s *ctx);
@@ -112,6 +115,7 @@ int main(int argc, char *argv[]) {
 	US_THREAD_RENAME("main");
 
 	const char *sink_name = NULL;
+	const char *fdsink_path = NULL;
 	unsigned sink_timeout = 1;
 	const char *output_path = NULL;
 	bool output_json = false;
@@ -151,6 +155,7 @@ int main(int argc, char *argv[]) {
 		switch (ch) {
 			case _O_SINK:			OPT_SET(sink_name, optarg);
 			case _O_SINK_TIMEOUT:	OPT_NUMBER("--sink-timeout", sink_timeout, 1, 60, 0);
+			case _O_FDSINK:			OPT_SET(fdsink_path, optarg);
 			case _O_OUTPUT:			OPT_SET(output_path, optarg);
 			case _O_OUTPUT_JSON:	OPT_SET(output_json, true);
 			case _O_COUNT:			OPT_NUMBER("--count", count, 0, LLONG_MAX, 0);
@@ -176,8 +181,8 @@ int main(int argc, char *argv[]) {
 #	undef OPT_NUMBER
 #	undef OPT_SET
 
-	if (sink_name == NULL || sink_name[0] == '\0') {
-		puts("Missing option --sink. See --help for details.");
+	if ((sink_name == NULL || sink_name[0] == '\0') && (fdsink_path == NULL || fdsink_path[0] == '\0')) {
+		puts("Missing option --sink or --fdsink. See --help for details.");
 		return 1;
 	}
 
@@ -192,7 +197,7 @@ int main(int argc, char *argv[]) {
 	}
 
 	us_install_signals_handler(_signal_handler, false);
-	const int retval = abs(_dump_sink(sink_name, sink_timeout, count, interval, key_required, &ctx));
+	const int retval = abs(_dump_sink(sink_name, fdsink_path, sink_timeout, count, interval, key_required, &ctx));
 	if (ctx.v_output && ctx.destroy) {
 		ctx.destroy(ctx.v_output);
 	}
@@ -208,7 +213,7 @@ static void _signal_handler(int signum) {
 }
 
 static int _dump_sink(
-	const char *sink_name, unsigned sink_timeout,
+	const char *sink_name, const char *fdsink_path, unsigned sink_timeout,
 	long long count, long double interval,
 	bool key_required,
 	_output_context_s *ctx) {
@@ -222,10 +227,16 @@ static int _dump_sink(
 	const useconds_t interval_us = interval * 1000000;
 
 	us_frame_s *frame = us_frame_init();
+	us_frame_s view;
 	us_fpsi_s *fpsi = us_fpsi_init("SINK", false);
 	us_memsink_s *sink = NULL;
+	us_fdsink_s *fdsink = NULL;
 
-	if ((sink = us_memsink_init_opened("input", sink_name, false, 0, false, 0, sink_timeout)) == NULL) {
+	if (fdsink_path != NULL && fdsink_path[0] != '\0') {
+		if ((fdsink = us_fdsink_init("input", fdsink_path, false, 0, false, sink_timeout)) == NULL) {
+			goto error;
+		}
+	} else if ((sink = us_memsink_init_opened("input", sink_name, false, 0, false, 0, sink_timeout)) == NULL) {
 		goto error;
 	}
 
@@ -233,7 +244,26 @@ static int _dump_sink(
 
 	while (!_g_stop) {
 		bool key_requested;
-		const int got = us_memsink_client_get(sink, frame, &key_requested, key_required);
+		int got;
+		if (fdsink != NULL) {
+			if ((got = us_fdsink_client_get(fdsink, &view)) == 0) {
+				// The frame is copied only for the output, the buffer is returned to the server right away
+				US_FRAME_COPY_META(&view, frame);
+				if (ctx->v_output != NULL) {
+					us_frame_set_data(frame, view.data, view.used);
+				} else {
+					frame->used = view.used;
+				}
+				got = us_fdsink_client_release(fdsink);
+			}
+		} else if (ctx->v_output != NULL) {
+			got = us_memsink_client_get(sink, frame, &key_requested, key_required);
+		} else if ((got = us_memsink_client_borrow(sink, &view, &key_requested, key_required)) == 0) {
+			// Without the output only the meta is needed, so the data is not copied
+			US_FRAME_COPY_META(&view, frame);
+			frame->used = view.used;
+			got = us_memsink_client_release(sink);
+		}
 		if (got == 0) {
 			key_required = false;
 
@@ -267,9 +297,7 @@ static int _dump_sink(
 			if (interval_us > 0) {
 				usleep(interval_us);
 			}
-		} else if (got == US_ERROR_NO_DATA) {
-			usleep(1000);
-		} else {
+		} else if (got != US_ERROR_NO_DATA) { // NO_DATA after the sink timeout, just wait again
 			goto error;
 		}
 	}
@@ -278,6 +306,7 @@ static int _dump_sink(
 
 error:
 	US_DELETE(sink, us_memsink_destroy);
+	US_DELETE(fdsink, us_fdsink_destroy);
 	us_fpsi_destroy(fpsi);
 	us_frame_destroy(frame);
 	US_LOG_INFO("Bye-bye");
@@ -298,6 +327,8 @@ static void _help(FILE *fp) {
 	SAY("═════════════");
 	SAY("    -s|--sink <name>  ──────── Memory sink ID. No default.\n");
 	SAY("    -t|--sink-timeout <sec>  ─ Timeout for the upcoming frame. Default: 1.\n");
+	SAY("    -f|--fdsink <path>  ────── Read RAW frames from the fdsink UNIX socket instead of the memory sink.");
+	SAY("                               No default.\n");
 	SAY("    -o|--output <filename> ─── Filename to dump output to. Use '-' for stdout. Default: just consume the sink.\n");
 	SAY("    -j|--output-json  ──────── Format output as JSON. Required option --output. Default: disabled.\n");
 	SAY("    -c|--count  <N>  ───────── Limit the number of frames. Default: 0 (infinite).\n");
@@ -0,0 +1,496 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "fdsink.h"
+
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#	include <linux/dma-buf.h>
+#endif
+
+#include <pthread.h>
+
+#include "types.h"
+#include "errors.h"
+#include "tools.h"
+#include "array.h"
+#include "threading.h"
+#include "logging.h"
+#include "xioctl.h"
+#include "frame.h"
+#include "capture.h"
+
+
+static void *_server_thread(void *v_sink);
+static void _server_accept(us_fdsink_s *sink);
+static void _server_close_client(us_fdsink_s *sink, us_fdsink_client_s *client);
+static void _server_unhold(us_fdsink_client_s *client);
+static void _server_update_has_clients(us_fdsink_s *sink);
+static int _server_make_memfd(us_fdsink_s *sink, const us_frame_s *frame);
+static int _server_send(int fd, const us_fdsink_msg_s *msg, int frame_fd);
+
+static int _client_recv(us_fdsink_s *sink);
+static void _client_sync(us_fdsink_s *sink, bool start);
+
+
+us_fdsink_s *us_fdsink_init(const char *name, const char *path, bool server, mode_t mode, bool rm, uint timeout) {
+	us_fdsink_s *sink;
+	US_CALLOC(sink, 1);
+	sink->name = name;
+	sink->path = path;
+	sink->server = server;
+	sink->rm = rm;
+	sink->timeout = timeout;
+	sink->fd = -1;
+	sink->frame_fd = -1;
+	for (uint index = 0; index < US_FDSINK_MAX_CLIENTS; ++index) {
+		sink->clients[index].fd = -1;
+	}
+	atomic_init(&sink->stop, false);
+	atomic_init(&sink->has_clients, false);
+
+	US_LOG_INFO("Using %s-fdsink: %s", name, path);
+
+	struct sockaddr_un addr = {0};
+	const uz max_sun_path = sizeof(addr.sun_path) - 1;
+	if (strlen(path) > max_sun_path) {
+		US_LOG_ERROR("%s-fdsink: UNIX socket path is too long; max=%zu", name, max_sun_path);
+		goto error;
+	}
+	strncpy(addr.sun_path, path, max_sun_path);
+	addr.sun_family = AF_UNIX;
+
+	// SEQPACKET сохраняет границы сообщений, поэтому каждый фрейм
+	// приходит одним сообщением вместе со своим файловым дескриптором.
+	assert((sink->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) >= 0);
+
+	if (server) {
+		if (rm && unlink(path) < 0) {
+			if (errno != ENOENT) {
+				US_LOG_PERROR("%s-fdsink: Can't remove old UNIX socket", name);
+				goto error;
+			}
+		}
+		if (bind(sink->fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) < 0) {
+			US_LOG_PERROR("%s-fdsink: Can't bind to UNIX socket", name);
+			goto error;
+		}
+		if (mode && chmod(path, mode) < 0) {
+			US_LOG_PERROR("%s-fdsink: Can't set permissions %o to UNIX socket", name, mode);
+			goto error;
+		}
+		if (listen(sink->fd, US_FDSINK_MAX_CLIENTS) < 0) {
+			US_LOG_PERROR("%s-fdsink: Can't listen UNIX socket", name);
+			goto error;
+		}
+		US_MUTEX_INIT(sink->mutex);
+		US_THREAD_CREATE(sink->tid, _server_thread, sink);
+		sink->tid_created = true;
+	} else {
+		if (connect(sink->fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) < 0) {
+			US_LOG_PERROR("%s-fdsink: Can't connect to UNIX socket", name);
+			goto error;
+		}
+	}
+	return sink;
+
+error:
+	us_fdsink_destroy(sink);
+	return NULL;
+}
+
+void us_fdsink_destroy(us_fdsink_s *sink) {
+	if (sink->tid_created) {
+		atomic_store(&sink->stop, true);
+		US_THREAD_JOIN(sink->tid);
+		for (uint index = 0; index < US_FDSINK_MAX_CLIENTS; ++index) {
+			_server_close_client(sink, &sink->clients[index]);
+		}
+		US_MUTEX_DESTROY(sink->mutex);
+		if (unlink(sink->path) < 0) {
+			US_LOG_PERROR("%s-fdsink: Can't remove UNIX socket", sink->name);
+		}
+	}
+	if (sink->frame_fd >= 0) {
+		us_fdsink_client_release(sink);
+	}
+	US_CLOSE_FD(sink->fd);
+	free(sink);
+}
+
+int us_fdsink_server_put(us_fdsink_s *sink, const us_frame_s *frame, us_capture_hwbuf_s *hw) {
+	// Если у фрейма есть DMABUF, то клиенты получают его напрямую, а буфер захвата
+	// не возвращается в очередь V4L2, пока они его не отпустят. Иначе данные копируются
+	// один раз в запечатанный memfd, общий для всех клиентов этого фрейма.
+	// Клиент, не отпустивший предыдущий фрейм, пропускает этот.
+	assert(sink->server);
+
+	const bool dma = (hw != NULL && frame->dma_fd >= 0);
+	us_fdsink_msg_s msg = {
+		.magic = US_FDSINK_MAGIC,
+		.version = US_FDSINK_VERSION,
+		.id = us_get_now_id(),
+		.used = frame->used,
+		.dma = dma,
+	};
+	US_FRAME_COPY_META(frame, &msg);
+
+	int retval = 0;
+	int memfd = -1;
+	uint sent = 0;
+
+	US_MUTEX_LOCK(sink->mutex);
+	for (uint index = 0; index < US_FDSINK_MAX_CLIENTS; ++index) {
+		us_fdsink_client_s *const client = &sink->clients[index];
+		if (client->fd < 0 || client->sent_id != 0) {
+			continue;
+		}
+
+		if (!dma && memfd < 0 && (memfd = _server_make_memfd(sink, frame)) < 0) {
+			retval = -1;
+			break;
+		}
+		if (_server_send(client->fd, &msg, (dma ? frame->dma_fd : memfd)) < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				US_LOG_PERROR("%s-fdsink: Can't send frame to client=%u", sink->name, index);
+				shutdown(client->fd, SHUT_RDWR); // The server thread will close it
+			}
+			continue;
+		}
+
+		client->sent_id = msg.id;
+		if (dma) {
+			us_capture_hwbuf_incref(hw);
+			client->hw = hw;
+		}
+		++sent;
+	}
+	US_MUTEX_UNLOCK(sink->mutex);
+
+	US_CLOSE_FD(memfd); // The clients have their own references
+	US_LOG_VERBOSE("%s-fdsink: Sent new frame to %u clients; dma=%d", sink->name, sent, dma);
+	return retval;
+}
+
+void us_fdsink_server_drop(us_fdsink_s *sink) {
+	// Вызывается перед закрытием устройства: буферы захвата больше не существуют,
+	// и поздние уведомления клиентов о них будут проигнорированы.
+	assert(sink->server);
+	US_MUTEX_LOCK(sink->mutex);
+	for (uint index = 0; index < US_FDSINK_MAX_CLIENTS; ++index) {
+		_server_unhold(&sink->clients[index]);
+	}
+	US_MUTEX_UNLOCK(sink->mutex);
+}
+
+int us_fdsink_client_get(us_fdsink_s *sink, us_frame_s *view) {
+	// Data of the view is read-only and valid until us_fdsink_client_release().
+	// For DMABUF frames view->dma_fd is set, so the buffer can be imported to another device.
+	assert(!sink->server);
+	assert(sink->frame_fd < 0);
+
+	struct pollfd pfd = {.fd = sink->fd, .events = POLLIN};
+	const int polled = poll(&pfd, 1, sink->timeout * 1000);
+	if (polled < 0) {
+		if (errno == EINTR) {
+			return US_ERROR_NO_DATA;
+		}
+		US_LOG_PERROR("%s-fdsink: Can't poll UNIX socket", sink->name);
+		return -1;
+	} else if (polled == 0) {
+		return US_ERROR_NO_DATA;
+	}
+
+	if (_client_recv(sink) < 0) {
+		return -1;
+	}
+	if (sink->msg.used > 0) {
+		u8 *const data = mmap(NULL, sink->msg.used, PROT_READ, MAP_SHARED, sink->frame_fd, 0);
+		if (data == MAP_FAILED) {
+			US_LOG_PERROR("%s-fdsink: Can't mmap frame", sink->name);
+			us_fdsink_client_release(sink);
+			return -1;
+		}
+		sink->frame_data = data;
+		_client_sync(sink, true);
+	}
+
+	US_MEMSET_ZERO(*view);
+	view->data = sink->frame_data;
+	view->used = sink->msg.used;
+	view->dma_fd = (sink->msg.dma ? sink->frame_fd : -1);
+	US_FRAME_COPY_META(&sink->msg, view);
+	return 0;
+}
+
+int us_fdsink_client_release(us_fdsink_s *sink) {
+	// Для DMABUF уведомление вернет буфер в очередь захвата сервера
+	assert(!sink->server);
+	assert(sink->frame_fd >= 0);
+	if (sink->frame_data != NULL) {
+		_client_sync(sink, false);
+		munmap(sink->frame_data, sink->msg.used);
+		sink->frame_data = NULL;
+	}
+	US_CLOSE_FD(sink->frame_fd);
+	if (send(sink->fd, &sink->msg.id, sizeof(sink->msg.id), MSG_NOSIGNAL) < 0) {
+		US_LOG_PERROR("%s-fdsink: Can't send release notification", sink->name);
+		return -1;
+	}
+	return 0;
+}
+
+static void *_server_thread(void *v_sink) {
+	US_THREAD_SETTLE("fdsink");
+	us_fdsink_s *const sink = v_sink;
+
+	while (!atomic_load(&sink->stop)) {
+		struct pollfd pfds[US_FDSINK_MAX_CLIENTS + 1] = {0};
+		pfds[0].fd = sink->fd;
+		pfds[0].events = POLLIN;
+		US_MUTEX_LOCK(sink->mutex);
+		for (uint index = 0; index < US_FDSINK_MAX_CLIENTS; ++index) {
+			pfds[index + 1].fd = sink->clients[index].fd; // Negative fds are ignored by poll()
+			pfds[index + 1].events = POLLIN;
+		}
+		US_MUTEX_UNLOCK(sink->mutex);
+
+		if (poll(pfds, US_ARRAY_LEN(pfds), 100) < 0) {
+			if (errno != EINTR) {
+				US_LOG_PERROR("%s-fdsink: Can't poll UNIX sockets", sink->name);
+				usleep(100 * 1000);
+			}
+			continue;
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			_server_accept(sink);
+		}
+
+		// Только этот поток закрывает клиентов, поэтому их fd не могли поменяться после poll()
+		US_MUTEX_LOCK(sink->mutex);
+		for (uint index = 0; index < US_FDSINK_MAX_CLIENTS; ++index) {
+			us_fdsink_client_s *const client = &sink->clients[index];
+			if (pfds[index + 1].fd < 0 || pfds[index + 1].revents == 0) {
+				continue;
+			}
+			u64 id;
+			const sz readed = recv(client->fd, &id, sizeof(id), MSG_DONTWAIT);
+			if (readed == sizeof(id)) {
+				if (id == client->sent_id) {
+					_server_unhold(client);
+				}
+			} else if (readed < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+				continue;
+			} else {
+				_server_close_client(sink, client);
+			}
+		}
+		US_MUTEX_UNLOCK(sink->mutex);
+	}
+	return NULL;
+}
+
+static void _server_accept(us_fdsink_s *sink) {
+	const int fd = accept4(sink->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		US_LOG_PERROR("%s-fdsink: Can't accept client", sink->name);
+		return;
+	}
+
+	US_MUTEX_LOCK(sink->mutex);
+	us_fdsink_client_s *client = NULL;
+	for (uint index = 0; index < US_FDSINK_MAX_CLIENTS; ++index) {
+		if (sink->clients[index].fd < 0) {
+			client = &sink->clients[index];
+			US_LOG_INFO("%s-fdsink: Client=%u connected", sink->name, index);
+			break;
+		}
+	}
+	if (client != NULL) {
+		client->fd = fd;
+		client->sent_id = 0;
+		client->hw = NULL;
+		_server_update_has_clients(sink);
+	} else {
+		US_LOG_ERROR("%s-fdsink: Can't accept client: too many clients, max=%d", sink->name, US_FDSINK_MAX_CLIENTS);
+		close(fd);
+	}
+	US_MUTEX_UNLOCK(sink->mutex);
+}
+
+static void _server_close_client(us_fdsink_s *sink, us_fdsink_client_s *client) {
+	if (client->fd >= 0) {
+		_server_unhold(client);
+		US_CLOSE_FD(client->fd);
+		US_LOG_INFO("%s-fdsink: Client=%td disconnected", sink->name, client - sink->clients);
+		_server_update_has_clients(sink);
+	}
+}
+
+static void _server_unhold(us_fdsink_client_s *client) {
+	if (client->hw != NULL) {
+		us_capture_hwbuf_decref(client->hw);
+		client->hw = NULL;
+	}
+	client->sent_id = 0;
+}
+
+static void _server_update_has_clients(us_fdsink_s *sink) {
+	bool has_clients = false;
+	for (uint index = 0; index < US_FDSINK_MAX_CLIENTS; ++index) {
+		has_clients = (has_clients || sink->clients[index].fd >= 0);
+	}
+	atomic_store(&sink->has_clients, has_clients);
+}
+
+static int _server_make_memfd(us_fdsink_s *sink, const us_frame_s *frame) {
+	// Печати гарантируют клиенту, что размер и данные уже не изменятся
+	const int fd = memfd_create("ustreamer-fdsink", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		US_LOG_PERROR("%s-fdsink: Can't create memfd", sink->name);
+		return -1;
+	}
+	for (uz written = 0; written < frame->used;) {
+		const sz retval = write(fd, frame->data + written, frame->used - written);
+		if (retval < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			US_LOG_PERROR("%s-fdsink: Can't write memfd", sink->name);
+			goto error;
+		}
+		written += retval;
+	}
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+		US_LOG_PERROR("%s-fdsink: Can't seal memfd", sink->name);
+		goto error;
+	}
+	return fd;
+
+error:
+	close(fd);
+	return -1;
+}
+
+static int _server_send(int fd, const us_fdsink_msg_s *msg, int frame_fd) {
+	struct iovec iov = {.iov_base = (void*)msg, .iov_len = sizeof(*msg)};
+	union {
+		char			buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr	align;
+	} control = {0};
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	struct cmsghdr *const cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &frame_fd, sizeof(int));
+	return (sendmsg(fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 ? -1 : 0);
+}
+
+static int _client_recv(us_fdsink_s *sink) {
+	struct iovec iov = {.iov_base = &sink->msg, .iov_len = sizeof(sink->msg)};
+	union {
+		char			buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr	align;
+	} control = {0};
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	const sz readed = recvmsg(sink->fd, &mh, MSG_CMSG_CLOEXEC);
+
+	// Дескриптор забирается в любом случае, чтобы не утек при ошибке
+	int frame_fd = -1;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (
+			cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+			&& cmsg->cmsg_len == CMSG_LEN(sizeof(int))
+		) {
+			memcpy(&frame_fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+
+	if (readed < 0) {
+		US_LOG_PERROR("%s-fdsink: Can't receive frame", sink->name);
+		goto error;
+	} else if (readed == 0) {
+		US_LOG_ERROR("%s-fdsink: The server has closed the connection", sink->name);
+		goto error;
+	}
+	if (
+		readed != sizeof(sink->msg) || (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+		|| sink->msg.magic != US_FDSINK_MAGIC || frame_fd < 0
+	) {
+		US_LOG_ERROR("%s-fdsink: Got invalid message", sink->name);
+		goto error;
+	}
+	if (sink->msg.version != US_FDSINK_VERSION) {
+		US_LOG_ERROR("%s-fdsink: Protocol version mismatch: sink=%u, required=%u",
+			sink->name, sink->msg.version, US_FDSINK_VERSION);
+		goto error;
+	}
+	sink->frame_fd = frame_fd;
+	return 0;
+
+error:
+	if (frame_fd >= 0) {
+		close(frame_fd);
+	}
+	return -1;
+}
+
+static void _client_sync(us_fdsink_s *sink, bool start) {
+	// Для DMABUF кэши процессора синхронизируются с памятью устройства
+#	ifdef DMA_BUF_IOCTL_SYNC
+	if (sink->msg.dma) {
+		struct dma_buf_sync sync = {
+			.flags = DMA_BUF_SYNC_READ | (start ? DMA_BUF_SYNC_START : DMA_BUF_SYNC_END),
+		};
+		if (us_xioctl(sink->frame_fd, DMA_BUF_IOCTL_SYNC, &sync) < 0) {
+			US_LOG_VERBOSE_PERROR("%s-fdsink: Can't sync DMABUF", sink->name);
+		}
+	}
+#	else
+	(void)sink;
+	(void)start;
+#	endif
+}
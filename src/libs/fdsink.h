@@ -0,0 +1,89 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#pragma once
+
+#include <stdatomic.h>
+
+#include <sys/types.h>
+
+#include <pthread.h>
+
+#include "types.h"
+#include "frame.h"
+#include "capture.h"
+
+
+#define US_FDSINK_MAGIC		((u64)0xCAFEBABEFDFDFDFD)
+#define US_FDSINK_VERSION	((u32)1)
+
+// Each client holds at most one frame, so it is also a limit
+// of the capture buffers which can be taken out of the V4L2 queue.
+#define US_FDSINK_MAX_CLIENTS	4
+
+
+typedef struct {
+	u64		magic;
+	u32		version;
+	u64		id;
+	uz		used;
+	bool	dma; // The fd is a DMABUF of the capture buffer instead of a sealed memfd
+
+	US_FRAME_META_DECLARE;
+} us_fdsink_msg_s;
+
+typedef struct {
+	int					fd;
+	u64					sent_id; // The frame that the client holds, 0 if none
+	us_capture_hwbuf_s	*hw; // The capture buffer held for the client
+} us_fdsink_client_s;
+
+typedef struct {
+	const char	*name;
+	const char	*path;
+	bool		server;
+	bool		rm;
+	uint		timeout;
+
+	int			fd;
+
+	pthread_t			tid; // Only for server
+	bool				tid_created; // Only for server
+	pthread_mutex_t		mutex; // Only for server
+	us_fdsink_client_s	clients[US_FDSINK_MAX_CLIENTS]; // Only for server
+	atomic_bool			stop; // Only for server
+	atomic_bool			has_clients; // Only for server results
+
+	us_fdsink_msg_s		msg; // Only for client, the held frame
+	int					frame_fd; // Only for client
+	u8					*frame_data; // Only for client
+} us_fdsink_s;
+
+
+us_fdsink_s *us_fdsink_init(const char *name, const char *path, bool server, mode_t mode, bool rm, uint timeout);
+void us_fdsink_destroy(us_fdsink_s *sink);
+
+int us_fdsink_server_put(us_fdsink_s *sink, const us_frame_s *frame, us_capture_hwbuf_s *hw);
+void us_fdsink_server_drop(us_fdsink_s *sink);
+
+int us_fdsink_client_get(us_fdsink_s *sink, us_frame_s *view);
+int us_fdsink_client_release(us_fdsink_s *sink);
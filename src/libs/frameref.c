@@ -0,0 +1,65 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "frameref.h"
+
+#include <stdatomic.h>
+
+#include "types.h"
+#include "tools.h"
+#include "frame.h"
+
+
+us_frameref_s *us_frameref_init(void) {
+	us_frameref_s *ref;
+	US_CALLOC(ref, 1);
+	ref->frame = us_frame_init();
+	atomic_init(&ref->refs, 1);
+	return ref;
+}
+
+us_frameref_s *us_frameref_ref(us_frameref_s *ref) {
+	atomic_fetch_add_explicit(&ref->refs, 1, memory_order_relaxed);
+	return ref;
+}
+
+void us_frameref_unref(us_frameref_s *ref) {
+	if (atomic_fetch_sub_explicit(&ref->refs, 1, memory_order_acq_rel) == 1) {
+		us_frame_destroy(ref->frame);
+		free(ref);
+	}
+}
+
+bool us_frameref_is_shared(us_frameref_s *ref) {
+	return (atomic_load_explicit(&ref->refs, memory_order_acquire) > 1);
+}
+
+void us_frameref_unshare(us_frameref_s **ref) {
+	// The owner wants to write a new frame. If somebody else still holds the old one,
+	// the owner gets a new buffer of the same size, and the old one will be released by the last holder.
+	if (us_frameref_is_shared(*ref)) {
+		us_frameref_s *const fresh = us_frameref_init();
+		us_frame_realloc_data(fresh->frame, (*ref)->frame->allocated);
+		us_frameref_unref(*ref);
+		*ref = fresh;
+	}
+}
@@ -0,0 +1,42 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#pragma once
+
+#include <stdatomic.h>
+
+#include "types.h"
+#include "frame.h"
+
+
+typedef struct {
+	us_frame_s	*frame; // Must not be changed while the reference is shared
+	atomic_uint	refs;
+} us_frameref_s;
+
+
+us_frameref_s *us_frameref_init(void);
+us_frameref_s *us_frameref_ref(us_frameref_s *ref);
+void us_frameref_unref(us_frameref_s *ref);
+
+bool us_frameref_is_shared(us_frameref_s *ref);
+void us_frameref_unshare(us_frameref_s **ref);
@@ -28,7 +28,6 @@
 #include <errno.h>
 #include <assert.h>
 
-#include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 
@@ -40,6 +39,15 @@
 #include "memsinksh.h"
 
 
+static int _server_fit(us_memsink_s *sink, uz used);
+static int _server_resize(us_memsink_s *sink, uz data_size);
+static uz _server_get_data_size(uz used);
+static uint _server_get_free_slot(us_memsink_shared_s *mem);
+
+static int _client_wait(us_memsink_s *sink, us_frame_s *frame, bool *key_requested, bool key_required, bool borrow);
+static int _client_get(us_memsink_s *sink, us_frame_s *frame, bool *key_requested, bool key_required, bool borrow);
+
+
 us_memsink_s *us_memsink_init_opened(
 	const char *name, const char *obj, bool server,
 	mode_t mode, bool rm, uint client_ttl, uint timeout) {
@@ -53,6 +61,7 @@ us_memsink_s *us_memsink_init_opened(
 	sink->client_ttl = client_ttl;
 	sink->timeout = timeout;
 	sink->fd = -1;
+	sink->borrowed = -1;
 	atomic_init(&sink->has_clients, false);
 
 	US_LOG_INFO("Using %s-sink: %s", name, obj);
@@ -71,15 +80,32 @@ us_memsink_s *us_memsink_init_opened(
 		goto error;
 	}
 
-	if (sink->server && ftruncate(sink->fd, sizeof(us_memsink_shared_s) + sink->data_size) < 0) {
-		US_LOG_PERROR("%s-sink: Can't truncate shared memory", name);
-		goto error;
+	if (sink->server) {
+		// Существующий файл не уменьшаем: его могут держать замапленным старые клиенты
+		struct stat st;
+		if (fstat(sink->fd, &st) < 0) {
+			US_LOG_PERROR("%s-sink: Can't stat shared memory", name);
+			goto error;
+		}
+		sink->file_size = us_memsink_shared_get_size(sink->data_size);
+		if ((uz)st.st_size > sink->file_size) {
+			sink->file_size = st.st_size;
+		} else if (ftruncate(sink->fd, sink->file_size) < 0) {
+			US_LOG_PERROR("%s-sink: Can't truncate shared memory", name);
+			goto error;
+		}
+		sink->window_ts = us_get_now_monotonic();
+	} else {
+		sink->data_size = 0; // Only the header, the actual size is known from it
 	}
 
 	if ((sink->mem = us_memsink_shared_map(sink->fd, sink->data_size)) == NULL) {
 		US_LOG_PERROR("%s-sink: Can't mmap shared memory", name);
 		goto error;
 	}
+	if (sink->server) {
+		sink->mem->data_size = sink->data_size;
+	}
 	return sink;
 
 error:
@@ -89,6 +115,9 @@ error:
 
 void us_memsink_destroy(us_memsink_s *sink) {
 	if (sink->mem != NULL) {
+		if (sink->borrowed >= 0) {
+			us_memsink_shared_release(sink->mem, sink->borrowed, sink->borrowed_gen);
+		}
 		if (us_memsink_shared_unmap(sink->mem, sink->data_size) < 0) {
 			US_LOG_PERROR("%s-sink: Can't unmap shared memory", sink->name);
 		}
@@ -126,35 +155,22 @@ bool us_memsink_server_check(us_memsink_s *sink, const us_frame_s *frame) {
 		// и даже если мы прочитали мусор из-за гонки в памяти между чтением здеси и записью
 		// из клиента, мы все равно можем сделать вывод, есть ли у нас клиенты вообще.
 		// Если число число поменялось то у нас точно есть клиенты и дальнейшие проверки
-		// проводить не требуется. Если же число неизменно, то стоит поставить блокировку
-		// и проверить, нужно ли записать что-нибудь в память для инициализации фрейма.
+		// проводить не требуется. Если же число неизменно, то стоит проверить таймаут
+		// и то, нужно ли записать что-нибудь в память для инициализации фрейма.
 		sink->unsafe_last_client_ts = unsafe_ts;
 		atomic_store(&sink->has_clients, true);
 		return true;
 	}
 
-	if (flock(sink->fd, LOCK_EX | LOCK_NB) < 0) {
-		if (errno == EWOULDBLOCK) {
-			// Есть живой клиент, который прямо сейчас взял блокировку и читает фрейм из синка
-			atomic_store(&sink->has_clients, true);
-			return true;
-		}
-		US_LOG_PERROR("%s-sink: Can't lock memory", sink->name);
-		return false;
-	}
-
 	// Проверяем, есть ли у нас живой клиент по таймауту
 	const bool has_clients = (sink->mem->last_client_ts + sink->client_ttl > us_get_now_monotonic());
 	atomic_store(&sink->has_clients, has_clients);
 
-	if (flock(sink->fd, LOCK_UN) < 0) {
-		US_LOG_PERROR("%s-sink: Can't unlock memory", sink->name);
-		return false;
-	}
 	if (has_clients) {
 		return true;
 	}
-	if (frame != NULL && !US_FRAME_COMPARE_GEOMETRY(sink->mem, frame)) {
+	const uint last = atomic_load_explicit(&sink->mem->last, memory_order_relaxed);
+	if (frame != NULL && !US_FRAME_COMPARE_GEOMETRY(&sink->mem->slots[last], frame)) {
 		// Если есть изменения в геометрии/формате фрейма, то их тоже нобходимо сразу записать в синк
 		return true;
 	}
@@ -162,99 +178,238 @@ bool us_memsink_server_check(us_memsink_s *sink, const us_frame_s *frame) {
 }
 
 int us_memsink_server_put(us_memsink_s *sink, const us_frame_s *frame, bool *key_requested) {
+	// Сервер никогда не ждет клиентов и не пропускает фреймы: он пишет в слот, следующий
+	// за последним выставленным, а клиенты сами проверяют, что их копия консистентна.
 	assert(sink->server);
 
 	const ldf now = us_get_now_monotonic();
 
-	if (frame->used > sink->data_size) {
-		US_LOG_ERROR("%s-sink: Can't put frame: is too big (%zu > %zu)",
-			sink->name, frame->used, sink->data_size);
-		return 0;
+	if (_server_fit(sink, frame->used) < 0) {
+		return -1;
 	}
 
-	if (us_flock_timedwait_monotonic(sink->fd, 1) == 0) {
-		US_LOG_VERBOSE("%s-sink: >>>>> Exposing new frame ...", sink->name);
+	US_LOG_VERBOSE("%s-sink: >>>>> Exposing new frame ...", sink->name);
 
-		sink->mem->id = us_get_now_id();
-		if (sink->mem->key_requested && frame->key) {
-			sink->mem->key_requested = false;
-		}
-		if (key_requested != NULL) { // We don't need it for non-H264 sinks
-			*key_requested = sink->mem->key_requested;
-		}
+	us_memsink_shared_s *const mem = sink->mem; // After _server_fit()
+	const uint index = _server_get_free_slot(mem);
+	us_memsink_slot_s *const slot = &mem->slots[index];
+
+	const u32 gen = atomic_load_explicit(&slot->gen, memory_order_relaxed);
+	atomic_store_explicit(&slot->gen, gen + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release); // The odd gen is visible before the data
+
+	memcpy(us_memsink_get_data(mem, sink->data_size, index), frame->data, frame->used);
+	slot->used = frame->used;
+	US_FRAME_COPY_META(frame, slot);
+	slot->id = us_get_now_id();
+
+	atomic_store_explicit(&slot->gen, gen + 2, memory_order_release);
+
+	mem->magic = US_MEMSINK_MAGIC;
+	mem->version = US_MEMSINK_VERSION;
+	atomic_store_explicit(&mem->last, index, memory_order_release);
+	us_memsink_shared_wake(mem);
+
+	if (mem->key_requested && frame->key) {
+		mem->key_requested = false;
+	}
+	if (key_requested != NULL) { // We don't need it for non-H264 sinks
+		*key_requested = mem->key_requested;
+	}
 
-		memcpy(us_memsink_get_data(sink->mem), frame->data, frame->used);
-		sink->mem->used = frame->used;
-		US_FRAME_COPY_META(frame, sink->mem);
+	atomic_store(&sink->has_clients, (mem->last_client_ts + sink->client_ttl > us_get_now_monotonic()));
 
-		sink->mem->magic = US_MEMSINK_MAGIC;
-		sink->mem->version = US_MEMSINK_VERSION;
+	US_LOG_VERBOSE("%s-sink: Exposed new frame to slot %u; full exposition time = %.3Lf",
+		sink->name, index, us_get_now_monotonic() - now);
+	return 0;
+}
 
-		atomic_store(&sink->has_clients, (sink->mem->last_client_ts + sink->client_ttl > us_get_now_monotonic()));
+int us_memsink_client_get(us_memsink_s *sink, us_frame_s *frame, bool *key_requested, bool key_required) {
+	return _client_wait(sink, frame, key_requested, key_required, false);
+}
+
+int us_memsink_client_borrow(us_memsink_s *sink, us_frame_s *view, bool *key_requested, bool key_required) {
+	// Data of the view is valid until us_memsink_client_release(), the view should not be freed
+	assert(sink->borrowed < 0);
+	return _client_wait(sink, view, key_requested, key_required, true);
+}
 
-		if (flock(sink->fd, LOCK_UN) < 0) {
-			US_LOG_PERROR("%s-sink: Can't unlock memory", sink->name);
+int us_memsink_client_release(us_memsink_s *sink) {
+	// Возвращает US_ERROR_NO_DATA, если сервер все-таки переписал слот за это время
+	assert(sink->borrowed >= 0);
+	const bool valid = us_memsink_shared_release(sink->mem, sink->borrowed, sink->borrowed_gen);
+	sink->borrowed = -1;
+	if (!valid) {
+		US_LOG_VERBOSE("%s-sink: Borrowed frame was overwritten", sink->name);
+		return US_ERROR_NO_DATA;
+	}
+	return 0;
+}
+
+static int _server_fit(us_memsink_s *sink, uz used) {
+	// Слоты растут сразу, как только не влезает фрейм, а уменьшаются, только если
+	// за окно в 10 секунд ни один фрейм не занял и половины слота, чтобы не дергать
+	// клиентов ремапингом при каждом колебании размера JPEG.
+	const ldf now_ts = us_get_now_monotonic();
+	sink->window_used = US_MAX(sink->window_used, used);
+
+	uz data_size = sink->data_size;
+	if (used > sink->data_size) {
+		data_size = _server_get_data_size(used);
+	} else if (sink->window_ts + 10 < now_ts) {
+		if (sink->window_used * 2 < sink->data_size) {
+			data_size = _server_get_data_size(sink->window_used);
+		}
+		sink->window_used = used;
+		sink->window_ts = now_ts;
+	}
+	if (data_size != sink->data_size) {
+		US_LOG_VERBOSE("%s-sink: Resizing slots: %zu -> %zu", sink->name, sink->data_size, data_size);
+		if (_server_resize(sink, data_size) < 0) {
 			return -1;
 		}
-		US_LOG_VERBOSE("%s-sink: Exposed new frame; full exposition time = %.3Lf",
-			sink->name, us_get_now_monotonic() - now);
+	}
+	return 0;
+}
 
-	} else if (errno == EWOULDBLOCK) {
-		US_LOG_VERBOSE("%s-sink: ===== Shared memory is busy now; frame skipped", sink->name);
+static int _server_resize(us_memsink_s *sink, uz data_size) {
+	// Сначала все слоты помечаются как пишущиеся, поэтому клиенты со старым маппингом
+	// не примут ничего, пока сервер меняет раскладку. Затем слоты опустошаются (id=0),
+	// и клиенты, увидев новый mem->data_size, сами делают ремапинг.
+	us_memsink_shared_s *mem = sink->mem;
+	for (uint index = 0; index < US_MEMSINK_SLOTS; ++index) {
+		atomic_fetch_add_explicit(&mem->slots[index].gen, 1, memory_order_relaxed);
+	}
+	atomic_thread_fence(memory_order_release);
+
+	int retval = -1;
+	const uz size = us_memsink_shared_get_size(data_size);
+	if (size > sink->file_size) {
+		if (ftruncate(sink->fd, size) < 0) {
+			US_LOG_PERROR("%s-sink: Can't truncate shared memory", sink->name);
+			goto done;
+		}
+		sink->file_size = size;
+	}
 
-	} else {
-		US_LOG_PERROR("%s-sink: Can't lock memory", sink->name);
-		return -1;
+	us_memsink_shared_s *const new_mem = us_memsink_shared_map(sink->fd, data_size);
+	if (new_mem == NULL) {
+		US_LOG_PERROR("%s-sink: Can't mmap shared memory", sink->name);
+		goto done;
 	}
-	return 0;
+	if (us_memsink_shared_unmap(mem, sink->data_size) < 0) {
+		US_LOG_PERROR("%s-sink: Can't unmap shared memory", sink->name);
+	}
+	sink->mem = mem = new_mem;
+	sink->data_size = data_size;
+
+#	ifdef FALLOC_FL_PUNCH_HOLE
+	// Файл не обрезается, иначе клиенты со старым маппингом получат SIGBUS,
+	// но ненужный хвост отдается системе.
+	if (size < sink->file_size && fallocate(
+		sink->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, size, sink->file_size - size
+	) < 0) {
+		US_LOG_PERROR("%s-sink: Can't release unused shared memory", sink->name);
+	}
+#	endif
+
+	mem->data_size = data_size;
+	for (uint index = 0; index < US_MEMSINK_SLOTS; ++index) {
+		mem->slots[index].used = 0;
+		mem->slots[index].id = 0;
+	}
+	retval = 0;
+
+done:
+	for (uint index = 0; index < US_MEMSINK_SLOTS; ++index) {
+		atomic_fetch_add_explicit(&mem->slots[index].gen, 1, memory_order_release);
+	}
+	return retval;
 }
 
-int us_memsink_client_get(us_memsink_s *sink, us_frame_s *frame, bool *key_requested, bool key_required) {
+static uz _server_get_data_size(uz used) {
+	// A quarter of the frame as a reserve for the next ones
+	return us_align_size(used + used / 4, getpagesize());
+}
+
+static uint _server_get_free_slot(us_memsink_shared_s *mem) {
+	// Самый старый слот, который никто не держит. Если все заняты (или клиент умер,
+	// не вернув слот), то просто самый старый: клиент узнает об этом при возврате.
+	const uint last = atomic_load_explicit(&mem->last, memory_order_relaxed);
+	for (uint offset = 1; offset < US_MEMSINK_SLOTS; ++offset) {
+		const uint index = (last + offset) % US_MEMSINK_SLOTS;
+		if (atomic_load(&mem->slots[index].readers) == 0) {
+			return index;
+		}
+	}
+	return (last + 1) % US_MEMSINK_SLOTS;
+}
+
+static int _client_wait(us_memsink_s *sink, us_frame_s *frame, bool *key_requested, bool key_required, bool borrow) {
+	// Ждем новый фрейм не дольше sink->timeout, засыпая на futex между проверками
 	assert(!sink->server); // Client only
 
-	if (us_flock_timedwait_monotonic(sink->fd, sink->timeout) < 0) {
-		if (errno == EWOULDBLOCK) {
+	const ldf deadline_ts = us_get_now_monotonic() + sink->timeout;
+	while (true) {
+		// The seq should be taken before checking the id, otherwise we can miss the wakeup
+		const u32 seq = us_memsink_shared_get_seq(sink->mem);
+
+		const int retval = _client_get(sink, frame, key_requested, key_required, borrow);
+		if (retval != US_ERROR_NO_DATA) {
+			return retval;
+		}
+
+		const ldf now_ts = us_get_now_monotonic();
+		if (now_ts >= deadline_ts) {
 			return US_ERROR_NO_DATA;
 		}
-		US_LOG_PERROR("%s-sink: Can't lock memory", sink->name);
-		return -1;
+		if (us_memsink_shared_wait(sink->mem, seq, deadline_ts - now_ts) < 0) {
+			US_LOG_PERROR("%s-sink: Can't wait for a new frame", sink->name);
+			return -1;
+		}
 	}
+}
 
-	int retval = 0;
+static int _client_get(us_memsink_s *sink, us_frame_s *frame, bool *key_requested, bool key_required, bool borrow) {
+	us_memsink_shared_s *mem = sink->mem;
 
-	if (sink->mem->magic != US_MEMSINK_MAGIC) {
-		retval = US_ERROR_NO_DATA; // Not updated
-		goto done;
+	if (mem->magic != US_MEMSINK_MAGIC) {
+		return US_ERROR_NO_DATA; // Not updated
 	}
-	if (sink->mem->version != US_MEMSINK_VERSION) {
+	if (mem->version != US_MEMSINK_VERSION) {
 		US_LOG_ERROR("%s-sink: Protocol version mismatch: sink=%u, required=%u",
-			sink->name, sink->mem->version, US_MEMSINK_VERSION);
-		retval = -1;
-		goto done;
+			sink->name, mem->version, US_MEMSINK_VERSION);
+		return -1;
+	}
+	if (mem->data_size != sink->data_size) {
+		if (sink->borrowed >= 0) {
+			return US_ERROR_NO_DATA; // The old mapping is still in use
+		}
+		if (us_memsink_shared_remap(sink->fd, &sink->mem, &sink->data_size) < 0) {
+			US_LOG_PERROR("%s-sink: Can't remap shared memory", sink->name);
+			return -1;
+		}
+		US_LOG_VERBOSE("%s-sink: Remapped to the new slot size: %zu", sink->name, sink->data_size);
+		mem = sink->mem;
 	}
 
 	// Let the sink know that the client is alive
-	sink->mem->last_client_ts = us_get_now_monotonic();
+	mem->last_client_ts = us_get_now_monotonic();
 
-	if (sink->mem->id == sink->last_readed_id) {
-		retval = US_ERROR_NO_DATA; // Not updated
-		goto done;
+	if (borrow) {
+		uint index;
+		if (us_memsink_shared_borrow(mem, sink->data_size, frame, &sink->last_readed_id, &index, &sink->borrowed_gen) < 0) {
+			return US_ERROR_NO_DATA; // Not updated
+		}
+		sink->borrowed = index;
+	} else if (us_memsink_shared_read(mem, sink->data_size, frame, &sink->last_readed_id) < 0) {
+		return US_ERROR_NO_DATA; // Not updated
 	}
-
-	sink->last_readed_id = sink->mem->id;
-	us_frame_set_data(frame, us_memsink_get_data(sink->mem), sink->mem->used);
-	US_FRAME_COPY_META(sink->mem, frame);
 	if (key_requested != NULL) { // We don't need it for non-H264 sinks
-		*key_requested = sink->mem->key_requested;
+		*key_requested = mem->key_requested;
 	}
 	if (key_required) {
-		sink->mem->key_requested = true;
+		mem->key_requested = true;
 	}
-
-done:
-	if (flock(sink->fd, LOCK_UN) < 0) {
-		US_LOG_PERROR("%s-sink: Can't unlock memory", sink->name);
-		retval = -1;
-	}
-	return retval;
+	return 0;
 }
@@ -34,7 +34,7 @@
 typedef struct {
 	const char	*name;
 	const char	*obj;
-	uz			data_size;
+	uz			data_size; // Of the own mapping
 	bool		server;
 	bool		rm;
 	uint		client_ttl; // Only for server
@@ -43,7 +43,13 @@ typedef struct {
 	int					fd;
 	us_memsink_shared_s	*mem;
 
+	uz			file_size; // Only for server
+	uz			window_used; // Only for server, the biggest frame since window_ts
+	ldf			window_ts; // Only for server
+
 	u64			last_readed_id; // Only for client
+	int			borrowed; // Only for client, the slot index or -1
+	u32			borrowed_gen;
 
 	atomic_bool	has_clients; // Only for server results
 	ldf			unsafe_last_client_ts; // Only for server
@@ -60,3 +66,5 @@ bool us_memsink_server_check(us_memsink_s *sink, const us_frame_s *frame);
 int us_memsink_server_put(us_memsink_s *sink, const us_frame_s *frame, bool *key_requested);
 
 int us_memsink_client_get(us_memsink_s *sink, us_frame_s *frame, bool *key_requested, bool key_required);
+int us_memsink_client_borrow(us_memsink_s *sink, us_frame_s *view, bool *key_requested, bool key_required);
+int us_memsink_client_release(us_memsink_s *sink);
@@ -22,19 +22,33 @@
 
 #include "memsinksh.h"
 
+#include <stdatomic.h>
 #include <string.h>
 #include <strings.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
 #include <assert.h>
 
 #include <sys/mman.h>
+#if defined(__linux__)
+#	include <sys/syscall.h>
+#	include <linux/futex.h>
+#elif defined(__FreeBSD__)
+#	include <sys/types.h>
+#	include <sys/umtx.h>
+#endif
 
 #include "types.h"
+#include "errors.h"
+#include "tools.h"
+#include "frame.h"
 
 
 us_memsink_shared_s *us_memsink_shared_map(int fd, uz data_size) {
 	us_memsink_shared_s *mem = mmap(
 		NULL,
-		sizeof(us_memsink_shared_s) + data_size,
+		us_memsink_shared_get_size(data_size),
 		PROT_READ | PROT_WRITE, MAP_SHARED,
 		fd, 0);
 	if (mem == MAP_FAILED) {
@@ -46,10 +60,16 @@ us_memsink_shared_s *us_memsink_shared_map(int fd, uz data_size) {
 
 int us_memsink_shared_unmap(us_memsink_shared_s *mem, uz data_size) {
 	assert(mem != NULL);
-	return munmap(mem, sizeof(us_memsink_shared_s) + data_size);
+	return munmap(mem, us_memsink_shared_get_size(data_size));
+}
+
+uz us_memsink_shared_get_size(uz data_size) {
+	return sizeof(us_memsink_shared_s) + data_size * US_MEMSINK_SLOTS;
 }
 
 uz us_memsink_calculate_size(const char *obj) {
+	// Начальный размер слота. Сервер сам увеличит его до размера реальных фреймов
+	// и уменьшит обратно, если они станут меньше, поэтому здесь не нужен худший случай.
 	const char *ptr = strrchr(obj, ':');
 	if (ptr == NULL) {
 		ptr = strrchr(obj, '.');
@@ -57,16 +77,178 @@ uz us_memsink_calculate_size(const char *obj) {
 	if (ptr != NULL) {
 		ptr += 1;
 		if (!strcasecmp(ptr, "jpeg")) {
-			return 4 * 1024 * 1024;
+			return 256 * 1024;
 		} else if (!strcasecmp(ptr, "h264")) {
-			return 2 * 1024 * 1024;
+			return 128 * 1024;
 		} else if (!strcasecmp(ptr, "raw")) {
-			return 1920 * 1200 * 3; // RGB
+			return 1024 * 1024;
 		}
 	}
 	return 0;
 }
 
-u8 *us_memsink_get_data(us_memsink_shared_s *mem) {
-	return (u8*)(mem) + sizeof(us_memsink_shared_s);
+u8 *us_memsink_get_data(us_memsink_shared_s *mem, uz data_size, uint index) {
+	// The data_size is the one of the caller's mapping, not the current mem->data_size
+	assert(index < US_MEMSINK_SLOTS);
+	return (u8*)(mem) + sizeof(us_memsink_shared_s) + data_size * index;
+}
+
+int us_memsink_shared_remap(int fd, us_memsink_shared_s **mem, uz *data_size) {
+	// Клиент следует за размером, выставленным сервером. Сервер только увеличивает
+	// файл, поэтому маппинг нового размера всегда им покрыт.
+	const uz new_data_size = (*mem)->data_size;
+	if (new_data_size == *data_size) {
+		return 0;
+	}
+	us_memsink_shared_s *const new_mem = us_memsink_shared_map(fd, new_data_size);
+	if (new_mem == NULL) {
+		return -1;
+	}
+	us_memsink_shared_unmap(*mem, *data_size);
+	*mem = new_mem;
+	*data_size = new_data_size;
+	return 0;
+}
+
+u32 us_memsink_shared_get_seq(us_memsink_shared_s *mem) {
+	return atomic_load_explicit(&mem->seq, memory_order_acquire);
+}
+
+int us_memsink_shared_wait(us_memsink_shared_s *mem, u32 seq, ldf timeout) {
+	// Спим в ядре, пока сервер не выставит новый seq. Возврат без ошибки не означает
+	// новый фрейм: это может быть и таймаут, и сигнал, поэтому клиент перепроверяет id.
+	// The futex is not private: the word lives in the shared memory of another process.
+	struct timespec ts;
+	us_ld_to_timespec(timeout, &ts);
+#	if defined(__linux__)
+	if (syscall(SYS_futex, &mem->seq, FUTEX_WAIT, seq, &ts, NULL, 0) < 0) {
+		if (errno != EAGAIN && errno != ETIMEDOUT && errno != EINTR) {
+			return -1;
+		}
+	}
+#	elif defined(__FreeBSD__)
+	if (_umtx_op(&mem->seq, UMTX_OP_WAIT_UINT, seq, (void*)sizeof(ts), &ts) < 0) {
+		if (errno != ETIMEDOUT && errno != EINTR) {
+			return -1;
+		}
+	}
+#	else
+	if (us_memsink_shared_get_seq(mem) == seq && usleep(US_MIN(timeout, 0.001) * 1000000) < 0) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+#	endif
+	return 0;
+}
+
+void us_memsink_shared_wake(us_memsink_shared_s *mem) {
+	atomic_fetch_add_explicit(&mem->seq, 1, memory_order_release);
+#	if defined(__linux__)
+	syscall(SYS_futex, &mem->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#	elif defined(__FreeBSD__)
+	_umtx_op(&mem->seq, UMTX_OP_WAKE, INT_MAX, NULL, NULL);
+#	endif
+}
+
+u64 us_memsink_shared_get_last_id(us_memsink_shared_s *mem) {
+	// Only a hint to check for a new frame without reading it
+	const uint index = atomic_load_explicit(&mem->last, memory_order_acquire);
+	return (index < US_MEMSINK_SLOTS ? mem->slots[index].id : 0);
+}
+
+int us_memsink_shared_read(us_memsink_shared_s *mem, uz data_size, us_frame_s *frame, u64 *id) {
+	// Читатель ничего не блокирует: копирует последний слот и проверяет, что сервер
+	// не начал его переписывать за это время (gen не изменился). Если начал,
+	// то к этому моменту уже выставлен новый последний слот, и мы пробуем еще раз.
+	// Returns US_ERROR_NO_DATA if the frame is the same as *id or couldn't be read consistently.
+	// In the last case the frame is left empty. It's also so after resizing of the sink
+	// until the caller remaps the memory by us_memsink_shared_remap().
+
+	for (uint attempt = 0; attempt < US_MEMSINK_SLOTS; ++attempt) {
+		const uint index = atomic_load_explicit(&mem->last, memory_order_acquire);
+		if (index >= US_MEMSINK_SLOTS) {
+			break;
+		}
+		us_memsink_slot_s *const slot = &mem->slots[index];
+
+		const u32 gen = atomic_load_explicit(&slot->gen, memory_order_acquire);
+		if (gen & 1 || mem->data_size != data_size || slot->id == 0) {
+			continue; // Being written, resized or emptied by resizing
+		}
+		if (slot->id == *id) {
+			return US_ERROR_NO_DATA; // Not updated
+		}
+		const u64 slot_id = slot->id;
+		const uz used = slot->used;
+		if (used > data_size) {
+			continue; // Garbage from the writer
+		}
+		us_frame_set_data(frame, us_memsink_get_data(mem, data_size, index), used);
+		US_FRAME_COPY_META(slot, frame);
+
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&slot->gen, memory_order_relaxed) == gen) {
+			*id = slot_id;
+			return 0;
+		}
+	}
+	frame->used = 0;
+	return US_ERROR_NO_DATA;
+}
+
+int us_memsink_shared_borrow(us_memsink_shared_s *mem, uz data_size, us_frame_s *view, u64 *id, uint *index, u32 *gen) {
+	// Как us_memsink_shared_read(), но без копирования: view указывает прямо в слот.
+	// Пока слот занят, сервер пишет в другие, но если свободных нет, то перезапишет
+	// самый старый, поэтому валидность данных окончательно проверяется при возврате.
+	// The view must be released by us_memsink_shared_release() in any case of success.
+
+	for (uint attempt = 0; attempt < US_MEMSINK_SLOTS; ++attempt) {
+		const uint last = atomic_load_explicit(&mem->last, memory_order_acquire);
+		if (last >= US_MEMSINK_SLOTS) {
+			break;
+		}
+		us_memsink_slot_s *const slot = &mem->slots[last];
+
+		atomic_fetch_add(&slot->readers, 1);
+		const u32 last_gen = atomic_load(&slot->gen);
+		if (last_gen & 1 || mem->data_size != data_size || slot->id == 0) {
+			goto next;
+		}
+		if (slot->id == *id) {
+			atomic_fetch_sub(&slot->readers, 1);
+			return US_ERROR_NO_DATA; // Not updated
+		}
+		const u64 slot_id = slot->id;
+		const uz used = slot->used;
+		if (used > data_size) {
+			goto next; // Garbage from the writer
+		}
+		US_MEMSET_ZERO(*view);
+		view->data = us_memsink_get_data(mem, data_size, last);
+		view->used = used;
+		view->dma_fd = -1;
+		US_FRAME_COPY_META(slot, view);
+
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&slot->gen, memory_order_relaxed) == last_gen) {
+			*id = slot_id;
+			*index = last;
+			*gen = last_gen;
+			return 0;
+		}
+	next:
+		atomic_fetch_sub(&slot->readers, 1);
+	}
+	return US_ERROR_NO_DATA;
+}
+
+bool us_memsink_shared_release(us_memsink_shared_s *mem, uint index, u32 gen) {
+	// Returns false if the borrowed data was overwritten and must be discarded
+	assert(index < US_MEMSINK_SLOTS);
+	us_memsink_slot_s *const slot = &mem->slots[index];
+	atomic_thread_fence(memory_order_acquire);
+	const bool valid = (atomic_load_explicit(&slot->gen, memory_order_relaxed) == gen);
+	atomic_fetch_sub(&slot->readers, 1);
+	return valid;
 }
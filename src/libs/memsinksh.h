@@ -22,29 +22,56 @@
 
 #pragma once
 
+#include <stdatomic.h>
+
 #include "types.h"
 #include "frame.h"
 
 
 #define US_MEMSINK_MAGIC	((u64)0xCAFEBABECAFEBABE)
-#define US_MEMSINK_VERSION	((u32)7)
+#define US_MEMSINK_VERSION	((u32)11)
 
+// The server writes a new frame to the slot next to the last exposed one,
+// so a client can copy the last frame while the next ones are being written.
+#define US_MEMSINK_SLOTS	3
 
-typedef struct {
-	u64		magic;
-	u32		version;
-	u64		id;
-	uz		used;
 
-	ldf		last_client_ts;
-	bool	key_requested;
+typedef struct {
+	atomic_uint	gen; // Seqlock: odd while the server is writing the slot
+	atomic_uint	readers; // Clients borrowing the slot, the server avoids it
+	u64			id;
+	uz			used;
 
 	US_FRAME_META_DECLARE;
+} us_memsink_slot_s;
+
+typedef struct {
+	u64			magic;
+	u32			version;
+	atomic_uint	seq; // Futex word, the server increments it after each new frame
+	atomic_uint	last; // The index of the last exposed slot
+	uz			data_size; // For each slot, the server changes it to fit the frames
+
+	ldf			last_client_ts;
+	bool		key_requested;
+
+	us_memsink_slot_s	slots[US_MEMSINK_SLOTS];
 } us_memsink_shared_s;
 
 
 us_memsink_shared_s *us_memsink_shared_map(int fd, uz data_size);
 int us_memsink_shared_unmap(us_memsink_shared_s *mem, uz data_size);
+uz us_memsink_shared_get_size(uz data_size);
 
 uz us_memsink_calculate_size(const char *obj);
-u8 *us_memsink_get_data(us_memsink_shared_s *mem);
+u8 *us_memsink_get_data(us_memsink_shared_s *mem, uz data_size, uint index);
+int us_memsink_shared_remap(int fd, us_memsink_shared_s **mem, uz *data_size);
+
+u32 us_memsink_shared_get_seq(us_memsink_shared_s *mem);
+int us_memsink_shared_wait(us_memsink_shared_s *mem, u32 seq, ldf timeout);
+void us_memsink_shared_wake(us_memsink_shared_s *mem);
+
+u64 us_memsink_shared_get_last_id(us_memsink_shared_s *mem);
+int us_memsink_shared_read(us_memsink_shared_s *mem, uz data_size, us_frame_s *frame, u64 *id);
+int us_memsink_shared_borrow(us_memsink_shared_s *mem, uz data_size, us_frame_s *view, u64 *id, uint *index, u32 *gen);
+bool us_memsink_shared_release(us_memsink_shared_s *mem, uint index, u32 gen);
@@ -22,6 +22,8 @@
 
 #include "queue.h"
 
+#include <stdatomic.h>
+#include <sched.h>
 #include <errno.h>
 #include <time.h>
 #include <assert.h>
@@ -33,11 +35,25 @@
 #include "threading.h"
 
 
+static int _queue_try_put(us_queue_s *queue, void *item);
+static int _queue_try_get(us_queue_s *queue, void **item);
+
+
 us_queue_s *us_queue_init(uint capacity) {
+	assert(capacity > 0);
+
 	us_queue_s *queue;
 	US_CALLOC(queue, 1);
-	US_CALLOC(queue->items, capacity);
+	US_CALLOC(queue->cells, capacity);
 	queue->capacity = capacity;
+	atomic_init(&queue->in, 0);
+	atomic_init(&queue->out, 0);
+	for (uint index = 0; index < capacity; ++index) {
+		atomic_init(&queue->cells[index].turn, 0);
+	}
+
+	atomic_init(&queue->full_waiters, 0);
+	atomic_init(&queue->empty_waiters, 0);
 	US_MUTEX_INIT(queue->mutex);
 
 	pthread_condattr_t attrs;
@@ -53,60 +69,128 @@ void us_queue_destroy(us_queue_s *queue) {
 	US_COND_DESTROY(queue->empty_cond);
 	US_COND_DESTROY(queue->full_cond);
 	US_MUTEX_DESTROY(queue->mutex);
-	free(queue->items);
+	free(queue->cells);
 	free(queue);
 }
 
-#define _WAIT_OR_UNLOCK(x_var, x_cond) { \
-		struct timespec m_ts; \
-		assert(!clock_gettime(CLOCK_MONOTONIC, &m_ts)); \
-		us_ld_to_timespec(us_timespec_to_ld(&m_ts) + timeout, &m_ts); \
-		while (x_var) { \
-			const int err = pthread_cond_timedwait(&(x_cond), &queue->mutex, &m_ts); \
-			if (err == ETIMEDOUT) { \
-				US_MUTEX_UNLOCK(queue->mutex); \
+// Медленный путь: очередь пуста или заполнена, и нас попросили подождать.
+// Счетчик ожидающих выставляется под мьютексом до повторной попытки, поэтому
+// противоположная сторона либо увидит его и разбудит нас, либо мы сами увидим
+// её изменения при повторной попытке. Быстрый путь мьютекс не трогает вообще.
+#define _WAIT_FOR(x_try, x_waiters, x_cond) { \
+		if ((x_try) < 0) { \
+			if (timeout == 0) { \
+				return -1; \
+			} \
+			struct timespec m_ts; \
+			assert(!clock_gettime(CLOCK_MONOTONIC, &m_ts)); \
+			us_ld_to_timespec(us_timespec_to_ld(&m_ts) + timeout, &m_ts); \
+			US_MUTEX_LOCK(queue->mutex); \
+			atomic_fetch_add(&(x_waiters), 1); \
+			atomic_thread_fence(memory_order_seq_cst); \
+			int m_retval; \
+			while ((m_retval = (x_try)) < 0) { \
+				const int m_err = pthread_cond_timedwait(&(x_cond), &queue->mutex, &m_ts); \
+				if (m_err == ETIMEDOUT) { \
+					break; \
+				} \
+				assert(!m_err); \
+			} \
+			atomic_fetch_sub(&(x_waiters), 1); \
+			US_MUTEX_UNLOCK(queue->mutex); \
+			if (m_retval < 0) { \
 				return -1; \
 			} \
-			assert(!err); \
 		} \
 	}
 
-int us_queue_put(us_queue_s *queue, void *item, ldf timeout) {
-	US_MUTEX_LOCK(queue->mutex);
-	if (timeout == 0) {
-		if (queue->size == queue->capacity) {
-			US_MUTEX_UNLOCK(queue->mutex);
-			return -1;
-		}
-	} else {
-		_WAIT_OR_UNLOCK(queue->size == queue->capacity, queue->full_cond);
+#define _WAKE_UP(x_waiters, x_cond) { \
+		atomic_thread_fence(memory_order_seq_cst); \
+		if (atomic_load(&(x_waiters)) > 0) { \
+			US_MUTEX_LOCK(queue->mutex); \
+			US_MUTEX_UNLOCK(queue->mutex); \
+			US_COND_BROADCAST(x_cond); \
+		} \
 	}
-	queue->items[queue->in] = item;
-	++queue->size;
-	++queue->in;
-	queue->in %= queue->capacity;
-	US_MUTEX_UNLOCK(queue->mutex);
-	US_COND_BROADCAST(queue->empty_cond);
+
+int us_queue_put(us_queue_s *queue, void *item, ldf timeout) {
+	_WAIT_FOR(_queue_try_put(queue, item), queue->full_waiters, queue->full_cond);
+	_WAKE_UP(queue->empty_waiters, queue->empty_cond);
 	return 0;
 }
 
 int us_queue_get(us_queue_s *queue, void **item, ldf timeout) {
-	US_MUTEX_LOCK(queue->mutex);
-	_WAIT_OR_UNLOCK(queue->size == 0, queue->empty_cond);
-	*item = queue->items[queue->out];
-	--queue->size;
-	++queue->out;
-	queue->out %= queue->capacity;
-	US_MUTEX_UNLOCK(queue->mutex);
-	US_COND_BROADCAST(queue->full_cond);
+	_WAIT_FOR(_queue_try_get(queue, item), queue->empty_waiters, queue->empty_cond);
+	_WAKE_UP(queue->full_waiters, queue->full_cond);
 	return 0;
 }
 
-#undef _WAIT_OR_UNLOCK
+#undef _WAKE_UP
+#undef _WAIT_FOR
 
 bool us_queue_is_empty(us_queue_s *queue) {
-	US_MUTEX_LOCK(queue->mutex);
-	const uint size = queue->size;
-	US_MUTEX_UNLOCK(queue->mutex);
-	return (bool)(queue->capacity - size);
+	const ull out = atomic_load_explicit(&queue->out, memory_order_acquire);
+	const us_queue_cell_s *const cell = &queue->cells[out % queue->capacity];
+	const ull turn = (out / queue->capacity) * 2 + 1;
+	return (atomic_load_explicit(&cell->turn, memory_order_acquire) != turn);
+}
+
+// Ячейка на позиции pos свободна для записи на круге pos/capacity, если ее turn == круг*2,
+// и содержит элемент, если turn == круг*2+1. Позиции 64-битные и не переполняются на практике.
+
+static int _queue_try_put(us_queue_s *queue, void *item) {
+	ull in = atomic_load_explicit(&queue->in, memory_order_acquire);
+	while (true) {
+		us_queue_cell_s *const cell = &queue->cells[in % queue->capacity];
+		const ull turn = (in / queue->capacity) * 2;
+		if (atomic_load_explicit(&cell->turn, memory_order_acquire) == turn) {
+			if (atomic_compare_exchange_weak_explicit(
+				&queue->in, &in, in + 1,
+				memory_order_acq_rel, memory_order_acquire
+			)) {
+				cell->item = item;
+				atomic_store_explicit(&cell->turn, turn + 1, memory_order_release);
+				return 0;
+			}
+		} else {
+			const ull prev_in = in;
+			in = atomic_load_explicit(&queue->in, memory_order_acquire);
+			if (in == prev_in) {
+				const ull out = atomic_load_explicit(&queue->out, memory_order_acquire);
+				if ((sll)(in - out) >= (sll)queue->capacity) {
+					return -1; // Full
+				}
+				// Читатель прямо сейчас забирает элемент из этой ячейки, это вопрос пары инструкций
+				sched_yield();
+			}
+		}
+	}
+}
+
+static int _queue_try_get(us_queue_s *queue, void **item) {
+	ull out = atomic_load_explicit(&queue->out, memory_order_acquire);
+	while (true) {
+		us_queue_cell_s *const cell = &queue->cells[out % queue->capacity];
+		const ull turn = (out / queue->capacity) * 2 + 1;
+		if (atomic_load_explicit(&cell->turn, memory_order_acquire) == turn) {
+			if (atomic_compare_exchange_weak_explicit(
+				&queue->out, &out, out + 1,
+				memory_order_acq_rel, memory_order_acquire
+			)) {
+				*item = cell->item;
+				atomic_store_explicit(&cell->turn, turn + 1, memory_order_release);
+				return 0;
+			}
+		} else {
+			const ull prev_out = out;
+			out = atomic_load_explicit(&queue->out, memory_order_acquire);
+			if (out == prev_out) {
+				if (atomic_load_explicit(&queue->in, memory_order_acquire) <= out) {
+					return -1; // Empty
+				}
+				// Писатель прямо сейчас кладет элемент в эту ячейку
+				sched_yield();
+			}
+		}
+	}
 }
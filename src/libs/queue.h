@@ -22,21 +22,38 @@
 
 #pragma once
 
+#include <stdatomic.h>
+
 #include <pthread.h>
 
 #include "types.h"
 #include "tools.h"
 
 
-// Based on https://github.com/seifzadeh/c-pthread-queue/blob/master/queue.h
+// Bounded lock-free MPMC queue based on Dmitry Vyukov's algorithm:
+//   - https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+//   - https://github.com/rigtorp/MPMCQueue
+// The mutex and conds are used only for blocking when the queue is empty/full
+// and someone is waiting for it with a non-zero timeout.
+
+#define US_CACHE_LINE_SIZE ((uz)64)
 
 typedef struct {
-	void			**items;
-	uint			size;
+	atomic_ullong	turn;
+	void			*item;
+} us_queue_cell_s;
+
+typedef struct {
+	atomic_ullong	in;
+	u8				in_pad[US_CACHE_LINE_SIZE - sizeof(atomic_ullong)];
+	atomic_ullong	out;
+	u8				out_pad[US_CACHE_LINE_SIZE - sizeof(atomic_ullong)];
+
+	us_queue_cell_s	*cells;
 	uint			capacity;
-	uint			in;
-	uint			out;
 
+	atomic_uint		full_waiters;
+	atomic_uint		empty_waiters;
 	pthread_mutex_t	mutex;
 	pthread_cond_t	full_cond;
 	pthread_cond_t	empty_cond;
@@ -23,6 +23,7 @@
 #include "unjpeg.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <setjmp.h>
 #include <assert.h>
 
@@ -30,10 +31,24 @@
 #include <linux/videodev2.h>
 
 #include "types.h"
+#include "tools.h"
+#include "array.h"
 #include "logging.h"
 #include "frame.h"
 
 
+// Размеры блоков IDCT после масштабирования
+#if JPEG_LIB_VERSION >= 70
+#	define _MIN_DCT_SIZE(x_jpeg)	((x_jpeg)->min_DCT_v_scaled_size)
+#	define _DCT_H_SIZE(x_comp)		((x_comp)->DCT_h_scaled_size)
+#	define _DCT_V_SIZE(x_comp)		((x_comp)->DCT_v_scaled_size)
+#else
+#	define _MIN_DCT_SIZE(x_jpeg)	((x_jpeg)->min_DCT_scaled_size)
+#	define _DCT_H_SIZE(x_comp)		((x_comp)->DCT_scaled_size)
+#	define _DCT_V_SIZE(x_comp)		((x_comp)->DCT_scaled_size)
+#endif
+
+
 typedef struct {
 	struct jpeg_error_mgr	mgr; // Default manager
 	jmp_buf					jmp;
@@ -41,11 +56,21 @@ typedef struct {
 } _jpeg_error_manager_s;
 
 
+static void _jpeg_decode(j_decompress_ptr jpeg, const us_frame_s *src, us_frame_s *dest, uint format, bool decode);
+static void _jpeg_read_packed(j_decompress_ptr jpeg, us_frame_s *dest);
+
+static void _jpeg_read_yuv420(j_decompress_ptr jpeg, u8 *const planes[3], const uint strides[3], uint width, uint height);
+static bool _jpeg_can_read_raw(j_decompress_ptr jpeg);
+static void _jpeg_read_raw(j_decompress_ptr jpeg, u8 *const planes[3], const uint strides[3], uint width, uint height);
+static void _jpeg_read_ycbcr(j_decompress_ptr jpeg, u8 *const planes[3], const uint strides[3], uint width, uint height);
+
 static void _jpeg_error_handler(j_common_ptr jpeg);
 
 
-int us_unjpeg(const us_frame_s *src, us_frame_s *dest, bool decode) {
+int us_unjpeg(const us_frame_s *src, us_frame_s *dest, uint format, uint scale_num, uint scale_denom, bool decode) {
 	assert(us_is_jpeg(src->format));
+	assert(scale_num > 0);
+	assert(scale_denom > 0);
 
 	volatile int retval = 0;
 
@@ -64,35 +89,252 @@ int us_unjpeg(const us_frame_s *src, us_frame_s *dest, bool decode) {
 
 	jpeg_mem_src(&jpeg, src->data, src->used);
 	jpeg_read_header(&jpeg, TRUE);
-	jpeg.out_color_space = JCS_RGB;
 
-	jpeg_start_decompress(&jpeg);
+	// libjpeg масштабирует прямо в IDCT с шагом 1/8, неподдерживаемое значение округляется вверх
+	jpeg.scale_num = scale_num;
+	jpeg.scale_denom = scale_denom;
+	_jpeg_decode(&jpeg, src, dest, format, decode);
 
-	US_FRAME_COPY_META(src, dest); // cppcheck-suppress redundantAssignment
-	dest->format = V4L2_PIX_FMT_RGB24; // cppcheck-suppress redundantAssignment
-	dest->width = jpeg.output_width; // cppcheck-suppress redundantAssignment
-	dest->height = jpeg.output_height; // cppcheck-suppress redundantAssignment
-	dest->stride = jpeg.output_width * jpeg.output_components; // cppcheck-suppress redundantAssignment
-	dest->used = 0; // cppcheck-suppress redundantAssignment
+done:
+	jpeg_destroy_decompress(&jpeg);
+	return retval;
+}
 
-	if (decode) {
-		JSAMPARRAY scanlines;
-		scanlines = (*jpeg.mem->alloc_sarray)((j_common_ptr) &jpeg, JPOOL_IMAGE, dest->stride, 1);
+int us_unjpeg_yuv420(const us_frame_s *src, u8 *const planes[3], const uint strides[3], uint width, uint height) {
+	// Декодирует сразу в планарный YUV420 (I420) заданного размера, например в INPUT-буфер енкодера.
+	// Если картинка не совпадает по размеру, то она обрезается, а лишнее в плоскостях не трогается.
+	assert(us_is_jpeg(src->format));
+	assert(width % 2 == 0);
+	assert(height % 2 == 0);
 
-		us_frame_realloc_data(dest, ((dest->width * dest->height) << 1) * 2);
-		while (jpeg.output_scanline < jpeg.output_height) {
-			jpeg_read_scanlines(&jpeg, scanlines, 1);
-			us_frame_append_data(dest, scanlines[0], dest->stride);
-		}
+	volatile int retval = 0;
+
+	struct jpeg_decompress_struct jpeg;
+	jpeg_create_decompress(&jpeg);
 
-		jpeg_finish_decompress(&jpeg);
+	// https://stackoverflow.com/questions/19857766/error-handling-in-libjpeg
+	_jpeg_error_manager_s jpeg_error;
+	jpeg.err = jpeg_std_error((struct jpeg_error_mgr*)&jpeg_error);
+	jpeg_error.mgr.error_exit = _jpeg_error_handler;
+	jpeg_error.frame = src;
+	if (setjmp(jpeg_error.jmp) < 0) {
+		retval = -1;
+		goto done;
 	}
 
+	jpeg_mem_src(&jpeg, src->data, src->used);
+	jpeg_read_header(&jpeg, TRUE);
+
+	_jpeg_read_yuv420(&jpeg, planes, strides, width, height);
+	// Хвост картинки может быть не дочитан, поэтому без jpeg_finish_decompress()
+
 done:
 	jpeg_destroy_decompress(&jpeg);
 	return retval;
 }
 
+static void _jpeg_decode(j_decompress_ptr jpeg, const us_frame_s *src, us_frame_s *dest, uint format, bool decode) {
+	switch (format) {
+		case V4L2_PIX_FMT_RGB24: jpeg->out_color_space = JCS_RGB; break;
+		case V4L2_PIX_FMT_YUV24: jpeg->out_color_space = JCS_YCbCr; break;
+		case V4L2_PIX_FMT_GREY: jpeg->out_color_space = JCS_GRAYSCALE; break;
+		case V4L2_PIX_FMT_YUV420: break; // See _jpeg_read_yuv420()
+		default: assert(0 && "Unsupported unjpeg format");
+	}
+
+	// Только размеры, без запуска декодера
+	jpeg_calc_output_dimensions(jpeg);
+
+	US_FRAME_COPY_META(src, dest);
+	dest->format = format;
+	dest->width = jpeg->output_width;
+	dest->height = jpeg->output_height;
+	dest->used = 0;
+	uz size;
+	if (format == V4L2_PIX_FMT_YUV420) {
+		dest->width &= ~1u;
+		dest->height &= ~1u;
+		dest->stride = dest->width;
+		size = dest->stride * dest->height * 3 / 2;
+	} else {
+		dest->stride = dest->width * jpeg->out_color_components;
+		size = dest->stride * dest->height;
+	}
+
+	if (decode) {
+		us_frame_realloc_data(dest, size);
+		if (format == V4L2_PIX_FMT_YUV420) {
+			const uint c_stride = dest->stride / 2;
+			u8 *const u_plane = dest->data + dest->stride * dest->height;
+			u8 *const planes[3] = {dest->data, u_plane, u_plane + c_stride * (dest->height / 2)};
+			const uint strides[3] = {dest->stride, c_stride, c_stride};
+			_jpeg_read_yuv420(jpeg, planes, strides, dest->width, dest->height);
+		} else {
+			_jpeg_read_packed(jpeg, dest);
+		}
+		dest->used = size;
+	}
+}
+
+static void _jpeg_read_packed(j_decompress_ptr jpeg, us_frame_s *dest) {
+	jpeg_start_decompress(jpeg);
+
+	// Строки пишутся прямо во фрейм, по несколько за вызов
+	JSAMPROW lines[16];
+	while (jpeg->output_scanline < jpeg->output_height) {
+		const uint y = jpeg->output_scanline;
+		const uint n_lines = US_MIN((uint)US_ARRAY_LEN(lines), jpeg->output_height - y);
+		for (uint index = 0; index < n_lines; ++index) {
+			lines[index] = dest->data + dest->stride * (y + index);
+		}
+		jpeg_read_scanlines(jpeg, lines, n_lines);
+	}
+
+	jpeg_finish_decompress(jpeg);
+}
+
+static void _jpeg_read_yuv420(j_decompress_ptr jpeg, u8 *const planes[3], const uint strides[3], uint width, uint height) {
+	// Для типичной субдискретизации компоненты берутся как есть, без апсемплинга и цветового преобразования
+	const bool raw = _jpeg_can_read_raw(jpeg);
+	if (raw) {
+		jpeg->raw_data_out = TRUE;
+	} else {
+		jpeg->out_color_space = JCS_YCbCr;
+	}
+
+	jpeg_start_decompress(jpeg);
+
+	width = US_MIN(width, jpeg->output_width & ~1u);
+	height = US_MIN(height, jpeg->output_height & ~1u);
+	if (raw) {
+		_jpeg_read_raw(jpeg, planes, strides, width, height);
+	} else {
+		_jpeg_read_ycbcr(jpeg, planes, strides, width, height);
+	}
+}
+
+static bool _jpeg_can_read_raw(j_decompress_ptr jpeg) {
+	// Размеры блоков компонент зависят от масштаба, поэтому сперва считаем их
+	jpeg_calc_output_dimensions(jpeg);
+
+	if (jpeg->jpeg_color_space == JCS_GRAYSCALE && jpeg->num_components == 1) {
+		return true;
+	}
+	if (jpeg->jpeg_color_space != JCS_YCbCr || jpeg->num_components != 3) {
+		return false;
+	}
+	const jpeg_component_info *const comps = jpeg->comp_info;
+	if (
+		comps[0].h_samp_factor != jpeg->max_h_samp_factor
+		|| comps[0].v_samp_factor != jpeg->max_v_samp_factor
+		|| comps[1].h_samp_factor != comps[2].h_samp_factor
+		|| comps[1].v_samp_factor != comps[2].v_samp_factor
+		|| _DCT_H_SIZE(&comps[1]) != _DCT_H_SIZE(&comps[2])
+		|| _DCT_V_SIZE(&comps[1]) != _DCT_V_SIZE(&comps[2])
+	) {
+		return false;
+	}
+	// 4:2:0, 4:2:2, 4:4:0 и 4:4:4 с учетом того, что libjpeg может растянуть цветность в IDCT
+	const int y_h = comps[0].h_samp_factor * _DCT_H_SIZE(&comps[0]);
+	const int y_v = comps[0].v_samp_factor * _DCT_V_SIZE(&comps[0]);
+	const int c_h = comps[1].h_samp_factor * _DCT_H_SIZE(&comps[1]);
+	const int c_v = comps[1].v_samp_factor * _DCT_V_SIZE(&comps[1]);
+	return (
+		(y_h == c_h || y_h == c_h * 2)
+		&& (y_v == c_v || y_v == c_v * 2)
+	);
+}
+
+static void _jpeg_read_raw(j_decompress_ptr jpeg, u8 *const planes[3], const uint strides[3], uint width, uint height) {
+	const uint n_comps = jpeg->num_components;
+	const uint band = jpeg->max_v_samp_factor * _MIN_DCT_SIZE(jpeg); // Lines per iMCU row
+	// При сильном масштабировании строк в iMCU может быть нечетное число,
+	// а цветность собирается парами строк, поэтому тогда читаем по две iMCU.
+	const uint n_bands = (band % 2 ? 2 : 1);
+
+	JSAMPARRAY rows[3];
+	uint n_rows[3];
+	for (uint ci = 0; ci < n_comps; ++ci) {
+		const jpeg_component_info *const comp = &jpeg->comp_info[ci];
+		n_rows[ci] = comp->v_samp_factor * _DCT_V_SIZE(comp);
+		rows[ci] = (*jpeg->mem->alloc_sarray)((j_common_ptr)jpeg, JPOOL_IMAGE,
+			comp->width_in_blocks * _DCT_H_SIZE(comp), n_rows[ci] * n_bands);
+	}
+
+	// Во сколько раз яркость плотнее цветности: 2 - уже как в 4:2:0, 1 - надо усреднять пары
+	uint fx = 2;
+	uint fy = 2;
+	if (n_comps == 3) {
+		const jpeg_component_info *const comps = jpeg->comp_info;
+		fx = (comps[0].h_samp_factor * _DCT_H_SIZE(&comps[0])) / (comps[1].h_samp_factor * _DCT_H_SIZE(&comps[1]));
+		fy = (comps[0].v_samp_factor * _DCT_V_SIZE(&comps[0])) / (comps[1].v_samp_factor * _DCT_V_SIZE(&comps[1]));
+	}
+
+	while (jpeg->output_scanline < height) {
+		const uint y0 = jpeg->output_scanline;
+		for (uint bi = 0; bi < n_bands && jpeg->output_scanline < jpeg->output_height; ++bi) {
+			JSAMPARRAY band_rows[3];
+			for (uint ci = 0; ci < n_comps; ++ci) {
+				band_rows[ci] = rows[ci] + n_rows[ci] * bi;
+			}
+			jpeg_read_raw_data(jpeg, band_rows, band);
+		}
+		const uint lines = US_MIN(band * n_bands, height - y0);
+
+		for (uint y = 0; y < lines; ++y) {
+			memcpy(planes[0] + strides[0] * (y0 + y), rows[0][y], width);
+		}
+
+		for (uint y = 0; y < lines; y += 2) {
+			const uint cy = (y0 + y) / 2;
+			for (uint ci = 1; ci < 3; ++ci) {
+				u8 *const out = planes[ci] + strides[ci] * cy;
+				if (n_comps == 1) {
+					memset(out, 128, width / 2);
+				} else if (fx == 2 && fy == 2) {
+					memcpy(out, rows[ci][y / 2], width / 2);
+				} else {
+					const u8 *const top = rows[ci][y / fy];
+					const u8 *const bottom = rows[ci][(y + 1) / fy];
+					for (uint x = 0; x < width / 2; ++x) {
+						const uint left = x * 2 / fx;
+						const uint right = (x * 2 + 1) / fx;
+						out[x] = (top[left] + top[right] + bottom[left] + bottom[right] + 2) >> 2;
+					}
+				}
+			}
+		}
+	}
+}
+
+static void _jpeg_read_ycbcr(j_decompress_ptr jpeg, u8 *const planes[3], const uint strides[3], uint width, uint height) {
+	// Редкая субдискретизация: libjpeg отдает полноразмерный YCbCr, цветность усредняется по 2x2
+	const uint line_size = jpeg->output_width * jpeg->output_components;
+	JSAMPARRAY lines = (*jpeg->mem->alloc_sarray)((j_common_ptr)jpeg, JPOOL_IMAGE, line_size, 2);
+
+	while (jpeg->output_scanline < height) {
+		const uint y = jpeg->output_scanline;
+		jpeg_read_scanlines(jpeg, lines, 1);
+		jpeg_read_scanlines(jpeg, lines + 1, 1);
+
+		for (uint ly = 0; ly < 2; ++ly) {
+			u8 *const y_line = planes[0] + strides[0] * (y + ly);
+			for (uint x = 0; x < width; ++x) {
+				y_line[x] = lines[ly][x * 3];
+			}
+		}
+
+		u8 *const u_line = planes[1] + strides[1] * (y / 2);
+		u8 *const v_line = planes[2] + strides[2] * (y / 2);
+		for (uint x = 0; x < width; x += 2) {
+			const u8 *const top = lines[0] + x * 3;
+			const u8 *const bottom = lines[1] + x * 3;
+			u_line[x / 2] = (top[1] + top[4] + bottom[1] + bottom[4] + 2) >> 2;
+			v_line[x / 2] = (top[2] + top[5] + bottom[2] + bottom[5] + 2) >> 2;
+		}
+	}
+}
+
 static void _jpeg_error_handler(j_common_ptr jpeg) {
 	_jpeg_error_manager_s *jpeg_error = (_jpeg_error_manager_s*)jpeg->err;
 	char msg[JMSG_LENGTH_MAX];
@@ -26,4 +26,5 @@
 #include "frame.h"
 
 
-int us_unjpeg(const us_frame_s *src, us_frame_s *dest, bool decode);
+int us_unjpeg(const us_frame_s *src, us_frame_s *dest, uint format, uint scale_num, uint scale_denom, bool decode);
+int us_unjpeg_yuv420(const us_frame_s *src, u8 *const planes[3], const uint strides[3], uint width, uint height);
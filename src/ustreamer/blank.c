@@ -36,16 +36,18 @@ us_blank_s *us_blank_init(void) {
 	blank->ft = us_frametext_init();
 	blank->raw = blank->ft->frame;
 	blank->jpeg = us_frame_init();
+	blank->enc = us_cpu_encoder_init();
 	us_blank_draw(blank, "< NO LIVE VIDEO >", 640, 480);
 	return blank;
 }
 
 void us_blank_draw(us_blank_s *blank, const char *text, uint width, uint height) {
 	us_frametext_draw(blank->ft, text, width, height);
-	us_cpu_encoder_compress(blank->raw, blank->jpeg, 95);
+	us_cpu_encoder_compress(blank->enc, blank->raw, blank->jpeg, 95);
 }
 
 void us_blank_destroy(us_blank_s *blank) {
+	us_cpu_encoder_destroy(blank->enc);
 	us_frame_destroy(blank->jpeg);
 	us_frametext_destroy(blank->ft);
 	free(blank);
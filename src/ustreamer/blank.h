@@ -26,11 +26,14 @@
 #include "../libs/frame.h"
 #include "../libs/frametext.h"
 
+#include "encoders/cpu/encoder.h"
+
 
 typedef struct {
 	us_frametext_s	*ft;
 	us_frame_s		*raw;
 	us_frame_s		*jpeg;
+	us_cpu_encoder_s	*enc;
 } us_blank_s;
 
 
@@ -34,6 +34,7 @@
 #include "../libs/threading.h"
 #include "../libs/logging.h"
 #include "../libs/frame.h"
+#include "../libs/frameref.h"
 #include "../libs/capture.h"
 
 #include "workers.h"
@@ -61,6 +62,11 @@ static const struct {
 static void *_worker_job_init(void *v_enc);
 static void _worker_job_destroy(void *v_job);
 static bool _worker_run_job(us_worker_s *wr);
+static void _worker_compress_stripes(us_encoder_job_s *job, const us_frame_s *src, us_frame_s *dest, uint quality);
+
+static void *_stripe_job_init(void *v_enc);
+static void _stripe_job_destroy(void *v_job);
+static bool _stripe_run_job(us_worker_s *wr);
 
 
 us_encoder_s *us_encoder_init(void) {
@@ -162,6 +168,17 @@ void us_encoder_open(us_encoder_s *enc, us_capture_s *cap) {
 	run->quality = quality;
 	US_MUTEX_UNLOCK(run->mutex);
 
+	if (type == US_ENCODER_TYPE_CPU && enc->n_stripes > 1) {
+		// Все воркеры жмут полосы одного кадра, а кадры идут строго по очереди
+		US_LOG_INFO("Using per-stripe parallelism: stripes=%u, workers=%u", enc->n_stripes, enc->n_workers);
+		run->stripes_pool = us_workers_pool_init(
+			"JPEG-STRIPES", "js", enc->n_workers, 0,
+			_stripe_job_init, NULL,
+			_stripe_job_destroy,
+			_stripe_run_job);
+		n_workers = 1;
+	}
+
 	const ldf desired_interval = (
 		cap->desired_fps > 0 && (cap->desired_fps < cap->run->hw_fps || cap->run->hw_fps == 0)
 		? (ldf)1 / cap->desired_fps
@@ -178,6 +195,7 @@ void us_encoder_open(us_encoder_s *enc, us_capture_s *cap) {
 void us_encoder_close(us_encoder_s *enc) {
 	assert(enc->run->pool != NULL);
 	US_DELETE(enc->run->pool, us_workers_pool_destroy);
+	US_DELETE(enc->run->stripes_pool, us_workers_pool_destroy);
 }
 
 void us_encoder_get_runtime_params(us_encoder_s *enc, us_encoder_type_e *type, uint *quality) {
@@ -192,13 +210,19 @@ static void *_worker_job_init(void *v_enc) {
 	us_encoder_job_s *job;
 	US_CALLOC(job, 1);
 	job->enc = (us_encoder_s*)v_enc;
-	job->dest = us_frame_init();
+	job->dest = us_frameref_init();
+	job->cpu = us_cpu_encoder_init();
 	return (void*)job;
 }
 
 static void _worker_job_destroy(void *v_job) {
 	us_encoder_job_s *job = v_job;
-	us_frame_destroy(job->dest);
+	for (uint index = 0; index < job->n_stripes; ++index) {
+		us_frame_destroy(job->stripes[index]);
+	}
+	US_DELETE(job->stripes, free);
+	us_cpu_encoder_destroy(job->cpu);
+	us_frameref_unref(job->dest);
 	free(job);
 }
 
@@ -206,12 +230,17 @@ static bool _worker_run_job(us_worker_s *wr) {
 	us_encoder_job_s *const job = wr->job;
 	us_encoder_runtime_s *const run = job->enc->run;
 	const us_frame_s *const src = &job->hw->raw;
-	us_frame_s *const dest = job->dest;
+	us_frameref_unshare(&job->dest); // The previous frame may be still in use by the HTTP clients
+	us_frame_s *const dest = job->dest->frame;
 
 	if (run->type == US_ENCODER_TYPE_CPU) {
 		US_LOG_VERBOSE("Compressing JPEG using CPU: worker=%s, buffer=%u",
 			wr->name, job->hw->buf.index);
-		us_cpu_encoder_compress(src, dest, run->quality);
+		if (run->stripes_pool != NULL) {
+			_worker_compress_stripes(job, src, dest, run->quality);
+		} else {
+			us_cpu_encoder_compress(job->cpu, src, dest, run->quality);
+		}
 
 	} else if (run->type == US_ENCODER_TYPE_HW) {
 		US_LOG_VERBOSE("Compressing JPEG using HW (just copying): worker=%s, buffer=%u",
@@ -230,8 +259,8 @@ static bool _worker_run_job(us_worker_s *wr) {
 	}
 
 	US_LOG_VERBOSE("Compressed new JPEG: size=%zu, time=%0.3Lf, worker=%s, buffer=%u",
-		job->dest->used,
-		job->dest->encode_end_ts - job->dest->encode_begin_ts,
+		dest->used,
+		dest->encode_end_ts - dest->encode_begin_ts,
 		wr->name,
 		job->hw->buf.index);
 	return true;
@@ -240,3 +269,57 @@ error:
 	US_LOG_ERROR("Compression failed: worker=%s, buffer=%u", wr->name, job->hw->buf.index);
 	return false;
 }
+
+static void _worker_compress_stripes(us_encoder_job_s *job, const us_frame_s *src, us_frame_s *dest, uint quality) {
+	us_workers_pool_s *const pool = job->enc->run->stripes_pool;
+
+	uint stripe_height;
+	const uint n_stripes = us_cpu_encoder_get_stripes(src, job->enc->n_stripes, &stripe_height);
+	if (n_stripes < 2) {
+		us_cpu_encoder_compress(job->cpu, src, dest, quality);
+		return;
+	}
+
+	if (job->n_stripes < n_stripes) {
+		US_REALLOC(job->stripes, n_stripes);
+		for (; job->n_stripes < n_stripes; ++job->n_stripes) {
+			job->stripes[job->n_stripes] = us_frame_init();
+		}
+	}
+
+	// Полос может быть больше, чем воркеров, если кадр не влезает в 16-битный DRI
+	for (uint index = 0; index < n_stripes; ++index) {
+		us_worker_s *const wr = us_workers_pool_wait(pool);
+		us_encoder_stripe_job_s *const sj = wr->job;
+		sj->src = src;
+		sj->dest = job->stripes[index];
+		sj->quality = quality;
+		sj->top = index * stripe_height;
+		sj->height = stripe_height;
+		us_workers_pool_assign(pool, wr);
+	}
+	us_workers_pool_wait_idle(pool);
+
+	us_cpu_encoder_join_stripes(src, job->stripes, n_stripes, dest);
+}
+
+static void *_stripe_job_init(void *v_enc) {
+	(void)v_enc;
+	us_encoder_stripe_job_s *job;
+	US_CALLOC(job, 1);
+	job->cpu = us_cpu_encoder_init();
+	return (void*)job;
+}
+
+static void _stripe_job_destroy(void *v_job) {
+	us_encoder_stripe_job_s *job = v_job;
+	us_cpu_encoder_destroy(job->cpu);
+	free(job);
+}
+
+static bool _stripe_run_job(us_worker_s *wr) {
+	us_encoder_stripe_job_s *const job = wr->job;
+	US_LOG_VERBOSE("Compressing JPEG stripe using CPU: worker=%s, top=%u", wr->name, job->top);
+	us_cpu_encoder_compress_stripe(job->cpu, job->src, job->dest, job->quality, job->top, job->height);
+	return true;
+}
@@ -26,10 +26,12 @@
 
 #include "../libs/types.h"
 #include "../libs/frame.h"
+#include "../libs/frameref.h"
 #include "../libs/capture.h"
 
 #include "workers.h"
 #include "m2m.h"
+#include "encoders/cpu/encoder.h"
 
 
 #define ENCODER_TYPES_STR "CPU, HW, M2M-VIDEO, M2M-IMAGE"
@@ -51,11 +53,13 @@ typedef struct {
 	us_m2m_encoder_s	**m2ms;
 
 	us_workers_pool_s	*pool;
+	us_workers_pool_s	*stripes_pool;
 } us_encoder_runtime_s;
 
 typedef struct {
 	us_encoder_type_e	type;
 	uint				n_workers;
+	uint				n_stripes;
 	char				*m2m_path;
 
 	us_encoder_runtime_s *run;
@@ -64,9 +68,22 @@ typedef struct {
 typedef struct {
 	us_encoder_s		*enc;
 	us_capture_hwbuf_s	*hw;
-	us_frame_s			*dest;
+	us_frameref_s		*dest; // Shared with the HTTP server after exposing
+	us_cpu_encoder_s	*cpu;
+
+	us_frame_s			**stripes;
+	uint				n_stripes;
 } us_encoder_job_s;
 
+typedef struct {
+	us_cpu_encoder_s	*cpu;
+	const us_frame_s	*src;
+	us_frame_s			*dest;
+	uint				quality;
+	uint				top;
+	uint				height;
+} us_encoder_stripe_job_s;
+
 
 us_encoder_s *us_encoder_init(void);
 void us_encoder_destroy(us_encoder_s *enc);
@@ -27,6 +27,14 @@
 
 #include "encoder.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#	define _SIMD_X86
+#	include <immintrin.h>
+#elif defined(__ARM_NEON)
+#	define _SIMD_NEON
+#	include <arm_neon.h>
+#endif
+
 
 typedef struct {
 	struct jpeg_destination_mgr mgr; // Default manager
@@ -34,17 +42,64 @@ typedef struct {
 	us_frame_s	*frame;
 } _jpeg_dest_manager_s;
 
+typedef struct {
+	// Byte offsets inside of a 4-byte macropixel (two pixels)
+	uint	y0;
+	uint	u;
+	uint	y1;
+	uint	v;
+
+	// PSHUFB masks for 4 macropixels: 8 luma bytes, and 4 U + 4 V bytes
+	u8		y_shuf[16];
+	u8		uv_shuf[16];
+} _yuyv_layout_s;
+
+typedef void (*_yuyv_split_f)(
+	const _yuyv_layout_s *layout, const u8 *line0, const u8 *line1,
+	u8 *y0, u8 *y1, u8 *u, u8 *v, uint c_width);
+
+
+#define _BATCH_LINES ((uint)16)
+
+
+static void _cpu_encoder_compress(
+	us_cpu_encoder_s *enc, const us_frame_s *src, us_frame_s *dest,
+	uint quality, uint top, uint height, uint restart_interval);
+static void _cpu_encoder_configure(
+	us_cpu_encoder_s *enc, const us_frame_s *src,
+	uint quality, uint restart_interval, bool raw);
+static u8 *_cpu_encoder_get_buf(us_cpu_encoder_s *enc, uz size);
+static uint _cpu_encoder_get_mcu_size(const us_frame_s *src);
+
+static uz _jpeg_find_scan_data(const us_frame_s *frame, uz *sof_offset);
 
 static void _jpeg_set_dest_frame(j_compress_ptr jpeg, us_frame_s *frame);
 
-static void _jpeg_write_scanlines_yuv(struct jpeg_compress_struct *jpeg, const us_frame_s *frame);
-static void _jpeg_write_scanlines_yuv_planar(struct jpeg_compress_struct *jpeg, const us_frame_s *frame);
-static void _jpeg_write_scanlines_grey(struct jpeg_compress_struct *jpeg, const us_frame_s *frame);
-static void _jpeg_write_scanlines_rgb565(struct jpeg_compress_struct *jpeg, const us_frame_s *frame);
-static void _jpeg_write_scanlines_rgb24(struct jpeg_compress_struct *jpeg, const us_frame_s *frame);
+static void _jpeg_write_scanlines_yuv(us_cpu_encoder_s *enc, const us_frame_s *frame, uint top);
+static void _yuyv_layout_init(_yuyv_layout_s *layout, uint format);
+static _yuyv_split_f _yuyv_get_splitter(void);
+static void _yuyv_split_scalar(
+	const _yuyv_layout_s *layout, const u8 *line0, const u8 *line1,
+	u8 *y0, u8 *y1, u8 *u, u8 *v, uint c_width);
+#if defined(_SIMD_X86)
+static void _yuyv_split_ssse3(
+	const _yuyv_layout_s *layout, const u8 *line0, const u8 *line1,
+	u8 *y0, u8 *y1, u8 *u, u8 *v, uint c_width);
+#elif defined(_SIMD_NEON)
+static void _yuyv_split_neon(
+	const _yuyv_layout_s *layout, const u8 *line0, const u8 *line1,
+	u8 *y0, u8 *y1, u8 *u, u8 *v, uint c_width);
+#endif
+static void _jpeg_write_scanlines_yuv_planar(us_cpu_encoder_s *enc, const us_frame_s *frame, uint top);
+static bool _jpeg_can_write_raw_yuv(const us_frame_s *frame);
+static void _jpeg_set_raw_yuv420(struct jpeg_compress_struct *jpeg);
+static void _jpeg_write_raw_yuv(us_cpu_encoder_s *enc, const us_frame_s *frame, uint top);
+static void _jpeg_write_scanlines_grey(us_cpu_encoder_s *enc, const us_frame_s *frame, uint top);
+static void _jpeg_write_scanlines_rgb565(us_cpu_encoder_s *enc, const us_frame_s *frame, uint top);
+static void _jpeg_write_scanlines_rgb24(us_cpu_encoder_s *enc, const us_frame_s *frame, uint top);
 #ifndef JCS_EXTENSIONS
 #warning JCS_EXT_BGR is not supported, please use libjpeg-turbo
-static void _jpeg_write_scanlines_bgr24(struct jpeg_compress_struct *jpeg, const us_frame_s *frame);
+static void _jpeg_write_scanlines_bgr24(us_cpu_encoder_s *enc, const us_frame_s *frame, uint top);
 #endif
 
 static void _jpeg_init_destination(j_compress_ptr jpeg);
@@ -52,88 +107,244 @@ static boolean _jpeg_empty_output_buffer(j_compress_ptr jpeg);
 static void _jpeg_term_destination(j_compress_ptr jpeg);
 
 
-void us_cpu_encoder_compress(const us_frame_s *src, us_frame_s *dest, uint quality) {
+us_cpu_encoder_s *us_cpu_encoder_init(void) {
+	us_cpu_encoder_s *enc;
+	US_CALLOC(enc, 1);
+	enc->jpeg.err = jpeg_std_error(&enc->jpeg_error);
+	jpeg_create_compress(&enc->jpeg);
+	return enc;
+}
+
+void us_cpu_encoder_destroy(us_cpu_encoder_s *enc) {
+	jpeg_destroy_compress(&enc->jpeg);
+	US_DELETE(enc->buf, free);
+	free(enc);
+}
+
+void us_cpu_encoder_compress(us_cpu_encoder_s *enc, const us_frame_s *src, us_frame_s *dest, uint quality) {
+	_cpu_encoder_compress(enc, src, dest, quality, 0, src->height, 0);
+}
+
+uint us_cpu_encoder_get_stripes(const us_frame_s *src, uint n_stripes, uint *stripe_height) {
+	const uint mcu_size = _cpu_encoder_get_mcu_size(src);
+	const uint mcu_rows = (src->height + mcu_size - 1) / mcu_size;
+	const uint mcus_per_row = (src->width + mcu_size - 1) / mcu_size;
+
+	// The stripe boundaries are the restart points, so each stripe is a whole number of MCU rows.
+	// DRI is 16-bit, so the stripe can't be larger than 65535 MCUs.
+	n_stripes = US_MAX(n_stripes, 1u);
+	uint rows = (mcu_rows + n_stripes - 1) / n_stripes;
+	rows = US_MAX(US_MIN(rows, 65535 / mcus_per_row), 1u);
+
+	*stripe_height = rows * mcu_size;
+	return (mcu_rows + rows - 1) / rows;
+}
+
+void us_cpu_encoder_compress_stripe(
+	us_cpu_encoder_s *enc, const us_frame_s *src, us_frame_s *dest,
+	uint quality, uint top, uint stripe_height) {
+
+	assert(top < src->height);
+	const uint mcu_size = _cpu_encoder_get_mcu_size(src);
+	assert(stripe_height % mcu_size == 0);
+
+	// All stripes use the same restart interval, only the last stripe may be shorter
+	const uint restart_interval = (src->width + mcu_size - 1) / mcu_size * (stripe_height / mcu_size);
+	_cpu_encoder_compress(enc, src, dest, quality, top, US_MIN(stripe_height, src->height - top), restart_interval);
+}
+
+void us_cpu_encoder_join_stripes(const us_frame_s *src, us_frame_s *const *stripes, uint n_stripes, us_frame_s *dest) {
+	// Stripe 0 gives the headers with the DRI marker, only the image height in SOF is patched.
+	// The entropy-coded data of the following stripes are appended with RST0..RST7 markers between them.
+	// This is possible because all stripes use the same tables and each of them starts with the zero
+	// DC predictors and ends on the byte boundary - exactly as the restart interval in a regular JPEG.
+
+	assert(n_stripes > 0);
+	us_frame_encoding_begin(src, dest, V4L2_PIX_FMT_JPEG);
+
+	uz size = 0;
+	for (uint index = 0; index < n_stripes; ++index) {
+		size += stripes[index]->used;
+		dest->encode_begin_ts = US_MIN(dest->encode_begin_ts, stripes[index]->encode_begin_ts);
+	}
+	us_frame_realloc_data(dest, size);
+
+	for (uint index = 0; index < n_stripes; ++index) {
+		const us_frame_s *const stripe = stripes[index];
+		assert(stripe->used >= 4);
+		assert(stripe->data[stripe->used - 2] == 0xFF && stripe->data[stripe->used - 1] == JPEG_EOI);
+
+		uz sof_offset = 0;
+		const uz scan_offset = _jpeg_find_scan_data(stripe, &sof_offset);
+
+		if (index == 0) {
+			assert(sof_offset > 0);
+			us_frame_append_data(dest, stripe->data, stripe->used - 2);
+			// SOF: FF Cx, length (2), precision (1), height (2), width (2) ...
+			dest->data[sof_offset + 5] = (src->height >> 8) & 0xFF;
+			dest->data[sof_offset + 6] = src->height & 0xFF;
+		} else {
+			const u8 rst[2] = {0xFF, JPEG_RST0 + ((index - 1) & 7)};
+			us_frame_append_data(dest, rst, 2);
+			us_frame_append_data(dest, stripe->data + scan_offset, stripe->used - scan_offset - 2);
+		}
+	}
+
+	const u8 eoi[2] = {0xFF, JPEG_EOI};
+	us_frame_append_data(dest, eoi, 2);
+
+	us_frame_encoding_end(dest);
+}
+
+static void _cpu_encoder_compress(
+	us_cpu_encoder_s *enc, const us_frame_s *src, us_frame_s *dest,
+	uint quality, uint top, uint height, uint restart_interval) {
+
 	// This function based on compress_image_to_jpeg() from mjpg-streamer
 
 	us_frame_encoding_begin(src, dest, V4L2_PIX_FMT_JPEG);
 
-	struct jpeg_compress_struct jpeg;
-	struct jpeg_error_mgr jpeg_error;
+	struct jpeg_compress_struct *const jpeg = &enc->jpeg;
+
+	_jpeg_set_dest_frame(jpeg, dest);
+
+	const bool raw = _jpeg_can_write_raw_yuv(src);
+	if (
+		!enc->configured
+		|| enc->width != src->width
+		|| enc->format != src->format
+		|| enc->quality != quality
+		|| enc->restart_interval != restart_interval
+		|| enc->raw != raw
+	) {
+		_cpu_encoder_configure(enc, src, quality, restart_interval, raw);
+	}
+	jpeg->image_height = height; // The dimensions are used only by jpeg_start_compress()
+
+	jpeg_start_compress(jpeg, TRUE);
+
+	if (raw) {
+		_jpeg_write_raw_yuv(enc, src, top);
+	} else {
+		switch (src->format) {
+			// https://www.fourcc.org/yuv.php
+			case V4L2_PIX_FMT_YUYV:
+			case V4L2_PIX_FMT_YVYU:
+			case V4L2_PIX_FMT_UYVY:
+				_jpeg_write_scanlines_yuv(enc, src, top);
+				break;
+
+			case V4L2_PIX_FMT_YUV420:
+			case V4L2_PIX_FMT_YVU420:
+				_jpeg_write_scanlines_yuv_planar(enc, src, top);
+				break;
+
+			case V4L2_PIX_FMT_GREY:
+				_jpeg_write_scanlines_grey(enc, src, top);
+				break;
+
+			case V4L2_PIX_FMT_RGB565:
+				_jpeg_write_scanlines_rgb565(enc, src, top);
+				break;
+
+			case V4L2_PIX_FMT_RGB24:
+				_jpeg_write_scanlines_rgb24(enc, src, top);
+				break;
+
+			case V4L2_PIX_FMT_BGR24:
+#				ifdef JCS_EXTENSIONS
+				_jpeg_write_scanlines_rgb24(enc, src, top); // Use native JCS_EXT_BGR
+#				else
+				_jpeg_write_scanlines_bgr24(enc, src, top);
+#				endif
+				break;
+			default: assert(0 && "Unsupported input format for CPU encoder"); return;
+		}
+	}
+
+	// The compressor returns to the idle state and keeps all parameters and tables for the next frame
+	jpeg_finish_compress(jpeg);
+
+	us_frame_encoding_end(dest);
+}
 
-	jpeg.err = jpeg_std_error(&jpeg_error);
-	jpeg_create_compress(&jpeg);
+static void _cpu_encoder_configure(
+	us_cpu_encoder_s *enc, const us_frame_s *src,
+	uint quality, uint restart_interval, bool raw) {
 
-	_jpeg_set_dest_frame(&jpeg, dest);
+	struct jpeg_compress_struct *const jpeg = &enc->jpeg;
 
-	jpeg.image_width = src->width;
-	jpeg.image_height = src->height;
-	jpeg.input_components = 3;
+	jpeg->image_width = src->width;
+	jpeg->input_components = 3;
 	switch (src->format) {
 		case V4L2_PIX_FMT_YUYV:
 		case V4L2_PIX_FMT_YVYU:
 		case V4L2_PIX_FMT_UYVY:
 		case V4L2_PIX_FMT_YUV420:
 		case V4L2_PIX_FMT_YVU420:
-			jpeg.in_color_space = JCS_YCbCr;
+			jpeg->in_color_space = JCS_YCbCr;
 			break;
 		case V4L2_PIX_FMT_GREY:
-			jpeg.input_components = 1;
-			jpeg.in_color_space = JCS_GRAYSCALE;
+			jpeg->input_components = 1;
+			jpeg->in_color_space = JCS_GRAYSCALE;
 			break;
 #		ifdef JCS_EXTENSIONS
 		case V4L2_PIX_FMT_BGR24:
-			jpeg.in_color_space = JCS_EXT_BGR;
+			jpeg->in_color_space = JCS_EXT_BGR;
 			break;
 #		endif
 		default:
-			jpeg.in_color_space = JCS_RGB;
+			jpeg->in_color_space = JCS_RGB;
 			break;
 	}
 
-	jpeg_set_defaults(&jpeg);
-	jpeg_set_quality(&jpeg, quality, TRUE);
-
-	jpeg_start_compress(&jpeg, TRUE);
-
-	switch (src->format) {
-		// https://www.fourcc.org/yuv.php
-		case V4L2_PIX_FMT_YUYV:
-		case V4L2_PIX_FMT_YVYU:
-		case V4L2_PIX_FMT_UYVY:
-			_jpeg_write_scanlines_yuv(&jpeg, src);
-			break;
+	jpeg_set_defaults(jpeg);
+	jpeg_set_quality(jpeg, quality, TRUE);
 
-		case V4L2_PIX_FMT_YUV420:
-		case V4L2_PIX_FMT_YVU420:
-			_jpeg_write_scanlines_yuv_planar(&jpeg, src);
-			break;
-		
-		case V4L2_PIX_FMT_GREY:
-			_jpeg_write_scanlines_grey(&jpeg, src);
-			break;
-
-		case V4L2_PIX_FMT_RGB565:
-			_jpeg_write_scanlines_rgb565(&jpeg, src);
-			break;
-
-		case V4L2_PIX_FMT_RGB24:
-			_jpeg_write_scanlines_rgb24(&jpeg, src);
-			break;
+	if (raw) {
+		_jpeg_set_raw_yuv420(jpeg);
+	}
+	jpeg->restart_interval = restart_interval; // Reset by jpeg_set_defaults()
+
+	enc->configured = true;
+	enc->width = src->width;
+	enc->format = src->format;
+	enc->quality = quality;
+	enc->restart_interval = restart_interval;
+	enc->raw = raw;
+}
 
-		case V4L2_PIX_FMT_BGR24:
-#			ifdef JCS_EXTENSIONS
-			_jpeg_write_scanlines_rgb24(&jpeg, src); // Use native JCS_EXT_BGR
-#			else
-			_jpeg_write_scanlines_bgr24(&jpeg, src);
-#			endif
-			break;
-		default: assert(0 && "Unsupported input format for CPU encoder"); return;
+static u8 *_cpu_encoder_get_buf(us_cpu_encoder_s *enc, uz size) {
+	if (enc->buf_size < size) {
+		US_REALLOC(enc->buf, size);
+		enc->buf_size = size;
 	}
+	return enc->buf;
+}
 
-	jpeg_finish_compress(&jpeg);
-	jpeg_destroy_compress(&jpeg);
+static uint _cpu_encoder_get_mcu_size(const us_frame_s *src) {
+	// jpeg_set_defaults() selects 2x2 luma sampling for YCbCr, so only the grayscale has 8x8 MCU
+	return (src->format == V4L2_PIX_FMT_GREY ? DCTSIZE : DCTSIZE * 2);
+}
 
-	us_frame_encoding_end(dest);
+static uz _jpeg_find_scan_data(const us_frame_s *frame, uz *sof_offset) {
+	// Returns the offset of the entropy-coded data right after the SOS header
+	assert(frame->data[0] == 0xFF && frame->data[1] == 0xD8 /* SOI */);
+	uz offset = 2;
+	while (offset + 4 <= frame->used) {
+		assert(frame->data[offset] == 0xFF);
+		const u8 marker = frame->data[offset + 1];
+		const uz next = offset + 2 + ((frame->data[offset + 2] << 8) | frame->data[offset + 3]);
+		if (marker == 0xC0 || marker == 0xC1) { // SOF0 or SOF1
+			*sof_offset = offset;
+		} else if (marker == 0xDA) { // SOS
+			assert(next <= frame->used);
+			return next;
+		}
+		offset = next;
+	}
+	assert(0 && "No SOS marker in JPEG");
+	return 0; // Makes linter happy
 }
 
 static void _jpeg_set_dest_frame(j_compress_ptr jpeg, us_frame_s *frame) {
@@ -141,6 +352,7 @@ static void _jpeg_set_dest_frame(j_compress_ptr jpeg, us_frame_s *frame) {
 		assert((jpeg->dest = (struct jpeg_destination_mgr*)(*jpeg->mem->alloc_small)(
 			(j_common_ptr) jpeg, JPOOL_PERMANENT, sizeof(_jpeg_dest_manager_s)
 		)) != NULL);
+		((_jpeg_dest_manager_s*)jpeg->dest)->buf = NULL;
 	}
 
 	_jpeg_dest_manager_s *const dest = (_jpeg_dest_manager_s*)jpeg->dest;
@@ -152,69 +364,179 @@ static void _jpeg_set_dest_frame(j_compress_ptr jpeg, us_frame_s *frame) {
 	frame->used = 0;
 }
 
-static void _jpeg_write_scanlines_yuv(struct jpeg_compress_struct *jpeg, const us_frame_s *frame) {
-	u8 *line_buf;
-	US_CALLOC(line_buf, frame->width * 3);
+static void _jpeg_write_scanlines_yuv(us_cpu_encoder_s *enc, const us_frame_s *frame, uint top) {
+	// Only for the odd widths, the even ones go through _jpeg_write_raw_yuv()
+	struct jpeg_compress_struct *const jpeg = &enc->jpeg;
+	// The layout is selected once per frame, so there is no per-pixel branching
+	_yuyv_layout_s layout;
+	_yuyv_layout_init(&layout, frame->format);
+	const uint y0 = layout.y0;
+	const uint u = layout.u;
+	const uint y1 = layout.y1;
+	const uint v = layout.v;
+
+	const uz line_size = frame->width * 3;
+	u8 *const lines_buf = _cpu_encoder_get_buf(enc, line_size * _BATCH_LINES);
+	JSAMPROW scanlines[_BATCH_LINES];
+	for (uint index = 0; index < _BATCH_LINES; ++index) {
+		scanlines[index] = lines_buf + line_size * index;
+	}
 
-	const uint padding = us_frame_get_padding(frame);
-	const u8 *data = frame->data;
+	const uz stride = frame->width * 2 + us_frame_get_padding(frame);
+
+	while (jpeg->next_scanline < jpeg->image_height) {
+		const uint n_lines = US_MIN(_BATCH_LINES, jpeg->image_height - jpeg->next_scanline);
+		const u8 *data = frame->data + stride * (top + jpeg->next_scanline);
+		for (uint index = 0; index < n_lines; ++index) {
+			const u8 *src = data;
+			u8 *dest = scanlines[index];
+			uint x = 0;
+			for (; x + 1 < frame->width; x += 2) {
+				dest[0] = src[y0];
+				dest[1] = src[u];
+				dest[2] = src[v];
+				dest[3] = src[y1];
+				dest[4] = src[u];
+				dest[5] = src[v];
+				src += 4;
+				dest += 6;
+			}
+			if (x < frame->width) { // Odd width
+				dest[0] = src[y0];
+				dest[1] = src[u];
+				dest[2] = src[v];
+			}
+			data += stride;
+		}
+		jpeg_write_scanlines(jpeg, scanlines, n_lines);
+	}
 
-	while (jpeg->next_scanline < frame->height) {
-		u8 *ptr = line_buf;
+}
 
-		for (uint x = 0; x < frame->width; ++x) {
-			// See also: https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/pixfmt-uyvy.html
-			const bool is_odd_pixel = x & 1;
-			u8 y, u, v;
-			if (frame->format == V4L2_PIX_FMT_YUYV) {
-				y = data[is_odd_pixel ? 2 : 0];
-				u = data[1];
-				v = data[3];
-			} else if (frame->format == V4L2_PIX_FMT_YVYU) {
-				y = data[is_odd_pixel ? 2 : 0];
-				u = data[3];
-				v = data[1];
-			} else if (frame->format == V4L2_PIX_FMT_UYVY) {
-				y = data[is_odd_pixel ? 3 : 1];
-				u = data[0];
-				v = data[2];
-			} else {
-				assert(0 && "Unsupported pixel format");
-				return; // Makes linter happy
-			}
+static void _yuyv_layout_init(_yuyv_layout_s *layout, uint format) {
+	// See also: https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/pixfmt-uyvy.html
+	switch (format) {
+		case V4L2_PIX_FMT_YUYV: *layout = (_yuyv_layout_s){.y0 = 0, .u = 1, .y1 = 2, .v = 3}; break;
+		case V4L2_PIX_FMT_YVYU: *layout = (_yuyv_layout_s){.y0 = 0, .u = 3, .y1 = 2, .v = 1}; break;
+		case V4L2_PIX_FMT_UYVY: *layout = (_yuyv_layout_s){.y0 = 1, .u = 0, .y1 = 3, .v = 2}; break;
+		default: assert(0 && "Unsupported pixel format");
+	}
 
-			ptr[0] = y;
-			ptr[1] = u;
-			ptr[2] = v;
-			ptr += 3;
+	for (uint index = 0; index < 16; ++index) {
+		// 0x80 zeroes the output byte
+		const uint base = (index / 2) * 4;
+		layout->y_shuf[index] = (index < 8 ? base + (index & 1 ? layout->y1 : layout->y0) : 0x80);
+		layout->uv_shuf[index] = (index < 8 ? (index % 4) * 4 + (index < 4 ? layout->u : layout->v) : 0x80);
+	}
+}
 
-			data += (is_odd_pixel ? 4 : 0);
+static _yuyv_split_f _yuyv_get_splitter(void) {
+#	if defined(_SIMD_X86)
+	if (__builtin_cpu_supports("ssse3")) {
+		return _yuyv_split_ssse3;
+	}
+#	elif defined(_SIMD_NEON)
+	return _yuyv_split_neon;
+#	endif
+	return _yuyv_split_scalar;
+}
+
+static void _yuyv_split_scalar(
+	const _yuyv_layout_s *layout, const u8 *line0, const u8 *line1,
+	u8 *y0, u8 *y1, u8 *u, u8 *v, uint c_width) {
+
+	// Two source lines give two luma rows and one vertically averaged chroma row
+	for (uint x = 0; x < c_width; ++x) {
+		const u8 *const mp0 = line0 + x * 4;
+		const u8 *const mp1 = line1 + x * 4;
+		y0[x * 2] = mp0[layout->y0];
+		y0[x * 2 + 1] = mp0[layout->y1];
+		y1[x * 2] = mp1[layout->y0];
+		y1[x * 2 + 1] = mp1[layout->y1];
+		u[x] = (mp0[layout->u] + mp1[layout->u] + 1) >> 1;
+		v[x] = (mp0[layout->v] + mp1[layout->v] + 1) >> 1;
+	}
+}
+
+#if defined(_SIMD_X86)
+__attribute__((target("ssse3")))
+static void _yuyv_split_ssse3(
+	const _yuyv_layout_s *layout, const u8 *line0, const u8 *line1,
+	u8 *y0, u8 *y1, u8 *u, u8 *v, uint c_width) {
+
+	// SSE2 has no byte shuffle, so the deinterleaving requires at least SSSE3.
+	// PAVGB rounds up exactly as the scalar (a + b + 1) >> 1.
+	const __m128i y_shuf = _mm_loadu_si128((const __m128i*)layout->y_shuf);
+	const __m128i uv_shuf = _mm_loadu_si128((const __m128i*)layout->uv_shuf);
+
+#	define SPLIT_LINE(x_line, x_y, x_uv) { \
+			const __m128i m_lo = _mm_loadu_si128((const __m128i*)(x_line)); \
+			const __m128i m_hi = _mm_loadu_si128((const __m128i*)((x_line) + 16)); \
+			_mm_storeu_si128((__m128i*)(x_y), _mm_unpacklo_epi64( \
+				_mm_shuffle_epi8(m_lo, y_shuf), _mm_shuffle_epi8(m_hi, y_shuf))); \
+			/* U0-3 U4-7 V0-3 V4-7 */ \
+			x_uv = _mm_unpacklo_epi32(_mm_shuffle_epi8(m_lo, uv_shuf), _mm_shuffle_epi8(m_hi, uv_shuf)); \
 		}
-		data += padding;
 
-		JSAMPROW scanlines[1] = {line_buf};
-		jpeg_write_scanlines(jpeg, scanlines, 1);
+	uint x = 0;
+	for (; x + 8 <= c_width; x += 8) { // 8 macropixels, 32 bytes of each line
+		__m128i uv0;
+		__m128i uv1;
+		SPLIT_LINE(line0 + x * 4, y0 + x * 2, uv0);
+		SPLIT_LINE(line1 + x * 4, y1 + x * 2, uv1);
+		const __m128i uv = _mm_avg_epu8(uv0, uv1);
+		_mm_storel_epi64((__m128i*)(u + x), uv);
+		_mm_storel_epi64((__m128i*)(v + x), _mm_srli_si128(uv, 8));
 	}
 
-	free(line_buf);
+#	undef SPLIT_LINE
+
+	_yuyv_split_scalar(layout, line0 + x * 4, line1 + x * 4, y0 + x * 2, y1 + x * 2, u + x, v + x, c_width - x);
+}
+
+#elif defined(_SIMD_NEON)
+static void _yuyv_split_neon(
+	const _yuyv_layout_s *layout, const u8 *line0, const u8 *line1,
+	u8 *y0, u8 *y1, u8 *u, u8 *v, uint c_width) {
+
+	uint x = 0;
+	for (; x + 16 <= c_width; x += 16) { // 16 macropixels, 64 bytes of each line
+		// Deinterleave the macropixels by byte offset
+		const uint8x16x4_t mp0 = vld4q_u8(line0 + x * 4);
+		const uint8x16x4_t mp1 = vld4q_u8(line1 + x * 4);
+		const uint8x16x2_t luma0 = {{mp0.val[layout->y0], mp0.val[layout->y1]}};
+		const uint8x16x2_t luma1 = {{mp1.val[layout->y0], mp1.val[layout->y1]}};
+		vst2q_u8(y0 + x * 2, luma0);
+		vst2q_u8(y1 + x * 2, luma1);
+		// VRHADD rounds up exactly as the scalar (a + b + 1) >> 1
+		vst1q_u8(u + x, vrhaddq_u8(mp0.val[layout->u], mp1.val[layout->u]));
+		vst1q_u8(v + x, vrhaddq_u8(mp0.val[layout->v], mp1.val[layout->v]));
+	}
+	_yuyv_split_scalar(layout, line0 + x * 4, line1 + x * 4, y0 + x * 2, y1 + x * 2, u + x, v + x, c_width - x);
 }
+#endif
 
-static void _jpeg_write_scanlines_yuv_planar(struct jpeg_compress_struct *jpeg, const us_frame_s *frame) {
-	u8 *line_buf;
-	US_CALLOC(line_buf, frame->width * 3);
+static void _jpeg_write_scanlines_yuv_planar(us_cpu_encoder_s *enc, const us_frame_s *frame, uint top) {
+	struct jpeg_compress_struct *const jpeg = &enc->jpeg;
+	u8 *const line_buf = _cpu_encoder_get_buf(enc, frame->width * 3);
 
 	const uint padding = us_frame_get_padding(frame);
 	const uint image_size = frame->width * frame->height;
 	const uint chroma_array_size = (frame->used - image_size) / 2;
 	const uint chroma_matrix_order = (image_size / chroma_array_size) == 16 ? 4 : 2;
-	const u8 *data = frame->data;
-	const u8 *chroma1_data = frame->data + image_size;
-	const u8 *chroma2_data = frame->data + image_size + chroma_array_size;
+	const uz stride = frame->width + padding;
+	const uz chroma_stride = stride / chroma_matrix_order;
 
 	//US_LOG_DEBUG("Planar data: Image Size %u, Chroma Array Size %u, Chroma Matrix Order %u",
 	//	image_size, chroma_array_size, chroma_matrix_order);
 
-	while (jpeg->next_scanline < frame->height) {
+	while (jpeg->next_scanline < jpeg->image_height) {
+		const uint row = top + jpeg->next_scanline;
+		const u8 *const data = frame->data + stride * row;
+		// The chroma line is switched after the line, which is a multiple of the matrix order
+		const uz chroma_offset = chroma_stride * (row > 0 ? (row - 1) / chroma_matrix_order : 0);
+		const u8 *const chroma1_data = frame->data + image_size + chroma_offset;
+		const u8 *const chroma2_data = frame->data + image_size + chroma_array_size + chroma_offset;
 		u8 *ptr = line_buf;
 
 		for (uint x = 0; x < frame->width; ++x) {
@@ -244,28 +566,168 @@ static void _jpeg_write_scanlines_yuv_planar(struct jpeg_compress_struct *jpeg,
 			ptr += 3;
 		}
 
-		data += frame->width + padding;
+		JSAMPROW scanlines[1] = {line_buf};
+		jpeg_write_scanlines(jpeg, scanlines, 1);
+	}
+
+}
+
+static bool _jpeg_can_write_raw_yuv(const us_frame_s *frame) {
+	if (frame->width < 2 || frame->width % 2 != 0) {
+		return false;
+	}
+	switch (frame->format) {
+		case V4L2_PIX_FMT_YUYV:
+		case V4L2_PIX_FMT_YVYU:
+		case V4L2_PIX_FMT_UYVY:
+			return true;
 
-		if (jpeg->next_scanline > 0 && jpeg->next_scanline % chroma_matrix_order == 0) {
-			chroma1_data += (frame->width + padding) / chroma_matrix_order;
-			chroma2_data += (frame->width + padding) / chroma_matrix_order;
+		case V4L2_PIX_FMT_YUV420:
+		case V4L2_PIX_FMT_YVU420: {
+			// Only the true 4:2:0, the YUV410-like chroma is handled by the scanlines path
+			const uz y_stride = frame->width + us_frame_get_padding(frame);
+			const uz c_size = (y_stride / 2) * ((frame->height + 1) / 2);
+			return (frame->used >= y_stride * frame->height + c_size * 2);
 		}
 
-		JSAMPROW scanlines[1] = {line_buf};
-		jpeg_write_scanlines(jpeg, scanlines, 1);
+		default: return false;
+	}
+}
+
+static void _jpeg_set_raw_yuv420(struct jpeg_compress_struct *jpeg) {
+	// The output is the same 4:2:0 that jpeg_set_defaults() selects for YCbCr,
+	// but we feed downsampled planes directly, bypassing libjpeg's color conversion
+	// and downsampling of the 4:4:4 triplets.
+	jpeg->raw_data_in = TRUE;
+	jpeg->comp_info[0].h_samp_factor = 2;
+	jpeg->comp_info[0].v_samp_factor = 2;
+	for (uint ci = 1; ci < 3; ++ci) {
+		jpeg->comp_info[ci].h_samp_factor = 1;
+		jpeg->comp_info[ci].v_samp_factor = 1;
+	}
+}
+
+#define _PAD_ROW(x_row, x_width, x_padded) { \
+		if ((x_padded) > (x_width)) { \
+			memset((x_row) + (x_width), (x_row)[(x_width) - 1], (x_padded) - (x_width)); \
+		} \
+	}
+
+static void _jpeg_write_raw_yuv(us_cpu_encoder_s *enc, const us_frame_s *frame, uint top) {
+	struct jpeg_compress_struct *const jpeg = &enc->jpeg;
+	// One iMCU row of 4:2:0 is 16 luma lines and 8 chroma lines. The rows must be padded
+	// to the full MCU width, and lines beyond the image height repeat the last one.
+
+	const uint width = frame->width;
+	const uint height = frame->height;
+	const uint c_width = width / 2;
+	const uint c_height = (height + 1) / 2;
+	const uint y_padded = us_align_size(width, 16);
+	const uint c_padded = y_padded / 2;
+	const bool planar = (frame->format == V4L2_PIX_FMT_YUV420 || frame->format == V4L2_PIX_FMT_YVU420);
+
+	u8 *const buf = _cpu_encoder_get_buf(enc, (y_padded * 16) + (c_padded * 8 * 2));
+	JSAMPROW y_bufs[16];
+	JSAMPROW u_bufs[8];
+	JSAMPROW v_bufs[8];
+	for (uint index = 0; index < 16; ++index) {
+		y_bufs[index] = buf + y_padded * index;
+	}
+	for (uint index = 0; index < 8; ++index) {
+		u_bufs[index] = buf + y_padded * 16 + c_padded * index;
+		v_bufs[index] = buf + y_padded * 16 + c_padded * (8 + index);
+	}
+
+	JSAMPROW y_rows[16];
+	JSAMPROW u_rows[8];
+	JSAMPROW v_rows[8];
+	JSAMPARRAY planes[3] = {y_rows, u_rows, v_rows};
+
+	if (planar) {
+		const uz y_stride = width + us_frame_get_padding(frame);
+		const uz c_stride = y_stride / 2;
+		u8 *const y_data = frame->data;
+		u8 *u_data = y_data + y_stride * height;
+		u8 *v_data = u_data + c_stride * c_height;
+		if (frame->format == V4L2_PIX_FMT_YVU420) {
+			u8 *const tmp = u_data;
+			u_data = v_data;
+			v_data = tmp;
+		}
+
+		// Without the right padding the source lines are used directly, without any copying
+		const bool direct = (width == y_padded);
+
+		while (jpeg->next_scanline < jpeg->image_height) {
+			const uint row = top + jpeg->next_scanline;
+			for (uint index = 0; index < 16; ++index) {
+				u8 *const line = y_data + y_stride * US_MIN(row + index, height - 1);
+				if (direct) {
+					y_rows[index] = line;
+				} else {
+					memcpy(y_bufs[index], line, width);
+					_PAD_ROW(y_bufs[index], width, y_padded);
+					y_rows[index] = y_bufs[index];
+				}
+			}
+			for (uint index = 0; index < 8; ++index) {
+				const uz offset = c_stride * US_MIN(row / 2 + index, c_height - 1);
+				if (direct) {
+					u_rows[index] = u_data + offset;
+					v_rows[index] = v_data + offset;
+				} else {
+					memcpy(u_bufs[index], u_data + offset, c_width);
+					memcpy(v_bufs[index], v_data + offset, c_width);
+					_PAD_ROW(u_bufs[index], c_width, c_padded);
+					_PAD_ROW(v_bufs[index], c_width, c_padded);
+					u_rows[index] = u_bufs[index];
+					v_rows[index] = v_bufs[index];
+				}
+			}
+			jpeg_write_raw_data(jpeg, planes, 16);
+		}
+
+	} else {
+		_yuyv_layout_s layout;
+		_yuyv_layout_init(&layout, frame->format);
+		const _yuyv_split_f split = _yuyv_get_splitter();
+		const uz stride = width * 2 + us_frame_get_padding(frame);
+
+		memcpy(y_rows, y_bufs, sizeof(y_rows));
+		memcpy(u_rows, u_bufs, sizeof(u_rows));
+		memcpy(v_rows, v_bufs, sizeof(v_rows));
+
+		while (jpeg->next_scanline < jpeg->image_height) {
+			const uint row = top + jpeg->next_scanline;
+			for (uint index = 0; index < 8; ++index) {
+				const u8 *const line0 = frame->data + stride * US_MIN(row + index * 2, height - 1);
+				const u8 *const line1 = frame->data + stride * US_MIN(row + index * 2 + 1, height - 1);
+				u8 *const y0 = y_bufs[index * 2];
+				u8 *const y1 = y_bufs[index * 2 + 1];
+				u8 *const u = u_bufs[index];
+				u8 *const v = v_bufs[index];
+				split(&layout, line0, line1, y0, y1, u, v, c_width);
+				_PAD_ROW(y0, width, y_padded);
+				_PAD_ROW(y1, width, y_padded);
+				_PAD_ROW(u, c_width, c_padded);
+				_PAD_ROW(v, c_width, c_padded);
+			}
+			jpeg_write_raw_data(jpeg, planes, 16);
+		}
 	}
 
-	free(line_buf);
 }
 
-static void _jpeg_write_scanlines_grey(struct jpeg_compress_struct *jpeg, const us_frame_s *frame) {
-	u8 *line_buf;
-	US_CALLOC(line_buf, frame->width);
+#undef _PAD_ROW
+
+static void _jpeg_write_scanlines_grey(us_cpu_encoder_s *enc, const us_frame_s *frame, uint top) {
+	struct jpeg_compress_struct *const jpeg = &enc->jpeg;
+	u8 *const line_buf = _cpu_encoder_get_buf(enc, frame->width);
 
 	const uint padding = us_frame_get_padding(frame);
-	const u8 *data = frame->data;
+	const u8 *data = frame->data + (frame->width + padding) * top;
 
-	while (jpeg->next_scanline < frame->height) {
+	while (jpeg->next_scanline < jpeg->image_height) {
 		u8 *ptr = line_buf;
 
 		for (uint x = 0; x < frame->width; ++x) {
@@ -279,17 +741,16 @@ static void _jpeg_write_scanlines_grey(struct jpeg_compress_struct *jpeg, const
 		jpeg_write_scanlines(jpeg, scanlines, 1);
 	}
 
-	free(line_buf);
 }
 
-static void _jpeg_write_scanlines_rgb565(struct jpeg_compress_struct *jpeg, const us_frame_s *frame) {
-	u8 *line_buf;
-	US_CALLOC(line_buf, frame->width * 3);
+static void _jpeg_write_scanlines_rgb565(us_cpu_encoder_s *enc, const us_frame_s *frame, uint top) {
+	struct jpeg_compress_struct *const jpeg = &enc->jpeg;
+	u8 *const line_buf = _cpu_encoder_get_buf(enc, frame->width * 3);
 
 	const uint padding = us_frame_get_padding(frame);
-	const u8 *data = frame->data;
+	const u8 *data = frame->data + (frame->width * 2 + padding) * top;
 
-	while (jpeg->next_scanline < frame->height) {
+	while (jpeg->next_scanline < jpeg->image_height) {
 		u8 *ptr = line_buf;
 
 		for (uint x = 0; x < frame->width; ++x) {
@@ -308,14 +769,14 @@ static void _jpeg_write_scanlines_rgb565(struct jpeg_compress_struct *jpeg, cons
 		jpeg_write_scanlines(jpeg, scanlines, 1);
 	}
 
-	free(line_buf);
 }
 
-static void _jpeg_write_scanlines_rgb24(struct jpeg_compress_struct *jpeg, const us_frame_s *frame) {
+static void _jpeg_write_scanlines_rgb24(us_cpu_encoder_s *enc, const us_frame_s *frame, uint top) {
+	struct jpeg_compress_struct *const jpeg = &enc->jpeg;
 	const uint padding = us_frame_get_padding(frame);
-	u8 *data = frame->data;
+	u8 *data = frame->data + (frame->width * 3 + padding) * top;
 
-	while (jpeg->next_scanline < frame->height) {
+	while (jpeg->next_scanline < jpeg->image_height) {
 		JSAMPROW scanlines[1] = {data};
 		jpeg_write_scanlines(jpeg, scanlines, 1);
 
@@ -324,14 +785,14 @@ static void _jpeg_write_scanlines_rgb24(struct jpeg_compress_struct *jpeg, const
 }
 
 #ifndef JCS_EXTENSIONS
-static void _jpeg_write_scanlines_bgr24(struct jpeg_compress_struct *jpeg, const us_frame_s *frame) {
-	u8 *line_buf;
-	US_CALLOC(line_buf, frame->width * 3);
+static void _jpeg_write_scanlines_bgr24(us_cpu_encoder_s *enc, const us_frame_s *frame, uint top) {
+	struct jpeg_compress_struct *const jpeg = &enc->jpeg;
+	u8 *const line_buf = _cpu_encoder_get_buf(enc, frame->width * 3);
 
 	const uint padding = us_frame_get_padding(frame);
-	u8 *data = frame->data;
+	u8 *data = frame->data + (frame->width * 3 + padding) * top;
 
-	while (jpeg->next_scanline < frame->height) {
+	while (jpeg->next_scanline < jpeg->image_height) {
 		u8 *ptr = line_buf;
 
 		// swap B and R values
@@ -348,7 +809,6 @@ static void _jpeg_write_scanlines_bgr24(struct jpeg_compress_struct *jpeg, const
 		data += (frame->width * 3) + padding;
 	}
 
-	free(line_buf);
 }
 #endif
 
@@ -357,10 +817,12 @@ static void _jpeg_write_scanlines_bgr24(struct jpeg_compress_struct *jpeg, const
 static void _jpeg_init_destination(j_compress_ptr jpeg) {
 	_jpeg_dest_manager_s *const dest = (_jpeg_dest_manager_s*)jpeg->dest;
 
-	// Allocate the output buffer - it will be released when done with image
-	assert((dest->buf = (JOCTET*)(*jpeg->mem->alloc_small)(
-		(j_common_ptr) jpeg, JPOOL_IMAGE, JPEG_OUTPUT_BUFFER_SIZE * sizeof(JOCTET)
-	)) != NULL);
+	if (dest->buf == NULL) {
+		// Allocate the output buffer once - it lives as long as the compressor
+		assert((dest->buf = (JOCTET*)(*jpeg->mem->alloc_small)(
+			(j_common_ptr) jpeg, JPOOL_PERMANENT, JPEG_OUTPUT_BUFFER_SIZE * sizeof(JOCTET)
+		)) != NULL);
+	}
 
 	dest->mgr.next_output_byte = dest->buf;
 	dest->mgr.free_in_buffer = JPEG_OUTPUT_BUFFER_SIZE;
@@ -391,3 +853,4 @@ static void _jpeg_term_destination(j_compress_ptr jpeg) {
 }
 
 #undef JPEG_OUTPUT_BUFFER_SIZE
+#undef _BATCH_LINES
@@ -35,4 +35,33 @@
 #include "../../../libs/frame.h"
 
 
-void us_cpu_encoder_compress(const us_frame_s *src, us_frame_s *dest, uint quality);
+typedef struct {
+	struct jpeg_compress_struct	jpeg;
+	struct jpeg_error_mgr		jpeg_error;
+
+	// The compressor is reconfigured only when these parameters are changed.
+	// The height is not here: the tail stripe is shorter, it's set on each call.
+	bool	configured;
+	uint	width;
+	uint	format;
+	uint	quality;
+	uint	restart_interval;
+	bool	raw;
+
+	u8		*buf; // Reusable scanlines/planes buffer
+	uz		buf_size;
+} us_cpu_encoder_s;
+
+
+us_cpu_encoder_s *us_cpu_encoder_init(void);
+void us_cpu_encoder_destroy(us_cpu_encoder_s *enc);
+
+void us_cpu_encoder_compress(us_cpu_encoder_s *enc, const us_frame_s *src, us_frame_s *dest, uint quality);
+
+// Slice-parallel encoding: the frame is split into horizontal stripes of whole MCU rows,
+// which can be compressed independently and joined into a single baseline JPEG with restart markers.
+uint us_cpu_encoder_get_stripes(const us_frame_s *src, uint n_stripes, uint *stripe_height);
+void us_cpu_encoder_compress_stripe(
+	us_cpu_encoder_s *enc, const us_frame_s *src, us_frame_s *dest,
+	uint quality, uint top, uint stripe_height);
+void us_cpu_encoder_join_stripes(const us_frame_s *src, us_frame_s *const *stripes, uint n_stripes, us_frame_s *dest);
@@ -0,0 +1,388 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#include "encoder.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include <x264.h>
+
+#include <linux/videodev2.h>
+
+#include "../../../libs/types.h"
+#include "../../../libs/tools.h"
+#include "../../../libs/logging.h"
+#include "../../../libs/frame.h"
+#include "../../../libs/unjpeg.h"
+
+
+static void _x264_encoder_ensure(us_x264_encoder_s *enc, const us_frame_s *frame);
+static void _x264_encoder_cleanup(us_x264_encoder_s *enc);
+static int _x264_encoder_convert(us_x264_encoder_s *enc, const us_frame_s *src);
+
+static void _convert_yuyv(x264_image_t *img, const us_frame_s *src, uint width, uint height);
+static void _convert_rgb(x264_image_t *img, const us_frame_s *src, uint width, uint height);
+static void _read_rgb(const u8 *line, uint format, uint x, uint *r, uint *g, uint *b);
+
+
+#define _LOG_ERROR(x_msg, ...)	US_LOG_ERROR("%s: " x_msg, enc->name, ##__VA_ARGS__)
+#define _LOG_INFO(x_msg, ...)		US_LOG_INFO("%s: " x_msg, enc->name, ##__VA_ARGS__)
+#define _LOG_VERBOSE(x_msg, ...)	US_LOG_VERBOSE("%s: " x_msg, enc->name, ##__VA_ARGS__)
+#define _LOG_DEBUG(x_msg, ...)	US_LOG_DEBUG("%s: " x_msg, enc->name, ##__VA_ARGS__)
+
+
+us_x264_encoder_s *us_x264_encoder_init(const char *name, uint bitrate, uint gop) {
+	US_LOG_INFO("%s: Initializing encoder ...", name);
+
+	us_x264_encoder_runtime_s *run;
+	US_CALLOC(run, 1);
+	run->last_online = -1;
+	run->last_pts = -1;
+
+	us_x264_encoder_s *enc;
+	US_CALLOC(enc, 1);
+	enc->name = us_strdup(name);
+	enc->bitrate = bitrate; // Kbps, as it is expected by x264
+	enc->gop = gop;
+	enc->run = run;
+	return enc;
+}
+
+void us_x264_encoder_destroy(us_x264_encoder_s *enc) {
+	_LOG_INFO("Destroying encoder ...");
+	_x264_encoder_cleanup(enc);
+	free(enc->name);
+	free(enc->run);
+	free(enc);
+}
+
+int us_x264_encoder_compress(us_x264_encoder_s *enc, const us_frame_s *src, us_frame_s *dest, bool force_key) {
+	us_x264_encoder_runtime_s *const run = enc->run;
+
+	// Те же правила, что и у M2M: новый клиент или перерыв в потоке требуют ключевого фрейма
+	force_key = (
+		force_key
+		|| run->last_online != src->online
+		|| run->last_encode_ts + 0.5 < us_get_now_monotonic()
+	);
+
+	us_frame_encoding_begin(src, dest, V4L2_PIX_FMT_H264);
+
+	_x264_encoder_ensure(enc, src);
+	if (!run->ready) { // Already prepared but failed
+		return -1;
+	}
+
+	_LOG_DEBUG("Compressing new frame; force_key=%d ...", force_key);
+
+	if (_x264_encoder_convert(enc, src) < 0) {
+		return -1;
+	}
+
+	// Таймстампы должны расти, а у пустых фреймов они одинаковые
+	s64 pts = llroundl(src->grab_ts * 1000);
+	if (pts <= run->last_pts) {
+		pts = run->last_pts + 1;
+	}
+	run->last_pts = pts;
+	run->pic.i_pts = pts;
+	run->pic.i_type = (force_key ? X264_TYPE_IDR : X264_TYPE_AUTO);
+
+	x264_nal_t *nals;
+	int n_nals;
+	x264_picture_t pic_out;
+	const int size = x264_encoder_encode(run->x264, &nals, &n_nals, &run->pic, &pic_out);
+	if (size <= 0) {
+		// С zerolatency енкодер не задерживает фреймы, так что пустой выход - это ошибка
+		_x264_encoder_cleanup(enc);
+		_LOG_ERROR("Encoder destroyed due an error (compress)");
+		return -1;
+	}
+
+	// В режиме Annex B все NAL лежат в памяти подряд
+	us_frame_set_data(dest, nals[0].p_payload, size);
+	dest->key = pic_out.b_keyframe;
+	dest->gop = enc->gop;
+
+	us_frame_encoding_end(dest);
+
+	_LOG_VERBOSE("Compressed new frame: size=%zu, time=%0.3Lf, force_key=%d",
+		dest->used, dest->encode_end_ts - dest->encode_begin_ts, force_key);
+
+	run->last_online = src->online;
+	run->last_encode_ts = dest->encode_end_ts;
+	return 0;
+}
+
+static void _x264_encoder_ensure(us_x264_encoder_s *enc, const us_frame_s *frame) {
+	us_x264_encoder_runtime_s *const run = enc->run;
+
+	if (
+		run->p_width == frame->width
+		&& run->p_height == frame->height
+		&& run->p_format == frame->format
+		&& run->p_stride == frame->stride
+	) {
+		return; // Configured already
+	}
+
+	_LOG_INFO("Configuring encoder ...");
+
+	_LOG_DEBUG("Encoder changes: width=%u->%u, height=%u->%u, format=%u->%u, stride=%u->%u",
+		run->p_width, frame->width,
+		run->p_height, frame->height,
+		run->p_format, frame->format,
+		run->p_stride, frame->stride);
+
+	_x264_encoder_cleanup(enc);
+
+	run->p_width = frame->width;
+	run->p_height = frame->height;
+	run->p_format = frame->format;
+	run->p_stride = frame->stride;
+
+	// 4:2:0 требует четных размеров, последний нечетный столбец или строка отбрасываются
+	const uint width = frame->width & ~1u;
+	const uint height = frame->height & ~1u;
+	if (width == 0 || height == 0) {
+		_LOG_ERROR("Invalid frame size: %ux%u", frame->width, frame->height);
+		goto error;
+	}
+
+	x264_param_t param;
+	if (x264_param_default_preset(&param, "ultrafast", "zerolatency") < 0) {
+		_LOG_ERROR("Can't apply x264 preset");
+		goto error;
+	}
+	param.i_log_level = X264_LOG_ERROR;
+	param.i_width = width;
+	param.i_height = height;
+	param.i_csp = X264_CSP_I420;
+	param.i_threads = X264_THREADS_AUTO;
+
+	// Захват неравномерный, поэтому битрейт считается по реальным таймстампам
+	param.b_vfr_input = 1;
+	param.i_timebase_num = 1;
+	param.i_timebase_den = 1000;
+	param.i_fps_num = 30;
+	param.i_fps_den = 1;
+
+	param.i_keyint_max = (enc->gop > 0 ? (int)enc->gop : X264_KEYINT_MAX_INFINITE);
+	param.rc.i_rc_method = X264_RC_ABR;
+	param.rc.i_bitrate = enc->bitrate;
+	param.rc.i_vbv_max_bitrate = enc->bitrate;
+	param.rc.i_vbv_buffer_size = enc->bitrate; // One second
+	param.rc.i_qp_min = 16;
+	param.rc.i_qp_max = 32;
+
+	// Как у M2M: SPS/PPS перед каждым ключевым фреймом и уровень по разрешению
+	param.b_repeat_headers = 1;
+	param.b_annexb = 1;
+	param.i_level_idc = (width * height <= 1920 * 1080 ? 40 : 51);
+	if (x264_param_apply_profile(&param, "baseline") < 0) {
+		_LOG_ERROR("Can't apply x264 baseline profile");
+		goto error;
+	}
+
+	if (x264_picture_alloc(&run->pic, X264_CSP_I420, width, height) < 0) {
+		_LOG_ERROR("Can't allocate x264 picture");
+		goto error;
+	}
+	if ((run->x264 = x264_encoder_open(&param)) == NULL) {
+		x264_picture_clean(&run->pic);
+		_LOG_ERROR("Can't open x264 encoder");
+		goto error;
+	}
+
+	run->ready = true;
+	_LOG_INFO("Encoder is ready");
+	return;
+
+error:
+	_x264_encoder_cleanup(enc);
+	_LOG_ERROR("Encoder destroyed due an error (prepare)");
+}
+
+static void _x264_encoder_cleanup(us_x264_encoder_s *enc) {
+	us_x264_encoder_runtime_s *const run = enc->run;
+
+	if (run->x264 != NULL) {
+		x264_encoder_close(run->x264);
+		x264_picture_clean(&run->pic);
+		run->x264 = NULL;
+		_LOG_INFO("Encoder closed");
+	}
+
+	run->last_online = -1;
+	run->ready = false;
+}
+
+static int _x264_encoder_convert(us_x264_encoder_s *enc, const us_frame_s *src) {
+	x264_image_t *const img = &enc->run->pic.img;
+	const uint width = src->width & ~1u;
+	const uint height = src->height & ~1u;
+
+	switch (src->format) {
+		case V4L2_PIX_FMT_YUYV:
+		case V4L2_PIX_FMT_YVYU:
+		case V4L2_PIX_FMT_UYVY:
+			_convert_yuyv(img, src, width, height);
+			return 0;
+
+		case V4L2_PIX_FMT_YUV420:
+		case V4L2_PIX_FMT_YVU420: {
+			const uint c_stride = src->stride / 2;
+			const u8 *const y_plane = src->data;
+			const u8 *const first_plane = y_plane + src->stride * src->height;
+			const u8 *const second_plane = first_plane + c_stride * (src->height / 2);
+			const u8 *const u_plane = (src->format == V4L2_PIX_FMT_YUV420 ? first_plane : second_plane);
+			const u8 *const v_plane = (src->format == V4L2_PIX_FMT_YUV420 ? second_plane : first_plane);
+			for (uint y = 0; y < height; ++y) {
+				memcpy(img->plane[0] + img->i_stride[0] * y, y_plane + src->stride * y, width);
+			}
+			for (uint y = 0; y < height / 2; ++y) {
+				memcpy(img->plane[1] + img->i_stride[1] * y, u_plane + c_stride * y, width / 2);
+				memcpy(img->plane[2] + img->i_stride[2] * y, v_plane + c_stride * y, width / 2);
+			}
+			return 0;
+		}
+
+		case V4L2_PIX_FMT_GREY:
+			for (uint y = 0; y < height; ++y) {
+				memcpy(img->plane[0] + img->i_stride[0] * y, src->data + src->stride * y, width);
+			}
+			for (uint y = 0; y < height / 2; ++y) {
+				memset(img->plane[1] + img->i_stride[1] * y, 128, width / 2);
+				memset(img->plane[2] + img->i_stride[2] * y, 128, width / 2);
+			}
+			return 0;
+
+		case V4L2_PIX_FMT_RGB565:
+		case V4L2_PIX_FMT_RGB24:
+		case V4L2_PIX_FMT_BGR24:
+			_convert_rgb(img, src, width, height);
+			return 0;
+
+		case V4L2_PIX_FMT_JPEG:
+		case V4L2_PIX_FMT_MJPEG: {
+			// Декодируется прямо в плоскости картинки, без промежуточного RGB
+			u8 *const planes[3] = {img->plane[0], img->plane[1], img->plane[2]};
+			const uint strides[3] = {img->i_stride[0], img->i_stride[1], img->i_stride[2]};
+			return us_unjpeg_yuv420(src, planes, strides, width, height);
+		}
+	}
+
+	char fourcc_str[8];
+	_LOG_ERROR("Unsupported input format: %s", us_fourcc_to_string(src->format, fourcc_str, 8));
+	return -1;
+}
+
+static void _convert_yuyv(x264_image_t *img, const us_frame_s *src, uint width, uint height) {
+	uint y_off = 0; // Offsets inside the macropixel Y0-C0-Y1-C1
+	uint u_off = 1;
+	uint v_off = 3;
+	switch (src->format) {
+		case V4L2_PIX_FMT_YVYU: u_off = 3; v_off = 1; break;
+		case V4L2_PIX_FMT_UYVY: y_off = 1; u_off = 0; v_off = 2; break;
+	}
+
+	for (uint y = 0; y < height; y += 2) {
+		const u8 *const top = src->data + src->stride * y;
+		const u8 *const bottom = top + src->stride;
+		u8 *const y_top = img->plane[0] + img->i_stride[0] * y;
+		u8 *const y_bottom = y_top + img->i_stride[0];
+		u8 *const u_line = img->plane[1] + img->i_stride[1] * (y / 2);
+		u8 *const v_line = img->plane[2] + img->i_stride[2] * (y / 2);
+
+		for (uint x = 0; x < width; x += 2) {
+			const uint mp = x * 2; // Macropixel
+			y_top[x] = top[mp + y_off];
+			y_top[x + 1] = top[mp + y_off + 2];
+			y_bottom[x] = bottom[mp + y_off];
+			y_bottom[x + 1] = bottom[mp + y_off + 2];
+			u_line[x / 2] = (top[mp + u_off] + bottom[mp + u_off] + 1) / 2;
+			v_line[x / 2] = (top[mp + v_off] + bottom[mp + v_off] + 1) / 2;
+		}
+	}
+}
+
+static void _convert_rgb(x264_image_t *img, const us_frame_s *src, uint width, uint height) {
+	// BT.601, limited range, as the H264 decoders expect by default
+#	define RGB_TO_Y(x_r, x_g, x_b) ((( 66 * (x_r) + 129 * (x_g) +  25 * (x_b) + 128) >> 8) + 16)
+#	define RGB_TO_U(x_r, x_g, x_b) (((-38 * (x_r) -  74 * (x_g) + 112 * (x_b) + 128) >> 8) + 128)
+#	define RGB_TO_V(x_r, x_g, x_b) (((112 * (x_r) -  94 * (x_g) -  18 * (x_b) + 128) >> 8) + 128)
+
+	for (uint y = 0; y < height; y += 2) {
+		const u8 *const top = src->data + src->stride * y;
+		const u8 *const bottom = top + src->stride;
+		u8 *const y_top = img->plane[0] + img->i_stride[0] * y;
+		u8 *const y_bottom = y_top + img->i_stride[0];
+		u8 *const u_line = img->plane[1] + img->i_stride[1] * (y / 2);
+		u8 *const v_line = img->plane[2] + img->i_stride[2] * (y / 2);
+
+		for (uint x = 0; x < width; x += 2) {
+			int sum_r = 0;
+			int sum_g = 0;
+			int sum_b = 0;
+			for (uint index = 0; index < 4; ++index) {
+				const uint px = x + (index & 1);
+				uint r, g, b;
+				_read_rgb((index < 2 ? top : bottom), src->format, px, &r, &g, &b);
+				(index < 2 ? y_top : y_bottom)[px] = RGB_TO_Y((int)r, (int)g, (int)b);
+				sum_r += r;
+				sum_g += g;
+				sum_b += b;
+			}
+			u_line[x / 2] = RGB_TO_U(sum_r / 4, sum_g / 4, sum_b / 4);
+			v_line[x / 2] = RGB_TO_V(sum_r / 4, sum_g / 4, sum_b / 4);
+		}
+	}
+
+#	undef RGB_TO_V
+#	undef RGB_TO_U
+#	undef RGB_TO_Y
+}
+
+static void _read_rgb(const u8 *line, uint format, uint x, uint *r, uint *g, uint *b) {
+	switch (format) {
+		case V4L2_PIX_FMT_RGB565: {
+			const u16 px = line[x * 2] | (line[x * 2 + 1] << 8);
+			*r = ((px >> 11) & 0x1F) << 3;
+			*g = ((px >> 5) & 0x3F) << 2;
+			*b = (px & 0x1F) << 3;
+			break;
+		}
+		case V4L2_PIX_FMT_RGB24:
+			*r = line[x * 3];
+			*g = line[x * 3 + 1];
+			*b = line[x * 3 + 2];
+			break;
+		default: // BGR24
+			*b = line[x * 3];
+			*g = line[x * 3 + 1];
+			*r = line[x * 3 + 2];
+	}
+}
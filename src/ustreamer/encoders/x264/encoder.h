@@ -0,0 +1,59 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#pragma once
+
+#include <x264.h>
+
+#include "../../../libs/types.h"
+#include "../../../libs/frame.h"
+
+
+typedef struct {
+	x264_t			*x264;
+	x264_picture_t	pic; // I420 input, converted from any capture format
+
+	uint	p_width;
+	uint	p_height;
+	uint	p_format;
+	uint	p_stride;
+
+	bool	ready;
+	int		last_online;
+	ldf		last_encode_ts;
+	s64		last_pts;
+} us_x264_encoder_runtime_s;
+
+typedef struct {
+	char	*name;
+	uint	bitrate;
+	uint	gop;
+
+	us_x264_encoder_runtime_s *run;
+} us_x264_encoder_s;
+
+
+us_x264_encoder_s *us_x264_encoder_init(const char *name, uint bitrate, uint gop);
+void us_x264_encoder_destroy(us_x264_encoder_s *enc);
+
+int us_x264_encoder_compress(us_x264_encoder_s *enc, const us_frame_s *src, us_frame_s *dest, bool force_key);
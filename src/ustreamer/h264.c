@@ -0,0 +1,104 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#include "h264.h"
+
+#include <stdlib.h>
+#include <strings.h>
+
+#include "../libs/types.h"
+#include "../libs/tools.h"
+#include "../libs/array.h"
+#include "../libs/frame.h"
+
+#include "m2m.h"
+#ifdef WITH_X264
+#	include "encoders/x264/encoder.h"
+#endif
+
+
+static const struct {
+	const char *name;
+	const us_h264_encoder_type_e type; // cppcheck-suppress unusedStructMember
+} _H264_ENCODER_TYPES[] = {
+	{"M2M",		US_H264_ENCODER_TYPE_M2M},
+#	ifdef WITH_X264
+	{"X264",	US_H264_ENCODER_TYPE_X264},
+#	endif
+};
+
+
+us_h264_encoder_s *us_h264_encoder_init(us_h264_encoder_type_e type, const char *m2m_path, uint m2m_inflight, uint bitrate, uint gop) {
+	us_h264_encoder_s *enc;
+	US_CALLOC(enc, 1);
+	enc->type = type;
+	switch (type) {
+		case US_H264_ENCODER_TYPE_M2M: enc->m2m = us_m2m_h264_encoder_init("H264", m2m_path, bitrate, gop, m2m_inflight); break;
+#		ifdef WITH_X264
+		case US_H264_ENCODER_TYPE_X264: enc->x264 = us_x264_encoder_init("H264", bitrate, gop); break;
+#		endif
+	}
+	return enc;
+}
+
+void us_h264_encoder_destroy(us_h264_encoder_s *enc) {
+	US_DELETE(enc->m2m, us_m2m_encoder_destroy);
+#	ifdef WITH_X264
+	US_DELETE(enc->x264, us_x264_encoder_destroy);
+#	endif
+	free(enc);
+}
+
+int us_h264_encoder_parse_type(const char *str) {
+	US_ARRAY_ITERATE(_H264_ENCODER_TYPES, 0, item, {
+		if (!strcasecmp(item->name, str)) {
+			return item->type;
+		}
+	});
+	return -1;
+}
+
+const char *us_h264_encoder_type_to_string(us_h264_encoder_type_e type) {
+	US_ARRAY_ITERATE(_H264_ENCODER_TYPES, 0, item, {
+		if (item->type == type) {
+			return item->name;
+		}
+	});
+	return _H264_ENCODER_TYPES[0].name;
+}
+
+int us_h264_encoder_compress(us_h264_encoder_s *enc, const us_frame_s *src, us_frame_s *dest, bool force_key) {
+	switch (enc->type) {
+		case US_H264_ENCODER_TYPE_M2M: return us_m2m_encoder_compress(enc->m2m, src, dest, force_key);
+#		ifdef WITH_X264
+		case US_H264_ENCODER_TYPE_X264: return us_x264_encoder_compress(enc->x264, src, dest, force_key);
+#		endif
+	}
+	return -1;
+}
+
+uint us_h264_encoder_get_fps_limit(us_h264_encoder_s *enc) {
+	// Программный енкодер сам по себе ничего не ограничивает,
+	// а лишние фреймы просто пропускаются потоком H264, пока он занят.
+	return (enc->type == US_H264_ENCODER_TYPE_M2M ? enc->m2m->run->fps_limit : 0);
+}
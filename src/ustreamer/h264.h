@@ -0,0 +1,65 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#pragma once
+
+#include "../libs/types.h"
+#include "../libs/frame.h"
+
+#include "m2m.h"
+#ifdef WITH_X264
+#	include "encoders/x264/encoder.h"
+#endif
+
+
+#ifdef WITH_X264
+#	define US_H264_ENCODER_TYPES_STR "M2M, X264"
+#else
+#	define US_H264_ENCODER_TYPES_STR "M2M"
+#endif
+
+
+typedef enum {
+	US_H264_ENCODER_TYPE_M2M,
+#	ifdef WITH_X264
+	US_H264_ENCODER_TYPE_X264,
+#	endif
+} us_h264_encoder_type_e;
+
+typedef struct {
+	us_h264_encoder_type_e	type;
+	us_m2m_encoder_s		*m2m;
+#	ifdef WITH_X264
+	us_x264_encoder_s		*x264;
+#	endif
+} us_h264_encoder_s;
+
+
+us_h264_encoder_s *us_h264_encoder_init(us_h264_encoder_type_e type, const char *m2m_path, uint m2m_inflight, uint bitrate, uint gop);
+void us_h264_encoder_destroy(us_h264_encoder_s *enc);
+
+int us_h264_encoder_parse_type(const char *str);
+const char *us_h264_encoder_type_to_string(us_h264_encoder_type_e type);
+
+int us_h264_encoder_compress(us_h264_encoder_s *enc, const us_frame_s *src, us_frame_s *dest, bool force_key);
+uint us_h264_encoder_get_fps_limit(us_h264_encoder_s *enc);
@@ -0,0 +1,390 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#include "fmp4.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "../../libs/types.h"
+#include "../../libs/tools.h"
+#include "../../libs/array.h"
+#include "../../libs/logging.h"
+#include "../../libs/frame.h"
+
+
+// Минимальный муксер ISO BMFF (ISO/IEC 14496-12 и 14496-15) для одного H264-трека:
+// init-сегмент ftyp+moov и фрагменты moof+mdat по одному сэмплу на каждый фрейм.
+// Encoder doesn't produce B-frames, so there are no composition offsets.
+
+typedef struct {
+	u8	*data;
+	uz	size;
+	uz	max;
+} _writer_s;
+
+
+static const u8 *_find_nalu(const u8 *begin, const u8 *end, const u8 **nalu_end);
+
+static void _write_init(us_fmp4_s *fmp4);
+
+static void _w_u8(_writer_s *w, u8 value);
+static void _w_u16(_writer_s *w, u16 value);
+static void _w_u32(_writer_s *w, u32 value);
+static void _w_u64(_writer_s *w, u64 value);
+static void _w_data(_writer_s *w, const void *data, uz size);
+static void _w_zeros(_writer_s *w, uz size);
+static void _w_matrix(_writer_s *w);
+static uz _w_box_begin(_writer_s *w, const char *type);
+static uz _w_full_box_begin(_writer_s *w, const char *type, u8 version, u32 flags);
+static void _w_box_end(_writer_s *w, uz offset);
+static void _w_patch_u32(_writer_s *w, uz offset, u32 value);
+
+
+us_fmp4_s *us_fmp4_init(void) {
+	us_fmp4_s *fmp4;
+	US_CALLOC(fmp4, 1);
+	return fmp4;
+}
+
+void us_fmp4_destroy(us_fmp4_s *fmp4) {
+	free(fmp4);
+}
+
+int us_fmp4_convert_sample(us_fmp4_s *fmp4, const us_frame_s *src, us_frame_s *dest) {
+	// Annex B (start codes) to the length-prefixed AVC sample. SPS and PPS go to the init segment.
+
+	us_frame_realloc_data(dest, src->used + 64);
+	dest->used = 0;
+	US_FRAME_COPY_META(src, dest);
+	dest->key = false;
+
+	bool params_changed = (fmp4->width != src->width || fmp4->height != src->height);
+
+	const u8 *const end = src->data + src->used;
+	const u8 *nalu_end = src->data;
+	const u8 *nalu;
+	while ((nalu = _find_nalu(nalu_end, end, &nalu_end)) != NULL) {
+		const uz size = nalu_end - nalu;
+		switch (nalu[0] & 0x1F) {
+			case 5: dest->key = true; break; // IDR
+			case 9: continue; // Access unit delimiter
+			case 7:
+			case 8: {
+				u8 *const param = ((nalu[0] & 0x1F) == 7 ? fmp4->sps : fmp4->pps);
+				uz *const param_size = ((nalu[0] & 0x1F) == 7 ? &fmp4->sps_size : &fmp4->pps_size);
+				if (size > sizeof(fmp4->sps) || ((nalu[0] & 0x1F) == 7 && size < 4)) {
+					US_LOG_ERROR("FMP4: Invalid H264 parameter set: type=%u, size=%zu", nalu[0] & 0x1F, size);
+					return -1;
+				}
+				if (*param_size != size || memcmp(param, nalu, size)) {
+					memcpy(param, nalu, size);
+					*param_size = size;
+					params_changed = true;
+				}
+				continue;
+			}
+			default: break;
+		}
+		const u8 prefix[4] = {size >> 24, size >> 16, size >> 8, size};
+		us_frame_append_data(dest, prefix, 4);
+		us_frame_append_data(dest, nalu, size);
+	}
+
+	if (params_changed && fmp4->sps_size > 0 && fmp4->pps_size > 0) {
+		fmp4->width = src->width;
+		fmp4->height = src->height;
+		_write_init(fmp4);
+		fmp4->init_id += 1;
+		US_LOG_VERBOSE("FMP4: New init segment: %ux%u, size=%zu", fmp4->width, fmp4->height, fmp4->init_size);
+	}
+	return ((fmp4->init_size > 0 && dest->used > 0) ? 0 : -1);
+}
+
+uz us_fmp4_write_fragment_header(u8 *data, u32 sequence, u64 decode_ts, u32 duration, uz sample_size, bool key) {
+	_writer_s w = {.data = data, .max = US_FMP4_FRAGMENT_HEADER_SIZE};
+	uz data_offset;
+
+	const uz moof = _w_box_begin(&w, "moof");
+	{
+		const uz mfhd = _w_full_box_begin(&w, "mfhd", 0, 0);
+		_w_u32(&w, sequence);
+		_w_box_end(&w, mfhd);
+
+		const uz traf = _w_box_begin(&w, "traf");
+		{
+			const uz tfhd = _w_full_box_begin(&w, "tfhd", 0, 0x020000); // default-base-is-moof
+			_w_u32(&w, 1); // Track ID
+			_w_box_end(&w, tfhd);
+
+			const uz tfdt = _w_full_box_begin(&w, "tfdt", 1, 0);
+			_w_u64(&w, decode_ts);
+			_w_box_end(&w, tfdt);
+
+			// data-offset, sample-duration, sample-size, sample-flags
+			const uz trun = _w_full_box_begin(&w, "trun", 0, 0x000001 | 0x000100 | 0x000200 | 0x000400);
+			_w_u32(&w, 1); // Sample count
+			data_offset = w.size;
+			_w_u32(&w, 0); // Will be patched below
+			_w_u32(&w, duration);
+			_w_u32(&w, sample_size);
+			// Sync: depends_on=2; non-sync: depends_on=1 and is_non_sync_sample
+			_w_u32(&w, (key ? 0x02000000 : 0x01010000));
+			_w_box_end(&w, trun);
+		}
+		_w_box_end(&w, traf);
+	}
+	_w_box_end(&w, moof);
+
+	// The sample is sent separately right after the mdat header
+	_w_patch_u32(&w, data_offset, w.size + 8);
+	_w_u32(&w, 8 + sample_size);
+	_w_data(&w, "mdat", 4);
+
+	assert(w.size == US_FMP4_FRAGMENT_HEADER_SIZE);
+	return w.size;
+}
+
+static const u8 *_find_nalu(const u8 *begin, const u8 *end, const u8 **nalu_end) {
+	const u8 *nalu = NULL;
+	for (const u8 *ptr = begin; ptr + 3 <= end; ++ptr) {
+		if (ptr[0] == 0 && ptr[1] == 0 && ptr[2] == 1) {
+			nalu = ptr + 3;
+			break;
+		}
+	}
+	if (nalu == NULL || nalu >= end) {
+		return NULL;
+	}
+
+	const u8 *next = end;
+	for (const u8 *ptr = nalu; ptr + 3 <= end; ++ptr) {
+		if (ptr[0] == 0 && ptr[1] == 0 && (ptr[2] == 1 || ptr[2] == 0)) {
+			next = ptr;
+			break;
+		}
+	}
+	*nalu_end = next;
+	return nalu;
+}
+
+static void _write_init(us_fmp4_s *fmp4) {
+	_writer_s w = {.data = fmp4->init, .max = sizeof(fmp4->init)};
+
+	const uz ftyp = _w_box_begin(&w, "ftyp");
+	_w_data(&w, "isom", 4); // Major brand
+	_w_u32(&w, 0x200); // Minor version
+	_w_data(&w, "isomiso6avc1mp41", 16); // Compatible brands
+	_w_box_end(&w, ftyp);
+
+	const uz moov = _w_box_begin(&w, "moov");
+	{
+		const uz mvhd = _w_full_box_begin(&w, "mvhd", 0, 0);
+		_w_zeros(&w, 8); // Creation and modification time
+		_w_u32(&w, 1000); // Timescale
+		_w_u32(&w, 0); // Duration
+		_w_u32(&w, 0x00010000); // Rate 1.0
+		_w_u16(&w, 0x0100); // Volume 1.0
+		_w_zeros(&w, 10); // Reserved
+		_w_matrix(&w);
+		_w_zeros(&w, 24); // Pre-defined
+		_w_u32(&w, 2); // Next track ID
+		_w_box_end(&w, mvhd);
+
+		const uz trak = _w_box_begin(&w, "trak");
+		{
+			const uz tkhd = _w_full_box_begin(&w, "tkhd", 0, 0x000003); // Enabled, in movie
+			_w_zeros(&w, 8); // Creation and modification time
+			_w_u32(&w, 1); // Track ID
+			_w_zeros(&w, 4); // Reserved
+			_w_u32(&w, 0); // Duration
+			_w_zeros(&w, 8); // Reserved
+			_w_u16(&w, 0); // Layer
+			_w_u16(&w, 0); // Alternate group
+			_w_u16(&w, 0); // Volume
+			_w_zeros(&w, 2); // Reserved
+			_w_matrix(&w);
+			_w_u32(&w, fmp4->width << 16);
+			_w_u32(&w, fmp4->height << 16);
+			_w_box_end(&w, tkhd);
+
+			const uz mdia = _w_box_begin(&w, "mdia");
+			{
+				const uz mdhd = _w_full_box_begin(&w, "mdhd", 0, 0);
+				_w_zeros(&w, 8); // Creation and modification time
+				_w_u32(&w, US_FMP4_TIMESCALE);
+				_w_u32(&w, 0); // Duration
+				_w_u16(&w, 0x55C4); // Language "und"
+				_w_u16(&w, 0); // Pre-defined
+				_w_box_end(&w, mdhd);
+
+				const uz hdlr = _w_full_box_begin(&w, "hdlr", 0, 0);
+				_w_u32(&w, 0); // Pre-defined
+				_w_data(&w, "vide", 4);
+				_w_zeros(&w, 12); // Reserved
+				_w_data(&w, "VideoHandler", 13);
+				_w_box_end(&w, hdlr);
+
+				const uz minf = _w_box_begin(&w, "minf");
+				{
+					const uz vmhd = _w_full_box_begin(&w, "vmhd", 0, 1);
+					_w_zeros(&w, 8); // Graphics mode and opcolor
+					_w_box_end(&w, vmhd);
+
+					const uz dinf = _w_box_begin(&w, "dinf");
+					const uz dref = _w_full_box_begin(&w, "dref", 0, 0);
+					_w_u32(&w, 1); // Entry count
+					const uz url = _w_full_box_begin(&w, "url ", 0, 1); // Self-contained
+					_w_box_end(&w, url);
+					_w_box_end(&w, dref);
+					_w_box_end(&w, dinf);
+
+					const uz stbl = _w_box_begin(&w, "stbl");
+					{
+						const uz stsd = _w_full_box_begin(&w, "stsd", 0, 0);
+						_w_u32(&w, 1); // Entry count
+						const uz avc1 = _w_box_begin(&w, "avc1");
+						_w_zeros(&w, 6); // Reserved
+						_w_u16(&w, 1); // Data reference index
+						_w_zeros(&w, 16); // Pre-defined and reserved
+						_w_u16(&w, fmp4->width);
+						_w_u16(&w, fmp4->height);
+						_w_u32(&w, 0x00480000); // Horizontal resolution 72 dpi
+						_w_u32(&w, 0x00480000); // Vertical resolution 72 dpi
+						_w_u32(&w, 0); // Reserved
+						_w_u16(&w, 1); // Frame count
+						_w_zeros(&w, 32); // Compressor name
+						_w_u16(&w, 0x0018); // Depth
+						_w_u16(&w, 0xFFFF); // Pre-defined
+						{
+							const uz avcc = _w_box_begin(&w, "avcC");
+							_w_u8(&w, 1); // Configuration version
+							_w_data(&w, fmp4->sps + 1, 3); // Profile, compatibility, level
+							_w_u8(&w, 0xFF); // 4 bytes NALU length
+							_w_u8(&w, 0xE1); // One SPS
+							_w_u16(&w, fmp4->sps_size);
+							_w_data(&w, fmp4->sps, fmp4->sps_size);
+							_w_u8(&w, 1); // One PPS
+							_w_u16(&w, fmp4->pps_size);
+							_w_data(&w, fmp4->pps, fmp4->pps_size);
+							_w_box_end(&w, avcc);
+						}
+						_w_box_end(&w, avc1);
+						_w_box_end(&w, stsd);
+
+						// Samples are in the fragments, so the tables are empty
+						const char *const tables[] = {"stts", "stsc", "stco"};
+						for (uint index = 0; index < US_ARRAY_LEN(tables); ++index) {
+							const uz table = _w_full_box_begin(&w, tables[index], 0, 0);
+							_w_u32(&w, 0); // Entry count
+							_w_box_end(&w, table);
+						}
+						const uz stsz = _w_full_box_begin(&w, "stsz", 0, 0);
+						_w_u32(&w, 0); // Sample size
+						_w_u32(&w, 0); // Sample count
+						_w_box_end(&w, stsz);
+					}
+					_w_box_end(&w, stbl);
+				}
+				_w_box_end(&w, minf);
+			}
+			_w_box_end(&w, mdia);
+		}
+		_w_box_end(&w, trak);
+
+		const uz mvex = _w_box_begin(&w, "mvex");
+		const uz trex = _w_full_box_begin(&w, "trex", 0, 0);
+		_w_u32(&w, 1); // Track ID
+		_w_u32(&w, 1); // Default sample description index
+		_w_zeros(&w, 12); // Default sample duration, size and flags
+		_w_box_end(&w, trex);
+		_w_box_end(&w, mvex);
+	}
+	_w_box_end(&w, moov);
+
+	fmp4->init_size = w.size;
+}
+
+static void _w_u8(_writer_s *w, u8 value) {
+	_w_data(w, &value, 1);
+}
+
+static void _w_u16(_writer_s *w, u16 value) {
+	const u8 data[2] = {value >> 8, value};
+	_w_data(w, data, 2);
+}
+
+static void _w_u32(_writer_s *w, u32 value) {
+	const u8 data[4] = {value >> 24, value >> 16, value >> 8, value};
+	_w_data(w, data, 4);
+}
+
+static void _w_u64(_writer_s *w, u64 value) {
+	_w_u32(w, value >> 32);
+	_w_u32(w, value);
+}
+
+static void _w_data(_writer_s *w, const void *data, uz size) {
+	assert(w->size + size <= w->max);
+	memcpy(w->data + w->size, data, size);
+	w->size += size;
+}
+
+static void _w_zeros(_writer_s *w, uz size) {
+	assert(w->size + size <= w->max);
+	memset(w->data + w->size, 0, size);
+	w->size += size;
+}
+
+static void _w_matrix(_writer_s *w) {
+	const u32 matrix[9] = {0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000}; // Unity
+	for (uint index = 0; index < 9; ++index) {
+		_w_u32(w, matrix[index]);
+	}
+}
+
+static uz _w_box_begin(_writer_s *w, const char *type) {
+	const uz offset = w->size;
+	_w_u32(w, 0); // Will be patched by _w_box_end()
+	_w_data(w, type, 4);
+	return offset;
+}
+
+static uz _w_full_box_begin(_writer_s *w, const char *type, u8 version, u32 flags) {
+	const uz offset = _w_box_begin(w, type);
+	_w_u32(w, ((u32)version << 24) | (flags & 0xFFFFFF));
+	return offset;
+}
+
+static void _w_box_end(_writer_s *w, uz offset) {
+	_w_patch_u32(w, offset, w->size - offset);
+}
+
+static void _w_patch_u32(_writer_s *w, uz offset, u32 value) {
+	assert(offset + 4 <= w->size);
+	w->data[offset] = value >> 24;
+	w->data[offset + 1] = value >> 16;
+	w->data[offset + 2] = value >> 8;
+	w->data[offset + 3] = value;
+}
@@ -0,0 +1,52 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#pragma once
+
+#include "../../libs/types.h"
+#include "../../libs/frame.h"
+
+
+#define US_FMP4_TIMESCALE				90000
+#define US_FMP4_FRAGMENT_HEADER_SIZE	108 // moof + mdat header for a single sample
+
+
+typedef struct {
+	u8		sps[256];
+	uz		sps_size;
+	u8		pps[256];
+	uz		pps_size;
+	uint	width;
+	uint	height;
+
+	u8		init[2048]; // ftyp + moov
+	uz		init_size;
+	uint	init_id; // Changes with each new init segment
+} us_fmp4_s;
+
+
+us_fmp4_s *us_fmp4_init(void);
+void us_fmp4_destroy(us_fmp4_s *fmp4);
+
+int us_fmp4_convert_sample(us_fmp4_s *fmp4, const us_frame_s *src, us_frame_s *dest);
+uz us_fmp4_write_fragment_header(u8 *data, u32 sequence, u64 decode_ts, u32 duration, uz sample_size, bool key);
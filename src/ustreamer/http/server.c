@@ -31,11 +31,17 @@
 #include <inttypes.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <assert.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#if defined(__linux__)
+#	include <linux/sockios.h>
+#endif
 #include <netinet/tcp.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
@@ -57,6 +63,7 @@
 #include "../../libs/threading.h"
 #include "../../libs/logging.h"
 #include "../../libs/frame.h"
+#include "../../libs/frameref.h"
 #include "../../libs/base64.h"
 #include "../../libs/list.h"
 #include "../data/index_html.h"
@@ -68,32 +75,68 @@
 #endif
 
 #include "tools.h"
-#include "mime.h"
 #include "static.h"
 #ifdef WITH_SYSTEMD
 #	include "systemd/systemd.h"
 #endif
 
 
+typedef struct {
+	us_frameref_s	*ref; // Shared by all the replies of the batch
+	bool			online;
+	char			timestamp[32];
+	char			width[16];
+	char			height[16];
+	char			grab_ts[32];
+	char			encode_begin_ts[32];
+	char			encode_end_ts[32];
+	char			send_ts[32];
+} _snapshot_reply_s;
+
+
+static us_server_shard_s *_server_shard_init(us_server_s *server, uint index);
+static void _server_shard_destroy(us_server_shard_s *shard);
+static us_server_exposed_s *_server_exposed_init(const us_stream_s *stream, const char *name, bool blank);
+static void _server_exposed_destroy(us_server_exposed_s *ex);
+static void *_server_shard_thread(void *v_shard);
+
 static int _http_preprocess_request(struct evhttp_request *request, us_server_s *server);
 
-static int _http_check_run_compat_action(struct evhttp_request *request, void *v_server);
+static int _http_check_run_compat_action(struct evhttp_request *request, void *v_shard);
 
-static void _http_callback_root(struct evhttp_request *request, void *v_server);
-static void _http_callback_favicon(struct evhttp_request *request, void *v_server);
-static void _http_callback_static(struct evhttp_request *request, void *v_server);
-static void _http_callback_state(struct evhttp_request *request, void *v_server);
-static void _http_callback_snapshot(struct evhttp_request *request, void *v_server);
+static void _http_callback_root(struct evhttp_request *request, void *v_shard);
+static void _http_callback_favicon(struct evhttp_request *request, void *v_shard);
+static void _http_callback_static(struct evhttp_request *request, void *v_shard);
+static bool _http_is_encoding_accepted(const char *accept, const char *coding);
+static bool _http_is_not_modified(struct evhttp_request *request, const us_static_file_s *file, const char *etag);
+static bool _http_is_etag_matched(const char *if_none_match, const char *etag);
+static void _http_callback_state(struct evhttp_request *request, void *v_shard);
+static void _http_callback_snapshot(struct evhttp_request *request, void *v_shard);
 
-static void _http_callback_stream(struct evhttp_request *request, void *v_server);
+static void _http_callback_stream(struct evhttp_request *request, void *v_shard);
 static void _http_callback_stream_write(struct bufferevent *buf_event, void *v_ctx);
 static void _http_callback_stream_error(struct bufferevent *buf_event, short what, void *v_ctx);
 
-static void _http_refresher(int fd, short event, void *v_server);
-static void _http_send_stream(us_server_s *server, bool stream_updated, bool frame_updated);
-static void _http_send_snapshot(us_server_s *server);
+static void _http_callback_h264(struct evhttp_request *request, void *v_shard);
+static void _http_callback_h264_error(struct bufferevent *buf_event, short what, void *v_client);
+static void _http_h264_client_destroy(us_h264_client_s *client, const char *reason);
+
+static void _http_refresher(int fd, short event, void *v_shard);
+static void _http_h264_refresher(int fd, short event, void *v_shard);
+static void _http_send_h264(us_server_shard_s *shard, us_frameref_s *ref);
+static void _http_refresh_exposed(us_server_shard_s *shard, us_server_exposed_s *ex, us_frameref_s *ref);
+static void _http_send_stream(us_server_shard_s *shard, us_server_exposed_s *ex, bool stream_updated, bool frame_updated);
+static void _http_send_snapshot(us_server_shard_s *shard);
+static void _http_snapshot_reply_init(us_server_shard_s *shard, _snapshot_reply_s *reply);
+static void _http_snapshot_reply_send(const _snapshot_reply_s *reply, struct evhttp_request *request);
+
+static bool _expose_frame(us_server_shard_s *shard, us_server_exposed_s *ex, us_frameref_s *ref);
+static const us_server_part_s *_http_get_part(us_server_exposed_s *ex, us_server_part_e variant);
 
-static bool _expose_frame(us_server_s *server, const us_frame_s *frame);
+static void _http_evbuffer_add_raw_cors(struct evbuffer *buf, us_server_s *server, struct evhttp_request *request);
+static uz _http_get_queue_size(struct bufferevent *buf_event);
+static void _http_evbuffer_add_frameref(struct evbuffer *buf, us_frameref_s *ref);
+static void _http_frameref_cleanup(const void *data, size_t size, void *v_ref);
 
 
 #define _LOG_ERROR(x_msg, ...)	US_LOG_ERROR("HTTP: " x_msg, ##__VA_ARGS__)
@@ -109,17 +152,18 @@ static bool _expose_frame(us_server_s *server, const us_frame_s *frame);
 #define _A_ADD_HEADER(x_request, x_key, x_value) \
 		assert(!evhttp_add_header(evhttp_request_get_output_headers(x_request), x_key, x_value))
 
+#if defined(__linux__)
+#	define _IOCTL_UNSENT SIOCOUTQ
+#elif defined(__FreeBSD__)
+#	define _IOCTL_UNSENT FIONWRITE
+#endif
 
-us_server_s *us_server_init(us_stream_s *stream) {
-	us_server_exposed_s *exposed;
-	US_CALLOC(exposed, 1);
-	exposed->frame = us_frame_init();
-	exposed->queued_fpsi = us_fpsi_init("MJPEG-QUEUED", false);
 
+us_server_s *us_server_init(us_stream_s *stream) {
 	us_server_runtime_s *run;
 	US_CALLOC(run, 1);
 	run->ext_fd = -1;
-	run->exposed = exposed;
+	US_MUTEX_INIT(run->clients_mutex);
 
 	us_server_s *server;
 	US_CALLOC(server, 1);
@@ -132,84 +176,50 @@ us_server_s *us_server_init(us_stream_s *stream) {
 	server->allow_origin = "";
 	server->instance_id = "";
 	server->timeout = 10;
+	server->n_threads = 1;
 	server->stream = stream;
 	server->run = run;
 
 	assert(!evthread_use_pthreads());
-	assert((run->base = event_base_new()) != NULL);
-	assert((run->http = evhttp_new(run->base)) != NULL);
-	evhttp_set_allowed_methods(run->http, EVHTTP_REQ_GET|EVHTTP_REQ_HEAD|EVHTTP_REQ_OPTIONS);
 	return server;
 }
 
 void us_server_destroy(us_server_s *server) {
 	us_server_runtime_s *const run = server->run;
 
-	if (run->refresher != NULL) {
-		event_del(run->refresher);
-		event_free(run->refresher);
+	for (uint index = 0; index < run->n_shards; ++index) {
+		US_DELETE(run->shards[index], _server_shard_destroy);
 	}
-
-	evhttp_free(run->http);
+	free(run->shards);
 	US_CLOSE_FD(run->ext_fd);
-	event_base_free(run->base);
+	US_DELETE(run->static_cache, us_static_cache_destroy);
 
 #	if LIBEVENT_VERSION_NUMBER >= 0x02010100
 	libevent_global_shutdown();
 #	endif
 
-	US_LIST_ITERATE(run->snapshot_clients, client, { // cppcheck-suppress constStatement
-		free(client);
-	});
-
-	US_LIST_ITERATE(run->stream_clients, client, { // cppcheck-suppress constStatement
-		us_fpsi_destroy(client->fpsi);
-		free(client->key);
-		free(client->hostport);
-		free(client);
-	});
-
 	US_DELETE(run->auth_token, free);
 
-	us_fpsi_destroy(run->exposed->queued_fpsi);
-	us_frame_destroy(run->exposed->frame);
-	free(run->exposed);
+	US_MUTEX_DESTROY(run->clients_mutex);
 	free(server->run);
 	free(server);
 }
 
 int us_server_listen(us_server_s *server) {
 	us_server_runtime_s *const run = server->run;
-	us_server_exposed_s *const ex = run->exposed;
-	us_stream_s *const stream = server->stream;
 
-	{
-		if (server->static_path[0] != '\0') {
-			_LOG_INFO("Enabling the file server: %s", server->static_path);
-			evhttp_set_gencb(run->http, _http_callback_static, (void*)server);
-		} else {
-			assert(!evhttp_set_cb(run->http, "/", _http_callback_root, (void*)server));
-			assert(!evhttp_set_cb(run->http, "/favicon.ico", _http_callback_favicon, (void*)server));
-		}
-		assert(!evhttp_set_cb(run->http, "/state", _http_callback_state, (void*)server));
-		assert(!evhttp_set_cb(run->http, "/snapshot", _http_callback_snapshot, (void*)server));
-		assert(!evhttp_set_cb(run->http, "/stream", _http_callback_stream, (void*)server));
+	if (server->static_path[0] != '\0') {
+		_LOG_INFO("Enabling the file server: %s", server->static_path);
+		run->static_cache = us_static_cache_init(server->static_path);
 	}
 
-	us_frame_copy(stream->run->blank->jpeg, ex->frame);
-
-	{
-		struct timeval interval = {0};
-		if (stream->cap->desired_fps > 0) {
-			interval.tv_usec = 1000000 / (stream->cap->desired_fps * 2);
-		} else {
-			interval.tv_usec = 16000; // ~60fps
-		}
-		assert((run->refresher = event_new(run->base, -1, EV_PERSIST, _http_refresher, server)) != NULL);
-		assert(!event_add(run->refresher, &interval));
+	assert(server->n_threads > 0);
+	US_CALLOC(run->shards, server->n_threads);
+	for (uint index = 0; index < server->n_threads; ++index) {
+		run->shards[index] = _server_shard_init(server, index);
+		run->n_shards = index + 1;
 	}
-
-	evhttp_set_timeout(run->http, server->timeout);
+	us_server_shard_s *const first = run->shards[0];
 
 	if (server->user[0] != '\0') {
 		char *encoded_token = NULL;
@@ -228,7 +238,7 @@ int us_server_listen(us_server_s *server) {
 	if (server->unix_path[0] != '\0') {
 		_LOG_DEBUG("Binding server to UNIX socket '%s' ...", server->unix_path);
 		if ((run->ext_fd = us_evhttp_bind_unix(
-			run->http,
+			first->http,
 			server->unix_path,
 			server->unix_rm,
 			server->unix_mode)) < 0
@@ -240,32 +250,204 @@ int us_server_listen(us_server_s *server) {
 #	ifdef WITH_SYSTEMD
 	} else if (server->systemd) {
 		_LOG_DEBUG("Binding HTTP to systemd socket ...");
-		if ((run->ext_fd = us_evhttp_bind_systemd(run->http)) < 0) {
+		if ((run->ext_fd = us_evhttp_bind_systemd(first->http)) < 0) {
 			return -1;
 		}
 		_LOG_INFO("Listening systemd socket ...");
 #	endif
 
-	} else {
+	} else if (run->n_shards == 1) {
 		_LOG_DEBUG("Binding HTTP to [%s]:%u ...", server->host, server->port);
-		if (evhttp_bind_socket(run->http, server->host, server->port) < 0) {
+		if (evhttp_bind_socket(first->http, server->host, server->port) < 0) {
 			_LOG_PERROR("Can't bind HTTP on [%s]:%u", server->host, server->port)
 			return -1;
 		}
 		_LOG_INFO("Listening HTTP on [%s]:%u", server->host, server->port);
+
+	} else {
+		// Каждый шард слушает собственный сокет, а ядро раскидывает между ними соединения
+		_LOG_DEBUG("Binding HTTP to [%s]:%u with SO_REUSEPORT ...", server->host, server->port);
+		for (uint index = 0; index < run->n_shards; ++index) {
+			us_server_shard_s *const shard = run->shards[index];
+			if ((shard->fd = us_evhttp_bind_reuseport(shard->http, server->host, server->port)) < 0) {
+				return -1;
+			}
+		}
+		_LOG_INFO("Listening HTTP on [%s]:%u", server->host, server->port);
 	}
 
+	if (run->ext_fd >= 0) {
+		// Все шарды ждут соединений на одном внешнем сокете, accept() достанется только одному
+		for (uint index = 1; index < run->n_shards; ++index) {
+			us_server_shard_s *const shard = run->shards[index];
+			assert((shard->fd = dup(run->ext_fd)) >= 0);
+			if (evhttp_accept_socket(shard->http, shard->fd) < 0) {
+				_LOG_PERROR("Can't evhttp_accept_socket() for the HTTP thread %u", index);
+				return -1;
+			}
+		}
+	}
+
+	if (run->n_shards > 1) {
+		_LOG_INFO("Using %u HTTP threads", run->n_shards);
+	}
 	return 0;
 }
 
 void us_server_loop(us_server_s *server) {
+	us_server_runtime_s *const run = server->run;
+
 	_LOG_INFO("Starting eventloop ...");
-	event_base_dispatch(server->run->base);
+	for (uint index = 1; index < run->n_shards; ++index) {
+		US_THREAD_CREATE(run->shards[index]->tid, _server_shard_thread, run->shards[index]);
+	}
+	event_base_dispatch(run->shards[0]->base);
+	for (uint index = 1; index < run->n_shards; ++index) {
+		US_THREAD_JOIN(run->shards[index]->tid);
+	}
 	_LOG_INFO("Eventloop stopped");
 }
 
 void us_server_loop_break(us_server_s *server) {
-	event_base_loopbreak(server->run->base);
+	us_server_runtime_s *const run = server->run;
+	for (uint index = 0; index < run->n_shards; ++index) {
+		event_base_loopbreak(run->shards[index]->base);
+	}
+}
+
+static us_server_shard_s *_server_shard_init(us_server_s *server, uint index) {
+	us_stream_s *const stream = server->stream;
+
+	us_server_shard_s *shard;
+	US_CALLOC(shard, 1);
+	shard->server = server;
+	shard->index = index;
+	shard->fd = -1;
+	assert((shard->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0);
+	shard->jpeg_reader = us_stream_add_jpeg_reader(stream, shard->notify_fd);
+	shard->exposed = _server_exposed_init(stream, "MJPEG-QUEUED", true);
+	for (uint scaled = 0; scaled < stream->n_scales; ++scaled) {
+		char *name;
+		US_ASPRINTF(name, "MJPEG-QUEUED-1/%u", stream->scales[scaled]);
+		shard->scaled_exposed[scaled] = _server_exposed_init(stream, name, true);
+		free(name);
+	}
+	for (uint crop = 0; crop < US_STREAM_MAX_CROPS; ++crop) {
+		char *name;
+		US_ASPRINTF(name, "MJPEG-QUEUED-CROP-%u", crop);
+		shard->crop_exposed[crop] = _server_exposed_init(stream, name, false);
+		free(name);
+	}
+	shard->h264_notify_fd = -1;
+
+	assert((shard->base = event_base_new()) != NULL);
+	assert((shard->http = evhttp_new(shard->base)) != NULL);
+	evhttp_set_allowed_methods(shard->http, EVHTTP_REQ_GET|EVHTTP_REQ_HEAD|EVHTTP_REQ_OPTIONS);
+
+	if (server->static_path[0] != '\0') {
+		evhttp_set_gencb(shard->http, _http_callback_static, (void*)shard);
+	} else {
+		assert(!evhttp_set_cb(shard->http, "/", _http_callback_root, (void*)shard));
+		assert(!evhttp_set_cb(shard->http, "/favicon.ico", _http_callback_favicon, (void*)shard));
+	}
+	assert(!evhttp_set_cb(shard->http, "/state", _http_callback_state, (void*)shard));
+	assert(!evhttp_set_cb(shard->http, "/snapshot", _http_callback_snapshot, (void*)shard));
+	assert(!evhttp_set_cb(shard->http, "/stream", _http_callback_stream, (void*)shard));
+	if (stream->h264_http) {
+		assert((shard->h264_notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0);
+		shard->h264_reader = us_stream_add_h264_reader(stream, shard->h264_notify_fd);
+		shard->fmp4 = us_fmp4_init();
+		assert((shard->h264_notifier = event_new(shard->base, shard->h264_notify_fd, EV_READ|EV_PERSIST, _http_h264_refresher, shard)) != NULL);
+		assert(!event_add(shard->h264_notifier, NULL));
+		assert(!evhttp_set_cb(shard->http, "/stream.mp4", _http_callback_h264, (void*)shard));
+	}
+
+	{
+		// Новые фреймы будят цикл сразу через eventfd, а таймер нужен только
+		// для повторов фрейма раз в секунду и таймаутов снапшотов.
+		assert((shard->notifier = event_new(shard->base, shard->notify_fd, EV_READ|EV_PERSIST, _http_refresher, shard)) != NULL);
+		assert(!event_add(shard->notifier, NULL));
+
+		struct timeval interval = {0};
+		interval.tv_usec = 100000;
+		assert((shard->refresher = event_new(shard->base, -1, EV_PERSIST, _http_refresher, shard)) != NULL);
+		assert(!event_add(shard->refresher, &interval));
+	}
+
+	evhttp_set_timeout(shard->http, server->timeout);
+	return shard;
+}
+
+static void _server_shard_destroy(us_server_shard_s *shard) {
+	if (shard->refresher != NULL) {
+		event_del(shard->refresher);
+		event_free(shard->refresher);
+	}
+	if (shard->notifier != NULL) {
+		event_del(shard->notifier);
+		event_free(shard->notifier);
+	}
+	if (shard->h264_notifier != NULL) {
+		event_del(shard->h264_notifier);
+		event_free(shard->h264_notifier);
+	}
+
+	evhttp_free(shard->http);
+	US_CLOSE_FD(shard->fd);
+	event_base_free(shard->base);
+	US_CLOSE_FD(shard->notify_fd);
+	US_CLOSE_FD(shard->h264_notify_fd);
+	US_DELETE(shard->fmp4, us_fmp4_destroy);
+
+	US_LIST_ITERATE(shard->snapshot_clients, client, { // cppcheck-suppress constStatement
+		free(client);
+	});
+
+	US_LIST_ITERATE(shard->h264_clients, client, { // cppcheck-suppress constStatement
+		free(client->hostport);
+		free(client);
+	});
+
+	US_LIST_ITERATE(shard->stream_clients, client, { // cppcheck-suppress constStatement
+		us_fpsi_destroy(client->fpsi);
+		free(client->key);
+		free(client->hostport);
+		free(client);
+	});
+
+	for (uint scaled = 0; scaled < US_STREAM_MAX_SCALES; ++scaled) {
+		US_DELETE(shard->scaled_exposed[scaled], _server_exposed_destroy);
+	}
+	for (uint crop = 0; crop < US_STREAM_MAX_CROPS; ++crop) {
+		_server_exposed_destroy(shard->crop_exposed[crop]);
+	}
+	_server_exposed_destroy(shard->exposed);
+	free(shard);
+}
+
+static us_server_exposed_s *_server_exposed_init(const us_stream_s *stream, const char *name, bool blank) {
+	// Without the blank the clients are waiting for the first frame
+	us_server_exposed_s *ex;
+	US_CALLOC(ex, 1);
+	ex->ref = us_frameref_init();
+	ex->queued_fpsi = us_fpsi_init(name, false);
+	if (blank) {
+		us_frame_copy(stream->run->blank->jpeg, ex->ref->frame);
+	}
+	return ex;
+}
+
+static void _server_exposed_destroy(us_server_exposed_s *ex) {
+	us_fpsi_destroy(ex->queued_fpsi);
+	us_frameref_unref(ex->ref);
+	free(ex);
+}
+
+static void *_server_shard_thread(void *v_shard) {
+	us_server_shard_s *const shard = v_shard;
+	US_THREAD_SETTLE("http-%u", shard->index);
+	event_base_dispatch(shard->base);
+	return NULL;
 }
 
 static int _http_preprocess_request(struct evhttp_request *request, us_server_s *server) {
@@ -314,7 +496,7 @@ static int _http_preprocess_request(struct evhttp_request *request, us_server_s
 		} \
 	}
 
-static int _http_check_run_compat_action(struct evhttp_request *request, void *v_server) {
+static int _http_check_run_compat_action(struct evhttp_request *request, void *v_shard) {
 	// MJPG-Streamer compatibility layer
 
 	int retval = -1;
@@ -324,10 +506,10 @@ static int _http_check_run_compat_action(struct evhttp_request *request, void *v
 	const char *const action = evhttp_find_header(&params, "action");
 
 	if (action && !strcmp(action, "snapshot")) {
-		_http_callback_snapshot(request, v_server);
+		_http_callback_snapshot(request, v_shard);
 		retval = 0;
 	} else if (action && !strcmp(action, "stream")) {
-		_http_callback_stream(request, v_server);
+		_http_callback_stream(request, v_shard);
 		retval = 0;
 	}
 
@@ -336,13 +518,13 @@ static int _http_check_run_compat_action(struct evhttp_request *request, void *v
 }
 
 #define COMPAT_REQUEST { \
-		if (_http_check_run_compat_action(request, v_server) == 0) { \
+		if (_http_check_run_compat_action(request, v_shard) == 0) { \
 			return; \
 		} \
 	}
 
-static void _http_callback_root(struct evhttp_request *request, void *v_server) {
-	us_server_s *const server = v_server;
+static void _http_callback_root(struct evhttp_request *request, void *v_shard) {
+	us_server_s *const server = ((us_server_shard_s*)v_shard)->server;
 
 	PREPROCESS_REQUEST;
 	COMPAT_REQUEST;
@@ -356,8 +538,8 @@ static void _http_callback_root(struct evhttp_request *request, void *v_server)
 	evbuffer_free(buf);
 }
 
-static void _http_callback_favicon(struct evhttp_request *request, void *v_server) {
-	us_server_s *const server = v_server;
+static void _http_callback_favicon(struct evhttp_request *request, void *v_shard) {
+	us_server_s *const server = ((us_server_shard_s*)v_shard)->server;
 
 	PREPROCESS_REQUEST;
 
@@ -370,8 +552,9 @@ static void _http_callback_favicon(struct evhttp_request *request, void *v_serve
 	evbuffer_free(buf);
 }
 
-static void _http_callback_static(struct evhttp_request *request, void *v_server) {
-	us_server_s *const server = v_server;
+static void _http_callback_static(struct evhttp_request *request, void *v_shard) {
+	us_server_s *const server = ((us_server_shard_s*)v_shard)->server;
+	us_server_runtime_s *const run = server->run;
 
 	PREPROCESS_REQUEST;
 	COMPAT_REQUEST;
@@ -379,8 +562,6 @@ static void _http_callback_static(struct evhttp_request *request, void *v_server
 	struct evbuffer *buf = NULL;
 	struct evhttp_uri *uri = NULL;
 	char *decoded_path = NULL;
-	char *static_path = NULL;
-	int fd = -1;
 
 	{
 		const char *uri_path;
@@ -395,33 +576,60 @@ static void _http_callback_static(struct evhttp_request *request, void *v_server
 		}
 	}
 
-	_A_EVBUFFER_NEW(buf);
-
-	if ((static_path = us_find_static_file_path(server->static_path, decoded_path)) == NULL) {
-		goto not_found;
-	}
-
-	if ((fd = open(static_path, O_RDONLY)) < 0) {
-		_LOG_PERROR("Can't open found static file %s", static_path);
+	const us_static_file_s *const file = us_static_cache_get(run->static_cache, decoded_path);
+	if (file == NULL) {
 		goto not_found;
 	}
 
 	{
-		struct stat st;
-		if (fstat(fd, &st) < 0) {
-			_LOG_PERROR("Can't stat() found static file %s", static_path);
-			goto not_found;
+		const char *const accept = us_evhttp_get_header(request, "Accept-Encoding");
+		us_static_encoding_e encoding = US_STATIC_IDENTITY;
+		bool has_encodings = false;
+		for (int index = US_STATIC_ENCODINGS - 1; index > US_STATIC_IDENTITY; --index) {
+			if (file->variants[index].seg != NULL) {
+				has_encodings = true;
+				if (encoding == US_STATIC_IDENTITY && _http_is_encoding_accepted(accept, us_static_encoding_to_string(index))) {
+					encoding = index;
+				}
+			}
 		}
-		if (st.st_size > 0 && evbuffer_add_file(buf, fd, 0, st.st_size) < 0) {
-			_LOG_ERROR("Can't serve static file %s", static_path);
-			goto not_found;
+		const us_static_variant_s *const variant = &file->variants[encoding];
+
+		_A_ADD_HEADER(request, "ETag", variant->etag);
+		_A_ADD_HEADER(request, "Last-Modified", file->last_modified);
+		_A_ADD_HEADER(request, "Cache-Control", "no-cache");
+		if (has_encodings) {
+			_A_ADD_HEADER(request, "Vary", "Accept-Encoding");
 		}
 
-		// evbuffer_add_file() owns the resulting file descriptor
-		// and will close it when finished transferring data
-		fd = -1;
+		if (_http_is_not_modified(request, file, variant->etag)) {
+			us_static_cache_put(run->static_cache);
+			evhttp_send_reply(request, HTTP_NOTMODIFIED, "Not Modified", NULL);
+			goto cleanup;
+		}
+
+		_A_EVBUFFER_NEW(buf);
+		// Сегмент рефкаунтится самим libevent и переживет перезагрузку файла в кеше
+		if (variant->size > 0) {
+			assert(!evbuffer_add_file_segment(buf, variant->seg, 0, variant->size));
+		}
+		_A_ADD_HEADER(request, "Content-Type", file->mime_type);
+		if (encoding != US_STATIC_IDENTITY) {
+			_A_ADD_HEADER(request, "Content-Encoding", us_static_encoding_to_string(encoding));
+		}
+		us_static_cache_put(run->static_cache);
+
+		if (server->tcp_nodelay && server->unix_path[0] == '\0') {
+			// Заголовки уходят через write(), а тело через sendfile(), поэтому с алгоритмом Нейгла
+			// хвост файла ждал бы delayed ACK от клиента (~40ms на каждый ответ keep-alive).
+			const evutil_socket_t fd = bufferevent_getfd(evhttp_connection_get_bufferevent(evhttp_request_get_connection(request)));
+			assert(fd >= 0);
+			int on = 1;
+			if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*)&on, sizeof(on)) != 0) {
+				_LOG_PERROR("Can't set TCP_NODELAY to the static client");
+			}
+		}
 
-		_A_ADD_HEADER(request, "Content-Type", us_guess_mime_type(static_path));
 		evhttp_send_reply(request, HTTP_OK, "OK", buf);
 		goto cleanup;
 	}
@@ -435,19 +643,81 @@ not_found:
 	goto cleanup;
 
 cleanup:
-	US_CLOSE_FD(fd); // cppcheck-suppress unreadVariable
-	US_DELETE(static_path, free);
 	US_DELETE(buf, evbuffer_free);
 	US_DELETE(decoded_path, free);
 	US_DELETE(uri, evhttp_uri_free);
 }
 
+static bool _http_is_encoding_accepted(const char *accept, const char *coding) {
+	if (accept == NULL) {
+		return false;
+	}
+	const uz len = strlen(coding);
+	while (*accept != '\0') {
+		accept += strspn(accept, " \t,");
+		const char *const next = accept + strcspn(accept, ",");
+		if (strcspn(accept, " \t;,") == len && !evutil_ascii_strncasecmp(accept, coding, len)) {
+			// Кодировка с q=0 явно запрещена клиентом
+			const char *const param = strstr(accept, "q=");
+			return (param == NULL || param >= next || strtod(param + 2, NULL) > 0);
+		}
+		accept = next;
+	}
+	return false;
+}
+
+static bool _http_is_not_modified(struct evhttp_request *request, const us_static_file_s *file, const char *etag) {
+	const char *const if_none_match = us_evhttp_get_header(request, "If-None-Match");
+	if (if_none_match != NULL) {
+		// If-None-Match has a priority over If-Modified-Since (RFC 9110)
+		return _http_is_etag_matched(if_none_match, etag);
+	}
+	const char *const if_modified_since = us_evhttp_get_header(request, "If-Modified-Since");
+	if (if_modified_since != NULL) {
+		struct tm tm = {0};
+		if (strptime(if_modified_since, "%a, %d %b %Y %H:%M:%S GMT", &tm) != NULL) {
+			return (file->mtime <= timegm(&tm));
+		}
+	}
+	return false;
+}
+
+static bool _http_is_etag_matched(const char *if_none_match, const char *etag) {
+	// The list of entity-tags or "*". The weak comparison is used for GET/HEAD (RFC 9110),
+	// so the W/ prefix is ignored, but the opaque tags must be equal, not just contain each other.
+	const uz etag_len = strlen(etag);
+	while (*if_none_match != '\0') {
+		if_none_match += strspn(if_none_match, " \t,");
+		uz len = strcspn(if_none_match, " \t,");
+		if (len == 1 && if_none_match[0] == '*') {
+			return true;
+		}
+		if (!strncmp(if_none_match, "W/", 2)) {
+			if_none_match += 2;
+		}
+		if (if_none_match[0] == '"') {
+			// Comma is allowed inside the quotes
+			const char *const end = strchr(if_none_match + 1, '"');
+			if (end == NULL) {
+				return false;
+			}
+			len = end - if_none_match + 1;
+		} else {
+			len = strcspn(if_none_match, " \t,");
+		}
+		if (len == etag_len && !memcmp(if_none_match, etag, len)) {
+			return true;
+		}
+		if_none_match += len;
+	}
+	return false;
+}
+
 #undef COMPAT_REQUEST
 
-static void _http_callback_state(struct evhttp_request *request, void *v_server) {
-	us_server_s *const server = v_server;
+static void _http_callback_state(struct evhttp_request *request, void *v_shard) {
+	us_server_s *const server = ((us_server_shard_s*)v_shard)->server;
 	us_server_runtime_s *const run = server->run;
-	us_server_exposed_s *const ex = run->exposed;
 	us_stream_s *const stream = server->stream;
 
 	PREPROCESS_REQUEST;
@@ -459,13 +729,21 @@ static void _http_callback_state(struct evhttp_request *request, void *v_server)
 	struct evbuffer *buf;
 	_A_EVBUFFER_NEW(buf);
 
+	const ull jpeg_encoded = atomic_load(&stream->run->http->jpeg_encoded);
+	const ull jpeg_skipped = atomic_load(&stream->run->http->jpeg_skipped);
+
 	_A_EVBUFFER_ADD_PRINTF(buf,
 		"{\"ok\": true, \"result\": {"
 		" \"instance_id\": \"%s\","
-		" \"encoder\": {\"type\": \"%s\", \"quality\": %u},",
+		" \"encoder\": {\"type\": \"%s\", \"quality\": %u,"
+		" \"skip_unchanged\": {\"enabled\": %s, \"encoded\": %llu, \"skipped\": %llu, \"ratio\": %.3Lf}},",
 		server->instance_id,
 		us_encoder_type_to_string(enc_type),
-		enc_quality
+		enc_quality,
+		us_bool_to_string(stream->skip_unchanged),
+		jpeg_encoded,
+		jpeg_skipped,
+		(jpeg_encoded + jpeg_skipped > 0 ? (ldf)jpeg_skipped / (jpeg_encoded + jpeg_skipped) : (ldf)0)
 	);
 
 #	ifdef WITH_V4P
@@ -480,18 +758,65 @@ static void _http_callback_state(struct evhttp_request *request, void *v_server)
 	}
 #	endif
 
-	if (stream->h264_sink != NULL) {
+	if (stream->h264_sink != NULL || stream->h264_http) {
 		us_fpsi_meta_s meta;
 		const uint fps = us_fpsi_get(stream->run->http->h264_fpsi, &meta);
 		_A_EVBUFFER_ADD_PRINTF(buf,
-			" \"h264\": {\"bitrate\": %u, \"gop\": %u, \"online\": %s, \"fps\": %u},",
+			" \"h264\": {\"bitrate\": %u, \"gop\": %u, \"online\": %s, \"fps\": %u, \"http_clients\": %u},",
 			stream->h264_bitrate,
 			stream->h264_gop,
 			us_bool_to_string(meta.online),
-			fps
+			fps,
+			atomic_load(&stream->run->http->h264_clients)
 		);
 	}
 
+	if (stream->n_scales > 0) {
+		_A_EVBUFFER_ADD_PRINTF(buf, " \"scaled\": {");
+		for (uint index = 0; index < stream->n_scales; ++index) {
+			const us_stream_scaled_s *const scaled = &stream->run->http->scaled[index];
+			us_fpsi_meta_s meta;
+			const uint fps = us_fpsi_get(scaled->fpsi, &meta);
+			_A_EVBUFFER_ADD_PRINTF(buf,
+				"%s\"%u\": {\"resolution\": {\"width\": %u, \"height\": %u},"
+				" \"online\": %s, \"fps\": %u, \"clients\": %u}",
+				(index > 0 ? ", " : ""),
+				stream->scales[index],
+				meta.width,
+				meta.height,
+				us_bool_to_string(meta.online),
+				fps,
+				atomic_load(&scaled->clients)
+			);
+		}
+		_A_EVBUFFER_ADD_PRINTF(buf, "},");
+	}
+
+	{
+		us_stream_http_s *const http = stream->run->http;
+		_A_EVBUFFER_ADD_PRINTF(buf, " \"crops\": [");
+		bool first = true;
+		US_MUTEX_LOCK(http->crops_mutex);
+		for (uint index = 0; index < US_STREAM_MAX_CROPS; ++index) {
+			const us_stream_crop_s *const slot = &http->crops[index];
+			if (slot->clients > 0 || slot->pinned) {
+				_A_EVBUFFER_ADD_PRINTF(buf,
+					"%s{\"x\": %u, \"y\": %u, \"width\": %u, \"height\": %u, \"clients\": %u, \"sink\": %s}",
+					(first ? "" : ", "),
+					slot->crop.x,
+					slot->crop.y,
+					slot->crop.width,
+					slot->crop.height,
+					slot->clients,
+					us_bool_to_string(slot->pinned)
+				);
+				first = false;
+			}
+		}
+		US_MUTEX_UNLOCK(http->crops_mutex);
+		_A_EVBUFFER_ADD_PRINTF(buf, "],");
+	}
+
 	if (stream->jpeg_sink != NULL || stream->h264_sink != NULL) {
 		_A_EVBUFFER_ADD_PRINTF(buf, " \"sinks\": {");
 		if (stream->jpeg_sink != NULL) {
@@ -510,6 +835,12 @@ static void _http_callback_state(struct evhttp_request *request, void *v_server)
 		_A_EVBUFFER_ADD_PRINTF(buf, "},");
 	}
 
+	US_MUTEX_LOCK(run->clients_mutex); // The clients of the other shards
+	uint queued_fps = 0;
+	for (uint index = 0; index < run->n_shards; ++index) {
+		queued_fps = US_MAX(queued_fps, us_fpsi_get(run->shards[index]->exposed->queued_fpsi, NULL));
+	}
+
 	us_fpsi_meta_s captured_meta;
 	const uint captured_fps = us_fpsi_get(stream->run->http->captured_fpsi, &captured_meta);
 	_A_EVBUFFER_ADD_PRINTF(buf,
@@ -521,24 +852,34 @@ static void _http_callback_state(struct evhttp_request *request, void *v_server)
 		us_bool_to_string(captured_meta.online),
 		stream->cap->desired_fps,
 		captured_fps,
-		us_fpsi_get(ex->queued_fpsi, NULL),
+		queued_fps,
 		run->stream_clients_count
 	);
 
-	US_LIST_ITERATE(run->stream_clients, client, { // cppcheck-suppress constStatement
-		_A_EVBUFFER_ADD_PRINTF(buf,
-			"\"%" PRIx64 "\": {\"fps\": %u, \"extra_headers\": %s, \"advance_headers\": %s,"
-			" \"dual_final_frames\": %s, \"zero_data\": %s, \"key\": \"%s\"}%s",
-			client->id,
-			us_fpsi_get(client->fpsi, NULL),
-			us_bool_to_string(client->extra_headers),
-			us_bool_to_string(client->advance_headers),
-			us_bool_to_string(client->dual_final_frames),
-			us_bool_to_string(client->zero_data),
-			(client->key != NULL ? client->key : "0"),
-			(client->next ? ", " : "")
-		);
-	});
+	bool first = true;
+	for (uint index = 0; index < run->n_shards; ++index) {
+		us_server_shard_s *const shard = run->shards[index];
+		US_LIST_ITERATE(shard->stream_clients, client, { // cppcheck-suppress constStatement
+			_A_EVBUFFER_ADD_PRINTF(buf,
+				"%s\"%" PRIx64 "\": {\"fps\": %u, \"queue_size\": %llu, \"dropped\": %llu,"
+				" \"extra_headers\": %s, \"advance_headers\": %s,"
+				" \"dual_final_frames\": %s, \"zero_data\": %s, \"scale\": %u, \"key\": \"%s\"}",
+				(first ? "" : ", "),
+				client->id,
+				us_fpsi_get(client->fpsi, NULL),
+				atomic_load(&client->queue_size),
+				atomic_load(&client->dropped),
+				us_bool_to_string(client->extra_headers),
+				us_bool_to_string(client->advance_headers),
+				us_bool_to_string(client->dual_final_frames),
+				us_bool_to_string(client->zero_data),
+				client->scale,
+				(client->key != NULL ? client->key : "0")
+			);
+			first = false;
+		});
+	}
+	US_MUTEX_UNLOCK(run->clients_mutex);
 
 	_A_EVBUFFER_ADD_PRINTF(buf, "}}}}");
 
@@ -547,29 +888,43 @@ static void _http_callback_state(struct evhttp_request *request, void *v_server)
 	evbuffer_free(buf);
 }
 
-static void _http_callback_snapshot(struct evhttp_request *request, void *v_server) {
-	us_server_s *const server = v_server;
+static void _http_callback_snapshot(struct evhttp_request *request, void *v_shard) {
+	us_server_shard_s *const shard = v_shard;
+	us_server_s *const server = shard->server;
 
 	PREPROCESS_REQUEST;
 
+	const ldf now_ts = us_get_now_monotonic();
+
+	if (server->snapshot_cache > 0 && shard->exposed->actual_ts + (ldf)server->snapshot_cache / 1000 >= now_ts) {
+		// Частый поллинг не должен будить энкодер, если нет других клиентов
+		_snapshot_reply_s reply;
+		_http_snapshot_reply_init(shard, &reply);
+		_http_snapshot_reply_send(&reply, request);
+		us_frameref_unref(reply.ref);
+		return;
+	}
+
 	us_snapshot_client_s *client;
 	US_CALLOC(client, 1);
 	client->server = server;
+	client->shard = shard;
 	client->request = request;
-	client->request_ts = us_get_now_monotonic();
+	client->request_ts = now_ts;
 
 	atomic_fetch_add(&server->stream->run->http->snapshot_requested, 1);
-	US_LIST_APPEND(server->run->snapshot_clients, client);
+	US_LIST_APPEND(shard->snapshot_clients, client);
 }
 
-static void _http_callback_stream(struct evhttp_request *request, void *v_server) {
+static void _http_callback_stream(struct evhttp_request *request, void *v_shard) {
 	// https://github.com/libevent/libevent/blob/29cc8386a2f7911eaa9336692a2c5544d8b4734f/http.c#L2814
 	// https://github.com/libevent/libevent/blob/29cc8386a2f7911eaa9336692a2c5544d8b4734f/http.c#L2789
 	// https://github.com/libevent/libevent/blob/29cc8386a2f7911eaa9336692a2c5544d8b4734f/http.c#L362
 	// https://github.com/libevent/libevent/blob/29cc8386a2f7911eaa9336692a2c5544d8b4734f/http.c#L791
 	// https://github.com/libevent/libevent/blob/29cc8386a2f7911eaa9336692a2c5544d8b4734f/http.c#L1458
 
-	us_server_s *const server = v_server;
+	us_server_shard_s *const shard = v_shard;
+	us_server_s *const server = shard->server;
 	us_server_runtime_s *const run = server->run;
 
 	PREPROCESS_REQUEST;
@@ -579,6 +934,7 @@ static void _http_callback_stream(struct evhttp_request *request, void *v_server
 		us_stream_client_s *client;
 		US_CALLOC(client, 1);
 		client->server = server;
+		client->shard = shard;
 		client->request = request;
 		client->need_initial = true;
 		client->need_first_frame = true;
@@ -591,9 +947,46 @@ static void _http_callback_stream(struct evhttp_request *request, void *v_server
 		PARSE_PARAM(true, advance_headers);
 		PARSE_PARAM(true, dual_final_frames);
 		PARSE_PARAM(true, zero_data);
+		PARSE_PARAM(uint, scale);
 #		undef PARSE_PARAM
+		us_scaler_crop_s crop = {0};
+		const char *const crop_str = evhttp_find_header(&params, "crop");
+		const int crop_error = (crop_str != NULL ? us_scaler_parse_crop(crop_str, &crop) : 0);
 		evhttp_clear_headers(&params);
 
+#		define REPLY_ERROR(x_code, x_reason) { \
+				free(client->key); \
+				free(client); \
+				evhttp_send_error(request, x_code, x_reason); \
+				return; \
+			}
+		if (crop_error < 0 || (crop_str != NULL && client->scale > 1)) {
+			REPLY_ERROR(HTTP_BADREQUEST, "Invalid crop");
+		}
+		int scaled = -1;
+		if (client->scale > 1 && (scaled = us_stream_find_scaled(server->stream, client->scale)) < 0) {
+			REPLY_ERROR(HTTP_NOTFOUND, "Unknown scale");
+		}
+		client->scale = US_MAX(client->scale, (uint)1);
+		client->crop = -1;
+		client->exposed = (scaled < 0 ? shard->exposed : shard->scaled_exposed[scaled]);
+		if (crop_str != NULL) {
+			uint gen;
+			if ((client->crop = us_stream_acquire_crop(server->stream, &crop, &gen)) < 0) {
+				REPLY_ERROR(HTTP_SERVUNAVAIL, "Too many crops");
+			}
+			us_server_exposed_s *const ex = shard->crop_exposed[client->crop];
+			if (ex->gen != gen) {
+				// The slot was used for another rectangle, so wait for the first frame of this one
+				us_frameref_unref(ex->ref);
+				ex->ref = us_frameref_init();
+				ex->dropped = 0;
+				ex->gen = gen;
+			}
+			client->exposed = ex;
+		}
+#		undef REPLY_ERROR
+
 		client->hostport = us_evhttp_get_hostport(request);
 		client->id = us_get_now_id();
 
@@ -603,21 +996,30 @@ static void _http_callback_stream(struct evhttp_request *request, void *v_server
 			client->fpsi = us_fpsi_init(name, false);
 			free(name);
 		}
+		atomic_init(&client->queue_size, 0);
+		atomic_init(&client->dropped, 0);
 
-		US_LIST_APPEND_C(run->stream_clients, client, run->stream_clients_count);
+		US_MUTEX_LOCK(run->clients_mutex);
+		US_LIST_APPEND_C(shard->stream_clients, client, shard->stream_clients_count);
+		run->stream_clients_count += 1;
 
-		if (run->stream_clients_count == 1) {
+		if (scaled >= 0) {
+			atomic_fetch_add(&server->stream->run->http->scaled[scaled].clients, 1);
+		} else if (client->crop < 0 && ++run->full_clients_count == 1) {
 			atomic_store(&server->stream->run->http->has_clients, true);
-#			ifdef WITH_GPIO
+		}
+#		ifdef WITH_GPIO
+		if (run->stream_clients_count == 1) {
 			us_gpio_set_has_http_clients(true);
-#			endif
 		}
+#		endif
 
-		_LOG_INFO("NEW client (now=%u): %s, id=%" PRIx64,
-			run->stream_clients_count, client->hostport, client->id);
+		_LOG_INFO("NEW client (now=%u): %s, id=%" PRIx64 ", scale=1/%u",
+			run->stream_clients_count, client->hostport, client->id, client->scale);
+		US_MUTEX_UNLOCK(run->clients_mutex);
 
 		struct bufferevent *const buf_event = evhttp_connection_get_bufferevent(conn);
-		if (server->tcp_nodelay && run->ext_fd >= 0) {
+		if (server->tcp_nodelay && server->unix_path[0] == '\0') {
 			_LOG_DEBUG("Setting up TCP_NODELAY to the client %s ...", client->hostport);
 			const evutil_socket_t fd = bufferevent_getfd(buf_event);
 			assert(fd >= 0);
@@ -626,21 +1028,89 @@ static void _http_callback_stream(struct evhttp_request *request, void *v_server
 				_LOG_PERROR("Can't set TCP_NODELAY to the client %s", client->hostport);
 			}
 		}
-		bufferevent_setcb(buf_event, NULL, NULL, _http_callback_stream_error, (void*)client);
-		bufferevent_enable(buf_event, EV_READ);
+		if (client->exposed->ref->frame->used > 0) {
+			// Первый фрейм отправляем сразу, не дожидаясь следующего нового фрейма
+			client->need_first_frame = false;
+			client->pending = true;
+			bufferevent_setcb(buf_event, NULL, _http_callback_stream_write, _http_callback_stream_error, (void*)client);
+			bufferevent_enable(buf_event, EV_READ|EV_WRITE);
+		} else {
+			bufferevent_setcb(buf_event, NULL, NULL, _http_callback_stream_error, (void*)client);
+			bufferevent_enable(buf_event, EV_READ);
+		}
 	} else {
 		evhttp_request_free(request);
 	}
 }
 
+static void _http_callback_h264(struct evhttp_request *request, void *v_shard) {
+	us_server_shard_s *const shard = v_shard;
+	us_server_s *const server = shard->server;
+	us_stream_http_s *const http = server->stream->run->http;
+
+	PREPROCESS_REQUEST;
+
+	struct evhttp_connection *const conn = evhttp_request_get_connection(request);
+	if (conn == NULL) {
+		evhttp_request_free(request);
+		return;
+	}
+
+	us_h264_client_s *client;
+	US_CALLOC(client, 1);
+	client->server = server;
+	client->shard = shard;
+	client->request = request;
+	client->hostport = us_evhttp_get_hostport(request);
+	client->id = us_get_now_id();
+	client->need_key = true;
+
+	US_LIST_APPEND_C(shard->h264_clients, client, shard->h264_clients_count);
+	const uint total = atomic_fetch_add(&http->h264_clients, 1) + 1;
+	atomic_store(&http->h264_key_requested, true); // Don't wait for the whole GOP
+	_LOG_INFO("NEW H264 client (now=%u): %s, id=%" PRIx64, total, client->hostport, client->id);
+
+	struct bufferevent *const buf_event = evhttp_connection_get_bufferevent(conn);
+	if (server->tcp_nodelay && server->unix_path[0] == '\0') {
+		const evutil_socket_t fd = bufferevent_getfd(buf_event);
+		assert(fd >= 0);
+		int on = 1;
+		if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*)&on, sizeof(on)) != 0) {
+			_LOG_PERROR("Can't set TCP_NODELAY to the H264 client %s", client->hostport);
+		}
+	}
+
+	struct evbuffer *buf;
+	_A_EVBUFFER_NEW(buf);
+	_A_EVBUFFER_ADD_PRINTF(buf, "HTTP/1.0 200 OK" RN);
+	_http_evbuffer_add_raw_cors(buf, server, request);
+	_A_EVBUFFER_ADD_PRINTF(buf,
+		"Cache-Control: no-store, no-cache, must-revalidate, proxy-revalidate, pre-check=0, post-check=0, max-age=0" RN
+		"Pragma: no-cache" RN
+		"Expires: Mon, 3 Jan 2000 12:34:56 GMT" RN
+		"Content-Type: video/mp4" RN
+		RN
+	);
+	assert(!bufferevent_write_buffer(buf_event, buf));
+	evbuffer_free(buf);
+
+	// Фрагменты пишутся по мере поступления фреймов в _http_send_h264().
+	// Клиент ничего не присылает, поэтому мертвое соединение ловится только по таймауту записи.
+	const struct timeval write_timeout = {.tv_sec = server->timeout};
+	bufferevent_set_timeouts(buf_event, NULL, &write_timeout);
+	bufferevent_setcb(buf_event, NULL, NULL, _http_callback_h264_error, (void*)client);
+	bufferevent_enable(buf_event, EV_READ|EV_WRITE);
+}
+
 #undef PREPROCESS_REQUEST
 
 static void _http_callback_stream_write(struct bufferevent *buf_event, void *v_client) {
 	us_stream_client_s *const client = v_client;
 	us_server_s *const server = client->server;
-	us_server_exposed_s *const ex = server->run->exposed;
+	us_server_exposed_s *const ex = client->exposed;
 
 	us_fpsi_update(client->fpsi, true, NULL);
+	client->pending = false;
 
 	struct evbuffer *buf;
 	_A_EVBUFFER_NEW(buf);
@@ -666,29 +1136,15 @@ static void _http_callback_stream_write(struct bufferevent *buf_event, void *v_c
 
 #	define BOUNDARY "boundarydonotcross"
 
-#	define ADD_ADVANCE_HEADERS \
-		_A_EVBUFFER_ADD_PRINTF(buf, \
-			"Content-Type: image/jpeg" RN "X-Timestamp: %.06Lf" RN RN, us_get_now_real())
+#	define ADD_ADVANCE_HEADERS { \
+			const us_server_part_s *const m_part = _http_get_part(ex, US_SERVER_PART_ADVANCE); \
+			_A_EVBUFFER_ADD(buf, m_part->data, m_part->size); \
+		}
 
 	if (client->need_initial) {
 		_A_EVBUFFER_ADD_PRINTF(buf, "HTTP/1.0 200 OK" RN);
 		
-		if (client->server->allow_origin[0] != '\0') {
-			const char *const cors_headers = us_evhttp_get_header(client->request, "Access-Control-Request-Headers");
-			const char *const cors_method = us_evhttp_get_header(client->request, "Access-Control-Request-Method");
-
-			_A_EVBUFFER_ADD_PRINTF(buf,
-				"Access-Control-Allow-Origin: %s" RN
-				"Access-Control-Allow-Credentials: true" RN,
-				client->server->allow_origin				
-			);
-			if (cors_headers != NULL) {
-				_A_EVBUFFER_ADD_PRINTF(buf, "Access-Control-Allow-Headers: %s" RN, cors_headers);
-			}
-			if (cors_method != NULL) {
-				_A_EVBUFFER_ADD_PRINTF(buf, "Access-Control-Allow-Methods: %s" RN, cors_method);
-			}
-		}
+		_http_evbuffer_add_raw_cors(buf, client->server, client->request);
 
 		_A_EVBUFFER_ADD_PRINTF(buf,
 			"Cache-Control: no-store, no-cache, must-revalidate, proxy-revalidate, pre-check=0, post-check=0, max-age=0" RN
@@ -713,53 +1169,31 @@ static void _http_callback_stream_write(struct bufferevent *buf_event, void *v_c
 	}
 
 	if (!client->advance_headers) {
-		_A_EVBUFFER_ADD_PRINTF(buf,
-			"Content-Type: image/jpeg" RN
-			"Content-Length: %zu" RN
-			"X-Timestamp: %.06Lf" RN
-			"%s",
-			(!client->zero_data ? ex->frame->used : 0),
-			us_get_now_real(),
-			(client->extra_headers ? "" : RN)
-		);
-		const ldf now_ts = us_get_now_monotonic();
+		// Заголовки собираются один раз на фрейм для каждого варианта клиентских опций,
+		// здесь добавляются только поля, уникальные для конкретного клиента.
+		const us_server_part_s *const part = _http_get_part(ex, (
+			(client->extra_headers ? US_SERVER_PART_EXTRA : US_SERVER_PART_PLAIN)
+			+ (client->zero_data ? US_SERVER_PART_ZERO_DATA : US_SERVER_PART_PLAIN)
+		));
+		_A_EVBUFFER_ADD(buf, part->data, part->fps_offset);
 		if (client->extra_headers) {
+			const ldf now_ts = us_get_now_monotonic();
+			_A_EVBUFFER_ADD_PRINTF(buf, "X-UStreamer-Client-FPS: %u" RN, us_fpsi_get(client->fpsi, NULL));
+			_A_EVBUFFER_ADD(buf, part->data + part->fps_offset, part->size - part->fps_offset);
 			_A_EVBUFFER_ADD_PRINTF(buf,
-				"X-UStreamer-Online: %s" RN
-				"X-UStreamer-Dropped: %u" RN
-				"X-UStreamer-Width: %u" RN
-				"X-UStreamer-Height: %u" RN
-				"X-UStreamer-Client-FPS: %u" RN
-				"X-UStreamer-Grab-Time: %.06Lf" RN
-				"X-UStreamer-Encode-Begin-Time: %.06Lf" RN
-				"X-UStreamer-Encode-End-Time: %.06Lf" RN
-				"X-UStreamer-Expose-Begin-Time: %.06Lf" RN
-				"X-UStreamer-Expose-Cmp-Time: %.06Lf" RN
-				"X-UStreamer-Expose-End-Time: %.06Lf" RN
 				"X-UStreamer-Send-Time: %.06Lf" RN
 				"X-UStreamer-Latency: %.06Lf" RN
 				RN,
-				us_bool_to_string(ex->frame->online),
-				ex->dropped,
-				ex->frame->width,
-				ex->frame->height,
-				us_fpsi_get(client->fpsi, NULL),
-				ex->frame->grab_ts,
-				ex->frame->encode_begin_ts,
-				ex->frame->encode_end_ts,
-				ex->expose_begin_ts,
-				ex->expose_cmp_ts,
-				ex->expose_end_ts,
 				now_ts,
-				now_ts - ex->frame->grab_ts
+				now_ts - ex->ref->frame->grab_ts
 			);
 		}
 	}
 
 	if (!client->zero_data) {
-		_A_EVBUFFER_ADD(buf, (void*)ex->frame->data, ex->frame->used);
+		_http_evbuffer_add_frameref(buf, ex->ref);
 	}
-	_A_EVBUFFER_ADD_PRINTF(buf, RN "--" BOUNDARY RN);
+	_A_EVBUFFER_ADD(buf, RN "--" BOUNDARY RN, sizeof(RN "--" BOUNDARY RN) - 1);
 
 	if (client->advance_headers) {
 		ADD_ADVANCE_HEADERS;
@@ -767,6 +1201,7 @@ static void _http_callback_stream_write(struct bufferevent *buf_event, void *v_c
 
 	assert(!bufferevent_write_buffer(buf_event, buf));
 	evbuffer_free(buf);
+	atomic_store(&client->queue_size, _http_get_queue_size(buf_event));
 
 	bufferevent_setcb(buf_event, NULL, NULL, _http_callback_stream_error, (void*)client);
 	bufferevent_enable(buf_event, EV_READ);
@@ -782,20 +1217,32 @@ static void _http_callback_stream_error(struct bufferevent *buf_event, short wha
 	us_stream_client_s *const client = v_client;
 	us_server_s *const server = client->server;
 	us_server_runtime_s *const run = server->run;
-
-	US_LIST_REMOVE_C(run->stream_clients, client, run->stream_clients_count);
-
-	if (run->stream_clients_count == 0) {
+	us_server_shard_s *const shard = client->shard;
+
+	US_MUTEX_LOCK(run->clients_mutex);
+	US_LIST_REMOVE_C(shard->stream_clients, client, shard->stream_clients_count);
+	run->stream_clients_count -= 1;
+
+	if (client->crop >= 0) {
+		us_stream_release_crop(server->stream, client->crop);
+	} else if (client->exposed != shard->exposed) {
+		const int scaled = us_stream_find_scaled(server->stream, client->scale);
+		assert(scaled >= 0);
+		atomic_fetch_sub(&server->stream->run->http->scaled[scaled].clients, 1);
+	} else if (--run->full_clients_count == 0) {
 		atomic_store(&server->stream->run->http->has_clients, false);
-#		ifdef WITH_GPIO
+	}
+#	ifdef WITH_GPIO
+	if (run->stream_clients_count == 0) {
 		us_gpio_set_has_http_clients(false);
-#		endif
 	}
+#	endif
 
 	char *const reason = us_bufferevent_format_reason(what);
 	_LOG_INFO("DEL client (now=%u): %s, id=%" PRIx64 ", %s",
 		run->stream_clients_count, client->hostport, client->id, reason);
 	free(reason);
+	US_MUTEX_UNLOCK(run->clients_mutex);
 
 	struct evhttp_connection *conn = evhttp_request_get_connection(client->request);
 	US_DELETE(conn, evhttp_connection_free);
@@ -806,16 +1253,47 @@ static void _http_callback_stream_error(struct bufferevent *buf_event, short wha
 	free(client);
 }
 
-static void _http_send_stream(us_server_s *server, bool stream_updated, bool frame_updated) {
-	us_server_runtime_s *const run = server->run;
-	us_server_exposed_s *const ex = run->exposed;
+static void _http_callback_h264_error(struct bufferevent *buf_event, short what, void *v_client) {
+	(void)buf_event;
+	char *const reason = us_bufferevent_format_reason(what);
+	_http_h264_client_destroy(v_client, reason);
+	free(reason);
+}
+
+static void _http_h264_client_destroy(us_h264_client_s *client, const char *reason) {
+	us_server_shard_s *const shard = client->shard;
+	us_stream_http_s *const http = client->server->stream->run->http;
+
+	US_LIST_REMOVE_C(shard->h264_clients, client, shard->h264_clients_count);
+	const uint total = atomic_fetch_sub(&http->h264_clients, 1) - 1;
+	_LOG_INFO("DEL H264 client (now=%u): %s, id=%" PRIx64 ", dropped=%llu, %s",
+		total, client->hostport, client->id, client->dropped, reason);
+
+	struct evhttp_connection *conn = evhttp_request_get_connection(client->request);
+	US_DELETE(conn, evhttp_connection_free);
+
+	free(client->hostport);
+	free(client);
+}
+
+static void _http_send_stream(us_server_shard_s *shard, us_server_exposed_s *ex, bool stream_updated, bool frame_updated) {
+	const us_server_s *const server = shard->server;
+
+	if (ex->ref->frame->used == 0) {
+		return; // A new crop without frames, the clients are waiting for the first one
+	}
+
+	// Заголовки частей пересобираются лениво на каждом тике
+	for (uint index = 0; index < US_SERVER_PART_VARIANTS; ++index) {
+		ex->parts[index].ready = false;
+	}
 
 	bool queued = false;
 	bool has_clients = true;
 
-	US_LIST_ITERATE(run->stream_clients, client, { // cppcheck-suppress constStatement
+	US_LIST_ITERATE(shard->stream_clients, client, { // cppcheck-suppress constStatement
 		struct evhttp_connection *const conn = evhttp_request_get_connection(client->request);
-		if (conn != NULL) {
+		if (conn != NULL && client->exposed == ex) {
 			// Фикс для бага WebKit. При включенной опции дропа одинаковых фреймов,
 			// WebKit отрисовывает последний фрейм в серии с некоторой задержкой,
 			// и нужно послать два фрейма, чтобы серия была вовремя завершена.
@@ -830,14 +1308,32 @@ static void _http_send_stream(us_server_s *server, bool stream_updated, bool fra
 				&& !frame_updated
 			);
 
-			if (dual_update || frame_updated || client->need_first_frame) {
+			const bool need_send = (dual_update || frame_updated || client->need_first_frame);
+			if (need_send || client->lagging) {
+				// Медленный клиент не получает промежуточные фреймы, пока его очередь
+				// не разгрузится до client_queue_limit. Потом он получит самый новый.
 				struct bufferevent *const buf_event = evhttp_connection_get_bufferevent(conn);
-				bufferevent_setcb(buf_event, NULL, _http_callback_stream_write, _http_callback_stream_error, (void*)client);
-				bufferevent_enable(buf_event, EV_READ|EV_WRITE);
+				const uz queue_size = _http_get_queue_size(buf_event);
+				atomic_store(&client->queue_size, queue_size);
+
+				if (client->pending) {
+					// The client will get the newest frame instead of the queued one
+					atomic_fetch_add(&client->dropped, need_send);
+				} else if (server->client_queue_limit > 0 && queue_size > (uz)server->client_queue_limit * 1024) {
+					atomic_fetch_add(&client->dropped, need_send);
+					client->lagging = true;
+				} else {
+					bufferevent_setcb(buf_event, NULL, _http_callback_stream_write, _http_callback_stream_error, (void*)client);
+					bufferevent_enable(buf_event, EV_READ|EV_WRITE);
+					client->pending = true;
+					client->lagging = false;
+					queued = true;
+				}
 
-				client->need_first_frame = false;
-				client->updated_prev = (frame_updated || client->need_first_frame); // Игнорировать dual
-				queued = true;
+				if (need_send) {
+					client->need_first_frame = false;
+					client->updated_prev = (frame_updated || client->need_first_frame); // Игнорировать dual
+				}
 			} else if (stream_updated) { // Для dual
 				client->updated_prev = false;
 			}
@@ -852,93 +1348,124 @@ static void _http_send_stream(us_server_s *server, bool stream_updated, bool fra
 	}
 }
 
-static void _http_send_snapshot(us_server_s *server) {
-	us_server_exposed_s *const ex = server->run->exposed;
-	us_blank_s *blank = NULL;
+static void _http_send_snapshot(us_server_shard_s *shard) {
+	const us_server_s *const server = shard->server;
+	const us_server_exposed_s *const ex = shard->exposed;
 
-#	define ADD_TIME_HEADER(x_key, x_value) { \
-			US_SNPRINTF(header_buf, 255, "%.06Lf", x_value); \
-			_A_ADD_HEADER(request, x_key, header_buf); \
-		}
-
-#	define ADD_UNSIGNED_HEADER(x_key, x_value) { \
-			US_SNPRINTF(header_buf, 255, "%u", x_value); \
-			_A_ADD_HEADER(request, x_key, header_buf); \
-		}
-
-	us_fpsi_meta_s captured_meta;
-	us_fpsi_get(server->stream->run->http->captured_fpsi, &captured_meta);
+	// All the clients waiting at this moment get the same JPEG and the same headers,
+	// so the reply is prepared once for the batch and the data is shared by reference.
+	_snapshot_reply_s reply = {0};
 
-	US_LIST_ITERATE(server->run->snapshot_clients, client, { // cppcheck-suppress constStatement
-		struct evhttp_request *request = client->request;
+	const ldf now_ts = us_get_now_monotonic();
 
-		const bool has_fresh_snapshot = (atomic_load(&server->stream->run->http->snapshot_requested) == 0);
-		const bool timed_out = (client->request_ts + US_MAX((uint)1, server->stream->error_delay * 3) < us_get_now_monotonic());
+	US_LIST_ITERATE(shard->snapshot_clients, client, { // cppcheck-suppress constStatement
+		const bool has_fresh_snapshot = (ex->actual_ts >= client->request_ts);
+		const bool timed_out = (client->request_ts + US_MAX((uint)1, server->stream->error_delay * 3) < now_ts);
 
 		if (has_fresh_snapshot || timed_out) {
-			us_frame_s *frame = ex->frame;
-			if (!captured_meta.online) {
-				if (blank == NULL) {
-					blank = us_blank_init();
-					us_blank_draw(blank, "< NO LIVE VIDEO >", captured_meta.width, captured_meta.height);
-				}
-				frame = blank->jpeg;
+			if (reply.ref == NULL) {
+				_http_snapshot_reply_init(shard, &reply);
 			}
+			_http_snapshot_reply_send(&reply, client->request);
 
-			struct evbuffer *buf;
-			_A_EVBUFFER_NEW(buf);
-			_A_EVBUFFER_ADD(buf, (const void*)frame->data, frame->used);
+			US_LIST_REMOVE(shard->snapshot_clients, client);
+			free(client);
+			atomic_fetch_sub(&server->stream->run->http->snapshot_requested, 1);
+		}
+	});
 
-			_A_ADD_HEADER(request, "Cache-Control", "no-store, no-cache, must-revalidate, proxy-revalidate, pre-check=0, post-check=0, max-age=0");
-			_A_ADD_HEADER(request, "Pragma", "no-cache");
-			_A_ADD_HEADER(request, "Expires", "Mon, 3 Jan 2000 12:34:56 GMT");
+	US_DELETE(reply.ref, us_frameref_unref);
+}
 
-			char header_buf[256];
+static void _http_snapshot_reply_init(us_server_shard_s *shard, _snapshot_reply_s *reply) {
+	const us_server_s *const server = shard->server;
+	const us_server_exposed_s *const ex = shard->exposed;
 
-			ADD_TIME_HEADER("X-Timestamp", us_get_now_real());
+	us_fpsi_meta_s captured_meta;
+	us_fpsi_get(server->stream->run->http->captured_fpsi, &captured_meta);
 
-			_A_ADD_HEADER(request, "X-UStreamer-Online",			us_bool_to_string(frame->online));
-			ADD_UNSIGNED_HEADER("X-UStreamer-Width",				frame->width);
-			ADD_UNSIGNED_HEADER("X-UStreamer-Height",				frame->height);
-			ADD_TIME_HEADER("X-UStreamer-Grab-Timestamp",			frame->grab_ts);
-			ADD_TIME_HEADER("X-UStreamer-Encode-Begin-Timestamp",	frame->encode_begin_ts);
-			ADD_TIME_HEADER("X-UStreamer-Encode-End-Timestamp",		frame->encode_end_ts);
-			ADD_TIME_HEADER("X-UStreamer-Send-Timestamp",			us_get_now_monotonic());
+	if (captured_meta.online) {
+		reply->ref = us_frameref_ref(ex->ref);
+	} else {
+		us_blank_s *const blank = us_blank_init();
+		us_blank_draw(blank, "< NO LIVE VIDEO >", captured_meta.width, captured_meta.height);
+		reply->ref = us_frameref_init();
+		us_frame_copy(blank->jpeg, reply->ref->frame);
+		us_blank_destroy(blank);
+	}
+	const us_frame_s *const frame = reply->ref->frame;
+
+#	define FORMAT_TIME(x_dest, x_value)		US_SNPRINTF(reply->x_dest, sizeof(reply->x_dest), "%.06Lf", x_value)
+#	define FORMAT_UNSIGNED(x_dest, x_value)	US_SNPRINTF(reply->x_dest, sizeof(reply->x_dest), "%u", x_value)
+	reply->online = frame->online;
+	FORMAT_TIME(timestamp, us_get_now_real());
+	FORMAT_UNSIGNED(width, frame->width);
+	FORMAT_UNSIGNED(height, frame->height);
+	FORMAT_TIME(grab_ts, frame->grab_ts);
+	FORMAT_TIME(encode_begin_ts, frame->encode_begin_ts);
+	FORMAT_TIME(encode_end_ts, frame->encode_end_ts);
+	FORMAT_TIME(send_ts, us_get_now_monotonic());
+#	undef FORMAT_UNSIGNED
+#	undef FORMAT_TIME
+}
 
-			_A_ADD_HEADER(request, "Content-Type", "image/jpeg");
+static void _http_snapshot_reply_send(const _snapshot_reply_s *reply, struct evhttp_request *request) {
+	struct evbuffer *buf;
+	_A_EVBUFFER_NEW(buf);
+	_http_evbuffer_add_frameref(buf, reply->ref);
 
-			evhttp_send_reply(request, HTTP_OK, "OK", buf);
-			evbuffer_free(buf);
+	_A_ADD_HEADER(request, "Cache-Control", "no-store, no-cache, must-revalidate, proxy-revalidate, pre-check=0, post-check=0, max-age=0");
+	_A_ADD_HEADER(request, "Pragma", "no-cache");
+	_A_ADD_HEADER(request, "Expires", "Mon, 3 Jan 2000 12:34:56 GMT");
 
-			US_LIST_REMOVE(server->run->snapshot_clients, client);
-			free(client);
-		}
-	});
+	_A_ADD_HEADER(request, "X-Timestamp",							reply->timestamp);
+	_A_ADD_HEADER(request, "X-UStreamer-Online",					us_bool_to_string(reply->online));
+	_A_ADD_HEADER(request, "X-UStreamer-Width",						reply->width);
+	_A_ADD_HEADER(request, "X-UStreamer-Height",					reply->height);
+	_A_ADD_HEADER(request, "X-UStreamer-Grab-Timestamp",			reply->grab_ts);
+	_A_ADD_HEADER(request, "X-UStreamer-Encode-Begin-Timestamp",	reply->encode_begin_ts);
+	_A_ADD_HEADER(request, "X-UStreamer-Encode-End-Timestamp",		reply->encode_end_ts);
+	_A_ADD_HEADER(request, "X-UStreamer-Send-Timestamp",			reply->send_ts);
 
-#	undef ADD_UNSUGNED_HEADER
-#	undef ADD_TIME_HEADER
+	_A_ADD_HEADER(request, "Content-Type", "image/jpeg");
 
-	US_DELETE(blank, us_blank_destroy);
+	evhttp_send_reply(request, HTTP_OK, "OK", buf);
+	evbuffer_free(buf);
 }
 
-static void _http_refresher(int fd, short what, void *v_server) {
-	(void)fd;
-	(void)what;
+static void _http_refresher(int fd, short what, void *v_shard) {
+	us_server_shard_s *const shard = v_shard;
+	us_stream_s *const stream = shard->server->stream;
 
-	us_server_s *server = v_server;
-	us_server_exposed_s *ex = server->run->exposed;
-	us_ring_s *const ring = server->stream->run->http->jpeg_ring;
+	if (what & EV_READ) {
+		// Reset the eventfd before taking the frames, so the next one can't be missed
+		eventfd_t value;
+		if (eventfd_read(fd, &value) < 0 && errno != EAGAIN) {
+			_LOG_PERROR("Can't read JPEG notification");
+		}
+	}
 
+	_http_refresh_exposed(shard, shard->exposed, us_stream_take_jpeg(stream, shard->jpeg_reader));
+	for (uint scaled = 0; scaled < stream->n_scales; ++scaled) {
+		_http_refresh_exposed(shard, shard->scaled_exposed[scaled],
+			us_stream_take_scaled_jpeg(stream, scaled, shard->jpeg_reader));
+	}
+	for (uint crop = 0; crop < US_STREAM_MAX_CROPS; ++crop) {
+		_http_refresh_exposed(shard, shard->crop_exposed[crop],
+			us_stream_take_crop_jpeg(stream, crop, shard->jpeg_reader));
+	}
+	_http_send_snapshot(shard);
+}
+
+static void _http_refresh_exposed(us_server_shard_s *shard, us_server_exposed_s *ex, us_frameref_s *ref) {
 	bool stream_updated = false;
 	bool frame_updated = false;
 
-	const int ri = us_ring_consumer_acquire(ring, 0);
-	if (ri >= 0) {
-		const us_frame_s *const frame = ring->items[ri];
-		frame_updated = _expose_frame(server, frame);
+	if (ref != NULL) {
+		ex->actual_ts = us_get_now_monotonic();
+		frame_updated = _expose_frame(shard, ex, ref);
 		stream_updated = true;
-		us_ring_consumer_release(ring, ri);
-	} else if (ex->expose_end_ts + 1 < us_get_now_monotonic()) {
+	} else if (ex->ref->frame->used > 0 && ex->expose_end_ts + 1 < us_get_now_monotonic()) {
 		_LOG_DEBUG("Repeating exposed ...");
 		ex->expose_begin_ts = us_get_now_monotonic();
 		ex->expose_cmp_ts = ex->expose_begin_ts;
@@ -947,12 +1474,122 @@ static void _http_refresher(int fd, short what, void *v_server) {
 		stream_updated = true;
 	}
 
-	_http_send_stream(server, stream_updated, frame_updated);
-	_http_send_snapshot(server);
+	_http_send_stream(shard, ex, stream_updated, frame_updated);
+}
+
+static void _http_h264_refresher(int fd, short what, void *v_shard) {
+	(void)what;
+	us_server_shard_s *const shard = v_shard;
+	us_stream_http_s *const http = shard->server->stream->run->http;
+
+	eventfd_t value;
+	if (eventfd_read(fd, &value) < 0 && errno != EAGAIN) {
+		_LOG_PERROR("Can't read H264 notification");
+	}
+
+	while (true) {
+		bool lost;
+		us_frameref_s *const ref = us_stream_take_h264(shard->server->stream, shard->h264_reader, &lost);
+		if (lost) {
+			// Следующие фреймы без пропущенных не декодируются, ждем новый ключевой
+			US_LIST_ITERATE(shard->h264_clients, client, { // cppcheck-suppress constStatement
+				client->need_key = true;
+			});
+			atomic_store(&http->h264_key_requested, true);
+		}
+		if (ref == NULL) {
+			break;
+		}
+		_http_send_h264(shard, ref);
+		us_frameref_unref(ref);
+	}
+}
+
+static void _http_send_h264(us_server_shard_s *shard, us_frameref_s *ref) {
+	const us_server_s *const server = shard->server;
+	us_stream_http_s *const http = server->stream->run->http;
+	us_fmp4_s *const fmp4 = shard->fmp4;
+
+	if (shard->h264_clients == NULL) {
+		return;
+	}
+
+	// Сэмпл конвертируется один раз на шард и уходит всем клиентам по ссылке,
+	// для каждого клиента формируется только заголовок фрагмента.
+	us_frameref_s *const sample = us_frameref_init();
+	if (us_fmp4_convert_sample(fmp4, ref->frame, sample->frame) < 0) {
+		_LOG_VERBOSE("H264: Waiting for SPS and PPS to make the init segment");
+		us_frameref_unref(sample);
+		return;
+	}
+	const us_frame_s *const frame = sample->frame;
+
+	// Decode time must grow, but the blank frames keep the same grab time
+	ldf ts = frame->grab_ts;
+	if (ts <= shard->h264_prev_ts) {
+		ts = US_MAX(frame->encode_end_ts, shard->h264_prev_ts + (ldf)1 / 1000);
+	}
+	u32 duration = US_FMP4_TIMESCALE / 30; // Unknown for the first frame
+	if (shard->h264_prev_ts > 0) {
+		duration = (ts - shard->h264_prev_ts) * US_FMP4_TIMESCALE;
+	}
+	shard->h264_prev_ts = ts;
+
+	const uz queue_limit = (server->client_queue_limit > 0 ? server->client_queue_limit * 1024 : US_SERVER_H264_QUEUE_LIMIT);
+
+	US_LIST_ITERATE(shard->h264_clients, client, { // cppcheck-suppress constStatement
+		struct bufferevent *const buf_event = evhttp_connection_get_bufferevent(evhttp_request_get_connection(client->request));
+
+		if (client->init_id != 0 && client->init_id != fmp4->init_id) {
+			// The players can't switch the resolution inside the single MP4
+			_http_h264_client_destroy(client, "stream parameters have been changed");
+			goto next; // The macro advances at the end of the body, so no continue here
+		}
+
+		const bool overflow = (_http_get_queue_size(buf_event) > queue_limit);
+		if (overflow && !client->need_key) {
+			_LOG_VERBOSE("H264: Client %s is too slow, waiting for a keyframe", client->hostport);
+			client->need_key = true;
+			atomic_store(&http->h264_key_requested, true);
+		}
+		if (client->need_key && (!frame->key || overflow)) {
+			if (client->init_id != 0) {
+				client->dropped += 1;
+			}
+			goto next;
+		}
+
+		struct evbuffer *buf;
+		_A_EVBUFFER_NEW(buf);
+
+		if (client->init_id == 0) {
+			_A_EVBUFFER_ADD(buf, fmp4->init, fmp4->init_size);
+			client->init_id = fmp4->init_id;
+			client->first_ts = ts;
+		}
+		client->need_key = false;
+
+		u8 header[US_FMP4_FRAGMENT_HEADER_SIZE];
+		const uz header_size = us_fmp4_write_fragment_header(
+			header, ++client->sequence,
+			(ts - client->first_ts) * US_FMP4_TIMESCALE,
+			duration, frame->used, frame->key);
+		_A_EVBUFFER_ADD(buf, header, header_size);
+		_http_evbuffer_add_frameref(buf, sample);
+
+		assert(!bufferevent_write_buffer(buf_event, buf));
+		evbuffer_free(buf);
+
+	next:
+		;
+	});
+
+	us_frameref_unref(sample);
 }
 
-static bool _expose_frame(us_server_s *server, const us_frame_s *frame) {
-	us_server_exposed_s *const ex = server->run->exposed;
+static bool _expose_frame(us_server_shard_s *shard, us_server_exposed_s *ex, us_frameref_s *ref) {
+	const us_server_s *const server = shard->server;
+	const us_frame_s *const frame = ref->frame;
 
 	_LOG_DEBUG("Updating exposed frame (online=%d) ...", frame->online);
 	ex->expose_begin_ts = us_get_now_monotonic();
@@ -962,13 +1599,14 @@ static bool _expose_frame(us_server_s *server, const us_frame_s *frame) {
 		bool maybe_same = false;
 		if (
 			(need_drop = (ex->dropped < server->drop_same_frames))
-			&& (maybe_same = us_frame_compare(ex->frame, frame))
+			&& (maybe_same = us_frame_compare(ex->ref->frame, frame))
 		) {
 			ex->expose_cmp_ts = us_get_now_monotonic();
 			ex->expose_end_ts = ex->expose_cmp_ts;
 			_LOG_VERBOSE("Dropped same frame number %u; cmp_time=%.06Lf",
 				ex->dropped, (ex->expose_cmp_ts - ex->expose_begin_ts));
 			ex->dropped += 1;
+			us_frameref_unref(ref);
 			return false; // Not updated
 		} else {
 			ex->expose_cmp_ts = us_get_now_monotonic();
@@ -980,9 +1618,18 @@ static bool _expose_frame(us_server_s *server, const us_frame_s *frame) {
 	if (frame->used == 0) {
 		// Фрейм нулевой длины означает, что мы просто должны повторить то,
 		// что у нас уже есть, с поправкой на онлайн.
-		ex->frame->online = frame->online;
+		if (ex->ref->frame->online != frame->online) {
+			// Exposed frame may be still referenced by the clients, so change only a copy
+			us_frameref_s *const fresh = us_frameref_init();
+			us_frame_copy(ex->ref->frame, fresh->frame);
+			fresh->frame->online = frame->online;
+			us_frameref_unref(ex->ref);
+			ex->ref = fresh;
+		}
+		us_frameref_unref(ref);
 	} else {
-		us_frame_copy(frame, ex->frame);
+		us_frameref_unref(ex->ref);
+		ex->ref = ref; // Zero-copy
 	}
 
 	ex->dropped = 0;
@@ -990,6 +1637,120 @@ static bool _expose_frame(us_server_s *server, const us_frame_s *frame) {
 	ex->expose_end_ts = us_get_now_monotonic();
 
 	_LOG_VERBOSE("Exposed frame: online=%d, exp_time=%.06Lf",
-		 ex->frame->online, (ex->expose_end_ts - ex->expose_begin_ts));
+		 ex->ref->frame->online, (ex->expose_end_ts - ex->expose_begin_ts));
 	return true; // Updated
 }
+
+static const us_server_part_s *_http_get_part(us_server_exposed_s *ex, us_server_part_e variant) {
+	const us_frame_s *const frame = ex->ref->frame;
+	us_server_part_s *const part = &ex->parts[variant];
+
+	if (part->ready) {
+		return part;
+	}
+
+#	define APPEND(x_fmt, ...) { \
+			const int m_n = snprintf(part->data + part->size, sizeof(part->data) - part->size, x_fmt, ##__VA_ARGS__); \
+			assert(m_n >= 0 && (uz)m_n < sizeof(part->data) - part->size); \
+			part->size += m_n; \
+		}
+
+	part->size = 0;
+	if (variant == US_SERVER_PART_ADVANCE) {
+		APPEND("Content-Type: image/jpeg" RN "X-Timestamp: %.06Lf" RN RN, us_get_now_real());
+		part->fps_offset = part->size;
+	} else {
+		const bool extra = (variant == US_SERVER_PART_EXTRA || variant == US_SERVER_PART_EXTRA_ZERO_DATA);
+		const bool zero_data = (variant == US_SERVER_PART_ZERO_DATA || variant == US_SERVER_PART_EXTRA_ZERO_DATA);
+		APPEND(
+			"Content-Type: image/jpeg" RN
+			"Content-Length: %zu" RN
+			"X-Timestamp: %.06Lf" RN
+			"%s",
+			(!zero_data ? frame->used : 0),
+			us_get_now_real(),
+			(extra ? "" : RN)
+		);
+		if (extra) {
+			APPEND(
+				"X-UStreamer-Online: %s" RN
+				"X-UStreamer-Dropped: %u" RN
+				"X-UStreamer-Width: %u" RN
+				"X-UStreamer-Height: %u" RN,
+				us_bool_to_string(frame->online),
+				ex->dropped,
+				frame->width,
+				frame->height
+			);
+			part->fps_offset = part->size;
+			APPEND(
+				"X-UStreamer-Grab-Time: %.06Lf" RN
+				"X-UStreamer-Encode-Begin-Time: %.06Lf" RN
+				"X-UStreamer-Encode-End-Time: %.06Lf" RN
+				"X-UStreamer-Expose-Begin-Time: %.06Lf" RN
+				"X-UStreamer-Expose-Cmp-Time: %.06Lf" RN
+				"X-UStreamer-Expose-End-Time: %.06Lf" RN,
+				frame->grab_ts,
+				frame->encode_begin_ts,
+				frame->encode_end_ts,
+				ex->expose_begin_ts,
+				ex->expose_cmp_ts,
+				ex->expose_end_ts
+			);
+		} else {
+			part->fps_offset = part->size;
+		}
+	}
+
+#	undef APPEND
+
+	part->ready = true;
+	return part;
+}
+
+static void _http_evbuffer_add_raw_cors(struct evbuffer *buf, us_server_s *server, struct evhttp_request *request) {
+	// For the streams which are sent without evhttp_send_reply()
+	if (server->allow_origin[0] != '\0') {
+		const char *const cors_headers = us_evhttp_get_header(request, "Access-Control-Request-Headers");
+		const char *const cors_method = us_evhttp_get_header(request, "Access-Control-Request-Method");
+
+		_A_EVBUFFER_ADD_PRINTF(buf,
+			"Access-Control-Allow-Origin: %s" RN
+			"Access-Control-Allow-Credentials: true" RN,
+			server->allow_origin
+		);
+		if (cors_headers != NULL) {
+			_A_EVBUFFER_ADD_PRINTF(buf, "Access-Control-Allow-Headers: %s" RN, cors_headers);
+		}
+		if (cors_method != NULL) {
+			_A_EVBUFFER_ADD_PRINTF(buf, "Access-Control-Allow-Methods: %s" RN, cors_method);
+		}
+	}
+}
+
+static uz _http_get_queue_size(struct bufferevent *buf_event) {
+	// Our output buffer plus the data in the socket which is not sent yet,
+	// because the kernel buffer can hold a lot of frames for a slow client.
+	uz size = evbuffer_get_length(bufferevent_get_output(buf_event));
+#	ifdef _IOCTL_UNSENT
+	const evutil_socket_t fd = bufferevent_getfd(buf_event);
+	int unsent = 0;
+	if (fd >= 0 && ioctl(fd, _IOCTL_UNSENT, &unsent) == 0 && unsent > 0) {
+		size += unsent;
+	}
+#	endif
+	return size;
+}
+
+static void _http_evbuffer_add_frameref(struct evbuffer *buf, us_frameref_s *ref) {
+	// The frame data is not copied: the buffer holds a reference until the data is sent to the client
+	assert(!evbuffer_add_reference(buf,
+		(const void*)ref->frame->data, ref->frame->used,
+		_http_frameref_cleanup, us_frameref_ref(ref)));
+}
+
+static void _http_frameref_cleanup(const void *data, size_t size, void *v_ref) {
+	(void)data;
+	(void)size;
+	us_frameref_unref((us_frameref_s*)v_ref);
+}
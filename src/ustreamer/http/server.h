@@ -22,72 +22,159 @@
 
 #pragma once
 
+#include <stdatomic.h>
+
 #include <sys/stat.h>
 
+#include <pthread.h>
+
 #include <event2/util.h>
 #include <event2/event.h>
 #include <event2/http.h>
 
 #include "../../libs/types.h"
 #include "../../libs/frame.h"
+#include "../../libs/frameref.h"
 #include "../../libs/list.h"
 #include "../../libs/fpsi.h"
 #include "../encoder.h"
 #include "../stream.h"
 
+#include "static.h"
+#include "fmp4.h"
+
+
+#define US_SERVER_MAX_THREADS US_STREAM_MAX_JPEG_READERS
+#define US_SERVER_H264_QUEUE_LIMIT (4 * 1024 * 1024) // Bytes, if --client-queue-limit is not set
+
 
 typedef struct {
-	struct us_server_sx		*server;
-	struct evhttp_request	*request;
+	struct us_server_sx			*server;
+	struct us_server_shard_sx	*shard;
+	struct evhttp_request		*request;
 
 	char	*key;
 	bool	extra_headers;
 	bool	advance_headers;
 	bool	dual_final_frames;
 	bool	zero_data;
+	uint	scale;
+	int		crop; // Index of the stream's crop slot or -1
+
+	struct us_server_exposed_sx	*exposed; // The full-size, downscaled or cropped stream
 
 	char	*hostport;
 	u64		id;
 	bool	need_initial;
 	bool	need_first_frame;
 	bool	updated_prev;
+	bool	pending; // Waiting for the write callback to send the exposed frame
+	bool	lagging; // Waiting for the output queue to fall below the limit
 
-	us_fpsi_s *fpsi;
+	us_fpsi_s		*fpsi;
+	atomic_ullong	queue_size; // Bytes in the output buffer and in the socket
+	atomic_ullong	dropped; // Frames skipped because the client is too slow
 
 	US_LIST_DECLARE;
 } us_stream_client_s;
 
 typedef struct {
-	struct us_server_sx		*server;
-	struct evhttp_request	*request;
-	ldf						request_ts;
+	struct us_server_sx			*server;
+	struct us_server_shard_sx	*shard;
+	struct evhttp_request		*request;
+	ldf							request_ts;
 
 	US_LIST_DECLARE;
 } us_snapshot_client_s;
 
 typedef struct {
-	us_frame_s	*frame;
-	us_fpsi_s	*queued_fpsi;
+	struct us_server_sx			*server;
+	struct us_server_shard_sx	*shard;
+	struct evhttp_request		*request;
+
+	char		*hostport;
+	u64			id;
+
+	bool		need_key; // Waiting for a keyframe to start or to recover after the drops
+	uint		init_id; // The init segment sent to the client or 0
+	u32			sequence;
+	ldf			first_ts; // Time of the first sent frame
+	ull			dropped;
+
+	US_LIST_DECLARE;
+} us_h264_client_s;
+
+typedef enum {
+	US_SERVER_PART_PLAIN = 0,
+	US_SERVER_PART_ZERO_DATA,
+	US_SERVER_PART_EXTRA,
+	US_SERVER_PART_EXTRA_ZERO_DATA,
+	US_SERVER_PART_ADVANCE,
+	US_SERVER_PART_VARIANTS,
+} us_server_part_e;
+
+typedef struct {
+	bool	ready;
+	char	data[1024];
+	uz		size;
+	uz		fps_offset; // Place for the per-client X-UStreamer-Client-FPS
+} us_server_part_s;
+
+typedef struct us_server_exposed_sx {
+	us_frameref_s	*ref; // Shared with the clients' output buffers
+	us_server_part_s parts[US_SERVER_PART_VARIANTS]; // Pre-serialized multipart headers
+	us_fpsi_s		*queued_fpsi;
 	uint		dropped;
 	ldf			expose_begin_ts;
 	ldf			expose_cmp_ts;
 	ldf			expose_end_ts;
+	ldf			actual_ts; // When the stream has delivered a JPEG, even if it was dropped as the same
+	uint		gen; // Generation of the stream's crop slot
 } us_server_exposed_s;
 
-typedef struct {
+typedef struct us_server_shard_sx {
+	struct us_server_sx	*server;
+	uint				index;
+	pthread_t			tid;
+
 	struct event_base	*base;
 	struct evhttp		*http;
-	evutil_socket_t		ext_fd; // Unix or socket activation
+	evutil_socket_t		fd; // Own listener of the shard, if any
 
-	char				*auth_token;
-
-	struct event		*refresher;
+	int					notify_fd; // Eventfd signaled by the stream for each new JPEG
+	uint				jpeg_reader;
+	struct event		*notifier;
+	struct event		*refresher; // Repeats and timeouts only, frames are pushed via notifier
 	us_server_exposed_s	*exposed;
+	us_server_exposed_s	*scaled_exposed[US_STREAM_MAX_SCALES]; // For the stream's scales
+	us_server_exposed_s	*crop_exposed[US_STREAM_MAX_CROPS]; // For the stream's crop slots
 
-	us_stream_client_s	*stream_clients;
+	us_stream_client_s	*stream_clients; // Changed only under the runtime's clients_mutex
 	uint				stream_clients_count;
 
 	us_snapshot_client_s *snapshot_clients;
+
+	int					h264_notify_fd; // -1 if H264 is disabled
+	uint				h264_reader;
+	struct event		*h264_notifier;
+	us_fmp4_s			*fmp4;
+	ldf					h264_prev_ts;
+	us_h264_client_s	*h264_clients; // Used only by the shard's own loop
+	uint				h264_clients_count;
+} us_server_shard_s;
+
+typedef struct {
+	us_server_shard_s	**shards;
+	uint				n_shards;
+
+	evutil_socket_t		ext_fd; // Unix or socket activation
+
+	char				*auth_token;
+	us_static_cache_s	*static_cache; // Shared between the shards
+
+	pthread_mutex_t		clients_mutex; // Protects the shards' clients lists and the total counter
+	uint				stream_clients_count; // Total for all shards
+	uint				full_clients_count; // Total clients of the full-size stream only
 } us_server_runtime_s;
 
 typedef struct us_server_sx {
@@ -106,6 +193,9 @@ typedef struct us_server_sx {
 
 	bool	tcp_nodelay;
 	uint	timeout;
+	uint	n_threads;
+	uint	client_queue_limit; // KiB
+	uint	snapshot_cache; // Milliseconds
 
 	char	*user;
 	char	*passwd;
@@ -26,16 +26,42 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
 #include <assert.h>
 
+#include <sys/types.h>
 #include <sys/stat.h>
 
+#include <event2/buffer.h>
+
+#include "../../libs/types.h"
 #include "../../libs/tools.h"
+#include "../../libs/threading.h"
 #include "../../libs/logging.h"
+#include "../../libs/list.h"
 
+#include "mime.h"
 #include "path.h"
 
 
+// Как часто перепроверять файлы на диске, чтобы подхватить изменения
+#define _CHECK_INTERVAL 1
+
+
+static const char *const _SUFFIXES[US_STATIC_ENCODINGS] = {"", ".gz", ".br"};
+
+
+static us_static_file_s *_static_file_init(const char *root_path, const char *request_path);
+static void _static_file_destroy(us_static_file_s *file);
+static bool _static_file_is_actual(const us_static_file_s *file);
+
+static int _static_variant_open(us_static_variant_s *variant, const char *path, const char *suffix);
+static bool _static_variant_is_actual(const us_static_variant_s *variant, const char *path, const char *suffix);
+static char *_static_make_variant_path(const char *path, const char *suffix);
+
+
 char *us_find_static_file_path(const char *root_path, const char *request_path) {
 	char *path = NULL;
 
@@ -82,3 +108,192 @@ ok:
 	free(simplified_path);
 	return path;
 }
+
+us_static_cache_s *us_static_cache_init(const char *root_path) {
+	us_static_cache_s *cache;
+	US_CALLOC(cache, 1);
+	cache->root_path = us_strdup(root_path);
+	US_MUTEX_INIT(cache->mutex);
+	return cache;
+}
+
+void us_static_cache_destroy(us_static_cache_s *cache) {
+	US_LIST_ITERATE(cache->files, file, {
+		US_LIST_REMOVE_C(cache->files, file, cache->files_count);
+		_static_file_destroy(file);
+	});
+	US_MUTEX_DESTROY(cache->mutex);
+	free(cache->root_path);
+	free(cache);
+}
+
+const us_static_file_s *us_static_cache_get(us_static_cache_s *cache, const char *request_path) {
+	// On success returns the file with the locked cache, us_static_cache_put() must be called after use.
+	// The file segments may be added to the evbuffers only before that: they are refcounted
+	// by libevent, so the replaced or evicted file will be freed after the last sending.
+
+	const ldf now_ts = us_get_now_monotonic();
+
+	US_MUTEX_LOCK(cache->mutex);
+
+	us_static_file_s *found = NULL;
+	US_LIST_ITERATE(cache->files, file, {
+		if (!strcmp(file->request_path, request_path)) {
+			found = file;
+			break;
+		}
+	});
+
+	if (found != NULL && found->checked_ts + _CHECK_INTERVAL < now_ts) {
+		if (_static_file_is_actual(found)) {
+			found->checked_ts = now_ts;
+		} else {
+			US_LOG_VERBOSE("HTTP: Static file %s has been changed, reloading ...", found->path);
+			US_LIST_REMOVE_C(cache->files, found, cache->files_count);
+			_static_file_destroy(found);
+			found = NULL;
+		}
+	}
+
+	if (found == NULL) {
+		if ((found = _static_file_init(cache->root_path, request_path)) == NULL) {
+			US_MUTEX_UNLOCK(cache->mutex);
+			return NULL;
+		}
+		found->checked_ts = now_ts;
+		if (cache->files_count >= US_STATIC_CACHE_MAX_FILES) {
+			us_static_file_s *const oldest = cache->files;
+			US_LIST_REMOVE_C(cache->files, oldest, cache->files_count);
+			_static_file_destroy(oldest);
+		}
+		US_LIST_APPEND_C(cache->files, found, cache->files_count);
+	}
+	return found;
+}
+
+void us_static_cache_put(us_static_cache_s *cache) {
+	US_MUTEX_UNLOCK(cache->mutex);
+}
+
+const char *us_static_encoding_to_string(us_static_encoding_e encoding) {
+	switch (encoding) {
+		case US_STATIC_GZIP: return "gzip";
+		case US_STATIC_BROTLI: return "br";
+		default: break;
+	}
+	return "identity";
+}
+
+static us_static_file_s *_static_file_init(const char *root_path, const char *request_path) {
+	char *const path = us_find_static_file_path(root_path, request_path);
+	if (path == NULL) {
+		return NULL;
+	}
+
+	us_static_file_s *file;
+	US_CALLOC(file, 1);
+	file->request_path = us_strdup(request_path);
+	file->path = path;
+	file->mime_type = us_guess_mime_type(path);
+
+	for (uint encoding = 0; encoding < US_STATIC_ENCODINGS; ++encoding) {
+		if (_static_variant_open(&file->variants[encoding], path, _SUFFIXES[encoding]) < 0) {
+			if (encoding == US_STATIC_IDENTITY) {
+				goto error;
+			}
+		}
+	}
+
+	file->mtime = file->variants[US_STATIC_IDENTITY].mtime.tv_sec;
+	struct tm tm;
+	assert(gmtime_r(&file->mtime, &tm) != NULL);
+	assert(strftime(file->last_modified, sizeof(file->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm) > 0);
+
+	US_LOG_VERBOSE("HTTP: Cached static file %s (gzip=%d, br=%d)", path,
+		(file->variants[US_STATIC_GZIP].seg != NULL), (file->variants[US_STATIC_BROTLI].seg != NULL));
+	return file;
+
+error:
+	_static_file_destroy(file);
+	return NULL;
+}
+
+static void _static_file_destroy(us_static_file_s *file) {
+	for (uint encoding = 0; encoding < US_STATIC_ENCODINGS; ++encoding) {
+		US_DELETE(file->variants[encoding].seg, evbuffer_file_segment_free);
+	}
+	free(file->path);
+	free(file->request_path);
+	free(file);
+}
+
+static bool _static_file_is_actual(const us_static_file_s *file) {
+	for (uint encoding = 0; encoding < US_STATIC_ENCODINGS; ++encoding) {
+		if (!_static_variant_is_actual(&file->variants[encoding], file->path, _SUFFIXES[encoding])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int _static_variant_open(us_static_variant_s *variant, const char *path, const char *suffix) {
+	char *const variant_path = _static_make_variant_path(path, suffix);
+	int fd = -1;
+
+	struct stat st;
+	if (lstat(variant_path, &st) < 0 || !S_ISREG(st.st_mode)) {
+		goto error; // Сжатых вариантов может и не быть, это нормально
+	}
+	if ((fd = open(variant_path, O_RDONLY | O_CLOEXEC)) < 0) {
+		US_LOG_PERROR("HTTP: Can't open static file %s", variant_path);
+		goto error;
+	}
+	if (fstat(fd, &st) < 0) {
+		US_LOG_PERROR("HTTP: Can't fstat() static file %s", variant_path);
+		goto error;
+	}
+
+	// Сегмент держит файл открытым, а libevent отправляет его через sendfile()
+	// без копирования в юзерспейс. Он сам закроет дескриптор после последней отправки.
+	if ((variant->seg = evbuffer_file_segment_new(fd, 0, st.st_size, EVBUF_FS_CLOSE_ON_FREE)) == NULL) {
+		US_LOG_ERROR("HTTP: Can't create file segment for the static file %s", variant_path);
+		goto error;
+	}
+	fd = -1;
+
+	variant->size = st.st_size;
+	variant->ino = st.st_ino;
+	variant->mtime = st.st_mtim;
+	US_SNPRINTF(variant->etag, sizeof(variant->etag), "\"%llx-%llx-%llx%09lx\"",
+		(ull)st.st_ino, (ull)st.st_size, (ull)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+
+	free(variant_path);
+	return 0;
+
+error:
+	US_CLOSE_FD(fd);
+	free(variant_path);
+	return -1;
+}
+
+static bool _static_variant_is_actual(const us_static_variant_s *variant, const char *path, const char *suffix) {
+	char *const variant_path = _static_make_variant_path(path, suffix);
+	struct stat st;
+	const bool exists = (lstat(variant_path, &st) == 0 && S_ISREG(st.st_mode));
+	free(variant_path);
+	if (variant->seg == NULL || !exists) {
+		return (variant->seg == NULL && !exists);
+	}
+	return (
+		variant->ino == st.st_ino
+		&& variant->size == (uz)st.st_size
+		&& variant->mtime.tv_sec == st.st_mtim.tv_sec
+		&& variant->mtime.tv_nsec == st.st_mtim.tv_nsec
+	);
+}
+
+static char *_static_make_variant_path(const char *path, const char *suffix) {
+	char *variant_path;
+	US_ASPRINTF(variant_path, "%s%s", path, suffix);
+	return variant_path;
+}
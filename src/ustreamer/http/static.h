@@ -20,7 +20,64 @@
 *****************************************************************************/
 
 
+
 #pragma once
 
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+
+#include <event2/buffer.h>
+
+#include "../../libs/types.h"
+#include "../../libs/list.h"
+
+
+#define US_STATIC_CACHE_MAX_FILES 256
+
+
+typedef enum {
+	US_STATIC_IDENTITY = 0,
+	US_STATIC_GZIP,
+	US_STATIC_BROTLI,
+	US_STATIC_ENCODINGS,
+} us_static_encoding_e;
+
+typedef struct {
+	struct evbuffer_file_segment *seg; // NULL if there is no such variant on the disk
+	uz				size;
+	ino_t			ino;
+	struct timespec	mtime;
+	char			etag[64];
+} us_static_variant_s;
+
+typedef struct {
+	char				*request_path;
+	char				*path;
+	const char			*mime_type;
+	time_t				mtime;
+	char				last_modified[64];
+	us_static_variant_s	variants[US_STATIC_ENCODINGS];
+	ldf					checked_ts;
+
+	US_LIST_DECLARE;
+} us_static_file_s;
+
+typedef struct {
+	char				*root_path;
+	pthread_mutex_t		mutex; // Shared between all HTTP shards
+	us_static_file_s	*files;
+	uint				files_count;
+} us_static_cache_s;
+
 
 char *us_find_static_file_path(const char *root_path, const char *request_path);
+
+us_static_cache_s *us_static_cache_init(const char *root_path);
+void us_static_cache_destroy(us_static_cache_s *cache);
+
+const us_static_file_s *us_static_cache_get(us_static_cache_s *cache, const char *request_path);
+void us_static_cache_put(us_static_cache_s *cache);
+
+const char *us_static_encoding_to_string(us_static_encoding_e encoding);
@@ -22,7 +22,9 @@
 
 #include "tools.h"
 
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
@@ -82,6 +84,53 @@ evutil_socket_t us_evhttp_bind_unix(struct evhttp *http, const char *path, bool
 	return fd;
 }
 
+evutil_socket_t us_evhttp_bind_reuseport(struct evhttp *http, const char *host, uint port) {
+	// Такой сокет можно открыть несколько раз на тот же адрес,
+	// и ядро будет распределять входящие соединения между ними.
+	struct evutil_addrinfo hints = {0};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = EVUTIL_AI_PASSIVE | EVUTIL_AI_ADDRCONFIG;
+
+	char port_str[16];
+	US_SNPRINTF(port_str, 15, "%u", port);
+
+	struct evutil_addrinfo *ai = NULL;
+	if (evutil_getaddrinfo(host, port_str, &hints, &ai) != 0 || ai == NULL) {
+		US_LOG_ERROR("HTTP: Can't resolve [%s]:%u", host, port);
+		return -1;
+	}
+
+	evutil_socket_t fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	assert(fd >= 0);
+	assert(!evutil_make_socket_nonblocking(fd));
+	assert(!evutil_make_socket_closeonexec(fd));
+	assert(!evutil_make_listen_socket_reuseable(fd));
+	if (evutil_make_listen_socket_reuseable_port(fd) < 0) {
+		US_LOG_PERROR("HTTP: Can't set SO_REUSEPORT for [%s]:%u", host, port);
+		goto error;
+	}
+	if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+		US_LOG_PERROR("HTTP: Can't bind HTTP on [%s]:%u", host, port);
+		goto error;
+	}
+	if (listen(fd, 128) < 0) {
+		US_LOG_PERROR("HTTP: Can't listen [%s]:%u", host, port);
+		goto error;
+	}
+	if (evhttp_accept_socket(http, fd) < 0) {
+		US_LOG_PERROR("HTTP: Can't evhttp_accept_socket() [%s]:%u", host, port);
+		goto error;
+	}
+	evutil_freeaddrinfo(ai);
+	return fd;
+
+error:
+	evutil_freeaddrinfo(ai);
+	US_CLOSE_FD(fd);
+	return -1;
+}
+
 const char *us_evhttp_get_header(struct evhttp_request *request, const char *key) {
 	return evhttp_find_header(evhttp_request_get_input_headers(request), key);
 }
@@ -140,6 +189,20 @@ char *us_evkeyvalq_get_string(struct evkeyvalq *params, const char *key) {
 	return NULL;
 }
 
+uint us_evkeyvalq_get_uint(struct evkeyvalq *params, const char *key) {
+	// Zero if the value is missing or invalid
+	const char *const value_str = evhttp_find_header(params, key);
+	if (value_str != NULL) {
+		errno = 0;
+		char *end = NULL;
+		const unsigned long value = strtoul(value_str, &end, 10);
+		if (!errno && end != value_str && *end == '\0' && value <= UINT_MAX) {
+			return value;
+		}
+	}
+	return 0;
+}
+
 char *us_bufferevent_format_reason(short what) {
 	char *reason;
 	US_CALLOC(reason, 2048);
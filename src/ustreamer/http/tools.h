@@ -31,11 +31,13 @@
 
 
 evutil_socket_t us_evhttp_bind_unix(struct evhttp *http, const char *path, bool rm, mode_t mode);
+evutil_socket_t us_evhttp_bind_reuseport(struct evhttp *http, const char *host, uint port);
 
 const char *us_evhttp_get_header(struct evhttp_request *request, const char *key);
 char *us_evhttp_get_hostport(struct evhttp_request *request);
 
 bool us_evkeyvalq_get_true(struct evkeyvalq *params, const char *key);
 char *us_evkeyvalq_get_string(struct evkeyvalq *params, const char *key);
+uint us_evkeyvalq_get_uint(struct evkeyvalq *params, const char *key);
 
 char *us_bufferevent_format_reason(short what);
@@ -38,7 +38,9 @@
 #include "../libs/tools.h"
 #include "../libs/logging.h"
 #include "../libs/frame.h"
+#include "../libs/errors.h"
 #include "../libs/xioctl.h"
+#include "../libs/unjpeg.h"
 
 
 static us_m2m_encoder_s *_m2m_encoder_init(
@@ -53,7 +55,17 @@ static int _m2m_encoder_init_buffers(
 
 static void _m2m_encoder_cleanup(us_m2m_encoder_s *enc);
 
-static int _m2m_encoder_compress_raw(us_m2m_encoder_s *enc, const us_frame_s *src, us_frame_s *dest, bool force_key);
+static const us_frame_s *_m2m_encoder_get_input(const us_m2m_encoder_s *enc, const us_frame_s *src, us_frame_s *unjpeg);
+static int _m2m_encoder_fill_input(us_m2m_encoder_s *enc, const us_frame_s *src, const us_frame_s *input, uint index);
+
+static int _m2m_encoder_compress_raw(
+	us_m2m_encoder_s *enc, const us_frame_s *src, const us_frame_s *input,
+	us_frame_s *dest, bool force_key);
+static int _m2m_encoder_compress_pipelined(us_m2m_encoder_s *enc, const us_frame_s *src, us_frame_s *dest, bool force_key);
+
+static int _m2m_encoder_force_key(us_m2m_encoder_s *enc);
+static void _m2m_inflight_release_input(us_m2m_inflight_s *item);
+static void _m2m_inflight_finish(us_m2m_encoder_s *enc, us_m2m_inflight_s *item);
 
 
 #define _LOG_ERROR(x_msg, ...)	US_LOG_ERROR("%s: " x_msg, enc->name, ##__VA_ARGS__)
@@ -63,9 +75,12 @@ static int _m2m_encoder_compress_raw(us_m2m_encoder_s *enc, const us_frame_s *sr
 #define _LOG_DEBUG(x_msg, ...)	US_LOG_DEBUG("%s: " x_msg, enc->name, ##__VA_ARGS__)
 
 
-us_m2m_encoder_s *us_m2m_h264_encoder_init(const char *name, const char *path, uint bitrate, uint gop) {
+us_m2m_encoder_s *us_m2m_h264_encoder_init(const char *name, const char *path, uint bitrate, uint gop, uint inflight) {
+	assert(inflight >= 1 && inflight <= US_M2M_MAX_INFLIGHT);
 	bitrate *= 1000; // From Kbps
-	return _m2m_encoder_init(name, path, V4L2_PIX_FMT_H264, bitrate, gop, 0, true);
+	us_m2m_encoder_s *const enc = _m2m_encoder_init(name, path, V4L2_PIX_FMT_H264, bitrate, gop, 0, true);
+	enc->inflight = inflight;
+	return enc;
 }
 
 us_m2m_encoder_s *us_m2m_mjpeg_encoder_init(const char *name, const char *path, uint quality) {
@@ -95,6 +110,10 @@ void us_m2m_encoder_destroy(us_m2m_encoder_s *enc) {
 int us_m2m_encoder_compress(us_m2m_encoder_s *enc, const us_frame_s *src, us_frame_s *dest, bool force_key) {
 	us_m2m_encoder_runtime_s *const run = enc->run;
 
+	if (enc->inflight > 1) {
+		return _m2m_encoder_compress_pipelined(enc, src, dest, force_key);
+	}
+
 	uint dest_format = enc->output_format;
 	switch (enc->output_format) {
 		case V4L2_PIX_FMT_JPEG:
@@ -112,16 +131,22 @@ int us_m2m_encoder_compress(us_m2m_encoder_s *enc, const us_frame_s *src, us_fra
 			break;
 	}
 
-	us_frame_encoding_begin(src, dest, dest_format);
+	us_frame_s unjpeg;
+	const us_frame_s *const input = _m2m_encoder_get_input(enc, src, &unjpeg);
+
+	us_frame_encoding_begin(input, dest, dest_format);
 
-	_m2m_encoder_ensure(enc, src);
+	_m2m_encoder_ensure(enc, input);
 	if (!run->ready) { // Already prepared but failed
 		return -1;
 	}
 
 	_LOG_DEBUG("Compressing new frame; force_key=%d ...", force_key);
 
-	if (_m2m_encoder_compress_raw(enc, src, dest, force_key) < 0) {
+	const int retval = _m2m_encoder_compress_raw(enc, src, input, dest, force_key);
+	if (retval == US_ERROR_NO_DATA) {
+		return -1; // Битый исходный фрейм, с енкодером все в порядке
+	} else if (retval < 0) {
 		_m2m_encoder_cleanup(enc);
 		_LOG_ERROR("Encoder destroyed due an error (compress)");
 		return -1;
@@ -137,6 +162,245 @@ int us_m2m_encoder_compress(us_m2m_encoder_s *enc, const us_frame_s *src, us_fra
 	return 0;
 }
 
+#define _E_XIOCTL(x_request, x_value, x_msg, ...) { \
+		if (us_xioctl(run->fd, x_request, x_value) < 0) { \
+			_LOG_PERROR(x_msg, ##__VA_ARGS__); \
+			goto error; \
+		} \
+	}
+
+int us_m2m_encoder_submit(us_m2m_encoder_s *enc, const us_frame_s *src, bool force_key, us_m2m_release_f release, void *opaque) {
+	us_m2m_encoder_runtime_s *const run = enc->run;
+
+	assert(enc->inflight > 1);
+	assert(enc->output_format == V4L2_PIX_FMT_H264);
+
+	force_key = (
+		force_key
+		|| run->last_online != src->online
+		|| run->last_encode_ts + 0.5 < us_get_now_monotonic()
+	);
+
+	us_frame_s unjpeg;
+	const us_frame_s *const input = _m2m_encoder_get_input(enc, src, &unjpeg);
+
+	_m2m_encoder_ensure(enc, input);
+	if (!run->ready) { // Already prepared but failed
+		goto release;
+	}
+
+	us_m2m_inflight_s *item = NULL;
+	uint index = 0;
+	for (; index < US_MIN(enc->inflight, run->n_input_bufs); ++index) {
+		if (!run->inflight[index].used) {
+			item = &run->inflight[index];
+			break;
+		}
+	}
+	if (item == NULL) {
+		_LOG_ERROR("No free INPUT buffers, the encoder is full");
+		goto release;
+	}
+
+	_LOG_DEBUG("Submitting new frame; force_key=%d, inflight=%u ...", force_key, run->n_inflight);
+
+	if (force_key && _m2m_encoder_force_key(enc) < 0) {
+		goto error;
+	}
+
+	// Таймстамп - это ключ для поиска исходного фрейма, он должен быть уникальным
+	u64 ts = us_get_now_monotonic_u64();
+	if (ts <= run->last_ts) {
+		ts = run->last_ts + 1;
+	}
+	run->last_ts = ts;
+
+	struct v4l2_buffer input_buf = {0};
+	struct v4l2_plane input_plane = {0};
+	input_buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	input_buf.index = index;
+	input_buf.length = 1;
+	input_buf.m.planes = &input_plane;
+	input_buf.timestamp.tv_sec = ts / 1000000;
+	input_buf.timestamp.tv_usec = ts % 1000000;
+	input_plane.bytesused = input->used;
+	input_plane.length = input->used;
+	if (run->p_dma) {
+		input_buf.memory = V4L2_MEMORY_DMABUF;
+		input_buf.field = V4L2_FIELD_NONE;
+		input_plane.m.fd = src->dma_fd;
+	} else {
+		input_buf.memory = V4L2_MEMORY_MMAP;
+		switch (_m2m_encoder_fill_input(enc, src, input, index)) {
+			case 0: break;
+			case US_ERROR_NO_DATA: goto release; // Буфер не отправлен и остается свободным
+			default: goto error;
+		}
+	}
+
+	const char *input_name = (run->p_dma ? "INPUT-DMA" : "INPUT");
+	_LOG_DEBUG("Sending %s buffer=%u ...", input_name, index);
+	_E_XIOCTL(VIDIOC_QBUF, &input_buf, "Can't send %s buffer=%u", input_name, index);
+
+	item->used = true;
+	item->input_released = false;
+	item->output_done = false;
+	item->ts = ts;
+	US_FRAME_COPY_META(input, &item->meta);
+	item->meta.encode_begin_ts = us_get_now_monotonic();
+	item->release = release;
+	item->opaque = opaque;
+	++run->n_inflight;
+
+	if (!run->p_dma) {
+		// Данные уже скопированы, исходный фрейм больше не нужен
+		_m2m_inflight_release_input(item);
+	}
+
+	run->last_online = src->online;
+	run->last_encode_ts = item->meta.encode_begin_ts;
+	return 0;
+
+error:
+	_m2m_encoder_cleanup(enc);
+	_LOG_ERROR("Encoder destroyed due an error (submit)");
+release:
+	if (release != NULL) {
+		release(opaque);
+	}
+	return -1;
+}
+
+int us_m2m_encoder_reap(us_m2m_encoder_s *enc, us_frame_s *dest) {
+	us_m2m_encoder_runtime_s *const run = enc->run;
+
+	assert(enc->inflight > 1);
+
+	if (!run->ready || run->n_inflight == 0) {
+		return US_ERROR_NO_DATA;
+	}
+
+	// Сначала возвращаем использованные исходные буферы: для DMA это буферы захвата
+	while (true) {
+		struct v4l2_buffer input_buf = {0};
+		struct v4l2_plane input_plane = {0};
+		input_buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+		input_buf.memory = (run->p_dma ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP);
+		input_buf.length = 1;
+		input_buf.m.planes = &input_plane;
+		if (us_xioctl(run->fd, VIDIOC_DQBUF, &input_buf) < 0) {
+			if (errno == EAGAIN) {
+				break;
+			}
+			_LOG_PERROR("Can't release INPUT buffer");
+			goto error;
+		}
+		if (input_buf.index >= US_M2M_MAX_INFLIGHT || !run->inflight[input_buf.index].used) {
+			_LOG_ERROR("V4L2 error: released unknown INPUT buffer=%u", input_buf.index);
+			goto error;
+		}
+		_LOG_DEBUG("Released INPUT buffer=%u", input_buf.index);
+		us_m2m_inflight_s *const item = &run->inflight[input_buf.index];
+		_m2m_inflight_release_input(item);
+		item->input_released = true;
+		_m2m_inflight_finish(enc, item);
+	}
+
+	while (true) {
+		struct v4l2_buffer output_buf = {0};
+		struct v4l2_plane output_plane = {0};
+		output_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		output_buf.memory = V4L2_MEMORY_MMAP;
+		output_buf.length = 1;
+		output_buf.m.planes = &output_plane;
+		if (us_xioctl(run->fd, VIDIOC_DQBUF, &output_buf) < 0) {
+			if (errno == EAGAIN) {
+				break;
+			}
+			_LOG_PERROR("Can't fetch OUTPUT buffer");
+			goto error;
+		}
+
+		const u64 ts = (u64)output_buf.timestamp.tv_sec * 1000000 + output_buf.timestamp.tv_usec;
+		us_m2m_inflight_s *item = NULL;
+		for (uint index = 0; index < US_M2M_MAX_INFLIGHT; ++index) {
+			us_m2m_inflight_s *const other = &run->inflight[index];
+			if (other->used && !other->output_done) {
+				if (other->ts == ts) {
+					item = other;
+				}
+			}
+		}
+
+		if (item != NULL) {
+			US_FRAME_COPY_META(&item->meta, dest);
+			dest->format = V4L2_PIX_FMT_H264;
+			dest->stride = 0;
+			us_frame_set_data(dest, run->output_bufs[output_buf.index].data, output_plane.bytesused);
+			dest->key = output_buf.flags & V4L2_BUF_FLAG_KEYFRAME;
+			dest->gop = enc->gop;
+		} else {
+			// См. синхронный режим: первый буфер может быть мусором без таймстампа
+			_LOG_DEBUG("Skipping OUTPUT buffer=%u with unknown timestamp", output_buf.index);
+		}
+
+		_LOG_DEBUG("Releasing OUTPUT buffer=%u ...", output_buf.index);
+		_E_XIOCTL(VIDIOC_QBUF, &output_buf, "Can't release OUTPUT buffer=%u", output_buf.index);
+
+		if (item != NULL) {
+			// Енкодер может пропустить фрейм, тогда более старые никогда не будут готовы
+			for (uint index = 0; index < US_M2M_MAX_INFLIGHT; ++index) {
+				us_m2m_inflight_s *const other = &run->inflight[index];
+				if (other->used && !other->output_done && other->ts < item->ts) {
+					_LOG_VERBOSE("Frame ts=%llu is dropped by the encoder", (ull)other->ts);
+					other->output_done = true;
+					_m2m_inflight_finish(enc, other);
+				}
+			}
+			item->output_done = true;
+			_m2m_inflight_finish(enc, item);
+
+			us_frame_encoding_end(dest);
+			_LOG_VERBOSE("Compressed new frame: size=%zu, time=%0.3Lf, inflight=%u",
+				dest->used, dest->encode_end_ts - dest->encode_begin_ts, run->n_inflight);
+			return 0;
+		}
+	}
+
+	// https://github.com/pikvm/ustreamer/issues/253
+	// За секунду точно должно закодироваться.
+	for (uint index = 0; index < US_M2M_MAX_INFLIGHT; ++index) {
+		const us_m2m_inflight_s *const item = &run->inflight[index];
+		if (item->used && item->meta.encode_begin_ts + 1 < us_get_now_monotonic()) {
+			_LOG_ERROR("Waiting for the encoder is too long");
+			goto error;
+		}
+	}
+	return US_ERROR_NO_DATA;
+
+error:
+	_m2m_encoder_cleanup(enc);
+	_LOG_ERROR("Encoder destroyed due an error (reap)");
+	return -1;
+}
+
+bool us_m2m_encoder_is_full(const us_m2m_encoder_s *enc) {
+	const us_m2m_encoder_runtime_s *const run = enc->run;
+	return (run->ready && run->n_inflight >= US_MIN(enc->inflight, run->n_input_bufs));
+}
+
+int us_m2m_encoder_get_poll_fd(const us_m2m_encoder_s *enc) {
+	const us_m2m_encoder_runtime_s *const run = enc->run;
+	return (run->ready && run->n_inflight > 0 ? run->fd : -1);
+}
+
+void us_m2m_encoder_flush(us_m2m_encoder_s *enc) {
+	if (enc->run->n_inflight > 0) {
+		_LOG_INFO("Dropping %u frames in flight ...", enc->run->n_inflight);
+		_m2m_encoder_cleanup(enc);
+	}
+}
+
 static us_m2m_encoder_s *_m2m_encoder_init(
 	const char *name, const char *path, uint output_format,
 	uint bitrate, uint gop, uint quality, bool allow_dma) {
@@ -147,6 +411,7 @@ static us_m2m_encoder_s *_m2m_encoder_init(
 	US_CALLOC(run, 1);
 	run->last_online = -1;
 	run->fd = -1;
+	run->held_input = -1;
 
 	us_m2m_encoder_s *enc;
 	US_CALLOC(enc, 1);
@@ -161,17 +426,11 @@ static us_m2m_encoder_s *_m2m_encoder_init(
 	enc->gop = gop;
 	enc->quality = quality;
 	enc->allow_dma = allow_dma;
+	enc->inflight = 1;
 	enc->run = run;
 	return enc;
 }
 
-#define _E_XIOCTL(x_request, x_value, x_msg, ...) { \
-		if (us_xioctl(run->fd, x_request, x_value) < 0) { \
-			_LOG_PERROR(x_msg, ##__VA_ARGS__); \
-			goto error; \
-		} \
-	}
-
 static void _m2m_encoder_ensure(us_m2m_encoder_s *enc, const us_frame_s *frame) {
 	us_m2m_encoder_runtime_s *const run = enc->run;
 
@@ -204,7 +463,8 @@ static void _m2m_encoder_ensure(us_m2m_encoder_s *enc, const us_frame_s *frame)
 	run->p_dma = dma;
 
 	_LOG_DEBUG("Opening encoder device ...");
-	if ((run->fd = open(enc->path, O_RDWR)) < 0) {
+	// В конвейерном режиме ввод и вывод разбираются по готовности, без блокировок на DQBUF
+	if ((run->fd = open(enc->path, O_RDWR | (enc->inflight > 1 ? O_NONBLOCK : 0))) < 0) {
 		_LOG_PERROR("Can't open encoder device");
 		goto error;
 	}
@@ -277,6 +537,7 @@ static void _m2m_encoder_ensure(us_m2m_encoder_s *enc, const us_frame_s *frame)
 	}
 
 	if (run->p_width * run->p_height <= 1280 * 720) {
+		// Конвейерный режим тоже не поднимает лимит для больших кадров: это не проверено на железе.
 		// H264 требует каких-то лимитов. Больше 30 не поддерживается, а при 0
 		// через какое-то время начинает производить некорректные фреймы.
 		// Если же привысить fps, то резко увеличивается время кодирования.
@@ -338,7 +599,7 @@ static int _m2m_encoder_init_buffers(
 	_LOG_DEBUG("Initializing %s buffers ...", name);
 
 	struct v4l2_requestbuffers req = {0};
-	req.count = 1;
+	req.count = enc->inflight;
 	req.type = type;
 	req.memory = (dma ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP);
 
@@ -380,6 +641,10 @@ static int _m2m_encoder_init_buffers(
 		assert((*bufs_ptr)[*n_bufs_ptr].data != NULL);
 		(*bufs_ptr)[*n_bufs_ptr].allocated = plane.length;
 
+		if (enc->inflight > 1 && type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+			continue; // The pipelined INPUT buffers are queued only with the frames
+		}
+
 		_LOG_DEBUG("Queuing %s buffer=%u ...", name, *n_bufs_ptr);
 		_E_XIOCTL(VIDIOC_QBUF, &buf, "Can't queue %s buffer=%u", name, *n_bufs_ptr);
 	}
@@ -409,6 +674,17 @@ static void _m2m_encoder_cleanup(us_m2m_encoder_s *enc) {
 #		undef STOP_STREAM
 	}
 
+	// После STREAMOFF енкодер уже не читает исходные буферы
+	for (uint index = 0; index < US_M2M_MAX_INFLIGHT; ++index) {
+		us_m2m_inflight_s *const item = &run->inflight[index];
+		if (item->used) {
+			_m2m_inflight_release_input(item);
+			item->used = false;
+		}
+	}
+	run->n_inflight = 0;
+	run->held_input = -1;
+
 #	define DELETE_BUFFERS(x_name, x_target) { \
 		if (run->x_target##_bufs != NULL) { \
 			say = true; \
@@ -444,17 +720,56 @@ static void _m2m_encoder_cleanup(us_m2m_encoder_s *enc) {
 	}
 }
 
-static int _m2m_encoder_compress_raw(us_m2m_encoder_s *enc, const us_frame_s *src, us_frame_s *dest, bool force_key) {
+static const us_frame_s *_m2m_encoder_get_input(const us_m2m_encoder_s *enc, const us_frame_s *src, us_frame_s *unjpeg) {
+	// MJPEG енкодер H264 не принимает, поэтому он декодируется программно прямо в INPUT-буфер
+	// в планарный YUV420, без промежуточного фрейма. Здесь только метаданные этого буфера.
+	if (enc->output_format != V4L2_PIX_FMT_H264 || !us_is_jpeg(src->format)) {
+		return src;
+	}
+	US_FRAME_COPY_META(src, unjpeg);
+	unjpeg->data = NULL;
+	unjpeg->allocated = 0;
+	unjpeg->dma_fd = -1;
+	unjpeg->format = V4L2_PIX_FMT_YUV420;
+	unjpeg->width = src->width & ~1u;
+	unjpeg->height = src->height & ~1u;
+	unjpeg->stride = unjpeg->width;
+	unjpeg->used = unjpeg->stride * unjpeg->height * 3 / 2;
+	return unjpeg;
+}
+
+static int _m2m_encoder_fill_input(us_m2m_encoder_s *enc, const us_frame_s *src, const us_frame_s *input, uint index) {
+	const us_m2m_buffer_s *const buf = &enc->run->input_bufs[index];
+	if (buf->allocated < input->used) {
+		_LOG_ERROR("Too big frame for INPUT buffer=%u: %zu > %zu", index, input->used, buf->allocated);
+		return -1;
+	}
+
+	if (input == src) {
+		memcpy(buf->data, src->data, src->used);
+		return 0;
+	}
+
+	const uint c_stride = input->stride / 2;
+	u8 *const u_plane = buf->data + input->stride * input->height;
+	u8 *const planes[3] = {buf->data, u_plane, u_plane + c_stride * (input->height / 2)};
+	const uint strides[3] = {input->stride, c_stride, c_stride};
+	if (us_unjpeg_yuv420(src, planes, strides, input->width, input->height) < 0) {
+		return US_ERROR_NO_DATA;
+	}
+	return 0;
+}
+
+static int _m2m_encoder_compress_raw(
+	us_m2m_encoder_s *enc, const us_frame_s *src, const us_frame_s *input,
+	us_frame_s *dest, bool force_key) {
+
 	us_m2m_encoder_runtime_s *const run = enc->run;
 
 	assert(run->ready);
 
-	if (force_key) {
-		struct v4l2_control ctl = {0};
-		ctl.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
-		ctl.value = 1;
-		_LOG_DEBUG("Forcing keyframe ...")
-		_E_XIOCTL(VIDIOC_S_CTRL, &ctl, "Can't force keyframe");
+	if (force_key && _m2m_encoder_force_key(enc) < 0) {
+		goto error;
 	}
 
 	struct v4l2_buffer input_buf = {0};
@@ -471,12 +786,18 @@ static int _m2m_encoder_compress_raw(us_m2m_encoder_s *enc, const us_frame_s *sr
 		_LOG_DEBUG("Using INPUT-DMA buffer=%u", input_buf.index);
 	} else {
 		input_buf.memory = V4L2_MEMORY_MMAP;
-		_LOG_DEBUG("Grabbing INPUT buffer ...");
-		_E_XIOCTL(VIDIOC_DQBUF, &input_buf, "Can't grab INPUT buffer");
-		if (input_buf.index >= run->n_input_bufs) {
-			_LOG_ERROR("V4L2 error: grabbed invalid INPUT: buffer=%u, n_bufs=%u",
-				input_buf.index, run->n_input_bufs);
-			goto error;
+		if (run->held_input >= 0) {
+			// Буфер остался у нас после битого исходного фрейма
+			input_buf.index = run->held_input;
+			run->held_input = -1;
+		} else {
+			_LOG_DEBUG("Grabbing INPUT buffer ...");
+			_E_XIOCTL(VIDIOC_DQBUF, &input_buf, "Can't grab INPUT buffer");
+			if (input_buf.index >= run->n_input_bufs) {
+				_LOG_ERROR("V4L2 error: grabbed invalid INPUT: buffer=%u, n_bufs=%u",
+					input_buf.index, run->n_input_bufs);
+				goto error;
+			}
 		}
 		_LOG_DEBUG("Grabbed INPUT buffer=%u", input_buf.index);
 	}
@@ -489,10 +810,16 @@ static int _m2m_encoder_compress_raw(us_m2m_encoder_s *enc, const us_frame_s *sr
 
 	input_buf.timestamp.tv_sec = ts.tv_sec;
 	input_buf.timestamp.tv_usec = ts.tv_usec;
-	input_plane.bytesused = src->used;
-	input_plane.length = src->used;
+	input_plane.bytesused = input->used;
+	input_plane.length = input->used;
 	if (!run->p_dma) {
-		memcpy(run->input_bufs[input_buf.index].data, src->data, src->used);
+		const int filled = _m2m_encoder_fill_input(enc, src, input, input_buf.index);
+		if (filled == US_ERROR_NO_DATA) {
+			run->held_input = input_buf.index;
+			return US_ERROR_NO_DATA;
+		} else if (filled < 0) {
+			goto error;
+		}
 	}
 
 	const char *input_name = (run->p_dma ? "INPUT-DMA" : "INPUT");
@@ -564,4 +891,53 @@ error: // Mostly for _E_XIOCTL
 	return -1;
 }
 
+static int _m2m_encoder_compress_pipelined(us_m2m_encoder_s *enc, const us_frame_s *src, us_frame_s *dest, bool force_key) {
+	// Синхронное сжатие на конвейере, например для заглушки.
+	// Чужих фреймов в этот момент в енкодере нет, поток H264 сбрасывает их при выходе.
+	us_m2m_encoder_flush(enc);
+	if (us_m2m_encoder_submit(enc, src, force_key, NULL, NULL) < 0) {
+		return -1;
+	}
+	while (true) {
+		struct pollfd enc_poll = {enc->run->fd, POLLIN | POLLOUT, 0};
+		if (poll(&enc_poll, 1, 100) < 0 && errno != EINTR) {
+			_LOG_PERROR("Can't poll encoder");
+			_m2m_encoder_cleanup(enc);
+			return -1;
+		}
+		const int retval = us_m2m_encoder_reap(enc, dest);
+		if (retval != US_ERROR_NO_DATA) {
+			return retval; // Compressed or failed
+		}
+	}
+}
+
+static int _m2m_encoder_force_key(us_m2m_encoder_s *enc) {
+	us_m2m_encoder_runtime_s *const run = enc->run;
+	struct v4l2_control ctl = {0};
+	ctl.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
+	ctl.value = 1;
+	_LOG_DEBUG("Forcing keyframe ...")
+	_E_XIOCTL(VIDIOC_S_CTRL, &ctl, "Can't force keyframe");
+	return 0;
+error:
+	return -1;
+}
+
+static void _m2m_inflight_release_input(us_m2m_inflight_s *item) {
+	if (item->release != NULL) {
+		item->release(item->opaque);
+		item->release = NULL;
+		item->opaque = NULL;
+	}
+}
+
+static void _m2m_inflight_finish(us_m2m_encoder_s *enc, us_m2m_inflight_s *item) {
+	if (item->used && item->input_released && item->output_done) {
+		item->used = false;
+		assert(enc->run->n_inflight > 0);
+		--enc->run->n_inflight;
+	}
+}
+
 #undef _E_XIOCTL
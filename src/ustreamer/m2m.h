@@ -26,11 +26,26 @@
 #include "../libs/frame.h"
 
 
+#define US_M2M_MAX_INFLIGHT 4
+
+
+typedef void (*us_m2m_release_f)(void *opaque);
+
 typedef struct {
 	u8	*data;
 	uz	allocated;
 } us_m2m_buffer_s;
 
+typedef struct {
+	bool				used;
+	bool				input_released;
+	bool				output_done;
+	u64					ts; // The V4L2 timestamp to match the output with the input
+	us_frame_s			meta; // Only the metadata of the source frame
+	us_m2m_release_f	release; // Called when the encoder doesn't need the source anymore
+	void				*opaque;
+} us_m2m_inflight_s;
+
 typedef struct {
 	int				fd;
 	uint			fps_limit;
@@ -46,8 +61,13 @@ typedef struct {
 	bool	p_dma;
 
 	bool	ready;
+	int		held_input; // The sync INPUT buffer is not sent due to a broken source frame
 	int		last_online;
 	ldf		last_encode_ts;
+
+	us_m2m_inflight_s	inflight[US_M2M_MAX_INFLIGHT];
+	uint				n_inflight;
+	u64					last_ts;
 } us_m2m_encoder_runtime_s;
 
 typedef struct {
@@ -58,14 +78,21 @@ typedef struct {
 	uint	gop;
 	uint	quality;
 	bool	allow_dma;
+	uint	inflight; // Max frames in the encoder, 1 means the synchronous mode
 
 	us_m2m_encoder_runtime_s *run;
 } us_m2m_encoder_s;
 
 
-us_m2m_encoder_s *us_m2m_h264_encoder_init(const char *name, const char *path, uint bitrate, uint gop);
+us_m2m_encoder_s *us_m2m_h264_encoder_init(const char *name, const char *path, uint bitrate, uint gop, uint inflight);
 us_m2m_encoder_s *us_m2m_mjpeg_encoder_init(const char *name, const char *path, uint quality);
 us_m2m_encoder_s *us_m2m_jpeg_encoder_init(const char *name, const char *path, uint quality);
 void us_m2m_encoder_destroy(us_m2m_encoder_s *enc);
 
 int us_m2m_encoder_compress(us_m2m_encoder_s *enc, const us_frame_s *src, us_frame_s *dest, bool force_key);
+
+int us_m2m_encoder_submit(us_m2m_encoder_s *enc, const us_frame_s *src, bool force_key, us_m2m_release_f release, void *opaque);
+int us_m2m_encoder_reap(us_m2m_encoder_s *enc, us_frame_s *dest);
+bool us_m2m_encoder_is_full(const us_m2m_encoder_s *enc);
+int us_m2m_encoder_get_poll_fd(const us_m2m_encoder_s *enc);
+void us_m2m_encoder_flush(us_m2m_encoder_s *enc);
@@ -64,6 +64,9 @@ enum _US_OPT_VALUES {
 	_O_DEVICE_ERROR_DELAY,
 	_O_FORMAT_SWAP_RGB,
 	_O_M2M_DEVICE,
+	_O_ENCODER_STRIPES,
+	_O_SKIP_UNCHANGED_FRAMES,
+	_O_STREAM_SCALES,
 
 	_O_IMAGE_DEFAULT,
 	_O_BRIGHTNESS,
@@ -87,6 +90,9 @@ enum _US_OPT_VALUES {
 	_O_INSTANCE_ID,
 	_O_TCP_NODELAY,
 	_O_SERVER_TIMEOUT,
+	_O_SERVER_THREADS,
+	_O_CLIENT_QUEUE_LIMIT,
+	_O_SNAPSHOT_CACHE,
 
 #	define ADD_SINK(x_prefix) \
 		_O_##x_prefix, \
@@ -97,9 +103,16 @@ enum _US_OPT_VALUES {
 	ADD_SINK(JPEG_SINK)
 	ADD_SINK(RAW_SINK)
 	ADD_SINK(H264_SINK)
+	_O_JPEG_SINK_CROP,
+	_O_RAW_FDSINK,
+	_O_RAW_FDSINK_MODE,
+	_O_RAW_FDSINK_RM,
 	_O_H264_BITRATE,
 	_O_H264_GOP,
+	_O_H264_ENCODER,
 	_O_H264_M2M_DEVICE,
+	_O_H264_M2M_INFLIGHT,
+	_O_H264_HTTP,
 #	undef ADD_SINK
 
 #	ifdef WITH_V4P
@@ -158,6 +171,9 @@ static const struct option _LONG_OPTS[] = {
 	{"device-timeout",			required_argument,	NULL,	_O_DEVICE_TIMEOUT},
 	{"device-error-delay",		required_argument,	NULL,	_O_DEVICE_ERROR_DELAY},
 	{"m2m-device",				required_argument,	NULL,	_O_M2M_DEVICE},
+	{"encoder-stripes",			required_argument,	NULL,	_O_ENCODER_STRIPES},
+	{"skip-unchanged-frames",	no_argument,		NULL,	_O_SKIP_UNCHANGED_FRAMES},
+	{"stream-scales",			required_argument,	NULL,	_O_STREAM_SCALES},
 
 	{"image-default",			no_argument,		NULL,	_O_IMAGE_DEFAULT},
 	{"brightness",				required_argument,	NULL,	_O_BRIGHTNESS},
@@ -191,6 +207,9 @@ static const struct option _LONG_OPTS[] = {
 	{"fake-resolution",			required_argument,	NULL,	_O_FAKE_RESOLUTION},
 	{"tcp-nodelay",				no_argument,		NULL,	_O_TCP_NODELAY},
 	{"server-timeout",			required_argument,	NULL,	_O_SERVER_TIMEOUT},
+	{"server-threads",			required_argument,	NULL,	_O_SERVER_THREADS},
+	{"client-queue-limit",		required_argument,	NULL,	_O_CLIENT_QUEUE_LIMIT},
+	{"snapshot-cache",			required_argument,	NULL,	_O_SNAPSHOT_CACHE},
 
 #	define ADD_SINK(x_opt, x_prefix) \
 		{x_opt "-sink",				required_argument,	NULL,	_O_##x_prefix}, \
@@ -202,10 +221,17 @@ static const struct option _LONG_OPTS[] = {
 	ADD_SINK("raw", RAW_SINK)
 	ADD_SINK("h264", H264_SINK)
 #	undef ADD_SINK
+	{"jpeg-sink-crop",			required_argument,	NULL,	_O_JPEG_SINK_CROP},
+	{"raw-fdsink",				required_argument,	NULL,	_O_RAW_FDSINK},
+	{"raw-fdsink-mode",			required_argument,	NULL,	_O_RAW_FDSINK_MODE},
+	{"raw-fdsink-rm",			no_argument,		NULL,	_O_RAW_FDSINK_RM},
 	// Extra opts for H.264
 	{"h264-bitrate",			required_argument,	NULL,	_O_H264_BITRATE},
 	{"h264-gop",				required_argument,	NULL,	_O_H264_GOP},
+	{"h264-encoder",			required_argument,	NULL,	_O_H264_ENCODER},
 	{"h264-m2m-device",			required_argument,	NULL,	_O_H264_M2M_DEVICE},
+	{"h264-m2m-inflight",		required_argument,	NULL,	_O_H264_M2M_INFLIGHT},
+	{"h264-http",				no_argument,		NULL,	_O_H264_HTTP},
 	// Compatibility
 	{"sink",					required_argument,	NULL,	_O_JPEG_SINK},
 	{"sink-mode",				required_argument,	NULL,	_O_JPEG_SINK_MODE},
@@ -251,6 +277,7 @@ static const struct option _LONG_OPTS[] = {
 
 
 static int _parse_resolution(const char *str, unsigned *width, unsigned *height, bool limited);
+static int _parse_scales(const char *str, unsigned *scales, unsigned *n_scales);
 static int _check_instance_id(const char *str);
 
 static void _features(void);
@@ -273,6 +300,7 @@ us_options_s *us_options_init(unsigned argc, char *argv[]) {
 void us_options_destroy(us_options_s *options) {
 	US_DELETE(options->jpeg_sink, us_memsink_destroy);
 	US_DELETE(options->raw_sink, us_memsink_destroy);
+	US_DELETE(options->raw_fdsink, us_fdsink_destroy);
 	US_DELETE(options->h264_sink, us_memsink_destroy);
 #	ifdef WITH_V4P
 	US_DELETE(options->drm, us_drm_destroy);
@@ -366,6 +394,9 @@ int options_parse(us_options_s *options, us_capture_s *cap, us_encoder_s *enc, u
 	ADD_SINK(raw_sink);
 	ADD_SINK(h264_sink);
 #	undef ADD_SINK
+	const char *raw_fdsink_path = NULL;
+	mode_t raw_fdsink_mode = 0660;
+	bool raw_fdsink_rm = false;
 
 #	ifdef WITH_SETPROCTITLE
 	const char *process_name_prefix = NULL;
@@ -402,6 +433,15 @@ int options_parse(us_options_s *options, us_capture_s *cap, us_encoder_s *enc, u
 			case _O_DEVICE_TIMEOUT:		OPT_NUMBER("--device-timeout", cap->timeout, 1, 60, 0);
 			case _O_DEVICE_ERROR_DELAY:	OPT_NUMBER("--device-error-delay", stream->error_delay, 1, 60, 0);
 			case _O_M2M_DEVICE:			OPT_SET(enc->m2m_path, optarg);
+			case _O_ENCODER_STRIPES:	OPT_NUMBER("--encoder-stripes", enc->n_stripes, 0, 64, 0);
+			case _O_SKIP_UNCHANGED_FRAMES:	OPT_SET(stream->skip_unchanged, true);
+			case _O_STREAM_SCALES:
+				if (_parse_scales(optarg, stream->scales, &stream->n_scales) < 0) {
+					printf("Invalid value for '--stream-scales=%s': up to %u unique factors of 2, 4 or 8\n",
+						optarg, US_STREAM_MAX_SCALES);
+					return -1;
+				}
+				break;
 
 			case _O_IMAGE_DEFAULT:
 				OPT_CTL_DEFAULT_NOBREAK(brightness);
@@ -455,6 +495,9 @@ int options_parse(us_options_s *options, us_capture_s *cap, us_encoder_s *enc, u
 				break;
 			case _O_TCP_NODELAY:		OPT_SET(server->tcp_nodelay, true);
 			case _O_SERVER_TIMEOUT:		OPT_NUMBER("--server-timeout", server->timeout, 1, 60, 0);
+			case _O_SERVER_THREADS:		OPT_NUMBER("--server-threads", server->n_threads, 1, US_SERVER_MAX_THREADS, 0);
+			case _O_CLIENT_QUEUE_LIMIT:	OPT_NUMBER("--client-queue-limit", server->client_queue_limit, 0, 65536, 0);
+			case _O_SNAPSHOT_CACHE:		OPT_NUMBER("--snapshot-cache", server->snapshot_cache, 0, 60000, 0);
 
 #			define ADD_SINK(x_opt, x_lp, x_up) \
 				case _O_##x_up:					OPT_SET(x_lp##_name, optarg); \
@@ -466,9 +509,21 @@ int options_parse(us_options_s *options, us_capture_s *cap, us_encoder_s *enc, u
 			ADD_SINK("raw", raw_sink, RAW_SINK)
 			ADD_SINK("h264", h264_sink, H264_SINK)
 #			undef ADD_SINK
+			case _O_JPEG_SINK_CROP:
+				if (us_scaler_parse_crop(optarg, &stream->jpeg_sink_crop) < 0) {
+					printf("Invalid value for '--jpeg-sink-crop=%s': should be <x,y,width,height>\n", optarg);
+					return -1;
+				}
+				break;
+			case _O_RAW_FDSINK:				OPT_SET(raw_fdsink_path, optarg);
+			case _O_RAW_FDSINK_MODE:		OPT_NUMBER("--raw-fdsink-mode", raw_fdsink_mode, INT_MIN, INT_MAX, 8);
+			case _O_RAW_FDSINK_RM:			OPT_SET(raw_fdsink_rm, true);
 			case _O_H264_BITRATE:			OPT_NUMBER("--h264-bitrate", stream->h264_bitrate, 25, 20000, 0);
 			case _O_H264_GOP:				OPT_NUMBER("--h264-gop", stream->h264_gop, 0, 60, 0);
+			case _O_H264_ENCODER:			OPT_PARSE_ENUM("H264 encoder type", stream->h264_encoder, us_h264_encoder_parse_type, US_H264_ENCODER_TYPES_STR);
 			case _O_H264_M2M_DEVICE:		OPT_SET(stream->h264_m2m_path, optarg);
+			case _O_H264_M2M_INFLIGHT:		OPT_NUMBER("--h264-m2m-inflight", stream->h264_m2m_inflight, 1, US_M2M_MAX_INFLIGHT, 0);
+			case _O_H264_HTTP:				OPT_SET(stream->h264_http, true);
 
 #			ifdef WITH_V4P
 			case _O_V4P:
@@ -535,6 +590,10 @@ int options_parse(us_options_s *options, us_capture_s *cap, us_encoder_s *enc, u
 	ADD_SINK("RAW", raw_sink);
 	ADD_SINK("H264", h264_sink);
 #	undef ADD_SINK
+	if (raw_fdsink_path && raw_fdsink_path[0] != '\0') {
+		options->raw_fdsink = us_fdsink_init("RAW", raw_fdsink_path, true, raw_fdsink_mode, raw_fdsink_rm, 0);
+	}
+	stream->raw_fdsink = options->raw_fdsink;
 
 #	ifdef WITH_SETPROCTITLE
 	if (process_name_prefix != NULL) {
@@ -571,6 +630,31 @@ static int _parse_resolution(const char *str, unsigned *width, unsigned *height,
 	return 0;
 }
 
+static int _parse_scales(const char *str, unsigned *scales, unsigned *n_scales) {
+	unsigned count = 0;
+	for (const char *ptr = str; *ptr != '\0';) {
+		errno = 0;
+		char *end = NULL;
+		const unsigned long factor = strtoul(ptr, &end, 10);
+		if (errno || end == ptr || (*end != '\0' && *end != ',') || !us_scaler_is_valid_factor(factor)) {
+			return -1;
+		}
+		for (unsigned index = 0; index < count; ++index) {
+			if (scales[index] == factor) {
+				return -1;
+			}
+		}
+		if (count >= US_STREAM_MAX_SCALES) {
+			return -1;
+		}
+		scales[count] = factor;
+		++count;
+		ptr = (*end == ',' ? end + 1 : end);
+	}
+	*n_scales = count;
+	return 0;
+}
+
 static int _check_instance_id(const char *str) {
 	for (const char *ptr = str; *ptr; ++ptr) {
 		if (!(isascii(*ptr) && (
@@ -614,6 +698,12 @@ static void _features(void) {
 	puts("- WITH_SYSTEMD");
 #	endif
 
+#	ifdef MK_WITH_X264
+	puts("+ WITH_X264");
+#	else
+	puts("- WITH_X264");
+#	endif
+
 #	ifdef MK_WITH_PTHREAD_NP
 	puts("+ WITH_PTHREAD_NP");
 #	else
@@ -687,6 +777,18 @@ static void _help(FILE *fp, const us_capture_s *cap, const us_encoder_s *enc, co
 	SAY("    --device-error-delay <sec>  ────────── Delay before trying to connect to the device again");
 	SAY("                                           after an error (timeout for example). Default: %u.\n", stream->error_delay);
 	SAY("    --m2m-device </dev/path>  ──────────── Path to V4L2 M2M encoder device. Default: auto select.\n");
+	SAY("    --encoder-stripes <N>  ─────────────── Split each frame into N horizontal stripes and compress them");
+	SAY("                                           in parallel using all workers (CPU encoder only).");
+	SAY("                                           The stripes are joined into a single JPEG with restart markers.");
+	SAY("                                           This reduces the latency of each frame instead of increasing");
+	SAY("                                           the throughput. 0 or 1 means per-frame parallelism. Default: %u.\n", enc->n_stripes);
+	SAY("    --skip-unchanged-frames  ───────────── Hash the captured frames before encoding and don't encode");
+	SAY("                                           the unchanged ones, the previous JPEG is repeated instead.");
+	SAY("                                           Useful for mostly static images like KVM consoles. Default: disabled.\n");
+	SAY("    --stream-scales <N,...>  ───────────── Also provide the downscaled streams from the same captured frames,");
+	SAY("                                           available as /stream?scale=N. Each factor is 2, 4 or 8, up to %u.", US_STREAM_MAX_SCALES);
+	SAY("                                           Every scaled stream is encoded by CPU only when it has clients.");
+	SAY("                                           MJPEG is downscaled by libjpeg while decoding. Default: disabled.\n");
 	SAY("Image control options:");
 	SAY("══════════════════════");
 	SAY("    --image-default  ────────────────────── Reset all image settings below to default. Default: no change.\n");
@@ -723,12 +825,21 @@ static void _help(FILE *fp, const us_capture_s *cap, const us_encoder_s *enc, co
 	SAY("                                  the CPU loading. Don't use this option with analog signal sources");
 	SAY("                                  or webcams, it's useless. Default: disabled.\n");
 	SAY("    -R|--fake-resolution <WxH>  ─ Override image resolution for the /state. Default: disabled.\n");
-	SAY("    --tcp-nodelay  ────────────── Set TCP_NODELAY flag to the client /stream socket. Only for TCP socket.");
+	SAY("    --tcp-nodelay  ────────────── Set TCP_NODELAY flag to the client /stream and static files socket. Only for TCP socket.");
 	SAY("                                  Default: disabled.\n");
 	SAY("    --allow-origin <str>  ─────── Set Access-Control-Allow-Origin header. Default: disabled.\n");
 	SAY("    --instance-id <str>  ──────── A short string identifier to be displayed in the /state handle.");
 	SAY("                                  It must satisfy regexp ^[a-zA-Z0-9\\./+_-]*$. Default: an empty string.\n");
 	SAY("    --server-timeout <sec>  ───── Timeout for client connections. Default: %u.\n", server->timeout);
+	SAY("    --server-threads <N>  ─────── Number of HTTP event loops in separate threads. The clients are spread");
+	SAY("                                  between the loops using SO_REUSEPORT listeners for TCP or a shared");
+	SAY("                                  socket for UNIX and systemd. Default: %u.\n", server->n_threads);
+	SAY("    --client-queue-limit <KiB>  ─ Skip /stream frames for a client while its unsent data (including");
+	SAY("                                  the socket buffer) exceeds this limit, then send the newest frame.");
+	SAY("                                  Default: %u (disabled, only the previous frame is waited for).\n", server->client_queue_limit);
+	SAY("    --snapshot-cache <ms>  ────── Answer /snapshot immediately with the last JPEG if it's not older than");
+	SAY("                                  this, instead of waiting for a new one to be encoded. The requests");
+	SAY("                                  waiting at the same moment always share one JPEG. Default: %u.\n", server->snapshot_cache);
 #	define ADD_SINK(x_name, x_opt) \
 		SAY(x_name " sink options:"); \
 		SAY("══════════════════"); \
@@ -738,14 +849,32 @@ static void _help(FILE *fp, const us_capture_s *cap, const us_encoder_s *enc, co
 		SAY("    --" x_opt "-sink-mode <mode>  ─────── Set " x_name " sink permissions (like 777). Default: 660.\n"); \
 		SAY("    --" x_opt "-sink-rm  ──────────────── Remove shared memory on stop. Default: disabled.\n"); \
 		SAY("    --" x_opt "-sink-client-ttl <sec>  ── Client TTL. Default: 10.\n"); \
-		SAY("    --" x_opt "-sink-timeout <sec>  ───── Timeout for lock. Default: 1.\n");
+		SAY("    --" x_opt "-sink-timeout <sec>  ───── It doesn't do anything. Still here for compatibility.\n");
 	ADD_SINK("JPEG", "jpeg")
+	SAY("    --jpeg-sink-crop <x,y,w,h>  ──── Sink only this region of the frame, re-encoded as a separate JPEG.");
+	SAY("                                     The same region requested by /stream?crop=x,y,w,h shares the encoding.");
+	SAY("                                     Default: disabled, full frame.\n");
 	ADD_SINK("RAW", "raw")
+	SAY("    --raw-fdsink <path>  ─────────── Pass RAW frames to the clients of this UNIX socket as file descriptors.");
+	SAY("                                     The captured DMABUFs are passed by reference and returned to the device");
+	SAY("                                     when the client releases them, other frames are copied to sealed memfds.");
+	SAY("                                     Each client holds at most one buffer, max %d clients. Default: disabled.\n", US_FDSINK_MAX_CLIENTS);
+	SAY("    --raw-fdsink-mode <mode>  ────── Set RAW fdsink socket permissions (like 777). Default: 660.\n");
+	SAY("    --raw-fdsink-rm  ─────────────── Try to remove old RAW fdsink socket before binding. Default: disabled.\n");
 	ADD_SINK("H264", "h264")
 #	undef ADD_SINK
 	SAY("    --h264-bitrate <kbps>  ───────── H264 bitrate in Kbps. Default: %u.\n", stream->h264_bitrate);
 	SAY("    --h264-gop <N>  ──────────────── Interval between keyframes. Default: %u.\n", stream->h264_gop);
+	SAY("    --h264-encoder <type>  ───────── H264 encoder type. Default: %s.", us_h264_encoder_type_to_string(stream->h264_encoder));
+	SAY("                                     Available:");
+	SAY("                                       * M2M  ── Hardware encoding using V4L2 M2M interface;");
+	SAY("                                       * X264 ── Software encoding using libx264. Required WITH_X264 feature.\n");
 	SAY("    --h264-m2m-device </dev/path>  ─ Path to V4L2 M2M encoder device. Default: auto select.\n");
+	SAY("    --h264-m2m-inflight <N>  ─────── Number of frames queued to M2M encoder at the same time.");
+	SAY("                                     More than 1 helps the encoders with high latency to reach the FPS limit.");
+	SAY("                                     Default: %u, synchronous encoding.\n", stream->h264_m2m_inflight);
+	SAY("    --h264-http  ──────────────────── Serve H264 in fragmented MP4 on /stream.mp4 for the browsers");
+	SAY("                                     and NVRs without WebRTC. Default: disabled.\n");
 #	ifdef WITH_V4P
 	SAY("Passthrough options for PiKVM V4:");
 	SAY("═════════════════════════════════");
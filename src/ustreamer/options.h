@@ -38,6 +38,7 @@
 #include "../libs/process.h"
 #include "../libs/frame.h"
 #include "../libs/memsink.h"
+#include "../libs/fdsink.h"
 #include "../libs/options.h"
 #include "../libs/capture.h"
 #ifdef WITH_V4P
@@ -45,6 +46,9 @@
 #endif
 
 #include "encoder.h"
+#include "m2m.h"
+#include "h264.h"
+#include "scaler.h"
 #include "stream.h"
 #include "http/server.h"
 #ifdef WITH_GPIO
@@ -58,6 +62,7 @@ typedef struct {
 	char			**argv_copy;
 	us_memsink_s	*jpeg_sink;
 	us_memsink_s	*raw_sink;
+	us_fdsink_s		*raw_fdsink;
 	us_memsink_s	*h264_sink;
 #	ifdef WITH_V4P
 	us_drm_s		*drm;
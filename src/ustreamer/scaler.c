@@ -0,0 +1,402 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "scaler.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <linux/videodev2.h>
+
+#include "../libs/types.h"
+#include "../libs/tools.h"
+#include "../libs/frame.h"
+#include "../libs/unjpeg.h"
+
+
+static void _downscale_yuyv(us_scaler_s *sc, const us_frame_s *src, us_frame_s *dest, uint factor);
+static void _downscale_yuv420(us_scaler_s *sc, const us_frame_s *src, us_frame_s *dest, uint factor);
+static void _downscale_rgb565(us_scaler_s *sc, const us_frame_s *src, us_frame_s *dest, uint factor);
+static void _downscale_plane(
+	us_scaler_s *sc, const u8 *src, uz src_stride, u8 *dest, uz dest_stride,
+	uint width, uint height, uint bpp, uint factor);
+static void _crop_yuv420(const us_frame_s *src, us_frame_s *dest, const us_scaler_crop_s *crop);
+
+static u16 *_scaler_get_acc(us_scaler_s *sc, uz size);
+static void _sum_lines(u16 *acc, const u8 *data, uz stride, uz size, uint n_lines);
+static void _add_line(u16 *acc, const u8 *line, uz size);
+static void _reduce_line(const u16 *acc, uint step, uint fx, uint div, u8 *dest, uint dest_step, uint width);
+
+
+us_scaler_s *us_scaler_init(void) {
+	us_scaler_s *sc;
+	US_CALLOC(sc, 1);
+	sc->decoded = us_frame_init();
+	sc->cropped = us_frame_init();
+	return sc;
+}
+
+void us_scaler_destroy(us_scaler_s *sc) {
+	us_frame_destroy(sc->cropped);
+	us_frame_destroy(sc->decoded);
+	free(sc->acc);
+	free(sc->line);
+	free(sc);
+}
+
+bool us_scaler_is_valid_factor(uint factor) {
+	// Только степени двойки: с ними DCT-масштабирование JPEG дает ровно тот же размер
+	return (factor == 2 || factor == 4 || factor == US_SCALER_MAX_FACTOR);
+}
+
+int us_scaler_downscale(us_scaler_s *sc, const us_frame_s *src, us_frame_s *dest, uint factor) {
+	// Box filter: each output pixel is the average of the factor*factor source block.
+	// The loops are simple enough to be vectorized by the compiler.
+	// JPEG is not decoded in the full size, libjpeg scales it using the DCT.
+	assert(us_scaler_is_valid_factor(factor));
+
+	if (us_is_jpeg(src->format)) {
+		return us_unjpeg(src, dest, V4L2_PIX_FMT_YUV420, 1, factor, true);
+	}
+
+	const uint width = (src->width / factor) & ~1u; // Even for YUV420
+	const uint height = (src->height / factor) & ~1u;
+	if (width == 0 || height == 0) {
+		return -1;
+	}
+
+	uint bpp = 0;
+	uz needed;
+	switch (src->format) {
+		case V4L2_PIX_FMT_YUV420:
+		case V4L2_PIX_FMT_YVU420: {
+			const uz y_stride = src->width + us_frame_get_padding(src);
+			needed = y_stride * src->height + (y_stride / 2) * ((src->height + 1) / 2) * 2;
+			break;
+		}
+		case V4L2_PIX_FMT_GREY: bpp = 1; break;
+		case V4L2_PIX_FMT_YUYV:
+		case V4L2_PIX_FMT_YVYU:
+		case V4L2_PIX_FMT_UYVY:
+		case V4L2_PIX_FMT_RGB565: bpp = 2; break;
+		case V4L2_PIX_FMT_RGB24:
+		case V4L2_PIX_FMT_BGR24: bpp = 3; break;
+		default: return -1;
+	}
+	if (bpp > 0) {
+		needed = (src->width * bpp + us_frame_get_padding(src)) * src->height;
+	}
+	if (src->used < needed) {
+		return -1;
+	}
+
+	US_FRAME_COPY_META(src, dest);
+	dest->width = width;
+	dest->height = height;
+
+	switch (src->format) {
+		case V4L2_PIX_FMT_YUYV:
+		case V4L2_PIX_FMT_YVYU:
+		case V4L2_PIX_FMT_UYVY:
+			_downscale_yuyv(sc, src, dest, factor);
+			break;
+		case V4L2_PIX_FMT_YUV420:
+		case V4L2_PIX_FMT_YVU420:
+			_downscale_yuv420(sc, src, dest, factor);
+			break;
+		case V4L2_PIX_FMT_RGB565:
+			_downscale_rgb565(sc, src, dest, factor);
+			break;
+		default: // GREY, RGB24, BGR24: the same format
+			dest->stride = width * bpp;
+			dest->used = dest->stride * height;
+			us_frame_realloc_data(dest, dest->used);
+			_downscale_plane(sc,
+				src->data, src->width * bpp + us_frame_get_padding(src),
+				dest->data, dest->stride, width, height, bpp, factor);
+	}
+	return 0;
+}
+
+int us_scaler_parse_crop(const char *str, us_scaler_crop_s *crop) {
+	// x,y,width,height
+	us_scaler_crop_s tmp;
+	char end;
+	if (sscanf(str, "%u,%u,%u,%u%c", &tmp.x, &tmp.y, &tmp.width, &tmp.height, &end) != 4) {
+		return -1;
+	}
+	if (tmp.width < 2 || tmp.height < 2) {
+		return -1;
+	}
+	*crop = tmp;
+	return 0;
+}
+
+const us_frame_s *us_scaler_crop(us_scaler_s *sc, const us_frame_s *src, us_frame_s *view, const us_scaler_crop_s *crop) {
+	// Упакованные форматы не копируются: view указывает внутрь src, а строки пропускаются
+	// через stride, так же как паддинг (см. us_frame_get_padding()). Планарный YUV420
+	// так не описать, поэтому он копируется в sc->cropped, а JPEG перед этим декодируется.
+	// The rectangle is aligned to even values for the chroma and clipped by the frame.
+	// Returns the cropped frame (view or sc->cropped), or NULL if it's empty.
+
+	if (us_is_jpeg(src->format)) {
+		if (sc->decoded->used == 0 || sc->decoded->grab_ts != src->grab_ts) {
+			sc->decoded->used = 0;
+			if (us_unjpeg(src, sc->decoded, V4L2_PIX_FMT_YUV420, 1, 1, true) < 0) {
+				return NULL;
+			}
+		}
+		src = sc->decoded;
+	}
+
+	const uint x = crop->x & ~1u;
+	const uint y = crop->y & ~1u;
+	if (x >= src->width || y >= src->height) {
+		return NULL;
+	}
+	const uint width = US_MIN(crop->width, src->width - x) & ~1u;
+	const uint height = US_MIN(crop->height, src->height - y) & ~1u;
+	if (width == 0 || height == 0) {
+		return NULL;
+	}
+	const us_scaler_crop_s aligned = {.x = x, .y = y, .width = width, .height = height};
+
+	uint bpp;
+	switch (src->format) {
+		case V4L2_PIX_FMT_YUV420:
+		case V4L2_PIX_FMT_YVU420: {
+			const uz y_stride = src->width + us_frame_get_padding(src);
+			if (src->used < y_stride * src->height + (y_stride / 2) * ((src->height + 1) / 2) * 2) {
+				return NULL;
+			}
+			_crop_yuv420(src, sc->cropped, &aligned);
+			return sc->cropped;
+		}
+		case V4L2_PIX_FMT_GREY: bpp = 1; break;
+		case V4L2_PIX_FMT_YUYV:
+		case V4L2_PIX_FMT_YVYU:
+		case V4L2_PIX_FMT_UYVY:
+		case V4L2_PIX_FMT_RGB565: bpp = 2; break;
+		case V4L2_PIX_FMT_RGB24:
+		case V4L2_PIX_FMT_BGR24: bpp = 3; break;
+		default: return NULL;
+	}
+
+	const uz stride = src->width * bpp + us_frame_get_padding(src);
+	if (src->used < stride * src->height) {
+		return NULL;
+	}
+	US_MEMSET_ZERO(*view);
+	US_FRAME_COPY_META(src, view);
+	view->data = src->data + stride * y + x * bpp;
+	view->used = stride * (height - 1) + width * bpp; // The last line has no padding
+	view->dma_fd = -1;
+	view->width = width;
+	view->height = height;
+	view->stride = stride;
+	return view;
+}
+
+static void _downscale_yuyv(us_scaler_s *sc, const us_frame_s *src, us_frame_s *dest, uint factor) {
+	uint y_offset = 0;
+	uint u_offset = 1;
+	uint v_offset = 3;
+	switch (src->format) {
+		case V4L2_PIX_FMT_YVYU: u_offset = 3; v_offset = 1; break;
+		case V4L2_PIX_FMT_UYVY: y_offset = 1; u_offset = 0; v_offset = 2; break;
+		default: break;
+	}
+
+	const uint width = dest->width;
+	const uint height = dest->height;
+	dest->format = V4L2_PIX_FMT_YUV420;
+	dest->stride = width;
+	dest->used = width * height * 3 / 2;
+	us_frame_realloc_data(dest, dest->used);
+
+	u8 *const y_data = dest->data;
+	u8 *const u_data = y_data + width * height;
+	u8 *const v_data = u_data + (width / 2) * (height / 2);
+
+	const uz stride = src->width * 2 + us_frame_get_padding(src);
+	const uz size = (uz)width * factor * 2; // The used part of the source line
+	u16 *const acc0 = _scaler_get_acc(sc, size * 2);
+	u16 *const acc1 = acc0 + size;
+
+	// Яркость усредняется по factor строк, а цветность по 2*factor, поэтому строки идут парами
+	for (uint row = 0; row < height; row += 2) {
+		const u8 *const data = src->data + stride * row * factor;
+		_sum_lines(acc0, data, stride, size, factor);
+		_sum_lines(acc1, data + stride * factor, stride, size, factor);
+		_reduce_line(acc0 + y_offset, 2, factor, factor * factor, y_data + width * row, 1, width);
+		_reduce_line(acc1 + y_offset, 2, factor, factor * factor, y_data + width * (row + 1), 1, width);
+
+		for (uz x = 0; x < size; ++x) {
+			acc0[x] += acc1[x];
+		}
+		const uz c_offset = (width / 2) * (row / 2);
+		_reduce_line(acc0 + u_offset, 4, factor, factor * factor * 2, u_data + c_offset, 1, width / 2);
+		_reduce_line(acc0 + v_offset, 4, factor, factor * factor * 2, v_data + c_offset, 1, width / 2);
+	}
+}
+
+static void _downscale_yuv420(us_scaler_s *sc, const us_frame_s *src, us_frame_s *dest, uint factor) {
+	const uz y_stride = src->width + us_frame_get_padding(src);
+	const uz c_stride = y_stride / 2;
+	const u8 *const y_src = src->data;
+	const u8 *u_src = y_src + y_stride * src->height;
+	const u8 *v_src = u_src + c_stride * ((src->height + 1) / 2);
+	if (src->format == V4L2_PIX_FMT_YVU420) {
+		const u8 *const tmp = u_src;
+		u_src = v_src;
+		v_src = tmp;
+	}
+
+	const uint width = dest->width;
+	const uint height = dest->height;
+	dest->format = V4L2_PIX_FMT_YUV420;
+	dest->stride = width;
+	dest->used = width * height * 3 / 2;
+	us_frame_realloc_data(dest, dest->used);
+
+	u8 *const y_data = dest->data;
+	u8 *const u_data = y_data + width * height;
+	u8 *const v_data = u_data + (width / 2) * (height / 2);
+
+	_downscale_plane(sc, y_src, y_stride, y_data, width, width, height, 1, factor);
+	_downscale_plane(sc, u_src, c_stride, u_data, width / 2, width / 2, height / 2, 1, factor);
+	_downscale_plane(sc, v_src, c_stride, v_data, width / 2, width / 2, height / 2, 1, factor);
+}
+
+static void _downscale_rgb565(us_scaler_s *sc, const us_frame_s *src, us_frame_s *dest, uint factor) {
+	const uint width = dest->width;
+	const uint height = dest->height;
+	dest->format = V4L2_PIX_FMT_RGB24;
+	dest->stride = width * 3;
+	dest->used = dest->stride * height;
+	us_frame_realloc_data(dest, dest->used);
+
+	const uz stride = src->width * 2 + us_frame_get_padding(src);
+	const uint line_width = width * factor;
+	const uz size = (uz)line_width * 3;
+	u16 *const acc = _scaler_get_acc(sc, size);
+	if (sc->line_size < size) {
+		US_REALLOC(sc->line, size);
+		sc->line_size = size;
+	}
+
+	for (uint row = 0; row < height; ++row) {
+		memset(acc, 0, size * sizeof(u16));
+		for (uint index = 0; index < factor; ++index) {
+			const u8 *const data = src->data + stride * (row * factor + index);
+			for (uint x = 0; x < line_width; ++x) {
+				const uint pixel = data[x * 2] | (data[x * 2 + 1] << 8);
+				sc->line[x * 3] = (pixel >> 8) & 0xF8;
+				sc->line[x * 3 + 1] = (pixel >> 3) & 0xFC;
+				sc->line[x * 3 + 2] = (pixel << 3) & 0xF8;
+			}
+			_add_line(acc, sc->line, size);
+		}
+		for (uint ch = 0; ch < 3; ++ch) {
+			_reduce_line(acc + ch, 3, factor, factor * factor, dest->data + dest->stride * row + ch, 3, width);
+		}
+	}
+}
+
+static void _downscale_plane(
+	us_scaler_s *sc, const u8 *src, uz src_stride, u8 *dest, uz dest_stride,
+	uint width, uint height, uint bpp, uint factor) {
+
+	const uz size = (uz)width * factor * bpp;
+	u16 *const acc = _scaler_get_acc(sc, size);
+	for (uint row = 0; row < height; ++row) {
+		_sum_lines(acc, src + src_stride * row * factor, src_stride, size, factor);
+		for (uint ch = 0; ch < bpp; ++ch) {
+			_reduce_line(acc + ch, bpp, factor, factor * factor, dest + dest_stride * row + ch, bpp, width);
+		}
+	}
+}
+
+static void _crop_yuv420(const us_frame_s *src, us_frame_s *dest, const us_scaler_crop_s *crop) {
+	const uz y_stride = src->width + us_frame_get_padding(src);
+	const uz c_stride = y_stride / 2;
+	const u8 *const y_src = src->data;
+	const u8 *const u_src = y_src + y_stride * src->height;
+	const u8 *const v_src = u_src + c_stride * ((src->height + 1) / 2);
+
+	const uint width = crop->width;
+	const uint height = crop->height;
+	US_FRAME_COPY_META(src, dest);
+	dest->width = width;
+	dest->height = height;
+	dest->stride = width;
+	dest->used = width * height * 3 / 2;
+	us_frame_realloc_data(dest, dest->used);
+
+	u8 *const y_data = dest->data;
+	u8 *const u_data = y_data + width * height;
+	u8 *const v_data = u_data + (width / 2) * (height / 2);
+
+	for (uint row = 0; row < height; ++row) {
+		memcpy(y_data + width * row, y_src + y_stride * (crop->y + row) + crop->x, width);
+	}
+	for (uint row = 0; row < height / 2; ++row) {
+		const uz offset = c_stride * (crop->y / 2 + row) + crop->x / 2;
+		memcpy(u_data + (width / 2) * row, u_src + offset, width / 2);
+		memcpy(v_data + (width / 2) * row, v_src + offset, width / 2);
+	}
+}
+
+static u16 *_scaler_get_acc(us_scaler_s *sc, uz size) {
+	if (sc->acc_size < size) {
+		US_REALLOC(sc->acc, size);
+		sc->acc_size = size;
+	}
+	return sc->acc;
+}
+
+static void _sum_lines(u16 *acc, const u8 *data, uz stride, uz size, uint n_lines) {
+	// Суммирование вертикальное, по целым строкам: самая тяжелая часть, и она векторизуется.
+	// Не более 2*US_SCALER_MAX_FACTOR строк, так что u16 не переполнится.
+	memset(acc, 0, size * sizeof(u16));
+	for (uint line = 0; line < n_lines; ++line) {
+		_add_line(acc, data + stride * line, size);
+	}
+}
+
+static void _add_line(u16 *acc, const u8 *line, uz size) {
+	for (uz x = 0; x < size; ++x) {
+		acc[x] += line[x];
+	}
+}
+
+static void _reduce_line(const u16 *acc, uint step, uint fx, uint div, u8 *dest, uint dest_step, uint width) {
+	for (uint x = 0; x < width; ++x) {
+		const u16 *const block = acc + (uz)x * fx * step;
+		uint sum = 0;
+		for (uint index = 0; index < fx; ++index) {
+			sum += block[index * step];
+		}
+		dest[x * dest_step] = (sum + div / 2) / div;
+	}
+}
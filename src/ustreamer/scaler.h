@@ -0,0 +1,57 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#pragma once
+
+#include "../libs/types.h"
+#include "../libs/frame.h"
+
+
+#define US_SCALER_MAX_FACTOR 8
+
+
+typedef struct {
+	uint	x;
+	uint	y;
+	uint	width;
+	uint	height;
+} us_scaler_crop_s;
+
+typedef struct {
+	u16		*acc; // Vertical sums of the source lines for one or two output lines
+	uz		acc_size;
+	u8		*line; // Unpacked RGB565 line
+	uz		line_size;
+
+	us_frame_s	*decoded; // The last decoded JPEG for cropping, the same frame is decoded once
+	us_frame_s	*cropped;
+} us_scaler_s;
+
+
+us_scaler_s *us_scaler_init(void);
+void us_scaler_destroy(us_scaler_s *sc);
+
+bool us_scaler_is_valid_factor(uint factor);
+int us_scaler_downscale(us_scaler_s *sc, const us_frame_s *src, us_frame_s *dest, uint factor);
+
+int us_scaler_parse_crop(const char *str, us_scaler_crop_s *crop);
+const us_frame_s *us_scaler_crop(us_scaler_s *sc, const us_frame_s *src, us_frame_s *view, const us_scaler_crop_s *crop);
@@ -23,12 +23,16 @@
 #include "stream.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <stdatomic.h>
 #include <limits.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
 #include <assert.h>
 
+#include <sys/eventfd.h>
+
 #include <pthread.h>
 
 #include "../libs/types.h"
@@ -37,11 +41,11 @@
 #include "../libs/threading.h"
 #include "../libs/process.h"
 #include "../libs/logging.h"
-#include "../libs/ring.h"
 #include "../libs/frame.h"
+#include "../libs/frameref.h"
 #include "../libs/memsink.h"
+#include "../libs/fdsink.h"
 #include "../libs/capture.h"
-#include "../libs/unjpeg.h"
 #include "../libs/fpsi.h"
 #ifdef WITH_V4P
 #	include "../libs/drm/drm.h"
@@ -50,7 +54,9 @@
 #include "blank.h"
 #include "encoder.h"
 #include "workers.h"
-#include "m2m.h"
+#include "h264.h"
+#include "tilehash.h"
+#include "scaler.h"
 #ifdef WITH_GPIO
 #	include "gpio/gpio.h"
 #endif
@@ -67,6 +73,7 @@ typedef struct {
 typedef struct {
 	pthread_t	tid;
 	us_queue_s	*queue;
+	int			notify_fd; // Wakes up the pipelined workers on each new frame, or -1
 	us_stream_s	*stream;
 	atomic_bool	*stop;
 } _worker_context_s;
@@ -76,6 +83,9 @@ static void *_releaser_thread(void *v_ctx);
 static void *_jpeg_thread(void *v_ctx);
 static void *_raw_thread(void *v_ctx);
 static void *_h264_thread(void *v_ctx);
+static void *_h264_pipelined_thread(void *v_ctx);
+static void *_scaled_thread(void *v_ctx);
+static void *_crop_thread(void *v_ctx);
 #ifdef WITH_V4P
 static void *_drm_thread(void *v_ctx);
 #endif
@@ -89,9 +99,27 @@ static void _stream_update_captured_fpsi(us_stream_s *stream, const us_frame_s *
 #ifdef WITH_V4P
 static void _stream_drm_ensure_no_signal(us_stream_s *stream);
 #endif
-static void _stream_expose_jpeg(us_stream_s *stream, const us_frame_s *frame);
+static void _stream_put_jpeg_slots(us_stream_http_s *http, _Atomic(us_frameref_s*) *slots, us_frameref_s *ref);
+static void _stream_expose_jpeg(us_stream_s *stream, us_frameref_s *ref);
+static void _stream_expose_jpeg_copy(us_stream_s *stream, const us_frame_s *frame);
+static void _stream_reexpose_jpeg(us_stream_s *stream, us_frameref_s **ref, const us_frame_s *raw);
 static void _stream_expose_raw(us_stream_s *stream, const us_frame_s *frame);
+static bool _stream_is_h264_enabled(us_stream_s *stream);
+static bool _stream_is_h264_pipelined(us_stream_s *stream);
+static bool _stream_has_h264_clients(us_stream_s *stream);
+static void _stream_prepare_h264(us_stream_s *stream, bool *force_key);
 static void _stream_encode_expose_h264(us_stream_s *stream, const us_frame_s *frame, bool force_key);
+static void _stream_expose_h264(us_stream_s *stream, const us_frame_s *frame);
+static void _stream_release_h264_hw(void *v_hw);
+static void _stream_expose_h264_http(us_stream_s *stream, const us_frame_s *frame);
+static bool _stream_has_scaled_clients(us_stream_s *stream);
+static void _stream_encode_expose_scaled(us_stream_s *stream, const us_frame_s *frame);
+static bool _stream_has_crop_clients(us_stream_s *stream);
+static int _stream_acquire_crop(us_stream_s *stream, const us_scaler_crop_s *crop, bool pin, uint *gen);
+static void _stream_release_crop(us_stream_s *stream, uint index, bool pin);
+static us_memsink_s *_stream_get_full_jpeg_sink(us_stream_s *stream);
+static void _stream_encode_expose_crops(us_stream_s *stream, const us_frame_s *frame);
+static void _stream_expose_crops_copy(us_stream_s *stream, const us_frame_s *frame);
 static void _stream_check_suicide(us_stream_s *stream);
 
 
@@ -102,16 +130,47 @@ us_stream_s *us_stream_init(us_capture_s *cap, us_encoder_s *enc) {
 	http->drm_fpsi = us_fpsi_init("DRM", true);
 #	endif
 	http->h264_fpsi = us_fpsi_init("H264", true);
-	US_RING_INIT_WITH_ITEMS(http->jpeg_ring, 4, us_frame_init);
+	for (uint index = 0; index < US_STREAM_MAX_JPEG_READERS; ++index) {
+		atomic_init(&http->jpeg_slots[index], NULL);
+		http->jpeg_notify_fds[index] = -1;
+	}
+	atomic_init(&http->jpeg_readers, 0);
+	for (uint index = 0; index < US_STREAM_MAX_H264_READERS; ++index) {
+		http->h264_notify_fds[index] = -1;
+		atomic_init(&http->h264_lost[index], false);
+	}
+	atomic_init(&http->h264_readers, 0);
+	atomic_init(&http->h264_clients, 0);
+	atomic_init(&http->h264_key_requested, false);
 	atomic_init(&http->has_clients, false);
 	atomic_init(&http->snapshot_requested, 0);
 	atomic_init(&http->last_request_ts, 0);
 	http->captured_fpsi = us_fpsi_init("STREAM-CAPTURED", true);
+	atomic_init(&http->jpeg_encoded, 0);
+	atomic_init(&http->jpeg_skipped, 0);
+	for (uint scaled = 0; scaled < US_STREAM_MAX_SCALES; ++scaled) {
+		for (uint index = 0; index < US_STREAM_MAX_JPEG_READERS; ++index) {
+			atomic_init(&http->scaled[scaled].jpeg_slots[index], NULL);
+		}
+		atomic_init(&http->scaled[scaled].clients, 0);
+		char *name;
+		US_ASPRINTF(name, "STREAM-SCALED-%u", scaled);
+		http->scaled[scaled].fpsi = us_fpsi_init(name, true);
+		free(name);
+	}
+	for (uint crop = 0; crop < US_STREAM_MAX_CROPS; ++crop) {
+		for (uint index = 0; index < US_STREAM_MAX_JPEG_READERS; ++index) {
+			atomic_init(&http->crops[crop].jpeg_slots[index], NULL);
+		}
+	}
+	US_MUTEX_INIT(http->crops_mutex);
+	atomic_init(&http->crop_clients, 0);
 
 	us_stream_runtime_s *run;
 	US_CALLOC(run, 1);
 	atomic_init(&run->stop, false);
 	run->blank = us_blank_init();
+	run->sink_crop = -1;
 	run->http = http;
 
 	us_stream_s *stream;
@@ -121,6 +180,8 @@ us_stream_s *us_stream_init(us_capture_s *cap, us_encoder_s *enc) {
 	stream->error_delay = 1;
 	stream->h264_bitrate = 5000; // Kbps
 	stream->h264_gop = 30;
+	stream->h264_encoder = US_H264_ENCODER_TYPE_M2M;
+	stream->h264_m2m_inflight = 1;
 	stream->run = run;
 
 	us_stream_update_blank(stream, cap); // Init blank
@@ -136,7 +197,27 @@ void us_stream_update_blank(us_stream_s *stream, const us_capture_s *cap) {
 
 void us_stream_destroy(us_stream_s *stream) {
 	us_fpsi_destroy(stream->run->http->captured_fpsi);
-	US_RING_DELETE_WITH_ITEMS(stream->run->http->jpeg_ring, us_frame_destroy);
+	for (uint index = 0; index < US_STREAM_MAX_JPEG_READERS; ++index) {
+		us_frameref_s *ref = atomic_exchange(&stream->run->http->jpeg_slots[index], NULL);
+		US_DELETE(ref, us_frameref_unref);
+	}
+	for (uint scaled = 0; scaled < US_STREAM_MAX_SCALES; ++scaled) {
+		for (uint index = 0; index < US_STREAM_MAX_JPEG_READERS; ++index) {
+			us_frameref_s *ref = atomic_exchange(&stream->run->http->scaled[scaled].jpeg_slots[index], NULL);
+			US_DELETE(ref, us_frameref_unref);
+		}
+		us_fpsi_destroy(stream->run->http->scaled[scaled].fpsi);
+	}
+	for (uint crop = 0; crop < US_STREAM_MAX_CROPS; ++crop) {
+		for (uint index = 0; index < US_STREAM_MAX_JPEG_READERS; ++index) {
+			us_frameref_s *ref = atomic_exchange(&stream->run->http->crops[crop].jpeg_slots[index], NULL);
+			US_DELETE(ref, us_frameref_unref);
+		}
+	}
+	US_MUTEX_DESTROY(stream->run->http->crops_mutex);
+	for (uint index = 0; index < US_STREAM_MAX_H264_READERS; ++index) {
+		US_QUEUE_DELETE_WITH_ITEMS(stream->run->http->h264_queues[index], us_frameref_unref);
+	}
 	us_fpsi_destroy(stream->run->http->h264_fpsi);
 #	ifdef WITH_V4P
 	us_fpsi_destroy(stream->run->http->drm_fpsi);
@@ -153,12 +234,26 @@ void us_stream_loop(us_stream_s *stream) {
 
 	atomic_store(&run->http->last_request_ts, us_get_now_monotonic());
 
-	if (stream->h264_sink != NULL) {
-		run->h264_enc = us_m2m_h264_encoder_init("H264", stream->h264_m2m_path, stream->h264_bitrate, stream->h264_gop);
-		run->h264_tmp_src = us_frame_init();
+	if (_stream_is_h264_enabled(stream)) {
+		run->h264_enc = us_h264_encoder_init(
+			stream->h264_encoder, stream->h264_m2m_path, stream->h264_m2m_inflight,
+			stream->h264_bitrate, stream->h264_gop);
 		run->h264_dest = us_frame_init();
 	}
 
+	if (stream->n_scales > 0) {
+		run->scaler = us_scaler_init();
+		run->scaled_raw = us_frame_init();
+		for (uint index = 0; index < stream->n_scales; ++index) {
+			run->scaled_encs[index] = us_cpu_encoder_init();
+		}
+	}
+
+	run->crop_scaler = us_scaler_init();
+	if (stream->jpeg_sink != NULL && stream->jpeg_sink_crop.width > 0) {
+		assert((run->sink_crop = _stream_acquire_crop(stream, &stream->jpeg_sink_crop, true, NULL)) >= 0);
+	}
+
 	while (!_stream_init_loop(stream)) {
 		atomic_bool threads_stop;
 		atomic_init(&threads_stop, false);
@@ -177,20 +272,30 @@ void us_stream_loop(us_stream_s *stream) {
 			US_THREAD_CREATE(ctx->tid, _releaser_thread, ctx);
 		}
 
-#		define CREATE_WORKER(x_cond, x_ctx, x_thread, x_capacity) \
+#		define CREATE_WORKER(x_cond, x_ctx, x_thread, x_capacity, x_notify) \
 			_worker_context_s *x_ctx = NULL; \
 			if (x_cond) { \
 				US_CALLOC(x_ctx, 1); \
 				x_ctx->queue = us_queue_init(x_capacity); \
+				x_ctx->notify_fd = -1; \
+				if (x_notify) { \
+					assert((x_ctx->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0); \
+				} \
 				x_ctx->stream = stream; \
 				x_ctx->stop = &threads_stop; \
 				US_THREAD_CREATE(x_ctx->tid, (x_thread), x_ctx); \
 			}
-		CREATE_WORKER(true, jpeg_ctx, _jpeg_thread, cap->run->n_bufs);
-		CREATE_WORKER((stream->raw_sink != NULL), raw_ctx, _raw_thread, 2);
-		CREATE_WORKER((stream->h264_sink != NULL), h264_ctx, _h264_thread, cap->run->n_bufs);
+		const bool h264_pipelined = _stream_is_h264_pipelined(stream);
+		CREATE_WORKER(true, jpeg_ctx, _jpeg_thread, cap->run->n_bufs, false);
+		CREATE_WORKER((stream->raw_sink != NULL || stream->raw_fdsink != NULL), raw_ctx, _raw_thread, 2, false);
+		CREATE_WORKER(
+			_stream_is_h264_enabled(stream), h264_ctx,
+			(h264_pipelined ? _h264_pipelined_thread : _h264_thread),
+			cap->run->n_bufs, h264_pipelined);
+		CREATE_WORKER((stream->n_scales > 0), scaled_ctx, _scaled_thread, cap->run->n_bufs, false);
+		CREATE_WORKER(true, crop_ctx, _crop_thread, cap->run->n_bufs, false);
 #		ifdef WITH_V4P
-		CREATE_WORKER((stream->drm != NULL), drm_ctx, _drm_thread, cap->run->n_bufs); // cppcheck-suppress assertWithSideEffect
+		CREATE_WORKER((stream->drm != NULL), drm_ctx, _drm_thread, cap->run->n_bufs, false); // cppcheck-suppress assertWithSideEffect
 #		endif
 #		undef CREATE_WORKER
 
@@ -214,10 +319,18 @@ void us_stream_loop(us_stream_s *stream) {
 #			define QUEUE_HW(x_ctx) if (x_ctx != NULL) { \
 					us_capture_hwbuf_incref(hw); \
 					us_queue_put(x_ctx->queue, hw, 0); \
+					if (x_ctx->notify_fd >= 0 && eventfd_write(x_ctx->notify_fd, 1) < 0) { \
+						US_LOG_PERROR("Can't notify the worker"); \
+					} \
 				}
 			QUEUE_HW(jpeg_ctx);
 			QUEUE_HW(raw_ctx);
 			QUEUE_HW(h264_ctx);
+			QUEUE_HW(scaled_ctx);
+			if (_stream_has_crop_clients(stream)) {
+				// The worker always exists, because crops are requested at any moment
+				QUEUE_HW(crop_ctx);
+			}
 #			ifdef WITH_V4P
 			QUEUE_HW(drm_ctx);
 #			endif
@@ -240,12 +353,15 @@ void us_stream_loop(us_stream_s *stream) {
 
 #		define DELETE_WORKER(x_ctx) if (x_ctx != NULL) { \
 				US_THREAD_JOIN(x_ctx->tid); \
+				US_CLOSE_FD(x_ctx->notify_fd); \
 				us_queue_destroy(x_ctx->queue); \
 				free(x_ctx); \
 			}
 #		ifdef WITH_V4P
 		DELETE_WORKER(drm_ctx);
 #		endif
+		DELETE_WORKER(crop_ctx);
+		DELETE_WORKER(scaled_ctx);
 		DELETE_WORKER(h264_ctx);
 		DELETE_WORKER(raw_ctx);
 		DELETE_WORKER(jpeg_ctx);
@@ -268,15 +384,93 @@ void us_stream_loop(us_stream_s *stream) {
 		}
 	}
 
-	US_DELETE(run->h264_enc, us_m2m_encoder_destroy);
-	US_DELETE(run->h264_tmp_src, us_frame_destroy);
+	US_DELETE(run->h264_enc, us_h264_encoder_destroy);
 	US_DELETE(run->h264_dest, us_frame_destroy);
+	for (uint index = 0; index < US_STREAM_MAX_SCALES; ++index) {
+		US_DELETE(run->scaled_encs[index], us_cpu_encoder_destroy);
+	}
+	US_DELETE(run->scaled_raw, us_frame_destroy);
+	US_DELETE(run->scaler, us_scaler_destroy);
+
+	if (run->sink_crop >= 0) {
+		_stream_release_crop(stream, run->sink_crop, true);
+		run->sink_crop = -1;
+	}
+	for (uint index = 0; index < US_STREAM_MAX_CROPS; ++index) {
+		US_DELETE(run->crop_encs[index], us_cpu_encoder_destroy);
+	}
+	US_DELETE(run->crop_scaler, us_scaler_destroy);
 }
 
 void us_stream_loop_break(us_stream_s *stream) {
 	atomic_store(&stream->run->stop, true);
 }
 
+uint us_stream_add_jpeg_reader(us_stream_s *stream, int notify_fd) {
+	// Must be called before us_stream_loop().
+	// The reader owns notify_fd, it's an eventfd which is signaled for each new frame.
+	const uint reader = atomic_fetch_add(&stream->run->http->jpeg_readers, 1);
+	assert(reader < US_STREAM_MAX_JPEG_READERS);
+	stream->run->http->jpeg_notify_fds[reader] = notify_fd;
+	return reader;
+}
+
+us_frameref_s *us_stream_take_jpeg(us_stream_s *stream, uint reader) {
+	// Lock-free: the caller owns the returned reference (or gets NULL)
+	return atomic_exchange(&stream->run->http->jpeg_slots[reader], NULL);
+}
+
+us_frameref_s *us_stream_take_scaled_jpeg(us_stream_s *stream, uint scaled, uint reader) {
+	// Same as us_stream_take_jpeg() for the downscaled rendition, the notify_fd is shared
+	return atomic_exchange(&stream->run->http->scaled[scaled].jpeg_slots[reader], NULL);
+}
+
+int us_stream_acquire_crop(us_stream_s *stream, const us_scaler_crop_s *crop, uint *gen) {
+	// The clients of the same rectangle share the slot and its encoding.
+	// Returns the slot index or -1 if all the slots are busy.
+	return _stream_acquire_crop(stream, crop, false, gen);
+}
+
+void us_stream_release_crop(us_stream_s *stream, uint index) {
+	_stream_release_crop(stream, index, false);
+}
+
+us_frameref_s *us_stream_take_crop_jpeg(us_stream_s *stream, uint index, uint reader) {
+	// Same as us_stream_take_jpeg() for the crop slot, the notify_fd is shared
+	return atomic_exchange(&stream->run->http->crops[index].jpeg_slots[reader], NULL);
+}
+
+int us_stream_find_scaled(const us_stream_s *stream, uint factor) {
+	for (uint index = 0; index < stream->n_scales; ++index) {
+		if (stream->scales[index] == factor) {
+			return index;
+		}
+	}
+	return -1;
+}
+
+uint us_stream_add_h264_reader(us_stream_s *stream, int notify_fd) {
+	// Same as us_stream_add_jpeg_reader(), but the reader gets every frame via a queue
+	us_stream_http_s *const http = stream->run->http;
+	const uint reader = atomic_fetch_add(&http->h264_readers, 1);
+	assert(reader < US_STREAM_MAX_H264_READERS);
+	http->h264_queues[reader] = us_queue_init(US_STREAM_H264_QUEUE_SIZE);
+	http->h264_notify_fds[reader] = notify_fd;
+	return reader;
+}
+
+us_frameref_s *us_stream_take_h264(us_stream_s *stream, uint reader, bool *lost) {
+	// The caller owns the returned reference (or gets NULL).
+	// The lost flag means that the frames before this one were dropped by the overflow.
+	us_stream_http_s *const http = stream->run->http;
+	*lost = atomic_exchange(&http->h264_lost[reader], false);
+	us_frameref_s *ref;
+	if (us_queue_get(http->h264_queues[reader], (void**)&ref, 0) < 0) {
+		return NULL;
+	}
+	return ref;
+}
+
 static void *_releaser_thread(void *v_ctx) {
 	US_THREAD_SETTLE("str_rel")
 	_releaser_context_s *ctx = v_ctx;
@@ -315,6 +509,11 @@ static void *_jpeg_thread(void *v_ctx) {
 	ldf grab_after_ts = 0;
 	uint fluency_passed = 0;
 
+	// Детектор изменений: неизменные кадры не отдаются воркерам, вместо них повторяется последний JPEG
+	us_tilehash_s *tilehash = (stream->skip_unchanged ? us_tilehash_init() : NULL);
+	us_frameref_s *last_jpeg = NULL;
+	uint in_flight = 0;
+
 	while (!atomic_load(ctx->stop)) {
 		us_worker_s *const wr = us_workers_pool_wait(stream->enc->run->pool);
 		us_encoder_job_s *const job = wr->job;
@@ -322,15 +521,20 @@ static void *_jpeg_thread(void *v_ctx) {
 		if (job->hw != NULL) {
 			us_capture_hwbuf_decref(job->hw);
 			job->hw = NULL;
+			in_flight -= 1;
 			if (wr->job_failed) {
-				// pass
+				if (tilehash != NULL) {
+					// The last exposed JPEG is older than the hashed frame, so the next one must be encoded
+					us_tilehash_reset(tilehash);
+				}
 			} else if (wr->job_timely) {
 				_stream_expose_jpeg(stream, job->dest);
-				if (atomic_load(&stream->run->http->snapshot_requested) > 0) { // Process real snapshots
-					atomic_fetch_sub(&stream->run->http->snapshot_requested, 1);
+				if (tilehash != NULL) {
+					US_DELETE(last_jpeg, us_frameref_unref);
+					last_jpeg = us_frameref_ref(job->dest);
 				}
 				US_LOG_PERF("JPEG: ##### Encoded JPEG exposed; worker=%s, latency=%.3Lf",
-					wr->name, us_get_now_monotonic() - job->dest->grab_ts);
+					wr->name, us_get_now_monotonic() - job->dest->frame->grab_ts);
 			} else {
 				US_LOG_PERF("JPEG: ----- Encoded JPEG dropped; worker=%s", wr->name);
 			}
@@ -341,7 +545,8 @@ static void *_jpeg_thread(void *v_ctx) {
 			continue;
 		}
 
-		const bool update_required = (stream->jpeg_sink != NULL && us_memsink_server_check(stream->jpeg_sink, NULL));
+		us_memsink_s *const sink = _stream_get_full_jpeg_sink(stream);
+		const bool update_required = (sink != NULL && us_memsink_server_check(sink, NULL));
 		if (!update_required && !_stream_has_jpeg_clients_cached(stream)) {
 			US_LOG_VERBOSE("JPEG: Passed encoding because nobody is watching");
 			us_capture_hwbuf_decref(hw);
@@ -362,16 +567,40 @@ static void *_jpeg_thread(void *v_ctx) {
 		grab_after_ts = now_ts + fluency_delay;
 		US_LOG_VERBOSE("JPEG: Fluency: delay=%.03Lf, grab_after=%.03Lf", fluency_delay, grab_after_ts);
 
+		if (tilehash != NULL) {
+			const uint changed = us_tilehash_update(tilehash, &hw->raw);
+			if (changed == 0 && (in_flight > 0 || last_jpeg != NULL)) {
+				if (in_flight == 0) {
+					_stream_reexpose_jpeg(stream, &last_jpeg, &hw->raw);
+					US_LOG_PERF("JPEG: ##### Unchanged frame, previous JPEG exposed again");
+				} else {
+					// The same image is being encoded right now and will be exposed soon
+					US_LOG_PERF("JPEG: ----- Unchanged frame dropped while encoding the same one");
+				}
+				atomic_fetch_add(&stream->run->http->jpeg_skipped, 1);
+				us_capture_hwbuf_decref(hw);
+				continue;
+			}
+			US_LOG_VERBOSE("JPEG: Changed tiles: %u of %u", changed, tilehash->n_tiles);
+		}
+
 		job->hw = hw;
+		in_flight += 1;
 		us_workers_pool_assign(stream->enc->run->pool, wr);
+		atomic_fetch_add(&stream->run->http->jpeg_encoded, 1);
 		US_LOG_DEBUG("JPEG: Assigned new frame in buffer=%d to worker=%s", hw->buf.index, wr->name);
 	}
+
+	US_DELETE(last_jpeg, us_frameref_unref);
+	US_DELETE(tilehash, us_tilehash_destroy);
 	return NULL;
 }
 
 static void *_raw_thread(void *v_ctx) {
 	US_THREAD_SETTLE("str_raw");
 	_worker_context_s *ctx = v_ctx;
+	us_memsink_s *const sink = ctx->stream->raw_sink;
+	us_fdsink_s *const fdsink = ctx->stream->raw_fdsink;
 
 	while (!atomic_load(ctx->stop)) {
 		us_capture_hwbuf_s *hw = _get_latest_hw(ctx->queue);
@@ -379,13 +608,23 @@ static void *_raw_thread(void *v_ctx) {
 			continue;
 		}
 
-		if (us_memsink_server_check(ctx->stream->raw_sink, NULL)) {
-			us_memsink_server_put(ctx->stream->raw_sink, &hw->raw, false);
-		} else {
-			US_LOG_VERBOSE("RAW: Passed publishing because nobody is watching");
+		if (sink != NULL) {
+			if (us_memsink_server_check(sink, NULL)) {
+				us_memsink_server_put(sink, &hw->raw, false);
+			} else {
+				US_LOG_VERBOSE("RAW: Passed publishing because nobody is watching");
+			}
+		}
+		if (fdsink != NULL && atomic_load(&fdsink->has_clients)) {
+			// The clients take the buffer by reference, it will be released by their notifications
+			us_fdsink_server_put(fdsink, &hw->raw, hw);
 		}
 		us_capture_hwbuf_decref(hw);
 	}
+
+	if (fdsink != NULL) {
+		us_fdsink_server_drop(fdsink); // The device is going to be closed
+	}
 	return NULL;
 }
 
@@ -401,7 +640,7 @@ static void *_h264_thread(void *v_ctx) {
 			continue;
 		}
 
-		if (!us_memsink_server_check(stream->h264_sink, NULL)) {
+		if (!_stream_has_h264_clients(stream)) {
 			US_LOG_VERBOSE("H264: Passed encoding because nobody is watching");
 			goto decref;
 		}
@@ -416,7 +655,7 @@ static void *_h264_thread(void *v_ctx) {
 		// Поэтому у нас есть два режима: 60 FPS для маленьких видео и 30 для 1920x1080(1200).
 		// Следующй фрейм захватывается не раньше, чем это требуется по FPS, минус небольшая
 		// погрешность (если захват неравномерный) - немного меньше 1/60, и примерно треть от 1/30.
-		const uint fps_limit = stream->run->h264_enc->run->fps_limit;
+		const uint fps_limit = us_h264_encoder_get_fps_limit(stream->run->h264_enc);
 		if (fps_limit > 0) {
 			const ldf frame_interval = (ldf)1 / fps_limit;
 			grab_after_ts = hw->raw.grab_ts + frame_interval - 0.01;
@@ -428,6 +667,118 @@ static void *_h264_thread(void *v_ctx) {
 	return NULL;
 }
 
+static void *_h264_pipelined_thread(void *v_ctx) {
+	US_THREAD_SETTLE("str_h264");
+	_worker_context_s *ctx = v_ctx;
+	us_stream_s *stream = ctx->stream;
+	us_stream_runtime_s *const run = stream->run;
+	us_m2m_encoder_s *const enc = run->h264_enc->m2m;
+
+	// Отправка фреймов в енкодер и получение результатов не ждут друг друга:
+	// пока одни фреймы кодируются, следующие уже стоят в очереди M2M.
+	ldf grab_after_ts = 0;
+	while (!atomic_load(ctx->stop)) {
+		struct pollfd fds[2] = {
+			{ctx->notify_fd, POLLIN, 0},
+			{us_m2m_encoder_get_poll_fd(enc), POLLIN | POLLOUT, 0}, // Ignored if -1
+		};
+		if (poll(fds, 2, 100) < 0 && errno != EINTR) {
+			US_LOG_PERROR("H264: Can't poll the encoder and the notifier");
+			atomic_store(ctx->stop, true); // Stop all other guys on error
+			break;
+		}
+		if (fds[0].revents & POLLIN) {
+			eventfd_t value;
+			(void)eventfd_read(ctx->notify_fd, &value);
+		}
+
+		// Сначала забираем готовые фреймы, чтобы освободить место для новых
+		while (us_m2m_encoder_get_poll_fd(enc) >= 0) {
+			const int retval = us_m2m_encoder_reap(enc, run->h264_dest);
+			if (retval == 0) {
+				_stream_expose_h264(stream, run->h264_dest);
+			} else {
+				if (retval != US_ERROR_NO_DATA) {
+					const us_fpsi_meta_s meta = {.online = false};
+					us_fpsi_update(run->http->h264_fpsi, false, &meta);
+				}
+				break;
+			}
+		}
+
+		while (!us_m2m_encoder_is_full(enc) && !us_queue_is_empty(ctx->queue)) {
+			us_capture_hwbuf_s *hw = _get_latest_hw(ctx->queue);
+			if (hw == NULL) {
+				break;
+			}
+			if (!_stream_has_h264_clients(stream)) {
+				US_LOG_VERBOSE("H264: Passed encoding because nobody is watching");
+				us_capture_hwbuf_decref(hw);
+				continue;
+			}
+			if (hw->raw.grab_ts < grab_after_ts) {
+				US_LOG_DEBUG("H264: Passed encoding for FPS limit");
+				us_capture_hwbuf_decref(hw);
+				continue;
+			}
+
+			const ldf grab_ts = hw->raw.grab_ts;
+			bool force_key = false;
+			_stream_prepare_h264(stream, &force_key);
+			// The encoder owns the buffer now and releases it when it's not needed, even on error
+			if (us_m2m_encoder_submit(enc, &hw->raw, force_key, _stream_release_h264_hw, hw) < 0) {
+				const us_fpsi_meta_s meta = {.online = false};
+				us_fpsi_update(run->http->h264_fpsi, false, &meta);
+				continue;
+			}
+
+			const uint fps_limit = us_h264_encoder_get_fps_limit(run->h264_enc);
+			if (fps_limit > 0) {
+				grab_after_ts = grab_ts + (ldf)1 / fps_limit - 0.01;
+			}
+		}
+	}
+
+	// Захваченные буферы должны вернуться до закрытия устройства
+	us_m2m_encoder_flush(enc);
+	return NULL;
+}
+
+static void *_scaled_thread(void *v_ctx) {
+	US_THREAD_SETTLE("str_scale");
+	_worker_context_s *ctx = v_ctx;
+
+	while (!atomic_load(ctx->stop)) {
+		us_capture_hwbuf_s *hw = _get_latest_hw(ctx->queue);
+		if (hw == NULL) {
+			continue;
+		}
+
+		if (_stream_has_scaled_clients(ctx->stream)) {
+			_stream_encode_expose_scaled(ctx->stream, &hw->raw);
+		} else {
+			US_LOG_VERBOSE("SCALED: Passed encoding because nobody is watching");
+		}
+		us_capture_hwbuf_decref(hw);
+	}
+	return NULL;
+}
+
+static void *_crop_thread(void *v_ctx) {
+	US_THREAD_SETTLE("str_crop");
+	_worker_context_s *ctx = v_ctx;
+
+	while (!atomic_load(ctx->stop)) {
+		us_capture_hwbuf_s *hw = _get_latest_hw(ctx->queue);
+		if (hw == NULL) {
+			continue;
+		}
+		_stream_encode_expose_crops(ctx->stream, &hw->raw);
+		us_capture_hwbuf_decref(hw);
+	}
+	return NULL;
+}
+
 #ifdef WITH_V4P
 static void *_drm_thread(void *v_ctx) {
 	US_THREAD_SETTLE("str_drm");
@@ -506,18 +857,24 @@ static us_capture_hwbuf_s *_get_latest_hw(us_queue_s *queue) {
 
 static bool _stream_has_jpeg_clients_cached(us_stream_s *stream) {
 	const us_stream_runtime_s *const run = stream->run;
+	us_memsink_s *const sink = _stream_get_full_jpeg_sink(stream);
 	return (
 		atomic_load(&run->http->has_clients)
 		|| (atomic_load(&run->http->snapshot_requested) > 0)
-		|| (stream->jpeg_sink != NULL && atomic_load(&stream->jpeg_sink->has_clients))
+		|| (sink != NULL && atomic_load(&sink->has_clients))
 	);
 }
 
 static bool _stream_has_any_clients_cached(us_stream_s *stream) {
 	return (
 		_stream_has_jpeg_clients_cached(stream)
+		|| (stream->jpeg_sink != NULL && atomic_load(&stream->jpeg_sink->has_clients)) // Cropped
+		|| (atomic_load(&stream->run->http->crop_clients) > 0)
 		|| (stream->h264_sink != NULL && atomic_load(&stream->h264_sink->has_clients))
+		|| (atomic_load(&stream->run->http->h264_clients) > 0)
+		|| _stream_has_scaled_clients(stream)
 		|| (stream->raw_sink != NULL && atomic_load(&stream->raw_sink->has_clients))
+		|| (stream->raw_fdsink != NULL && atomic_load(&stream->raw_fdsink->has_clients))
 #		ifdef WITH_V4P
 		|| (stream->drm != NULL)
 #		endif
@@ -548,7 +905,8 @@ static int _stream_init_loop(us_stream_s *stream) {
 		stream->cap->dma_export = (
 			stream->enc->type == US_ENCODER_TYPE_M2M_VIDEO
 			|| stream->enc->type == US_ENCODER_TYPE_M2M_IMAGE
-			|| stream->h264_sink != NULL
+			|| (_stream_is_h264_enabled(stream) && stream->h264_encoder == US_H264_ENCODER_TYPE_M2M)
+			|| stream->raw_fdsink != NULL
 #			ifdef WITH_V4P
 			|| stream->drm != NULL
 #			endif
@@ -633,9 +991,11 @@ static int _stream_init_loop(us_stream_s *stream) {
 				us_blank_draw(run->blank, blank_reason, width, height);
 
 				_stream_update_captured_fpsi(stream, run->blank->raw, false);
-				_stream_expose_jpeg(stream, run->blank->jpeg);
+				_stream_expose_jpeg_copy(stream, run->blank->jpeg);
 				_stream_expose_raw(stream, run->blank->raw);
 				_stream_encode_expose_h264(stream, run->blank->raw, true);
+				_stream_encode_expose_scaled(stream, run->blank->raw);
+				_stream_expose_crops_copy(stream, run->blank->jpeg);
 
 #				ifdef WITH_V4P
 				_stream_drm_ensure_no_signal(stream);
@@ -685,52 +1045,336 @@ close:
 }
 #endif
 
-static void _stream_expose_jpeg(us_stream_s *stream, const us_frame_s *frame) {
-	us_stream_runtime_s *const run = stream->run;
-	int ri;
-	while ((ri = us_ring_producer_acquire(run->http->jpeg_ring, 0)) < 0) {
-		if (atomic_load(&run->stop)) {
-			return;
+static void _stream_put_jpeg_slots(us_stream_http_s *http, _Atomic(us_frameref_s*) *slots, us_frameref_s *ref) {
+	// The frame is not copied, each reader gets a new reference to it.
+	// The producer must not change the frame after that, see us_frameref_unshare().
+	// A reader that didn't take the previous frame yet just skips it
+	// and doesn't need to be woken up again.
+	const uint readers = atomic_load(&http->jpeg_readers);
+	for (uint index = 0; index < readers; ++index) {
+		us_frameref_s *prev = atomic_exchange(&slots[index], us_frameref_ref(ref));
+		if (prev != NULL) {
+			us_frameref_unref(prev);
+		} else if (http->jpeg_notify_fds[index] >= 0) {
+			if (eventfd_write(http->jpeg_notify_fds[index], 1) < 0) {
+				US_LOG_PERROR("Can't notify JPEG reader %u", index);
+			}
 		}
 	}
-	us_frame_s *const dest = run->http->jpeg_ring->items[ri];
-	us_frame_copy(frame, dest);
-	us_ring_producer_release(run->http->jpeg_ring, ri);
-	if (stream->jpeg_sink != NULL) {
-		us_memsink_server_put(stream->jpeg_sink, dest, NULL);
+}
+
+static void _stream_expose_jpeg(us_stream_s *stream, us_frameref_s *ref) {
+	_stream_put_jpeg_slots(stream->run->http, stream->run->http->jpeg_slots, ref);
+	us_memsink_s *const sink = _stream_get_full_jpeg_sink(stream);
+	if (sink != NULL) {
+		us_memsink_server_put(sink, ref->frame, NULL);
 	}
 }
 
+static void _stream_expose_jpeg_copy(us_stream_s *stream, const us_frame_s *frame) {
+	us_frameref_s *const ref = us_frameref_init();
+	us_frame_copy(frame, ref->frame);
+	_stream_expose_jpeg(stream, ref);
+	us_frameref_unref(ref);
+}
+
+static void _stream_reexpose_jpeg(us_stream_s *stream, us_frameref_s **ref, const us_frame_s *raw) {
+	// The image is the same, only the timings are updated as it would be encoded right now.
+	// The exposed frame is immutable, so it's a copy, which is still much cheaper than encoding.
+	us_frameref_s *const fresh = us_frameref_init();
+	us_frame_copy((*ref)->frame, fresh->frame);
+	fresh->frame->online = raw->online;
+	fresh->frame->grab_ts = raw->grab_ts;
+	fresh->frame->encode_begin_ts = us_get_now_monotonic();
+	fresh->frame->encode_end_ts = fresh->frame->encode_begin_ts;
+	_stream_expose_jpeg(stream, fresh);
+	us_frameref_unref(*ref);
+	*ref = fresh;
+}
+
 static void _stream_expose_raw(us_stream_s *stream, const us_frame_s *frame) {
 	if (stream->raw_sink != NULL) {
 		us_memsink_server_put(stream->raw_sink, frame, NULL);
 	}
+	if (stream->raw_fdsink != NULL && atomic_load(&stream->raw_fdsink->has_clients)) {
+		us_fdsink_server_put(stream->raw_fdsink, frame, NULL);
+	}
+}
+
+static bool _stream_is_h264_enabled(us_stream_s *stream) {
+	return (stream->h264_sink != NULL || stream->h264_http);
+}
+
+static bool _stream_is_h264_pipelined(us_stream_s *stream) {
+	return (stream->h264_encoder == US_H264_ENCODER_TYPE_M2M && stream->h264_m2m_inflight > 1);
+}
+
+static bool _stream_has_h264_clients(us_stream_s *stream) {
+	return (
+		(stream->h264_sink != NULL && us_memsink_server_check(stream->h264_sink, NULL))
+		|| atomic_load(&stream->run->http->h264_clients) > 0
+	);
+}
+
+static void _stream_prepare_h264(us_stream_s *stream, bool *force_key) {
+	// MJPEG енкодеры декодируют сами, сразу в свой входной буфер
+	us_stream_runtime_s *const run = stream->run;
+	if (run->h264_key_requested) {
+		US_LOG_INFO("H264: Requested keyframe by a sink client");
+		run->h264_key_requested = false;
+		*force_key = true;
+	}
+	if (atomic_exchange(&run->http->h264_key_requested, false)) {
+		US_LOG_INFO("H264: Requested keyframe by an HTTP client");
+		*force_key = true;
+	}
 }
 
 static void _stream_encode_expose_h264(us_stream_s *stream, const us_frame_s *frame, bool force_key) {
-	if (stream->h264_sink == NULL) {
+	if (!_stream_is_h264_enabled(stream)) {
 		return;
 	}
-	us_stream_runtime_s *run = stream->run;
+	us_stream_runtime_s *const run = stream->run;
 
-	us_fpsi_meta_s meta = {.online = false};
-	if (us_is_jpeg(frame->format)) {
-		if (us_unjpeg(frame, run->h264_tmp_src, true) < 0) {
-			goto done;
+	_stream_prepare_h264(stream, &force_key);
+	if (us_h264_encoder_compress(run->h264_enc, frame, run->h264_dest, force_key) < 0) {
+		const us_fpsi_meta_s meta = {.online = false};
+		us_fpsi_update(run->http->h264_fpsi, false, &meta);
+		return;
+	}
+	_stream_expose_h264(stream, run->h264_dest);
+}
+
+static void _stream_expose_h264(us_stream_s *stream, const us_frame_s *frame) {
+	us_stream_runtime_s *const run = stream->run;
+	us_fpsi_meta_s meta = {.online = true};
+	if (stream->h264_sink != NULL) {
+		meta.online = !us_memsink_server_put(stream->h264_sink, frame, &run->h264_key_requested);
+	}
+	_stream_expose_h264_http(stream, frame);
+	us_fpsi_update(run->http->h264_fpsi, meta.online, &meta);
+}
+
+static void _stream_release_h264_hw(void *v_hw) {
+	us_capture_hwbuf_decref((us_capture_hwbuf_s*)v_hw);
+}
+
+static void _stream_expose_h264_http(us_stream_s *stream, const us_frame_s *frame) {
+	us_stream_http_s *const http = stream->run->http;
+	if (atomic_load(&http->h264_clients) == 0) {
+		return;
+	}
+
+	// The encoder reuses its buffer, so the readers get one shared copy
+	us_frameref_s *const ref = us_frameref_init();
+	us_frame_copy(frame, ref->frame);
+
+	const uint readers = atomic_load(&http->h264_readers);
+	for (uint index = 0; index < readers; ++index) {
+		if (us_queue_put(http->h264_queues[index], us_frameref_ref(ref), 0) < 0) {
+			us_frameref_unref(ref);
+			if (!atomic_exchange(&http->h264_lost[index], true)) {
+				US_LOG_VERBOSE("H264: HTTP reader %u is too slow, dropping frames", index);
+			}
+			continue;
+		}
+		if (eventfd_write(http->h264_notify_fds[index], 1) < 0) {
+			US_LOG_PERROR("Can't notify H264 reader %u", index);
 		}
-		frame = run->h264_tmp_src;
 	}
-	if (run->h264_key_requested) {
-		US_LOG_INFO("H264: Requested keyframe by a sink client");
-		run->h264_key_requested = false;
-		force_key = true;
+	us_frameref_unref(ref);
+}
+
+static bool _stream_has_scaled_clients(us_stream_s *stream) {
+	for (uint index = 0; index < stream->n_scales; ++index) {
+		if (atomic_load(&stream->run->http->scaled[index].clients) > 0) {
+			return true;
+		}
 	}
-	if (!us_m2m_encoder_compress(run->h264_enc, frame, run->h264_dest, force_key)) {
-		meta.online = !us_memsink_server_put(stream->h264_sink, run->h264_dest, &run->h264_key_requested);
+	return false;
+}
+
+static void _stream_encode_expose_scaled(us_stream_s *stream, const us_frame_s *frame) {
+	// Все уменьшенные копии делаются из того же захваченного буфера, но только для тех,
+	// у которых есть клиенты. Сжимаются они всегда CPU-енкодером, они маленькие.
+	us_stream_runtime_s *const run = stream->run;
+
+	us_encoder_type_e enc_type;
+	uint quality;
+	us_encoder_get_runtime_params(stream->enc, &enc_type, &quality);
+	if (quality == 0) {
+		quality = 80; // The device default of the hardware encoder
 	}
 
-done:
-	us_fpsi_update(run->http->h264_fpsi, meta.online, &meta);
+	for (uint index = 0; index < stream->n_scales; ++index) {
+		us_stream_scaled_s *const scaled = &run->http->scaled[index];
+		if (atomic_load(&scaled->clients) == 0) {
+			continue;
+		}
+
+		us_fpsi_meta_s meta = {0};
+		if (us_scaler_downscale(run->scaler, frame, run->scaled_raw, stream->scales[index]) < 0) {
+			US_LOG_VERBOSE("SCALED: Can't downscale the frame to 1/%u", stream->scales[index]);
+			us_fpsi_update(scaled->fpsi, false, &meta);
+			continue;
+		}
+
+		us_frameref_s *const ref = us_frameref_init();
+		us_cpu_encoder_compress(run->scaled_encs[index], run->scaled_raw, ref->frame, quality);
+		_stream_put_jpeg_slots(run->http, scaled->jpeg_slots, ref);
+		us_fpsi_frame_to_meta(ref->frame, &meta);
+		us_fpsi_update(scaled->fpsi, true, &meta);
+		us_frameref_unref(ref);
+	}
+}
+
+static bool _stream_has_crop_clients(us_stream_s *stream) {
+	// The pinned sink crop is checked by the worker, the sink clients can't be counted here cheaply
+	return (stream->run->sink_crop >= 0 || atomic_load(&stream->run->http->crop_clients) > 0);
+}
+
+static int _stream_acquire_crop(us_stream_s *stream, const us_scaler_crop_s *crop, bool pin, uint *gen) {
+	us_stream_http_s *const http = stream->run->http;
+
+	US_MUTEX_LOCK(http->crops_mutex);
+	int found = -1;
+	int free_index = -1;
+	for (uint index = 0; index < US_STREAM_MAX_CROPS; ++index) {
+		const us_stream_crop_s *const slot = &http->crops[index];
+		if (slot->clients > 0 || slot->pinned) {
+			if (!memcmp(&slot->crop, crop, sizeof(us_scaler_crop_s))) {
+				found = index;
+				break;
+			}
+		} else if (free_index < 0) {
+			free_index = index;
+		}
+	}
+	if (found < 0 && free_index >= 0) {
+		found = free_index;
+		us_stream_crop_s *const slot = &http->crops[found];
+		slot->crop = *crop;
+		slot->gen += 1;
+		for (uint index = 0; index < US_STREAM_MAX_JPEG_READERS; ++index) {
+			// The frames of the previous rectangle
+			us_frameref_s *ref = atomic_exchange(&slot->jpeg_slots[index], NULL);
+			US_DELETE(ref, us_frameref_unref);
+		}
+	}
+	if (found >= 0) {
+		us_stream_crop_s *const slot = &http->crops[found];
+		if (pin) {
+			slot->pinned = true;
+		} else {
+			slot->clients += 1;
+			atomic_fetch_add(&http->crop_clients, 1);
+		}
+		if (gen != NULL) {
+			*gen = slot->gen;
+		}
+	}
+	US_MUTEX_UNLOCK(http->crops_mutex);
+	return found;
+}
+
+static void _stream_release_crop(us_stream_s *stream, uint index, bool pin) {
+	us_stream_http_s *const http = stream->run->http;
+	us_stream_crop_s *const slot = &http->crops[index];
+
+	US_MUTEX_LOCK(http->crops_mutex);
+	if (pin) {
+		assert(slot->pinned);
+		slot->pinned = false;
+	} else {
+		assert(slot->clients > 0);
+		slot->clients -= 1;
+		atomic_fetch_sub(&http->crop_clients, 1);
+	}
+	US_MUTEX_UNLOCK(http->crops_mutex);
+}
+
+static us_memsink_s *_stream_get_full_jpeg_sink(us_stream_s *stream) {
+	// The cropped sink is fed by the crops thread
+	return (stream->jpeg_sink_crop.width > 0 ? NULL : stream->jpeg_sink);
+}
+
+static void _stream_encode_expose_crops(us_stream_s *stream, const us_frame_s *frame) {
+	us_stream_runtime_s *const run = stream->run;
+	us_stream_http_s *const http = run->http;
+
+	const bool sink_required = (run->sink_crop >= 0 && us_memsink_server_check(stream->jpeg_sink, NULL));
+	if (!sink_required && atomic_load(&http->crop_clients) == 0) {
+		US_LOG_VERBOSE("CROP: Passed encoding because nobody is watching");
+		return;
+	}
+
+	us_encoder_type_e enc_type;
+	uint quality;
+	us_encoder_get_runtime_params(stream->enc, &enc_type, &quality);
+	if (quality == 0) {
+		quality = 80; // The device default of the hardware encoder
+	}
+
+	for (uint index = 0; index < US_STREAM_MAX_CROPS; ++index) {
+		us_stream_crop_s *const slot = &http->crops[index];
+
+		US_MUTEX_LOCK(http->crops_mutex);
+		const us_scaler_crop_s crop = slot->crop;
+		const uint gen = slot->gen;
+		const bool has_clients = (slot->clients > 0);
+		US_MUTEX_UNLOCK(http->crops_mutex);
+
+		const bool to_sink = (sink_required && (int)index == run->sink_crop);
+		if (!has_clients && !to_sink) {
+			continue;
+		}
+
+		us_frame_s view;
+		const us_frame_s *const cropped = us_scaler_crop(run->crop_scaler, frame, &view, &crop);
+		if (cropped == NULL) {
+			US_LOG_VERBOSE("CROP: Can't crop %u,%u,%u,%u from the frame %ux%u",
+				crop.x, crop.y, crop.width, crop.height, frame->width, frame->height);
+			continue;
+		}
+
+		if (run->crop_encs[index] == NULL) {
+			run->crop_encs[index] = us_cpu_encoder_init();
+		}
+		us_frameref_s *const ref = us_frameref_init();
+		us_cpu_encoder_compress(run->crop_encs[index], cropped, ref->frame, quality);
+
+		if (has_clients) {
+			US_MUTEX_LOCK(http->crops_mutex);
+			if (slot->gen == gen) { // The slot is not reused for another rectangle while encoding
+				_stream_put_jpeg_slots(http, slot->jpeg_slots, ref);
+			}
+			US_MUTEX_UNLOCK(http->crops_mutex);
+		}
+		if (to_sink) {
+			us_memsink_server_put(stream->jpeg_sink, ref->frame, NULL);
+		}
+		us_frameref_unref(ref);
+	}
+}
+
+static void _stream_expose_crops_copy(us_stream_s *stream, const us_frame_s *frame) {
+	// Offline: the whole blank is more useful than its piece
+	us_stream_runtime_s *const run = stream->run;
+	us_stream_http_s *const http = run->http;
+
+	us_frameref_s *const ref = us_frameref_init();
+	us_frame_copy(frame, ref->frame);
+	US_MUTEX_LOCK(http->crops_mutex);
+	for (uint index = 0; index < US_STREAM_MAX_CROPS; ++index) {
+		if (http->crops[index].clients > 0) {
+			_stream_put_jpeg_slots(http, http->crops[index].jpeg_slots, ref);
+		}
+	}
+	US_MUTEX_UNLOCK(http->crops_mutex);
+	if (run->sink_crop >= 0) {
+		us_memsink_server_put(stream->jpeg_sink, ref->frame, NULL);
+	}
+	us_frameref_unref(ref);
 }
 
 static void _stream_check_suicide(us_stream_s *stream) {
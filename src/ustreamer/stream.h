@@ -28,9 +28,10 @@
 
 #include "../libs/types.h"
 #include "../libs/queue.h"
-#include "../libs/ring.h"
 #include "../libs/frame.h"
+#include "../libs/frameref.h"
 #include "../libs/memsink.h"
+#include "../libs/fdsink.h"
 #include "../libs/capture.h"
 #include "../libs/fpsi.h"
 #ifdef WITH_V4P
@@ -39,9 +40,35 @@
 
 #include "blank.h"
 #include "encoder.h"
-#include "m2m.h"
+#include "encoders/cpu/encoder.h"
+#include "scaler.h"
+#include "h264.h"
 
 
+#define US_STREAM_MAX_JPEG_READERS	64
+#define US_STREAM_MAX_H264_READERS	US_STREAM_MAX_JPEG_READERS
+#define US_STREAM_H264_QUEUE_SIZE	16
+#define US_STREAM_MAX_SCALES		3
+#define US_STREAM_MAX_CROPS			8
+
+
+typedef struct {
+	// Downscaled JPEG rendition, encoded only when it has clients
+	_Atomic(us_frameref_s*)	jpeg_slots[US_STREAM_MAX_JPEG_READERS]; // Same readers as the full-size stream
+	atomic_uint				clients;
+	us_fpsi_s				*fpsi;
+} us_stream_scaled_s;
+
+typedef struct {
+	// Region of interest, one encode is shared by all the clients of the same rectangle.
+	// The geometry and the counters are protected by the crops_mutex.
+	us_scaler_crop_s		crop;
+	uint					gen; // Incremented when the slot gets a new rectangle
+	uint					clients; // The slot is free if zero and not pinned
+	bool					pinned; // Used by the JPEG sink
+	_Atomic(us_frameref_s*)	jpeg_slots[US_STREAM_MAX_JPEG_READERS];
+} us_stream_crop_s;
+
 typedef struct {
 #	ifdef WITH_V4P
 	atomic_bool		drm_live;
@@ -51,21 +78,47 @@ typedef struct {
 	atomic_bool		h264_online;
 	us_fpsi_s		*h264_fpsi;
 
-	us_ring_s		*jpeg_ring;
-	atomic_bool		has_clients;
-	atomic_uint		snapshot_requested;
+	// Every H264 frame is required for decoding, so each reader has a queue instead of a slot
+	us_queue_s		*h264_queues[US_STREAM_MAX_H264_READERS];
+	int				h264_notify_fds[US_STREAM_MAX_H264_READERS];
+	atomic_bool		h264_lost[US_STREAM_MAX_H264_READERS]; // The queue was full, some frames are dropped
+	atomic_uint		h264_readers;
+	atomic_uint		h264_clients;
+	atomic_bool		h264_key_requested;
+
+	_Atomic(us_frameref_s*)	jpeg_slots[US_STREAM_MAX_JPEG_READERS]; // The latest frame for each reader
+	int						jpeg_notify_fds[US_STREAM_MAX_JPEG_READERS]; // Eventfd of each reader or -1
+	atomic_uint				jpeg_readers;
+	atomic_bool		has_clients; // Clients of the full-size stream
+	atomic_uint		snapshot_requested; // Number of /snapshot clients waiting for a new JPEG
 	atomic_ullong	last_request_ts; // Seconds
 	us_fpsi_s		*captured_fpsi;
+
+	atomic_ullong	jpeg_encoded;
+	atomic_ullong	jpeg_skipped; // Unchanged frames which were not encoded
+
+	us_stream_scaled_s	scaled[US_STREAM_MAX_SCALES];
+
+	us_stream_crop_s	crops[US_STREAM_MAX_CROPS];
+	pthread_mutex_t		crops_mutex;
+	atomic_uint			crop_clients; // Total for all crops
 } us_stream_http_s;
 
 typedef struct {
 	us_stream_http_s	*http;
 
-	us_m2m_encoder_s	*h264_enc;
-	us_frame_s			*h264_tmp_src;
+	us_h264_encoder_s	*h264_enc;
 	us_frame_s			*h264_dest;
 	bool				h264_key_requested;
 
+	us_scaler_s			*scaler;
+	us_frame_s			*scaled_raw;
+	us_cpu_encoder_s	*scaled_encs[US_STREAM_MAX_SCALES];
+
+	us_scaler_s			*crop_scaler;
+	us_cpu_encoder_s	*crop_encs[US_STREAM_MAX_CROPS];
+	int					sink_crop; // Pinned crop of the JPEG sink or -1
+
 	us_blank_s			*blank;
 
 	us_fpsi_meta_s		notify_meta;
@@ -79,17 +132,26 @@ typedef struct {
 
 	bool			notify_parent;
 	bool			slowdown;
+	bool			skip_unchanged;
 	uint			error_delay;
 	bool			exit_on_device_error;
 	uint			exit_on_no_clients;
 
+	uint			scales[US_STREAM_MAX_SCALES]; // Downscale factors of the additional renditions
+	uint			n_scales;
+
 	us_memsink_s	*jpeg_sink;
+	us_scaler_crop_s	jpeg_sink_crop; // Zero width means the full frame
 	us_memsink_s	*raw_sink;
+	us_fdsink_s		*raw_fdsink;
 
 	us_memsink_s	*h264_sink;
 	uint			h264_bitrate;
 	uint			h264_gop;
+	us_h264_encoder_type_e	h264_encoder;
 	char			*h264_m2m_path;
+	uint			h264_m2m_inflight;
+	bool			h264_http;
 
 #	ifdef WITH_V4P
 	us_drm_s		*drm;
@@ -105,3 +167,15 @@ void us_stream_destroy(us_stream_s *stream);
 
 void us_stream_loop(us_stream_s *stream);
 void us_stream_loop_break(us_stream_s *stream);
+
+uint us_stream_add_jpeg_reader(us_stream_s *stream, int notify_fd);
+us_frameref_s *us_stream_take_jpeg(us_stream_s *stream, uint reader);
+us_frameref_s *us_stream_take_scaled_jpeg(us_stream_s *stream, uint scaled, uint reader);
+int us_stream_find_scaled(const us_stream_s *stream, uint factor);
+
+int us_stream_acquire_crop(us_stream_s *stream, const us_scaler_crop_s *crop, uint *gen);
+void us_stream_release_crop(us_stream_s *stream, uint index);
+us_frameref_s *us_stream_take_crop_jpeg(us_stream_s *stream, uint index, uint reader);
+
+uint us_stream_add_h264_reader(us_stream_s *stream, int notify_fd);
+us_frameref_s *us_stream_take_h264(us_stream_s *stream, uint reader, bool *lost);
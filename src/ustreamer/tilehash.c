@@ -0,0 +1,198 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "tilehash.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#	define _CRC_X86
+#	include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#	define _CRC_ARM
+#	include <arm_acle.h>
+#endif
+
+#include "../libs/types.h"
+#include "../libs/tools.h"
+#include "../libs/frame.h"
+
+
+typedef void (*_hash_f)(const u8 *data, uz size, u64 *hash);
+
+
+#define _TILE_LINES		((uz)16)
+#define _TILE_NO_STRIDE	((uz)64 * 1024) // For (M)JPEG and other formats without lines
+
+
+static _hash_f _get_hasher(void);
+static void _hash_scalar(const u8 *data, uz size, u64 *hash);
+#if defined(_CRC_X86)
+static void _hash_crc32_sse42(const u8 *data, uz size, u64 *hash);
+#elif defined(_CRC_ARM)
+static void _hash_crc32_arm(const u8 *data, uz size, u64 *hash);
+#endif
+
+
+us_tilehash_s *us_tilehash_init(void) {
+	us_tilehash_s *th;
+	US_CALLOC(th, 1);
+	return th;
+}
+
+void us_tilehash_destroy(us_tilehash_s *th) {
+	US_DELETE(th->hashes, free);
+	free(th);
+}
+
+void us_tilehash_reset(us_tilehash_s *th) {
+	th->used = 0; // The next update will rebuild all hashes and report the full change
+}
+
+uint us_tilehash_update(us_tilehash_s *th, const us_frame_s *frame) {
+	// Returns the number of changed tiles, zero means that the frame is the same as the previous one
+
+	const _hash_f hash = _get_hasher();
+
+	bool reset = (
+		th->used == 0
+		|| th->used != frame->used
+		|| th->width != frame->width
+		|| th->height != frame->height
+		|| th->format != frame->format
+		|| th->stride != frame->stride
+	);
+	if (reset) {
+		th->tile_size = (frame->stride > 0 ? frame->stride * _TILE_LINES : _TILE_NO_STRIDE);
+		th->n_tiles = (frame->used + th->tile_size - 1) / th->tile_size;
+		US_DELETE(th->hashes, free);
+		US_CALLOC(th->hashes, th->n_tiles * 2);
+
+		th->used = frame->used;
+		th->width = frame->width;
+		th->height = frame->height;
+		th->format = frame->format;
+		th->stride = frame->stride;
+	}
+
+	uint changed = 0;
+	for (uint index = 0; index < th->n_tiles; ++index) {
+		const uz offset = th->tile_size * index;
+		u64 tile[2];
+		hash(frame->data + offset, US_MIN(th->tile_size, frame->used - offset), tile);
+		u64 *const prev = th->hashes + index * 2;
+		if (reset || prev[0] != tile[0] || prev[1] != tile[1]) {
+			prev[0] = tile[0];
+			prev[1] = tile[1];
+			++changed;
+		}
+	}
+	return changed;
+}
+
+static _hash_f _get_hasher(void) {
+#	if defined(_CRC_X86)
+	if (__builtin_cpu_supports("sse4.2")) {
+		return _hash_crc32_sse42;
+	}
+#	elif defined(_CRC_ARM)
+	return _hash_crc32_arm;
+#	endif
+	return _hash_scalar;
+}
+
+// All hashers process 4 independent lanes of 8-byte words, it keeps the CPU pipeline busy
+// and gives 128 bits of the hash per tile. The tail is mixed into the second lane.
+
+#define _LOAD_U64(x_ptr) ({ u64 m_word; memcpy(&m_word, (x_ptr), 8); m_word; })
+
+static void _hash_scalar(const u8 *data, uz size, u64 *hash) {
+#	define MIX(x_lane, x_word) { \
+			x_lane = (x_lane ^ (x_word)) * 0x9E3779B97F4A7C15ULL; \
+			x_lane ^= x_lane >> 29; \
+		}
+
+	u64 lanes[4] = {1, 2, 3, 4};
+	uz offset = 0;
+	for (; offset + 32 <= size; offset += 32) {
+		MIX(lanes[0], _LOAD_U64(data + offset));
+		MIX(lanes[1], _LOAD_U64(data + offset + 8));
+		MIX(lanes[2], _LOAD_U64(data + offset + 16));
+		MIX(lanes[3], _LOAD_U64(data + offset + 24));
+	}
+	for (; offset + 8 <= size; offset += 8) {
+		MIX(lanes[0], _LOAD_U64(data + offset));
+	}
+	for (; offset < size; ++offset) {
+		MIX(lanes[1], data[offset]);
+	}
+	hash[0] = lanes[0] ^ (lanes[1] << 32 | lanes[1] >> 32);
+	hash[1] = lanes[2] ^ (lanes[3] << 32 | lanes[3] >> 32);
+
+#	undef MIX
+}
+
+#if defined(_CRC_X86)
+__attribute__((target("sse4.2")))
+static void _hash_crc32_sse42(const u8 *data, uz size, u64 *hash) {
+	u64 lanes[4] = {1, 2, 3, 4};
+	uz offset = 0;
+	for (; offset + 32 <= size; offset += 32) {
+		lanes[0] = _mm_crc32_u64(lanes[0], _LOAD_U64(data + offset));
+		lanes[1] = _mm_crc32_u64(lanes[1], _LOAD_U64(data + offset + 8));
+		lanes[2] = _mm_crc32_u64(lanes[2], _LOAD_U64(data + offset + 16));
+		lanes[3] = _mm_crc32_u64(lanes[3], _LOAD_U64(data + offset + 24));
+	}
+	for (; offset + 8 <= size; offset += 8) {
+		lanes[0] = _mm_crc32_u64(lanes[0], _LOAD_U64(data + offset));
+	}
+	for (; offset < size; ++offset) {
+		lanes[1] = _mm_crc32_u8(lanes[1], data[offset]);
+	}
+	hash[0] = (lanes[0] << 32) | lanes[1];
+	hash[1] = (lanes[2] << 32) | lanes[3];
+}
+
+#elif defined(_CRC_ARM)
+static void _hash_crc32_arm(const u8 *data, uz size, u64 *hash) {
+	u32 lanes[4] = {1, 2, 3, 4};
+	uz offset = 0;
+	for (; offset + 32 <= size; offset += 32) {
+		lanes[0] = __crc32cd(lanes[0], _LOAD_U64(data + offset));
+		lanes[1] = __crc32cd(lanes[1], _LOAD_U64(data + offset + 8));
+		lanes[2] = __crc32cd(lanes[2], _LOAD_U64(data + offset + 16));
+		lanes[3] = __crc32cd(lanes[3], _LOAD_U64(data + offset + 24));
+	}
+	for (; offset + 8 <= size; offset += 8) {
+		lanes[0] = __crc32cd(lanes[0], _LOAD_U64(data + offset));
+	}
+	for (; offset < size; ++offset) {
+		lanes[1] = __crc32cb(lanes[1], data[offset]);
+	}
+	hash[0] = ((u64)lanes[0] << 32) | lanes[1];
+	hash[1] = ((u64)lanes[2] << 32) | lanes[3];
+}
+#endif
+
+#undef _LOAD_U64
+#undef _TILE_NO_STRIDE
+#undef _TILE_LINES
@@ -0,0 +1,47 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#pragma once
+
+#include "../libs/types.h"
+#include "../libs/frame.h"
+
+
+typedef struct {
+	// The frame is hashed by bands of a few lines, so a small change invalidates only a small band
+	uz		tile_size;
+	uint	n_tiles;
+	u64		*hashes; // Two words per tile
+
+	uz		used;
+	uint	width;
+	uint	height;
+	uint	format;
+	uint	stride;
+} us_tilehash_s;
+
+
+us_tilehash_s *us_tilehash_init(void);
+void us_tilehash_destroy(us_tilehash_s *th);
+
+void us_tilehash_reset(us_tilehash_s *th);
+uint us_tilehash_update(us_tilehash_s *th, const us_frame_s *frame);
@@ -139,6 +139,12 @@ void us_workers_pool_assign(us_workers_pool_s *pool, us_worker_s *wr) {
 	US_MUTEX_UNLOCK(pool->free_workers_mutex);
 }
 
+void us_workers_pool_wait_idle(us_workers_pool_s *pool) {
+	US_MUTEX_LOCK(pool->free_workers_mutex);
+	US_COND_WAIT_FOR(pool->free_workers == pool->n_workers, pool->free_workers_cond, pool->free_workers_mutex);
+	US_MUTEX_UNLOCK(pool->free_workers_mutex);
+}
+
 ldf us_workers_pool_get_fluency_delay(us_workers_pool_s *pool, const us_worker_s *wr) {
 	const ldf approx_job_time = pool->approx_job_time * 0.9 + wr->last_job_time * 0.1;
 
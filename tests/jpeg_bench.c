@@ -0,0 +1,207 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+// Benchmark of the CPU JPEG encoder on YUYV frames of common capture sizes.
+// The encoder is included as is to reach its static conversion kernels:
+// the SIMD split is measured against the scalar one, then the whole encoding
+// with the persistent compressor against a fresh one for each frame.
+//
+// Usage: jpeg_bench.bin [iterations=20]
+
+
+#include "../src/ustreamer/encoders/cpu/encoder.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/libs/array.h"
+
+
+typedef struct {
+	const char	*name;
+	uint		width;
+	uint		height;
+} _size_s;
+
+
+static const _size_s _SIZES[] = {
+	{"720p", 1280, 720},
+	{"1080p", 1920, 1080},
+	{"4K", 3840, 2160},
+};
+
+
+static ldf _get_now(void);
+static us_frame_s *_make_frame(uint width, uint height);
+static const char *_get_splitter_name(_yuyv_split_f split);
+static ldf _bench_split(const us_frame_s *frame, _yuyv_split_f split, uint iterations);
+static ldf _bench_encode(const us_frame_s *frame, uint iterations);
+static ldf _bench_fresh_encode(const us_frame_s *frame, uint iterations);
+static ldf _bench_setup(const us_frame_s *frame, uint iterations);
+
+
+int main(int argc, char *argv[]) {
+	const uint iterations = (argc > 1 ? (uint)atoi(argv[1]) : 20u);
+	assert(iterations > 0);
+
+	const _yuyv_split_f simd = _yuyv_get_splitter();
+	printf("== YUYV to 4:2:0 split, ms per frame\n");
+	printf("%-6s  %10s  %10s  %8s\n", "size", "scalar", _get_splitter_name(simd), "speedup");
+	for (uint index = 0; index < US_ARRAY_LEN(_SIZES); ++index) {
+		us_frame_s *const frame = _make_frame(_SIZES[index].width, _SIZES[index].height);
+		const ldf scalar_time = _bench_split(frame, _yuyv_split_scalar, iterations);
+		const ldf simd_time = _bench_split(frame, simd, iterations);
+		printf("%-6s  %10.3Lf  %10.3Lf  %7.2Lfx\n",
+			_SIZES[index].name, scalar_time * 1000, simd_time * 1000, scalar_time / simd_time);
+		us_frame_destroy(frame);
+	}
+
+	printf("\n== YUYV encoding with quality 80, ms per frame\n");
+	printf("%-6s  %10s  %10s  %10s\n", "size", "persistent", "fresh", "setup");
+	for (uint index = 0; index < US_ARRAY_LEN(_SIZES); ++index) {
+		us_frame_s *const frame = _make_frame(_SIZES[index].width, _SIZES[index].height);
+		const ldf persistent_time = _bench_encode(frame, iterations);
+		const ldf fresh_time = _bench_fresh_encode(frame, iterations);
+		const ldf setup_time = _bench_setup(frame, iterations * 100); // Too short to be measured by one
+		printf("%-6s  %10.3Lf  %10.3Lf  %10.4Lf\n",
+			_SIZES[index].name, persistent_time * 1000, fresh_time * 1000, setup_time * 1000);
+		us_frame_destroy(frame);
+	}
+	return 0;
+}
+
+static ldf _get_now(void) {
+	struct timespec ts;
+	assert(!clock_gettime(CLOCK_MONOTONIC, &ts));
+	return (ldf)ts.tv_sec + (ldf)ts.tv_nsec / 1000000000;
+}
+
+static us_frame_s *_make_frame(uint width, uint height) {
+	// Gradients with some noise, not too easy for the entropy coder
+	us_frame_s *const frame = us_frame_init();
+	frame->width = width;
+	frame->height = height;
+	frame->format = V4L2_PIX_FMT_YUYV;
+	frame->stride = width * 2;
+	frame->used = frame->stride * height;
+	us_frame_realloc_data(frame, frame->used);
+	u32 seed = 1;
+	for (uint y = 0; y < height; ++y) {
+		u8 *const line = frame->data + frame->stride * y;
+		for (uint x = 0; x < width * 2; ++x) {
+			seed = seed * 1103515245 + 12345;
+			line[x] = (x % 2 == 0 ? (x / 2 + y) / 8 : 96 + (x / 4) % 64) + ((seed >> 16) & 7);
+		}
+	}
+	return frame;
+}
+
+static const char *_get_splitter_name(_yuyv_split_f split) {
+#	if defined(_SIMD_X86)
+	if (split == _yuyv_split_ssse3) {
+		return "ssse3";
+	}
+#	elif defined(_SIMD_NEON)
+	if (split == _yuyv_split_neon) {
+		return "neon";
+	}
+#	endif
+	(void)split;
+	return "scalar";
+}
+
+static ldf _bench_split(const us_frame_s *frame, _yuyv_split_f split, uint iterations) {
+	_yuyv_layout_s layout;
+	_yuyv_layout_init(&layout, frame->format);
+	const uint c_width = frame->width / 2;
+
+	u8 *y_plane;
+	u8 *u_plane;
+	u8 *v_plane;
+	US_CALLOC(y_plane, frame->width * frame->height);
+	US_CALLOC(u_plane, c_width * frame->height / 2);
+	US_CALLOC(v_plane, c_width * frame->height / 2);
+
+	const ldf begin_ts = _get_now();
+	for (uint count = 0; count < iterations; ++count) {
+		for (uint y = 0; y + 1 < frame->height; y += 2) {
+			split(&layout,
+				frame->data + frame->stride * y, frame->data + frame->stride * (y + 1),
+				y_plane + frame->width * y, y_plane + frame->width * (y + 1),
+				u_plane + c_width * (y / 2), v_plane + c_width * (y / 2), c_width);
+		}
+	}
+	const ldf time = (_get_now() - begin_ts) / iterations;
+
+	free(y_plane);
+	free(u_plane);
+	free(v_plane);
+	return time;
+}
+
+static ldf _bench_encode(const us_frame_s *frame, uint iterations) {
+	us_cpu_encoder_s *const enc = us_cpu_encoder_init();
+	us_frame_s *const dest = us_frame_init();
+	us_cpu_encoder_compress(enc, frame, dest, 80); // Warm up the buffers
+
+	const ldf begin_ts = _get_now();
+	for (uint count = 0; count < iterations; ++count) {
+		us_cpu_encoder_compress(enc, frame, dest, 80);
+	}
+	const ldf time = (_get_now() - begin_ts) / iterations;
+
+	us_frame_destroy(dest);
+	us_cpu_encoder_destroy(enc);
+	return time;
+}
+
+static ldf _bench_fresh_encode(const us_frame_s *frame, uint iterations) {
+	// The way it was before: new compressor, tables and buffers for each frame
+	us_frame_s *const dest = us_frame_init();
+	us_frame_realloc_data(dest, frame->used); // The same warm destination as above
+
+	const ldf begin_ts = _get_now();
+	for (uint count = 0; count < iterations; ++count) {
+		us_cpu_encoder_s *const enc = us_cpu_encoder_init();
+		us_cpu_encoder_compress(enc, frame, dest, 80);
+		us_cpu_encoder_destroy(enc);
+	}
+	const ldf time = (_get_now() - begin_ts) / iterations;
+
+	us_frame_destroy(dest);
+	return time;
+}
+
+static ldf _bench_setup(const us_frame_s *frame, uint iterations) {
+	// Only what the persistent compressor saves on each frame:
+	// the context, the defaults with the quant/Huffman tables and the planes buffer.
+	const uz buf_size = us_align_size(frame->width, 16) * 24; // 16 luma and 2x8 chroma lines
+
+	const ldf begin_ts = _get_now();
+	for (uint count = 0; count < iterations; ++count) {
+		us_cpu_encoder_s *const enc = us_cpu_encoder_init();
+		_cpu_encoder_configure(enc, frame, 80, 0, _jpeg_can_write_raw_yuv(frame));
+		_cpu_encoder_get_buf(enc, buf_size)[0] = 0;
+		us_cpu_encoder_destroy(enc);
+	}
+	return (_get_now() - begin_ts) / iterations;
+}
@@ -0,0 +1,215 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+// Stress test for the seqlocked memsink slots: one server and many client processes.
+// Even clients copy the frames, odd ones borrow them and hold for a while, so the server
+// has to pick the free slots and sometimes to overwrite the held ones. The slots grow
+// when the big frames come, and shrink after 10 seconds of the small ones: run it
+// for 30+ seconds to cover the shrinking too.
+//
+// Each frame has a unique seed, the payload and the meta are derived from it.
+// Any accepted frame (the client_get() or the client_release() returned 0)
+// which doesn't match its seed is a torn read.
+//
+// Usage: memsink_stress.bin [readers=16] [seconds=5]
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../src/libs/types.h"
+#include "../src/libs/errors.h"
+#include "../src/libs/tools.h"
+#include "../src/libs/logging.h"
+#include "../src/libs/frame.h"
+#include "../src/libs/memsink.h"
+
+
+#define _MAX_READERS	256
+#define _N_FRAMES		4 // In each set
+
+
+static void _fill_frame(us_frame_s *frame, uint seed, uz used);
+static bool _check_frame(const us_frame_s *frame);
+static int _run_reader(const char *obj, uint reader, uint secs);
+
+
+int main(int argc, char *argv[]) {
+	US_LOGGING_INIT;
+
+	const uint readers = (argc > 1 ? (uint)atoi(argv[1]) : 16);
+	const uint secs = (argc > 2 ? (uint)atoi(argv[2]) : 5);
+	assert(readers > 0 && readers <= _MAX_READERS);
+	assert(secs > 0);
+
+	char obj[64];
+	US_SNPRINTF(obj, 63, "ustreamer-memsink-stress-%d.jpeg", getpid());
+
+	us_memsink_s *const sink = us_memsink_init_opened("STRESS", obj, true, 0600, true, 10, 1);
+	assert(sink != NULL);
+
+	// The big frames don't fit into the initial slots, the small ones let them shrink
+	us_frame_s *big[_N_FRAMES];
+	us_frame_s *small[_N_FRAMES];
+	for (uint index = 0; index < _N_FRAMES; ++index) {
+		big[index] = us_frame_init();
+		_fill_frame(big[index], index + 1, 2000000 + index * 300000);
+		small[index] = us_frame_init();
+		_fill_frame(small[index], index + 1 + _N_FRAMES, 20000 + index * 7000);
+	}
+
+	pid_t pids[_MAX_READERS];
+	fflush(stdout);
+	for (uint reader = 0; reader < readers; ++reader) {
+		assert((pids[reader] = fork()) >= 0);
+		if (pids[reader] == 0) {
+			const int retval = _run_reader(obj, reader, secs);
+			fflush(stdout);
+			_exit(retval);
+		}
+	}
+
+	// Big, small (shrink after the window), big again (grow)
+	const ldf begin_ts = us_get_now_monotonic();
+	const ldf end_ts = begin_ts + secs + 0.5;
+	ull puts = 0;
+	ldf max_put = 0;
+	uz data_size = 0;
+	ldf now_ts;
+	while ((now_ts = us_get_now_monotonic()) < end_ts) {
+		const ldf elapsed = now_ts - begin_ts;
+		const uint phase = (elapsed < secs / 3.0 ? 0 : (elapsed < secs * 2 / 3.0 ? 1 : 2));
+		us_frame_s *const frame = (phase == 1 ? small : big)[puts % _N_FRAMES];
+
+		if (sink->data_size != data_size) {
+			data_size = sink->data_size;
+			printf("server: phase=%u data_size=%zu\n", phase, data_size);
+		}
+
+		const ldf put_ts = us_get_now_monotonic();
+		assert(us_memsink_server_put(sink, frame, NULL) == 0);
+		max_put = US_MAX(max_put, us_get_now_monotonic() - put_ts);
+		++puts;
+	}
+
+	bool ok = true;
+	for (uint reader = 0; reader < readers; ++reader) {
+		int status;
+		assert(waitpid(pids[reader], &status, 0) == pids[reader]);
+		ok = (ok && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+	printf("server: puts=%llu (%.0Lf/s), max_put=%.3Lf ms -> %s\n",
+		puts, puts / (end_ts - begin_ts), max_put * 1000, (ok ? "OK" : "FAIL"));
+
+	us_memsink_destroy(sink);
+	for (uint index = 0; index < _N_FRAMES; ++index) {
+		us_frame_destroy(big[index]);
+		us_frame_destroy(small[index]);
+	}
+	return (ok ? 0 : 1);
+}
+
+static void _fill_frame(us_frame_s *frame, uint seed, uz used) {
+	us_frame_realloc_data(frame, used);
+	frame->used = used;
+	for (uz index = 0; index < used; ++index) {
+		frame->data[index] = (u8)(seed * 31 + index);
+	}
+	memcpy(frame->data, &seed, sizeof(seed));
+	frame->width = seed;
+	frame->height = used;
+	frame->stride = seed * 3;
+	frame->key = (seed % 2);
+}
+
+static bool _check_frame(const us_frame_s *frame) {
+	uint seed;
+	if (frame->used < sizeof(seed)) {
+		return false;
+	}
+	memcpy(&seed, frame->data, sizeof(seed));
+	if (
+		frame->width != seed
+		|| frame->height != frame->used
+		|| frame->stride != seed * 3
+		|| frame->key != (seed % 2)
+	) {
+		return false;
+	}
+	for (uz index = sizeof(seed); index < frame->used; ++index) {
+		if (frame->data[index] != (u8)(seed * 31 + index)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int _run_reader(const char *obj, uint reader, uint secs) {
+	const bool borrow = (reader % 2);
+	us_memsink_s *const sink = us_memsink_init_opened("STRESS", obj, false, 0, false, 0, 1);
+	if (sink == NULL) {
+		return 1;
+	}
+	us_frame_s *const frame = us_frame_init();
+
+	ull ok = 0;
+	ull bad = 0;
+	ull no_data = 0;
+	ull overwritten = 0;
+	const ldf end_ts = us_get_now_monotonic() + secs;
+	while (us_get_now_monotonic() < end_ts) {
+		int retval;
+		if (borrow) {
+			us_frame_s view;
+			if ((retval = us_memsink_client_borrow(sink, &view, NULL, false)) == 0) {
+				const bool valid = _check_frame(&view);
+				usleep(300); // Let the server come around
+				if (us_memsink_client_release(sink) == 0) {
+					// The view is good only if the slot was not overwritten
+					valid ? ++ok : ++bad;
+				} else {
+					++overwritten;
+				}
+			}
+		} else if ((retval = us_memsink_client_get(sink, frame, NULL, false)) == 0) {
+			_check_frame(frame) ? ++ok : ++bad;
+		}
+		if (retval == US_ERROR_NO_DATA) {
+			++no_data;
+		} else if (retval < 0) {
+			printf("reader %u: error %d\n", reader, retval);
+			return 1;
+		}
+	}
+
+	printf("reader %3u (%s): ok=%llu, bad=%llu, no_data=%llu, overwritten=%llu\n",
+		reader, (borrow ? "borrow" : "copy"), ok, bad, no_data, overwritten);
+	us_frame_destroy(frame);
+	us_memsink_destroy(sink);
+	return ((bad > 0 || ok == 0) ? 1 : 0);
+}
@@ -0,0 +1,147 @@
+#!/usr/bin/env -S python3 -B
+# ========================================================================== #
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+# ========================================================================== #
+
+
+"""
+Load test of the /stream handler: many concurrent MJPEG clients for a fixed time.
+Each client must get the multipart response and at least --min-frames parts,
+otherwise the exit code is 1.
+
+    ./ustreamer --host 127.0.0.1 --port 8080 --server-threads 4 &
+    tests/mjpeg_load.py --port 8080 --clients 500 --duration 10
+"""
+
+
+import sys
+import asyncio
+import argparse
+import dataclasses
+import resource
+import statistics
+import time
+
+
+# =====
+_BOUNDARY = b"--boundarydonotcross"
+
+
+@dataclasses.dataclass
+class _Client:
+    frames: int = 0
+    size: int = 0
+    first_frame_delay: float = -1.0
+    error: str = ""
+
+
+async def _run_client(host: str, port: int, path: str, duration: float, client: _Client) -> None:
+    begin_ts = time.monotonic()
+    try:
+        (reader, writer) = await asyncio.wait_for(asyncio.open_connection(host, port), timeout=10)
+    except Exception as ex:
+        client.error = f"connect: {type(ex).__name__}"
+        return
+
+    try:
+        writer.write(f"GET {path} HTTP/1.0\r\nHost: {host}\r\n\r\n".encode())
+        await writer.drain()
+
+        status = await asyncio.wait_for(reader.readline(), timeout=10)
+        if not status.startswith(b"HTTP/1.") or status.split()[1:2] != [b"200"]:
+            client.error = f"status: {status.decode(errors='replace').strip()!r}"
+            return
+
+        end_ts = time.monotonic() + duration
+        tail = b""  # The boundary can be split between the chunks
+        while (remaining := end_ts - time.monotonic()) > 0:
+            try:
+                chunk = await asyncio.wait_for(reader.read(65536), timeout=remaining)
+            except asyncio.TimeoutError:
+                break
+            if not chunk:
+                client.error = "closed by server"
+                break
+            client.size += len(chunk)
+            data = tail + chunk
+            count = data.count(_BOUNDARY)
+            if count > 0 and client.frames == 0:
+                client.first_frame_delay = time.monotonic() - begin_ts
+            client.frames += count
+            tail = data[-(len(_BOUNDARY) - 1):]
+    except Exception as ex:
+        client.error = f"read: {type(ex).__name__}"
+    finally:
+        writer.close()
+
+
+def _raise_nofile_limit(need: int) -> None:
+    (soft, hard) = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if soft < need:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (min(need, hard), hard))
+
+
+def _get_percentile(values: list[float], percent: int) -> float:
+    return sorted(values)[min(len(values) - 1, len(values) * percent // 100)]
+
+
+async def _run(options: argparse.Namespace) -> bool:
+    clients = [_Client() for _ in range(options.clients)]
+    begin_ts = time.monotonic()
+    await asyncio.gather(*[
+        _run_client(options.host, options.port, options.path, options.duration, client)
+        for client in clients
+    ])
+    total_time = time.monotonic() - begin_ts
+
+    failed = [client for client in clients if client.error or client.frames < options.min_frames]
+    for client in failed[:10]:
+        print(f"Failed client: frames={client.frames} error={client.error or 'too few frames'}")
+
+    fps = [client.frames / options.duration for client in clients]
+    delays = [client.first_frame_delay for client in clients if client.first_frame_delay >= 0]
+    size = sum(client.size for client in clients)
+    print(f"Clients: {options.clients}, failed: {len(failed)}, time: {total_time:.1f}s")
+    print(f"FPS per client: min={min(fps):.1f} median={statistics.median(fps):.1f} max={max(fps):.1f}")
+    print(f"Total: {sum(client.frames for client in clients) / options.duration:.0f} frames/s,"
+          f" {size / options.duration / 1024 / 1024:.1f} MiB/s")
+    if delays:
+        print(f"First frame delay: p50={_get_percentile(delays, 50) * 1000:.0f}ms"
+              f" p99={_get_percentile(delays, 99) * 1000:.0f}ms")
+    return (not failed)
+
+
+# =====
+def main() -> None:
+    parser = argparse.ArgumentParser(description="MJPEG /stream load test")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--path", default="/stream")
+    parser.add_argument("--clients", type=int, default=500)
+    parser.add_argument("--duration", type=float, default=10.0)
+    parser.add_argument("--min-frames", type=int, default=2)
+    options = parser.parse_args()
+
+    _raise_nofile_limit(options.clients + 64)
+    sys.exit(0 if asyncio.run(_run(options)) else 1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,288 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+// Benchmark of the lock-free us_queue_s against the previous mutex+condvar queue.
+// For 1/2/4 producers and as many consumers it measures the throughput and
+// the handoff latency: the time from us_queue_put() to the return of us_queue_get().
+// All the calls are blocking with a timeout, as in the stream workers.
+//
+// Usage: queue_bench.bin [items_per_producer=200000] [capacity=4]
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+
+#include <pthread.h>
+
+#include "../src/libs/types.h"
+#include "../src/libs/tools.h"
+#include "../src/libs/threading.h"
+#include "../src/libs/queue.h"
+
+
+// The mutex queue as it was before the lock-free one, for comparison
+typedef struct {
+	void			**items;
+	uint			size;
+	uint			capacity;
+	uint			in;
+	uint			out;
+
+	pthread_mutex_t	mutex;
+	pthread_cond_t	full_cond;
+	pthread_cond_t	empty_cond;
+} _mutex_queue_s;
+
+typedef struct {
+	const char	*name;
+	void		*(*init)(uint capacity);
+	void		(*destroy)(void *queue);
+	int			(*put)(void *queue, void *item, ldf timeout);
+	int			(*get)(void *queue, void **item, ldf timeout);
+} _impl_s;
+
+typedef struct {
+	const _impl_s	*impl;
+	void			*queue;
+	ull				n_items;
+	u64				*lats; // Only for consumer, nanoseconds
+	ull				n_lats;
+	pthread_t		tid;
+} _worker_s;
+
+
+static u64 _get_now_ns(void);
+static int _cmp_u64(const void *v_a, const void *v_b);
+static void _run(const _impl_s *impl, uint n_workers, ull n_items, uint capacity);
+static void *_producer_thread(void *v_worker);
+static void *_consumer_thread(void *v_worker);
+
+static void *_mutex_queue_init(uint capacity);
+static void _mutex_queue_destroy(void *v_queue);
+static int _mutex_queue_put(void *v_queue, void *item, ldf timeout);
+static int _mutex_queue_get(void *v_queue, void **item, ldf timeout);
+
+static void *_lf_queue_init(uint capacity);
+static void _lf_queue_destroy(void *v_queue);
+static int _lf_queue_put(void *v_queue, void *item, ldf timeout);
+static int _lf_queue_get(void *v_queue, void **item, ldf timeout);
+
+
+static const _impl_s _IMPLS[] = {
+	{"mutex", _mutex_queue_init, _mutex_queue_destroy, _mutex_queue_put, _mutex_queue_get},
+	{"lockfree", _lf_queue_init, _lf_queue_destroy, _lf_queue_put, _lf_queue_get},
+};
+
+
+int main(int argc, char *argv[]) {
+	const ull n_items = (argc > 1 ? strtoull(argv[1], NULL, 10) : 200000);
+	const uint capacity = (argc > 2 ? (uint)atoi(argv[2]) : 4);
+	assert(n_items > 0);
+	assert(capacity > 0);
+
+	printf("%-8s  %-5s  %12s  %10s  %10s  %10s\n", "queue", "P/C", "items/s", "p50 us", "p99 us", "max us");
+	const uint workers[] = {1, 2, 4};
+	for (uint wi = 0; wi < 3; ++wi) {
+		for (uint ii = 0; ii < 2; ++ii) {
+			_run(&_IMPLS[ii], workers[wi], n_items, capacity);
+		}
+	}
+	return 0;
+}
+
+static u64 _get_now_ns(void) {
+	struct timespec ts;
+	assert(!clock_gettime(CLOCK_MONOTONIC, &ts));
+	return (u64)ts.tv_sec * 1000000000 + (u64)ts.tv_nsec;
+}
+
+static int _cmp_u64(const void *v_a, const void *v_b) {
+	const u64 a = *(const u64*)v_a;
+	const u64 b = *(const u64*)v_b;
+	return (a > b) - (a < b);
+}
+
+static void _run(const _impl_s *impl, uint n_workers, ull n_items, uint capacity) {
+	void *const queue = impl->init(capacity);
+
+	_worker_s producers[4] = {0};
+	_worker_s consumers[4] = {0};
+	const u64 begin_ns = _get_now_ns();
+	for (uint index = 0; index < n_workers; ++index) {
+		_worker_s *const c = &consumers[index];
+		c->impl = impl;
+		c->queue = queue;
+		US_CALLOC(c->lats, n_items * n_workers);
+		US_THREAD_CREATE(c->tid, _consumer_thread, c);
+
+		_worker_s *const p = &producers[index];
+		p->impl = impl;
+		p->queue = queue;
+		p->n_items = n_items;
+		US_THREAD_CREATE(p->tid, _producer_thread, p);
+	}
+	for (uint index = 0; index < n_workers; ++index) {
+		US_THREAD_JOIN(producers[index].tid);
+	}
+	for (uint index = 0; index < n_workers; ++index) {
+		assert(!impl->put(queue, NULL, 10)); // Stop
+	}
+	for (uint index = 0; index < n_workers; ++index) {
+		US_THREAD_JOIN(consumers[index].tid);
+	}
+	const u64 end_ns = _get_now_ns();
+
+	u64 *lats;
+	US_CALLOC(lats, n_items * n_workers);
+	ull n_lats = 0;
+	for (uint index = 0; index < n_workers; ++index) {
+		memcpy(lats + n_lats, consumers[index].lats, consumers[index].n_lats * sizeof(u64));
+		n_lats += consumers[index].n_lats;
+		free(consumers[index].lats);
+	}
+	assert(n_lats == n_items * n_workers);
+	qsort(lats, n_lats, sizeof(u64), _cmp_u64);
+
+	char pc[8];
+	US_SNPRINTF(pc, 7, "%u/%u", n_workers, n_workers);
+	printf("%-8s  %-5s  %12.0Lf  %10.2Lf  %10.2Lf  %10.2Lf\n",
+		impl->name, pc,
+		(ldf)n_lats * 1000000000 / (end_ns - begin_ns),
+		(ldf)lats[n_lats / 2] / 1000,
+		(ldf)lats[n_lats * 99 / 100] / 1000,
+		(ldf)lats[n_lats - 1] / 1000);
+	free(lats);
+	impl->destroy(queue);
+}
+
+static void *_producer_thread(void *v_worker) {
+	_worker_s *const w = v_worker;
+	for (ull count = 0; count < w->n_items; ++count) {
+		// The item is the timestamp itself, it's never zero
+		assert(!w->impl->put(w->queue, (void*)(uintptr_t)_get_now_ns(), 10));
+	}
+	return NULL;
+}
+
+static void *_consumer_thread(void *v_worker) {
+	_worker_s *const w = v_worker;
+	while (true) {
+		void *item;
+		if (w->impl->get(w->queue, &item, 1) < 0) {
+			continue;
+		}
+		if (item == NULL) {
+			break;
+		}
+		w->lats[w->n_lats] = _get_now_ns() - (u64)(uintptr_t)item;
+		++w->n_lats;
+	}
+	return NULL;
+}
+
+static void *_mutex_queue_init(uint capacity) {
+	_mutex_queue_s *queue;
+	US_CALLOC(queue, 1);
+	US_CALLOC(queue->items, capacity);
+	queue->capacity = capacity;
+	US_MUTEX_INIT(queue->mutex);
+
+	pthread_condattr_t attrs;
+	assert(!pthread_condattr_init(&attrs));
+	assert(!pthread_condattr_setclock(&attrs, CLOCK_MONOTONIC));
+	assert(!pthread_cond_init(&queue->full_cond, &attrs));
+	assert(!pthread_cond_init(&queue->empty_cond, &attrs));
+	assert(!pthread_condattr_destroy(&attrs));
+	return queue;
+}
+
+static void _mutex_queue_destroy(void *v_queue) {
+	_mutex_queue_s *const queue = v_queue;
+	US_COND_DESTROY(queue->empty_cond);
+	US_COND_DESTROY(queue->full_cond);
+	US_MUTEX_DESTROY(queue->mutex);
+	free(queue->items);
+	free(queue);
+}
+
+#define _WAIT_OR_UNLOCK(x_var, x_cond) { \
+		struct timespec m_ts; \
+		assert(!clock_gettime(CLOCK_MONOTONIC, &m_ts)); \
+		us_ld_to_timespec(us_timespec_to_ld(&m_ts) + timeout, &m_ts); \
+		while (x_var) { \
+			const int err = pthread_cond_timedwait(&(x_cond), &queue->mutex, &m_ts); \
+			if (err == ETIMEDOUT) { \
+				US_MUTEX_UNLOCK(queue->mutex); \
+				return -1; \
+			} \
+			assert(!err); \
+		} \
+	}
+
+static int _mutex_queue_put(void *v_queue, void *item, ldf timeout) {
+	_mutex_queue_s *const queue = v_queue;
+	US_MUTEX_LOCK(queue->mutex);
+	_WAIT_OR_UNLOCK(queue->size == queue->capacity, queue->full_cond);
+	queue->items[queue->in] = item;
+	++queue->size;
+	++queue->in;
+	queue->in %= queue->capacity;
+	US_MUTEX_UNLOCK(queue->mutex);
+	US_COND_BROADCAST(queue->empty_cond);
+	return 0;
+}
+
+static int _mutex_queue_get(void *v_queue, void **item, ldf timeout) {
+	_mutex_queue_s *const queue = v_queue;
+	US_MUTEX_LOCK(queue->mutex);
+	_WAIT_OR_UNLOCK(queue->size == 0, queue->empty_cond);
+	*item = queue->items[queue->out];
+	--queue->size;
+	++queue->out;
+	queue->out %= queue->capacity;
+	US_MUTEX_UNLOCK(queue->mutex);
+	US_COND_BROADCAST(queue->full_cond);
+	return 0;
+}
+
+#undef _WAIT_OR_UNLOCK
+
+static void *_lf_queue_init(uint capacity) {
+	return us_queue_init(capacity);
+}
+
+static void _lf_queue_destroy(void *v_queue) {
+	us_queue_destroy(v_queue);
+}
+
+static int _lf_queue_put(void *v_queue, void *item, ldf timeout) {
+	return us_queue_put(v_queue, item, timeout);
+}
+
+static int _lf_queue_get(void *v_queue, void **item, ldf timeout) {
+	return us_queue_get(v_queue, item, timeout);
+}
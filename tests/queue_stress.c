@@ -0,0 +1,219 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+// Stress test for the lock-free us_queue_s with several producers and consumers.
+//
+// Each item is a plain struct filled by the producer before us_queue_put().
+// The consumer checks its contents, so a broken release/acquire pairing shows up
+// as a garbage item. Also checked: each item is received exactly once, items of
+// the same producer come to a consumer in order, and the blocking get never
+// times out while the producers are still working (a lost wakeup).
+//
+// Usage: queue_stress.bin [items_per_producer=50000]
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <assert.h>
+
+#include <pthread.h>
+
+#include "../src/libs/types.h"
+#include "../src/libs/tools.h"
+#include "../src/libs/array.h"
+#include "../src/libs/threading.h"
+#include "../src/libs/queue.h"
+
+
+#define _MAX_THREADS 8
+
+typedef struct {
+	uint		producer;
+	ull			seq;
+	ull			check;
+	atomic_uint	received;
+} _item_s;
+
+typedef struct {
+	us_queue_s	*queue;
+	uint		index;
+	uint		n_producers;
+	ull			n_items;
+	bool		blocking; // Wait inside of the queue or spin with the zero timeout
+	_item_s		*items; // Only for producer
+	ull			got; // Only for consumer
+	uint		errors; // Only for consumer
+	pthread_t	tid;
+} _worker_s;
+
+
+static _item_s _stop_item; // One for each consumer at the end
+
+static ull _get_check(uint producer, ull seq);
+static void *_producer_thread(void *v_worker);
+static void *_consumer_thread(void *v_worker);
+static bool _run(uint capacity, uint n_producers, uint n_consumers, ull n_items);
+
+
+int main(int argc, char *argv[]) {
+	const ull n_items = (argc > 1 ? strtoull(argv[1], NULL, 10) : 50000);
+	assert(n_items > 0);
+
+	const uint capacities[] = {1, 3, 64};
+	const uint workers[][2] = {{1, 1}, {2, 2}, {4, 4}, {1, 4}, {4, 1}};
+
+	bool ok = true;
+	for (uint ci = 0; ci < US_ARRAY_LEN(capacities); ++ci) {
+		for (uint wi = 0; wi < US_ARRAY_LEN(workers); ++wi) {
+			ok &= _run(capacities[ci], workers[wi][0], workers[wi][1], n_items);
+		}
+	}
+	puts(ok ? "OK" : "FAIL");
+	return (ok ? 0 : 1);
+}
+
+static ull _get_check(uint producer, ull seq) {
+	return ((ull)us_triple_u32(seq) << 32) ^ us_triple_u32(producer + 1) ^ seq;
+}
+
+static bool _run(uint capacity, uint n_producers, uint n_consumers, ull n_items) {
+	us_queue_s *const queue = us_queue_init(capacity);
+
+	_worker_s producers[_MAX_THREADS] = {0};
+	_worker_s consumers[_MAX_THREADS] = {0};
+	const ldf begin_ts = us_get_now_monotonic();
+
+	for (uint index = 0; index < n_consumers; ++index) {
+		_worker_s *const w = &consumers[index];
+		w->queue = queue;
+		w->index = index;
+		w->n_producers = n_producers;
+		w->blocking = (index % 2 == 0);
+		US_THREAD_CREATE(w->tid, _consumer_thread, w);
+	}
+	for (uint index = 0; index < n_producers; ++index) {
+		_worker_s *const w = &producers[index];
+		w->queue = queue;
+		w->index = index;
+		w->n_items = n_items;
+		w->blocking = (index % 2 == 0);
+		US_CALLOC(w->items, n_items);
+		US_THREAD_CREATE(w->tid, _producer_thread, w);
+	}
+
+	for (uint index = 0; index < n_producers; ++index) {
+		US_THREAD_JOIN(producers[index].tid);
+	}
+	for (uint index = 0; index < n_consumers; ++index) {
+		assert(!us_queue_put(queue, &_stop_item, 10));
+	}
+	for (uint index = 0; index < n_consumers; ++index) {
+		US_THREAD_JOIN(consumers[index].tid);
+	}
+
+	ull got = 0;
+	uint errors = 0;
+	for (uint index = 0; index < n_consumers; ++index) {
+		got += consumers[index].got;
+		errors += consumers[index].errors;
+	}
+	uint lost = 0;
+	uint dups = 0;
+	for (uint index = 0; index < n_producers; ++index) {
+		for (ull seq = 0; seq < n_items; ++seq) {
+			const uint received = atomic_load(&producers[index].items[seq].received);
+			lost += (received == 0);
+			dups += (received > 1);
+		}
+		free(producers[index].items);
+	}
+	const bool empty = us_queue_is_empty(queue);
+	us_queue_destroy(queue);
+
+	const bool ok = (errors == 0 && lost == 0 && dups == 0 && got == n_items * n_producers && empty);
+	printf("capacity=%-3u producers=%u consumers=%u: got=%llu, errors=%u, lost=%u, dups=%u, %.2Lf sec -> %s\n",
+		capacity, n_producers, n_consumers, got, errors, lost, dups,
+		us_get_now_monotonic() - begin_ts, (ok ? "OK" : "FAIL"));
+	return ok;
+}
+
+static void *_producer_thread(void *v_worker) {
+	_worker_s *const w = v_worker;
+	for (ull seq = 0; seq < w->n_items; ++seq) {
+		_item_s *const item = &w->items[seq];
+		item->producer = w->index;
+		item->seq = seq;
+		item->check = _get_check(w->index, seq);
+		if (w->blocking) {
+			assert(!us_queue_put(w->queue, item, 10));
+		} else {
+			while (us_queue_put(w->queue, item, 0) < 0) {
+				sched_yield();
+			}
+		}
+	}
+	return NULL;
+}
+
+static void *_consumer_thread(void *v_worker) {
+	_worker_s *const w = v_worker;
+	sll last_seqs[_MAX_THREADS];
+	for (uint index = 0; index < _MAX_THREADS; ++index) {
+		last_seqs[index] = -1;
+	}
+
+	while (true) {
+		void *ptr;
+		if (w->blocking) {
+			// The producers never stop for a second, so a timeout is a lost wakeup
+			if (us_queue_get(w->queue, &ptr, 1) < 0) {
+				printf("consumer %u: lost wakeup\n", w->index);
+				++w->errors;
+				continue;
+			}
+		} else if (us_queue_get(w->queue, &ptr, 0) < 0) {
+			sched_yield();
+			continue;
+		}
+
+		_item_s *const item = ptr;
+		if (item == &_stop_item) {
+			break;
+		}
+		if (item->producer >= w->n_producers || item->check != _get_check(item->producer, item->seq)) {
+			printf("consumer %u: garbage item\n", w->index);
+			++w->errors;
+			continue;
+		}
+		if ((sll)item->seq <= last_seqs[item->producer]) {
+			printf("consumer %u: unordered items of producer %u: %llu after %lld\n",
+				w->index, item->producer, item->seq, last_seqs[item->producer]);
+			++w->errors;
+		}
+		last_seqs[item->producer] = item->seq;
+		atomic_fetch_add(&item->received, 1);
+		++w->got;
+	}
+	return NULL;
+}
@@ -0,0 +1,126 @@
+#!/usr/bin/env -S python3 -B
+# ========================================================================== #
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+# ========================================================================== #
+
+
+"""
+Requests/sec benchmark of the --static handler over keep-alive connections.
+With --revalidate the clients send If-None-Match with the received ETag
+and expect 304, with --gzip they accept the pre-compressed variants.
+
+    ./ustreamer --host 127.0.0.1 --port 8080 --static /usr/share/ustreamer/www &
+    tests/static_bench.py --port 8080 --path /index.html --connections 32 --duration 10
+"""
+
+
+import sys
+import asyncio
+import argparse
+import dataclasses
+import time
+
+
+# =====
+@dataclasses.dataclass
+class _Stats:
+    requests: int = 0
+    size: int = 0
+    errors: int = 0
+    delays: list[float] = dataclasses.field(default_factory=list)
+
+
+async def _read_response(reader: asyncio.StreamReader) -> tuple[int, dict[str, str], bytes]:
+    head = await reader.readuntil(b"\r\n\r\n")
+    lines = head.decode("latin-1").split("\r\n")
+    status = int(lines[0].split()[1])
+    headers: dict[str, str] = {}
+    for line in filter(None, lines[1:]):
+        (name, value) = line.split(":", 1)
+        headers[name.strip().lower()] = value.strip()
+    body = b""
+    if status != 304:
+        body = await reader.readexactly(int(headers.get("content-length", "0")))
+    return (status, headers, body)
+
+
+async def _run_connection(options: argparse.Namespace, end_ts: float, stats: _Stats) -> None:
+    (reader, writer) = await asyncio.open_connection(options.host, options.port)
+    try:
+        etag = ""
+        while time.monotonic() < end_ts:
+            request = f"GET {options.path} HTTP/1.1\r\nHost: {options.host}\r\n"
+            if options.gzip:
+                request += "Accept-Encoding: gzip, br\r\n"
+            if etag:
+                request += f"If-None-Match: {etag}\r\n"
+            begin_ts = time.monotonic()
+            writer.write((request + "\r\n").encode())
+            (status, headers, body) = await _read_response(reader)
+            stats.delays.append(time.monotonic() - begin_ts)
+
+            expected = (304 if etag else 200)
+            if status != expected:
+                stats.errors += 1
+                print(f"Unexpected status {status} instead of {expected}")
+                return
+            stats.requests += 1
+            stats.size += len(body)
+            if options.revalidate:
+                etag = headers.get("etag", "")
+    except Exception as ex:
+        stats.errors += 1
+        print(f"Connection error: {type(ex).__name__}: {ex}")
+    finally:
+        writer.close()
+
+
+async def _run(options: argparse.Namespace) -> bool:
+    stats = _Stats()
+    end_ts = time.monotonic() + options.duration
+    await asyncio.gather(*[
+        _run_connection(options, end_ts, stats)
+        for _ in range(options.connections)
+    ])
+
+    delays = sorted(stats.delays) or [0.0]
+    print(f"Requests: {stats.requests}, errors: {stats.errors}, connections: {options.connections}")
+    print(f"Throughput: {stats.requests / options.duration:.0f} req/s, {stats.size / options.duration / 1024 / 1024:.1f} MiB/s")
+    print(f"Latency: p50={delays[len(delays) // 2] * 1000:.2f}ms p99={delays[len(delays) * 99 // 100] * 1000:.2f}ms")
+    return (stats.errors == 0 and stats.requests > 0)
+
+
+# =====
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Static files requests/sec benchmark")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--path", default="/index.html")
+    parser.add_argument("--connections", type=int, default=32)
+    parser.add_argument("--duration", type=float, default=10.0)
+    parser.add_argument("--revalidate", action="store_true")
+    parser.add_argument("--gzip", action="store_true")
+    options = parser.parse_args()
+
+    sys.exit(0 if asyncio.run(_run(options)) else 1)
+
+
+if __name__ == "__main__":
+    main()